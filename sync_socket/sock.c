@@ -52,12 +52,13 @@ static SsHooks *ss_hooks __read_mostly;
  * copying.
  * See do_tcp_sendpages() and tcp_sendmsg() in linux/net/ipv4/tcp.c.
  *
- * Called in softirq context.
+ * Called in softirq context under bh_lock_sock_nested(sk), so the caller can
+ * update its data bound with the socket along with the sending.
  *
  * TODO use MSG_MORE untill we reach end of message.
  */
 void
-ss_send(struct sock *sk, const SsSkbList *skb_list)
+ss_do_send(struct sock *sk, const SsSkbList *skb_list)
 {
 	struct sk_buff *skb;
 	struct tcp_skb_cb *tcb;
@@ -65,8 +66,6 @@ ss_send(struct sock *sk, const SsSkbList *skb_list)
 	int flags = MSG_DONTWAIT; /* we can't sleep */
 	int size_goal, mss_now;
 
-	bh_lock_sock_nested(sk);
-
 	mss_now = tcp_send_mss(sk, &size_goal, flags);
 
 	BUG_ON(ss_skb_queue_empty(skb_list));
@@ -99,7 +98,17 @@ ss_send(struct sock *sk, const SsSkbList *skb_list)
 	       sk, tcp_write_queue_empty(sk), tcp_send_head(sk), sk->sk_state);
 
 	tcp_push(sk, flags, mss_now, TCP_NAGLE_OFF|TCP_NAGLE_PUSH);
+}
+EXPORT_SYMBOL(ss_do_send);
 
+/**
+ * Same as ss_do_send(), but takes the socket lock.
+ */
+void
+ss_send(struct sock *sk, const SsSkbList *skb_list)
+{
+	bh_lock_sock_nested(sk);
+	ss_do_send(sk, skb_list);
 	bh_unlock_sock(sk);
 }
 EXPORT_SYMBOL(ss_send);
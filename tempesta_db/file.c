@@ -19,31 +19,75 @@
  * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 #include <linux/fs.h>
+#include <linux/hugetlb.h>
 #include <linux/mman.h>
+#include <linux/mmu_context.h>
+#include <linux/numa.h>
 #include <linux/sched.h>
+#include <linux/tempesta_fw.h>
 
 #include "file.h"
+#include "htrie.h"
+
+/**
+ * Map the file by extent aligned address, so each extent can be backed by
+ * a huge page. Must be called with init_mm.mmap_sem held for writing.
+ */
+static unsigned long
+tdb_file_map(struct file *filp, unsigned long size, unsigned long flags,
+	     unsigned long *populate)
+{
+	unsigned long addr;
+
+	/* Find a hole with room for the alignment. */
+	addr = get_unmapped_area(filp, 0, size + TDB_EXT_SZ, 0, flags);
+	if (IS_ERR_VALUE(addr))
+		return addr;
+	addr = ALIGN(addr, TDB_EXT_SZ);
+
+	return do_mmap_pgoff(filp, addr, size, PROT_READ|PROT_WRITE,
+			     flags | MAP_FIXED, 0, populate);
+}
 
 /**
  * Open, mmap and mlock the specified file to be able to read and
- * write to it in softirqs.
+ * write to it in softirqs. Only pinned extents of tiered tables are locked,
+ * see tdb_file_lock(). Only logs are populated here, index tables are
+ * populated by extents in background, see tdb_file_populate().
  *
- * The function must not be called from softirq!
+ * Files on hugetlbfs are mapped by huge pages, which removes most of TLB
+ * misses on index descents. Huge pages can't be paged out, so tiered mode
+ * is disabled for such files.
  *
- * FIXME database header must be extent aligned, so mmap must map file by
- * aligned address.
+ * Index tables can grow online, so TDB_SHARD_MAX bytes of address space
+ * are reserved for them, see tdb_file_resize(). The tail of the mapping
+ * beyond the file end is never accessed. Huge pages are reserved for whole
+ * mappings, so files on hugetlbfs don't grow.
+ *
+ * The function must not be called from softirq!
  */
 int
 tdb_file_open(TDB *db, unsigned long size)
 {
-	unsigned long addr, populate;
+	unsigned long addr, populate, flags = MAP_SHARED;
 	struct mm_struct *mm = current->mm;
 	struct file *filp;
 
 	/* Must be called from kernel thread context. */
 	BUG_ON(mm != &init_mm);
 
-	strcat(db->path, "/" TDB_FNAME);
+	/* Each table has its own file named after the table. */
+	strcat(db->path, "/");
+	strcat(db->path, db->name);
+	strcat(db->path, TDB_SUFFIX);
+	/* Each NUMA node has its own database shard. */
+	if (db->node != NUMA_NO_NODE)
+		snprintf(db->path + strlen(db->path), TDB_NODE_SFX_LEN, ".%d",
+			 db->node);
+	/* Large tables have a file per shard. */
+	if (db->shard >= 0)
+		snprintf(db->path + strlen(db->path), TDB_SHARD_SFX_LEN,
+			 ".s%d", db->shard);
 
 	filp = filp_open(db->path, O_CREAT | O_RDWR, 0600);
 	if (IS_ERR(filp))
@@ -51,6 +95,20 @@ tdb_file_open(TDB *db, unsigned long size)
 	if (!filp || !filp->f_dentry)
 		return -ENOENT;
 
+	if (is_file_hugepages(filp)) {
+		if (TDB_EXT_SZ % huge_page_size(hstate_file(filp))) {
+			TDB_ERR("Extents of %s aren't aligned to huge pages\n",
+				db->path);
+			filp_close(filp, NULL);
+			return -EINVAL;
+		}
+		if (db->hot_sz) {
+			TDB_ERR("Huge pages aren't swappable, lock whole %s\n",
+				db->path);
+			db->hot_sz = 0;
+		}
+	}
+
 	/* Allocate continous extents. */
 	if (filp->f_op->fallocate) {
 		struct inode *inode = file_inode(filp);
@@ -59,14 +117,20 @@ tdb_file_open(TDB *db, unsigned long size)
 		sb_end_write(inode->i_sb);
 	}
 
+	db->map_sz = max_t(unsigned long, size, file_inode(filp)->i_size);
+	if (!(db->flags & TDB_F_SEQLOG) && !is_file_hugepages(filp))
+		db->map_sz = TDB_SHARD_MAX;
+
 	down_write(&init_mm.mmap_sem);
 
 	/*
 	 * mmap() and mlock() the file to make it accessible from softirq.
 	 * Use MAP_SHARED to synchronize the mapping with underlying file.
+	 * Tiered tables can be larger than RAM, so they're locked by extents.
 	 */
-	addr = do_mmap_pgoff(filp, 0, size, PROT_READ|PROT_WRITE,
-			     MAP_SHARED|MAP_POPULATE|MAP_LOCKED, 0, &populate);
+	if (!db->hot_sz)
+		flags |= MAP_LOCKED;
+	addr = tdb_file_map(filp, db->map_sz, flags, &populate);
 
 	up_write(&init_mm.mmap_sem);
 
@@ -74,7 +138,7 @@ tdb_file_open(TDB *db, unsigned long size)
 		filp_close(filp, NULL);
 		return (long)addr;
 	}
-	if (populate)
+	if (populate && (db->flags & TDB_F_SEQLOG))
 		mm_populate(addr, populate);
 
 	db->filp = filp;
@@ -83,13 +147,101 @@ tdb_file_open(TDB *db, unsigned long size)
 	return 0;
 }
 
+/**
+ * Lock in memory and populate (if @on is true) or unlock extent @e of
+ * a tiered table. Unlocked pages can be written back and reclaimed.
+ *
+ * The function must not be called from softirq!
+ */
+int
+tdb_file_lock(TDB *db, unsigned long e, int on)
+{
+	int r, use = !current->mm;
+	unsigned long addr = (unsigned long)db->hdr + e * TDB_EXT_SZ;
+
+	/* The mapping belongs to init_mm, see tdb_file_open(). */
+	if (use)
+		use_mm(&init_mm);
+	BUG_ON(current->mm != &init_mm);
+
+	down_write(&init_mm.mmap_sem);
+	r = tempesta_mlock(addr, TDB_EXT_SZ, on);
+	up_write(&init_mm.mmap_sem);
+	if (!r && on)
+		r = __mm_populate(addr, TDB_EXT_SZ, 0);
+
+	if (use)
+		unuse_mm(&init_mm);
+
+	return r;
+}
+
+/**
+ * Fault in extent @e of file @hdr mapped by tdb_file_open(). Pages of
+ * the locked mapping stay resident after the fault.
+ *
+ * The function must not be called from softirq!
+ */
+int
+tdb_file_populate(TdbHdr *hdr, unsigned long e)
+{
+	int r, use = !current->mm;
+
+	if (use)
+		use_mm(&init_mm);
+	BUG_ON(current->mm != &init_mm);
+
+	r = __mm_populate((unsigned long)hdr + e * TDB_EXT_SZ, TDB_EXT_SZ, 0);
+
+	if (use)
+		unuse_mm(&init_mm);
+
+	return r;
+}
+
+/**
+ * Change size of the table file to @size bytes. New extents are allocated
+ * continuously if the file system supports it and read as zeroes.
+ *
+ * The function must not be called from softirq!
+ */
+int
+tdb_file_resize(TDB *db, unsigned long size)
+{
+	int r = 0;
+	struct inode *inode = file_inode(db->filp);
+
+	if (size > inode->i_size && db->filp->f_op->fallocate) {
+		sb_start_write(inode->i_sb);
+		r = db->filp->f_op->fallocate(db->filp, 0, inode->i_size,
+					      size - inode->i_size);
+		sb_end_write(inode->i_sb);
+	}
+	if (!r && size != inode->i_size)
+		r = vfs_truncate(&db->filp->f_path, size);
+
+	return r;
+}
+
+/**
+ * Write back dirty pages of @len bytes at offset @off of the table file
+ * and wait for the write back.
+ *
+ * The function must not be called from softirq!
+ */
+int
+tdb_file_sync(TDB *db, unsigned long off, unsigned long len)
+{
+	return vfs_fsync_range(db->filp, off, off + len - 1, 1);
+}
+
 void
 tdb_file_close(TDB *db)
 {
 	if (!db->hdr)
 		return;
 
-	vm_munmap((unsigned long)db->hdr, db->hdr->dbsz);
+	vm_munmap((unsigned long)db->hdr, db->map_sz);
 
 	filp_close(db->filp, NULL);
 
@@ -24,6 +24,10 @@
 #include "tdb.h"
 
 int tdb_file_open(TDB *db, unsigned long size);
+int tdb_file_lock(TDB *db, unsigned long e, int on);
+int tdb_file_populate(TdbHdr *hdr, unsigned long e);
+int tdb_file_resize(TDB *db, unsigned long size);
+int tdb_file_sync(TDB *db, unsigned long off, unsigned long len);
 void tdb_file_close(TDB *db);
 
 #endif /* __FILE_H__ */
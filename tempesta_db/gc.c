@@ -0,0 +1,653 @@
+/**
+ *		Tempesta DB
+ *
+ * Background garbage collector.
+ *
+ * Lock-free readers can reference unlinked blocks, so the blocks are freed
+ * by the collector thread only after all the readers which could see them
+ * finish. Readers and writers run in softirq context or under
+ * rcu_read_lock_bh(), so synchronize_rcu_bh() waits for all of them.
+ *
+ * The collector runs when some allocation fails or periodically if the
+ * database watermarks met, i.e. all the database extents were used at least
+ * once and new blocks can be got from garbage only. If there are still
+ * too few free blocks, then cold records are evicted by CLOCK algorithm.
+ *
+ * Expired records are freed by the collector each run regardless of the
+ * watermarks, so records can be seen by readers up to TDB_GC_INTERVAL
+ * seconds after their expiration.
+ *
+ * The collector also manages memory of tiered tables: it unlocks extents
+ * which weren't accessed for a while if there are more resident extents
+ * than the table hot size allows, and keeps extents near the watermarks
+ * resident for writers. Cold extents are locked back on reader requests,
+ * see tdb_fault_in(). The collector faults in cold pages while it walks
+ * the index, so it works in init_mm context. Tables which aren't tiered
+ * have cold extents only while their files are populated on start.
+ *
+ * Logs have no garbage, the collector only closes their idle segments.
+ *
+ * The collector also makes checkpoints: it writes back the whole database
+ * files each TDB_CKPT_INTERVAL seconds, so a crash loses only recent updates
+ * and the files which weren't closed cleanly are recovered quickly.
+ *
+ * Database pages can be referenced by skbs (e.g. cached responses are sent
+ * as paged fragments), so the pages with extra references aren't freed
+ * until the skbs are freed.
+ *
+ * Copyright (C) 2014 NatSys Lab. (info@natsys-lab.com).
+ * Copyright (C) 2014 Tempesta Technologies Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include <linux/freezer.h>
+#include <linux/kthread.h>
+#include <linux/mm.h>
+#include <linux/mmu_context.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/time.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+
+#include "file.h"
+#include "gc.h"
+#include "htrie.h"
+#include "seqlog.h"
+
+/* Period (in seconds) of checking the databases for garbage. */
+#define TDB_GC_INTERVAL		5
+/*
+ * Start eviction if less than 1/TDB_GC_EVICT_LOW of blocks are free
+ * and evict records until 1/TDB_GC_EVICT_HIGH of blocks are free.
+ */
+#define TDB_GC_EVICT_LOW	16
+#define TDB_GC_EVICT_HIGH	8
+/* Resident extents ahead of each watermark in tiered tables. */
+#define TDB_TIER_SPARE		2
+/* Period (in seconds) of the databases checkpoints. */
+#define TDB_CKPT_INTERVAL	60
+/* Maximum number of extents unlocked at once. */
+#define TDB_TIER_BATCH		64
+#define TDB_TIER_BLKS		(TDB_EXT_SZ / PAGE_SIZE)
+
+static LIST_HEAD(tdb_list);
+static DEFINE_MUTEX(tdb_list_mtx);
+static DECLARE_WAIT_QUEUE_HEAD(tdb_gc_wq);
+static struct task_struct *tdb_gc_thr;
+static int tdb_gc_req;
+/* Serializes memory locking of tiered tables. */
+static DEFINE_MUTEX(tdb_tier_mtx);
+
+/**
+ * Wake up the collector, e.g. if there is no free space in a database.
+ * Can be called from softirq.
+ */
+void
+tdb_gc_wakeup(void)
+{
+	if (ACCESS_ONCE(tdb_gc_req))
+		return;
+	tdb_gc_req = 1;
+	wake_up(&tdb_gc_wq);
+}
+
+/**
+ * Don't free pages which are still referenced by somebody else
+ * except the page cache and the database mapping.
+ */
+static void
+tdb_gc_skip_busy(TDB *db)
+{
+	unsigned long b, nb = db->hdr->dbsz / PAGE_SIZE;
+
+	for_each_set_bit(b, db->gc_bmp, nb) {
+		struct page *page = virt_to_page(TDB_PTR(db->hdr,
+							 b * PAGE_SIZE));
+		/* Huge page references are counted by the head page. */
+		page = compound_head(page);
+		if (page_count(page) > page_mapcount(page) + 1)
+			__clear_bit(b, db->gc_bmp);
+	}
+}
+
+/**
+ * Process the detached timers list @tl: free expired records and move
+ * timers of alive records to lower levels of the timer wheel.
+ */
+static void
+tdb_gc_expire_timers(TDB *db, unsigned int tl, unsigned long now)
+{
+	size_t n = 0;
+
+	while (tl) {
+		rcu_read_lock_bh();
+		tl = tdb_htrie_tw_expire(db->hdr, tl, now, &n);
+		rcu_read_unlock_bh();
+		cond_resched();
+	}
+
+	if (n)
+		TDB_DBG("GC: %lu records expired in %s\n", n, db->path);
+}
+
+/**
+ * Free expired records without garbage collection.
+ */
+static void
+tdb_gc_expire(TDB *db, unsigned long now)
+{
+	unsigned int tl;
+	unsigned long from = tdb_htrie_tw_advance(db->hdr, now);
+
+	/* Wait for writers which still use the previous wheel clock. */
+	synchronize_rcu_bh();
+	tl = tdb_htrie_tw_detach(db->hdr, from, now);
+	/* Wait for writers still appending timers to the detached blocks. */
+	synchronize_rcu_bh();
+
+	tdb_gc_expire_timers(db, tl, now);
+}
+
+static void
+tdb_gc_collect(TDB *db, unsigned long now)
+{
+	size_t n, nb;
+	unsigned int tl;
+	unsigned long from;
+	TdbHdr *dbh = db->hdr;
+
+	from = tdb_htrie_tw_advance(dbh, now);
+
+	nb = dbh->dbsz / PAGE_SIZE;
+	n = tdb_htrie_free_blks(dbh);
+	if (n < nb / TDB_GC_EVICT_LOW)
+		tdb_htrie_evict(dbh, &db->clock_hand,
+				(nb / TDB_GC_EVICT_HIGH - n) * PAGE_SIZE);
+
+	tdb_htrie_gc_snapshot(dbh, db->gc_bmp);
+	/*
+	 * Wait for writers which are probably still linking blocks
+	 * from the snapshot with the tree.
+	 */
+	synchronize_rcu_bh();
+
+	/*
+	 * Writers use the new wheel clock after the grace period, so they
+	 * don't add timers to the detached slots. Detached timer blocks
+	 * are unreachable, so they're freed by the sweep below.
+	 */
+	tl = tdb_htrie_tw_detach(dbh, from, now);
+	tdb_htrie_gc_mark(dbh, db->gc_bmp);
+	/*
+	 * Wait for readers which probably still see unreachable blocks
+	 * and for writers still appending timers to the detached blocks.
+	 */
+	synchronize_rcu_bh();
+
+	tdb_gc_expire_timers(db, tl, now);
+
+	tdb_gc_skip_busy(db);
+
+	n = tdb_htrie_gc_sweep(dbh, db->gc_bmp);
+
+	TDB_DBG("GC: %lu blocks freed in %s\n", n, db->path);
+}
+
+/**
+ * @return true if writers are going to allocate blocks from extent @e
+ * soon, so it must be resident.
+ */
+int
+tdb_gc_spare(TdbHdr *dbh, unsigned long e)
+{
+	unsigned long i_wm = ACCESS_ONCE(dbh->i_wm);
+	unsigned long d_wm = ACCESS_ONCE(dbh->d_wm);
+
+	return (e > i_wm && e <= i_wm + TDB_TIER_SPARE && e < d_wm)
+	       || (e < d_wm && e + TDB_TIER_SPARE >= d_wm && e > i_wm);
+}
+
+static int
+__tdb_tier_promote(TDB *db, unsigned long e)
+{
+	int r;
+
+	if (!tdb_htrie_ext_cold(db->hdr, e))
+		return 0;
+
+	/* Extents of the prefaulted tables are already locked. */
+	r = db->hot_sz ? tdb_file_lock(db, e, 1)
+		       : tdb_file_populate(db->hdr, e);
+	if (r) {
+		TDB_ERR("Cannot lock extent %lu of %s, %d\n", e, db->path, r);
+		return r;
+	}
+	if (db->hot_sz) {
+		set_bit(e, db->ref_bmp);
+		++db->hot_n;
+	}
+
+	/* The extent is populated, so readers can access it from now. */
+	smp_wmb();
+	tdb_htrie_ext_set_cold(db->hdr, e, 0);
+
+	return 0;
+}
+
+/**
+ * Make cold extent @e of table @db resident. Tables which are being
+ * prefaulted have cold extents as well, see tdb_prefault().
+ * The function must not be called from softirq!
+ */
+int
+tdb_gc_promote(TDB *db, unsigned long e)
+{
+	int r;
+
+	mutex_lock(&tdb_tier_mtx);
+	r = __tdb_tier_promote(db, e);
+	mutex_unlock(&tdb_tier_mtx);
+
+	return r;
+}
+
+/**
+ * Balance resident memory of tiered table @db: make extents near the
+ * watermarks and extents with free blocks (if there are too few resident
+ * free blocks) resident and unlock the least recently used extents above
+ * the hot size by CLOCK algorithm.
+ */
+static void
+tdb_tier_balance(TDB *db)
+{
+	int i, nd = 0;
+	TdbHdr *dbh = db->hdr;
+	unsigned long e, n = dbh->dbsz / TDB_EXT_SZ;
+	unsigned long hot_max = db->hot_sz / TDB_EXT_SZ, free, f;
+	unsigned long demote[TDB_TIER_BATCH];
+
+	mutex_lock(&tdb_tier_mtx);
+
+	for (e = 0; e < n; ++e)
+		if (tdb_gc_spare(dbh, e))
+			__tdb_tier_promote(db, e);
+
+	/* Only garbage blocks are available if the watermarks met. */
+	free = tdb_htrie_free_blks(dbh);
+	for (e = n; e-- > 0 && free < TDB_TIER_SPARE * TDB_TIER_BLKS; ) {
+		if (!tdb_htrie_ext_cold(dbh, e))
+			continue;
+		f = tdb_htrie_ext_free_blks(dbh, e);
+		if (f > TDB_TIER_BLKS / 2 && !__tdb_tier_promote(db, e))
+			free += f;
+	}
+
+	for (i = 0; i < 2 * n && db->hot_n - nd > hot_max
+		    && nd < TDB_TIER_BATCH; ++i) {
+		e = db->tier_hand++ % n;
+		if (tdb_htrie_ext_cold(dbh, e) || tdb_gc_spare(dbh, e)
+		    || tdb_htrie_ext_pinned(dbh, e))
+			continue;
+		/* Give recently used extents the second chance. */
+		if (test_and_clear_bit(e, db->ref_bmp))
+			continue;
+		tdb_htrie_ext_set_cold(dbh, e, 1);
+		demote[nd++] = e;
+	}
+	if (!nd)
+		goto out;
+
+	/* Wait for readers and writers which still see the extents hot. */
+	synchronize_rcu_bh();
+
+	for (i = 0; i < nd; ++i) {
+		e = demote[i];
+		/* A writer could move its cursor to the extent. */
+		if (tdb_htrie_ext_pinned(dbh, e) || tdb_file_lock(db, e, 0)) {
+			tdb_htrie_ext_set_cold(dbh, e, 0);
+			continue;
+		}
+		--db->hot_n;
+	}
+
+	TDB_DBG("GC: %d extents unlocked in %s, %lu resident\n", nd, db->path,
+		db->hot_n);
+out:
+	mutex_unlock(&tdb_tier_mtx);
+}
+
+/**
+ * Lock extents of tiered table @db which must be resident and mark other
+ * extents as cold. The file isn't populated on mmap(), so the locked
+ * extents are faulted in here.
+ */
+static int
+tdb_tier_init(TDB *db)
+{
+	int r = 0;
+	TdbHdr *dbh = db->hdr;
+	unsigned long e, n = dbh->dbsz / TDB_EXT_SZ;
+
+	/* Readers mark extents lock-free, so reserve room for growing. */
+	db->ref_bmp = vzalloc(BITS_TO_LONGS(db->map_sz / TDB_EXT_SZ)
+			      * sizeof(long));
+	if (!db->ref_bmp)
+		return -ENOMEM;
+
+	mutex_lock(&tdb_tier_mtx);
+	for (e = 0; e < n; ++e) {
+		if (!tdb_gc_spare(dbh, e) && !tdb_htrie_ext_pinned(dbh, e)) {
+			tdb_htrie_ext_set_cold(dbh, e, 1);
+			continue;
+		}
+		r = tdb_file_lock(db, e, 1);
+		if (r) {
+			TDB_ERR("Cannot lock extent %lu of %s, %d\n", e,
+				db->path, r);
+			break;
+		}
+		++db->hot_n;
+	}
+	mutex_unlock(&tdb_tier_mtx);
+
+	return r;
+}
+
+/**
+ * Write back the database file if the last checkpoint is too old.
+ */
+static void
+tdb_gc_checkpoint(TDB *db, unsigned long now)
+{
+	int r;
+	TdbHdr *dbh = db->hdr;
+
+	if (now - dbh->ckpt < TDB_CKPT_INTERVAL)
+		return;
+
+	r = tdb_file_sync(db, 0, dbh->dbsz);
+	if (r) {
+		TDB_ERR("Cannot checkpoint %s, %d\n", db->path, r);
+		return;
+	}
+	/* The time is written back by the next checkpoint. */
+	dbh->ckpt = now;
+}
+
+static int
+tdb_gc(void *arg)
+{
+	TDB *db;
+
+	set_freezable();
+	use_mm(&init_mm);
+
+	while (!kthread_should_stop()) {
+		int forced;
+		unsigned long now;
+
+		wait_event_freezable_timeout(tdb_gc_wq,
+					     ACCESS_ONCE(tdb_gc_req)
+					     || kthread_should_stop(),
+					     TDB_GC_INTERVAL * HZ);
+
+		forced = tdb_gc_req;
+		tdb_gc_req = 0;
+		now = get_seconds();
+
+		mutex_lock(&tdb_list_mtx);
+		list_for_each_entry(db, &tdb_list, list) {
+			TdbHdr *dbh = db->hdr;
+			tdb_gc_checkpoint(db, now);
+			if (db->flags & TDB_F_SEQLOG) {
+				tdb_seqlog_flush(dbh);
+				continue;
+			}
+			if (db->hot_sz)
+				tdb_tier_balance(db);
+			/*
+			 * Cold extents of prefaulted tables become available
+			 * soon, so don't evict records for their blocks.
+			 */
+			if ((!forced && dbh->i_wm + 1 < dbh->d_wm)
+			    || atomic_read(&db->pf_n))
+			{
+				if (dbh->tw)
+					tdb_gc_expire(db, now);
+				continue;
+			}
+			tdb_gc_collect(db, now);
+		}
+		mutex_unlock(&tdb_list_mtx);
+	}
+
+	unuse_mm(&init_mm);
+
+	return 0;
+}
+
+/**
+ * Grow table @db to @size bytes. The new extents are populated (or marked
+ * as cold in tiered mode) before allocators see them, so the table is
+ * usable while the file grows.
+ */
+static int
+tdb_gc_grow(TDB *db, unsigned long size)
+{
+	int r;
+	TdbHdr *dbh = db->hdr;
+	unsigned long e, last = size / TDB_EXT_SZ - 1, *bmp;
+
+	if (size > db->map_sz)
+		return -EFBIG;
+	r = tdb_file_resize(db, size);
+	if (r)
+		return r;
+
+	for (e = dbh->dbsz / TDB_EXT_SZ; e <= last; ++e) {
+		/* Writers allocate blocks from the last extent at once. */
+		if (db->hot_sz && e < last) {
+			tdb_htrie_ext_set_cold(dbh, e, 1);
+			continue;
+		}
+		r = db->hot_sz ? tdb_file_lock(db, e, 1)
+			       : tdb_file_populate(dbh, e);
+		if (r)
+			return r;
+		cond_resched();
+	}
+
+	bmp = vmalloc(BITS_TO_LONGS(size / PAGE_SIZE) * sizeof(long));
+	if (!bmp)
+		return -ENOMEM;
+
+	mutex_lock(&tdb_list_mtx);
+	vfree(db->gc_bmp);
+	db->gc_bmp = bmp;
+	tdb_htrie_grow(dbh, size);
+	mutex_unlock(&tdb_list_mtx);
+
+	if (db->hot_sz) {
+		mutex_lock(&tdb_tier_mtx);
+		set_bit(last, db->ref_bmp);
+		++db->hot_n;
+		mutex_unlock(&tdb_tier_mtx);
+	}
+
+	return 0;
+}
+
+/**
+ * Shrink table @db to @size bytes: evacuate the extents beyond the new file
+ * end and truncate the file. The timer wheel is rebuilt, since its blocks
+ * can be in the extents. The collector doesn't run meanwhile, but readers
+ * and writers do.
+ */
+static int
+tdb_gc_shrink(TDB *db, unsigned long size)
+{
+	int r;
+	unsigned int tl;
+	unsigned long e, tw, busy, old;
+	TdbHdr *dbh = db->hdr;
+
+	mutex_lock(&tdb_list_mtx);
+
+	old = dbh->dbsz;
+	r = tdb_htrie_shrink_start(dbh, size);
+	if (r)
+		goto out;
+	/* Wait for writers which could allocate blocks from the extents. */
+	synchronize_rcu_bh();
+
+	/* Free space for the new timer blocks. */
+	tdb_htrie_evacuate(dbh);
+	tdb_gc_collect(db, get_seconds());
+
+	r = tdb_htrie_tw_move(dbh, &tw);
+	if (r)
+		goto err;
+	if (tw && tw != dbh->tw) {
+		synchronize_rcu_bh();
+		tl = tdb_htrie_tw_detach_all(dbh, tw);
+		synchronize_rcu_bh();
+		/* Nothing expires at zero time, so all timers are re-added. */
+		tdb_gc_expire_timers(db, tl, 0);
+	}
+
+	/* Writers could link records with buckets from the extents. */
+	busy = tdb_htrie_evacuate(dbh);
+	if (busy) {
+		TDB_ERR("Cannot shrink %s, %lu blocks can't be evacuated\n",
+			db->path, busy);
+		r = -EBUSY;
+		goto err;
+	}
+	/* Wait for readers of the evicted records. */
+	synchronize_rcu_bh();
+
+	if (db->hot_sz) {
+		mutex_lock(&tdb_tier_mtx);
+		for (e = size / TDB_EXT_SZ; e < old / TDB_EXT_SZ; ++e)
+			if (!tdb_htrie_ext_cold(dbh, e)
+			    && !tdb_file_lock(db, e, 0))
+				--db->hot_n;
+		mutex_unlock(&tdb_tier_mtx);
+	}
+	tdb_htrie_shrink_finish(dbh, old);
+
+	r = tdb_file_resize(db, size);
+	if (r)
+		TDB_ERR("Cannot truncate %s, %d\n", db->path, r);
+	r = 0;
+	goto out;
+err:
+	/* The evacuated extents are empty, so just give them back. */
+	tdb_htrie_grow(dbh, old);
+out:
+	mutex_unlock(&tdb_list_mtx);
+
+	return r;
+}
+
+/**
+ * Grow or shrink table @db to @size bytes.
+ * The function must not be called from softirq!
+ */
+int
+tdb_gc_resize(TDB *db, unsigned long size)
+{
+	unsigned long old = db->hdr->dbsz;
+	int r;
+
+	if (size == old)
+		return 0;
+	r = size > old ? tdb_gc_grow(db, size) : tdb_gc_shrink(db, size);
+	if (r)
+		TDB_ERR("Cannot resize %s to %lu bytes, %d\n", db->path, size,
+			r);
+	else
+		TDB_DBG("%s is resized from %lu to %lu bytes\n", db->path,
+			old, size);
+
+	return r;
+}
+
+/**
+ * Add initialized database to the collector list.
+ */
+int
+tdb_gc_register(TDB *db)
+{
+	if (db->flags & TDB_F_SEQLOG)
+		goto reg;
+
+	if (db->hot_sz && tdb_tier_init(db))
+		goto err;
+
+	db->gc_bmp = vmalloc(tdb_htrie_gc_bmp_sz(db->hdr));
+	if (!db->gc_bmp)
+		goto err;
+reg:
+	mutex_lock(&tdb_list_mtx);
+	list_add(&db->list, &tdb_list);
+	mutex_unlock(&tdb_list_mtx);
+
+	return 0;
+err:
+	vfree(db->ref_bmp);
+	db->ref_bmp = NULL;
+	return -ENOMEM;
+}
+
+/**
+ * Remove the database from the collector list.
+ * Waits for the collector if it's processing the database.
+ */
+void
+tdb_gc_unregister(TDB *db)
+{
+	if (list_empty(&db->list))
+		return;
+
+	mutex_lock(&tdb_list_mtx);
+	list_del_init(&db->list);
+	mutex_unlock(&tdb_list_mtx);
+
+	vfree(db->gc_bmp);
+	db->gc_bmp = NULL;
+	vfree(db->ref_bmp);
+	db->ref_bmp = NULL;
+}
+
+int __init
+tdb_gc_init(void)
+{
+	tdb_gc_thr = kthread_run(tdb_gc, NULL, "tdb_gc");
+	if (IS_ERR(tdb_gc_thr)) {
+		TDB_ERR("Cannot start garbage collector, %ld\n",
+			PTR_ERR(tdb_gc_thr));
+		return PTR_ERR(tdb_gc_thr);
+	}
+
+	return 0;
+}
+
+void
+tdb_gc_exit(void)
+{
+	kthread_stop(tdb_gc_thr);
+}
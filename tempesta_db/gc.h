@@ -0,0 +1,36 @@
+/**
+ *		Tempesta DB
+ *
+ * Copyright (C) 2012-2014 NatSys Lab. (info@natsys-lab.com).
+ * Copyright (C) 2014 Tempesta Technologies Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __GC_H__
+#define __GC_H__
+
+#include "tdb.h"
+
+int tdb_gc_register(TDB *db);
+void tdb_gc_unregister(TDB *db);
+void tdb_gc_wakeup(void);
+int tdb_gc_promote(TDB *db, unsigned long e);
+int tdb_gc_spare(TdbHdr *dbh, unsigned long e);
+int tdb_gc_resize(TDB *db, unsigned long size);
+
+int tdb_gc_init(void);
+void tdb_gc_exit(void);
+
+#endif /* __GC_H__ */
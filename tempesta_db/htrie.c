@@ -7,6 +7,17 @@
  * for large data sets index records grow from lower addresses to higher while
  * data records grow towards them, from maximum to minimum addresses.
  *
+ * The tree is concurrent: readers never take locks, while writers publish
+ * new buckets and index nodes by CAS on index node slots. A bucket is never
+ * changed in place by burst: new index node and buckets are built privately
+ * and are linked with the tree by single CAS, so readers which are still
+ * traversing the old bucket see consistent data. Writers placing small
+ * records into the same bucket serialize on per-bucket spin bit.
+ *
+ * Nothing is freed in place. Garbage collector periodically marks all the
+ * blocks reachable from the tree root and returns the rest of used blocks
+ * to extent bitmaps, see tdb_htrie_gc_snapshot() and friends.
+ *
  * Copyright (C) 2014 NatSys Lab. (info@natsys-lab.com).
  * Copyright (C) 2014 Tempesta Technologies Ltd.
  *
@@ -25,38 +36,68 @@
  * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 #include <linux/bitops.h>
+#include <linux/bottom_half.h>
+#include <linux/prefetch.h>
+#include <linux/smp.h>
 
 #include "htrie.h"
 
-#define TDB_MAGIC	0x434947414D424454UL /* "TDBMAGIC" */
+/* __htrie_insert() modes. */
+#define TDB_INS_AGGREGATE	0x1	/* place small records to buckets */
+#define TDB_INS_UNIQUE		0x2	/* one pinned record per key */
 
 /**
  * Tempesta DB extent descriptor.
  *
+ * @b_full	- summary of @b_bmp: a bit is set if the corresponding word of
+ * 		  @b_bmp has no free blocks. This is a hint updated after
+ * 		  @b_bmp, see tdb_ext_word_full();
  * @b_bmp	- bitmap of used/free blocks;
+ * @flags	- TDB_EXT_F_* flags of the extent;
  */
 typedef struct {
+	unsigned long	b_full;
 	unsigned long	b_bmp[TDB_BLK_BMP_2L];
+	unsigned long	flags;
 } __attribute__((packed)) TdbExt;
 
+#define TDB_EXT_FULL_MASK	((1UL << TDB_BLK_BMP_2L) - 1)
+/*
+ * The extent keeps index nodes or expiration timers, which are accessed
+ * by writers w/o lookups, so tiered storage never unlocks it.
+ */
+#define TDB_EXT_F_META		0
+
 /**
  * Tempesta DB HTrie node.
  * This is exactly one cache line.
  * Each shift in @shifts determine index of a node in file including extent
  * and/or file headers, i.e. they start from 2 or 3.
+ * Empty shifts are set by CAS only, so concurrent writers never lose
+ * a published bucket or index node.
  */
 typedef struct {
 	unsigned int	shifts[TDB_HTRIE_FANOUT];
 } __attribute__((packed)) TdbHtrieNode;
 
+/*
+ * True if @len bytes starting at @o fit an already allocated block.
+ * Offset at block boundary means that the previous block is fully used.
+ */
+#define TDB_BLK_FITS(o, len)	(((o) & ~PAGE_MASK)			\
+				 && !(((o) ^ ((o) + (len) - 1)) & PAGE_MASK))
+
+/**
+ * @return extent descriptor for the extent containing byte offset @off.
+ */
 static inline TdbExt *
-tdb_ext(TdbHdr *dbh, void *ptr)
+tdb_ext(TdbHdr *dbh, unsigned long off)
 {
-	unsigned long e = TDB_EXT_O(ptr);
+	unsigned long e = TDB_EXT_O(off);
 
-	if (e == (unsigned long)dbh)
+	if (!e)
 		e += TDB_HDR_SZ(dbh); /* first extent */
-	return (TdbExt *)e;
+	return TDB_PTR(dbh, e);
 }
 
 static inline void
@@ -65,9 +106,79 @@ tdb_set_bit(unsigned long *bmp, unsigned int nr)
 	set_bit(nr % BITS_PER_LONG, bmp + nr / BITS_PER_LONG);
 }
 
+static inline void
+tdb_clear_bit(unsigned long *bmp, unsigned int nr)
+{
+	clear_bit(nr % BITS_PER_LONG, bmp + nr / BITS_PER_LONG);
+}
+
+static inline int
+tdb_test_bit(unsigned long *bmp, unsigned int nr)
+{
+	return test_bit(nr % BITS_PER_LONG, bmp + nr / BITS_PER_LONG);
+}
+
+/**
+ * Update the summaries when word @i of extent @e blocks bitmap probably
+ * became full. A concurrent free can make the word non-full again, so
+ * the word is rechecked after the summary update and the free path
+ * clears the summaries after the blocks bitmap. Thus a summary bit can be
+ * unset for a full word (allocators fix it), but not vise versa.
+ */
+static void
+tdb_ext_word_full(TdbHdr *dbh, TdbExt *e, int i)
+{
+	unsigned long id = TDB_EXT_ID(TDB_HTRIE_OFF(dbh, e));
+
+	if (test_and_set_bit(i, &e->b_full))
+		return;
+	if (ACCESS_ONCE(e->b_bmp[i]) != ~0UL) {
+		clear_bit(i, &e->b_full);
+		return;
+	}
+
+	if (ACCESS_ONCE(e->b_full) != TDB_EXT_FULL_MASK)
+		return;
+	tdb_set_bit(TDB_EXT_FULL(dbh), id);
+	smp_mb__after_clear_bit();
+	if (ACCESS_ONCE(e->b_full) != TDB_EXT_FULL_MASK)
+		tdb_clear_bit(TDB_EXT_FULL(dbh), id);
+}
+
+/**
+ * Mark block @nr of extent @e as free and update the summaries.
+ */
+static void
+tdb_ext_free_blk(TdbHdr *dbh, TdbExt *e, unsigned int nr)
+{
+	unsigned int i = nr / BITS_PER_LONG;
+	unsigned long id = TDB_EXT_ID(TDB_HTRIE_OFF(dbh, e));
+
+	clear_bit(nr % BITS_PER_LONG, &e->b_bmp[i]);
+	smp_mb__after_clear_bit();
+	if (test_bit(i, &e->b_full))
+		clear_bit(i, &e->b_full);
+	smp_mb__after_clear_bit();
+	if (tdb_test_bit(TDB_EXT_FULL(dbh), id))
+		tdb_clear_bit(TDB_EXT_FULL(dbh), id);
+}
+
+/**
+ * Mark the extent of block @off as holding metadata.
+ */
+static inline void
+tdb_ext_set_meta(TdbHdr *dbh, unsigned long off)
+{
+	TdbExt *e = tdb_ext(dbh, off);
+
+	if (!test_bit(TDB_EXT_F_META, &e->flags))
+		set_bit(TDB_EXT_F_META, &e->flags);
+}
+
 static TdbHdr *
 tdb_init_mapping(void *p, size_t db_size, unsigned int rec_len)
 {
+	unsigned long o;
 	TdbHdr *hdr = (TdbHdr *)p;
 
 	/* Use variable-size records for large stored data. */
@@ -78,20 +189,25 @@ tdb_init_mapping(void *p, size_t db_size, unsigned int rec_len)
 	memset(hdr, 0, db_size);
 
 	hdr->magic = TDB_MAGIC;
+	hdr->version = TDB_VERSION;
 	hdr->dbsz = db_size;
 	hdr->rec_len = rec_len;
-	/* Set index write cache line just after rool index node. */
-	hdr->i_wcl = TDB_HTRIE_IALIGN(TDB_HDR_SZ(hdr) + sizeof(TdbExt)
-				      + sizeof(TdbHtrieNode));
+	/* The new file doesn't need recovery. */
+	hdr->flags = TDB_F_CLEAN;
 	/* Data grows from the last extent to begin. */
 	hdr->d_wm = db_size / TDB_EXT_SZ - 1;
-	hdr->d_wcl = TDB_HTRIE_DALIGN(hdr->d_wm * TDB_EXT_SZ + sizeof(TdbExt));
 
-	/* Set first (current) extents and blocks as used. */
-	set_bit(0, hdr->ext_bmp);
-	set_bit(BITS_PER_LONG - 1, &hdr->ext_bmp[TDB_EXT_BMP_2L(hdr) - 1]);
-	set_bit(0, tdb_ext(hdr, hdr)->b_bmp);
-	set_bit(0, tdb_ext(hdr, TDB_PTR(hdr, hdr->d_wcl))->b_bmp);
+	/*
+	 * Set first (current) extents and the blocks of the file header and
+	 * the root index node as used. The cursors are zero, i.e. point to
+	 * no block, so each CPU allocates its own blocks on the first write.
+	 */
+	tdb_set_bit(hdr->ext_bmp, 0);
+	tdb_set_bit(hdr->ext_bmp, hdr->d_wm);
+	set_bit(TDB_EXT_F_META, &tdb_ext(hdr, 0)->flags);
+	for (o = 0; o < TDB_HTRIE_OFF(hdr, TDB_HTRIE_ROOT(hdr) + 1);
+	     o += PAGE_SIZE)
+		set_bit(o >> PAGE_SHIFT, tdb_ext(hdr, 0)->b_bmp);
 
 	return hdr;
 }
@@ -99,20 +215,26 @@ tdb_init_mapping(void *p, size_t db_size, unsigned int rec_len)
 /*
  * @return aligned and shrinked (if necessary) length to allocate data block.
  * Can be significanly less than @len for chunked data.
+ * @bckt is true if the record is the first one in a new bucket.
  */
 static size_t
-tdb_full_rec_len(TdbHdr *dbh, size_t *len)
+tdb_full_rec_len(TdbHdr *dbh, size_t *len, int bckt)
 {
-	size_t align_len, rhl;
+	size_t align_len, rhl, max = PAGE_SIZE;
 
 	rhl = TDB_HTRIE_VARLENRECS(dbh) ? sizeof(TdbVRec) : sizeof(TdbFRec);
+	if (bckt)
+		rhl += TDB_HTRIE_BCKT_HDR(dbh);
 
 	/* Allocate at least 2 cache lines for small data records. */
 	align_len = TDB_HTRIE_DALIGN(*len + rhl);
 
-	if (align_len > PAGE_SIZE) {
-		*len -= align_len - PAGE_SIZE;
-		align_len = PAGE_SIZE;
+	/* Chunks following the first one can span several blocks. */
+	if (!bckt && TDB_HTRIE_VARLENRECS(dbh))
+		max = TDB_HTRIE_CHUNK_MAX;
+	if (align_len > max) {
+		*len -= align_len - max;
+		align_len = max;
 	}
 
 	return align_len;
@@ -145,114 +267,263 @@ tdb_free_vsrec(TdbVRec *rec)
 
 /**
  * Allocates a free block (system page) in extent @e.
- * @return start of available room (offset in bytes) at the block.
+ * @return start of available room (offset in bytes) at the block
+ * or 0 if the extent is full.
  */
-static inline unsigned long
+static unsigned long
 tdb_alloc_blk(TdbHdr *dbh, TdbExt *e)
 {
 	int i;
-	unsigned long r;
+	unsigned long r, w, f;
+
+	while ((f = ACCESS_ONCE(e->b_full)) != TDB_EXT_FULL_MASK) {
+		i = ffz(f);
+		w = ACCESS_ONCE(e->b_bmp[i]);
+		if (unlikely(w == ~0UL)) {
+			/* Stale summary. */
+			tdb_ext_word_full(dbh, e, i);
+			continue;
+		}
+		r = ffz(w);
+		/* Other writer can grab the block concurrently. */
+		if (test_and_set_bit(r, &e->b_bmp[i]))
+			continue;
+		if (ACCESS_ONCE(e->b_bmp[i]) == ~0UL)
+			tdb_ext_word_full(dbh, e, i);
+		r += i * BITS_PER_LONG;
+		if (!r) {
+			/* Skip extent header in the first block. */
+			r = TDB_HTRIE_OFF(dbh, e) + sizeof(*e);
+		} else {
+			r = TDB_EXT_BASE(dbh, e) + r * PAGE_SIZE;
+		}
+		return r;
+	}
+
+	return 0;
+}
+
+/**
+ * Allocates @n contiguous free blocks in extent @e. The blocks are looked
+ * up within one word of the bitmap, so @n must be less than BITS_PER_LONG.
+ * @return offset of the first block or 0 if there is no such room.
+ */
+static unsigned long
+tdb_alloc_blks(TdbHdr *dbh, TdbExt *e, int n)
+{
+	int i, k;
+	unsigned long r, w, f;
 
 	for (i = 0; i < TDB_BLK_BMP_2L; ++i) {
-		if (!(e->b_bmp[i] ^ ~0UL))
+		if (test_bit(i, &e->b_full))
 			continue;
+		while (1) {
+			w = ACCESS_ONCE(e->b_bmp[i]);
+			/* The first block is shared with the extent header. */
+			f = i ? ~w : ~w & ~1UL;
+			/* Leave only bits starting @n free blocks. */
+			for (k = 1; k < n && f; ++k)
+				f &= ~w >> k;
+			if (!f)
+				break;
+			r = __ffs(f);
+			if (cmpxchg(&e->b_bmp[i], w,
+				    w | (((1UL << n) - 1) << r)) != w)
+				continue;
+			if (ACCESS_ONCE(e->b_bmp[i]) == ~0UL)
+				tdb_ext_word_full(dbh, e, i);
+			return TDB_EXT_BASE(dbh, e)
+			       + (i * BITS_PER_LONG + r) * PAGE_SIZE;
+		}
+	}
 
-		r = ffz(e->b_bmp[i]);
-		set_bit(r, &e->b_bmp[i]);
-		r = TDB_EXT_BASE(dbh, e) + r * PAGE_SIZE;
-		if (!r) {
-			r += sizeof(*e);
-			if (TDB_EXT_O(e) == TDB_EXT_O(dbh))
-				r += TDB_HDR_SZ(dbh);
+	return 0;
+}
+
+/**
+ * Allocate a block in any extent when the watermarks met, i.e. all the
+ * extents were used at least once and only blocks returned by garbage
+ * collector are available. Index blocks are looked up from the file begin
+ * and data blocks from its end to keep them close to each other.
+ */
+static unsigned long
+tdb_alloc_blk_any(TdbHdr *dbh, int from_end, int nblk)
+{
+	int i, w, b;
+	unsigned long e, r, f, n = dbh->dbsz / TDB_EXT_SZ;
+	int nw = BITS_TO_LONGS(n);
+	unsigned long *full = TDB_EXT_FULL(dbh), *cold = TDB_EXT_COLD(dbh);
+	TdbExt *ext;
+
+	/* Look through the resident extents which have free blocks only. */
+	for (i = 0; i < nw; ++i) {
+		w = from_end ? nw - 1 - i : i;
+		for (f = ~(ACCESS_ONCE(full[w]) | ACCESS_ONCE(cold[w])); f;
+		     f &= ~(1UL << b)) {
+			b = from_end ? __fls(f) : __ffs(f);
+			e = w * BITS_PER_LONG + b;
+			if (e >= n)
+				continue;
+			ext = tdb_ext(dbh, e * TDB_EXT_SZ);
+			r = nblk == 1 ? tdb_alloc_blk(dbh, ext)
+				      : tdb_alloc_blks(dbh, ext, nblk);
+			if (r) {
+				tdb_set_bit(dbh->ext_bmp, e);
+				return r;
+			}
 		}
-		return r;
 	}
 
 	return 0;
 }
 
+/**
+ * Return the block allocated by tdb_alloc_blk(), but not used by anyone.
+ */
+static void
+tdb_free_blk(TdbHdr *dbh, unsigned long blk)
+{
+	TdbExt *e = tdb_ext(dbh, blk);
+	unsigned int nr = (blk & ~TDB_EXT_MASK) >> PAGE_SHIFT;
+
+	tdb_ext_free_blk(dbh, e, nr);
+}
+
 static unsigned long
 tdb_alloc_index_blk(TdbHdr *dbh)
 {
 	unsigned long rptr;
-	TdbExt *e = tdb_ext(dbh, TDB_PTR(dbh, dbh->i_wcl));
+	unsigned short wm;
 
 	while (1) {
-		rptr = tdb_alloc_blk(dbh, e);
-		if (!rptr) {
-			unsigned long eo;
-			if (TDB_HTRIE_OFF(dbh, e) + TDB_EXT_SZ * 2 > dbh->d_wm)
-				return 0;
-			e = (TdbExt *)(TDB_EXT_O(e) + TDB_EXT_SZ);
-			eo = TDB_EXT_ID(TDB_HTRIE_OFF(dbh, e));
-			if (dbh->i_wm < eo)
-				dbh->i_wm = eo;
-			tdb_set_bit(dbh->ext_bmp,
-				    TDB_EXT_ID(TDB_EXT_BASE(dbh, e)));
-			continue;
+		wm = ACCESS_ONCE(dbh->i_wm);
+		rptr = tdb_alloc_blk(dbh, tdb_ext(dbh, wm * TDB_EXT_SZ));
+		if (rptr)
+			return TDB_HTRIE_IALIGN(rptr);
+
+		/* No room in current extent, try the next one. */
+		if (wm + 1 >= ACCESS_ONCE(dbh->d_wm)) {
+			rptr = tdb_alloc_blk_any(dbh, 0, 1);
+			return rptr ? TDB_HTRIE_IALIGN(rptr) : 0;
 		}
-		return TDB_HTRIE_IALIGN(rptr);
+		/* Wait until tiered storage makes the extent resident. */
+		if (tdb_test_bit(TDB_EXT_COLD(dbh), wm + 1))
+			return 0;
+		if (cmpxchg(&dbh->i_wm, wm, wm + 1) == wm)
+			tdb_set_bit(dbh->ext_bmp, wm + 1);
 	}
 }
 
+/**
+ * Allocate @n contiguous data blocks.
+ */
 static unsigned long
-tdb_alloc_data_blk(TdbHdr *dbh)
+tdb_alloc_data_blks(TdbHdr *dbh, int n)
 {
 	unsigned long rptr;
-	TdbExt *e = tdb_ext(dbh, TDB_PTR(dbh, dbh->d_wcl));
+	unsigned short wm;
+	TdbExt *e;
 
 	while (1) {
-		rptr = tdb_alloc_blk(dbh, e);
-		if (!rptr) {
-			/* No room in current extent, try the next one. */
-			unsigned long eo;
-			if (TDB_HTRIE_OFF(dbh, e) <  dbh->i_wm + TDB_EXT_SZ * 2)
-				return 0;
-			e = (TdbExt *)((char *)e - TDB_EXT_SZ);
-			eo = TDB_EXT_ID(TDB_HTRIE_OFF(dbh, e));
-			if (dbh->d_wm > eo)
-				dbh->d_wm = eo;
-			tdb_set_bit(dbh->ext_bmp,
-				    TDB_EXT_ID(TDB_EXT_BASE(dbh, e)));
-			continue;
+		wm = ACCESS_ONCE(dbh->d_wm);
+		e = tdb_ext(dbh, wm * TDB_EXT_SZ);
+		rptr = n == 1 ? tdb_alloc_blk(dbh, e) : tdb_alloc_blks(dbh, e, n);
+		if (rptr)
+			return TDB_HTRIE_DALIGN(rptr);
+
+		/* No room in current extent, try the previous one. */
+		if (wm - 1 <= ACCESS_ONCE(dbh->i_wm)) {
+			rptr = tdb_alloc_blk_any(dbh, 1, n);
+			return rptr ? TDB_HTRIE_DALIGN(rptr) : 0;
+		}
+		if (tdb_test_bit(TDB_EXT_COLD(dbh), wm - 1))
+			return 0;
+		if (cmpxchg(&dbh->d_wm, wm, wm - 1) == wm)
+			tdb_set_bit(dbh->ext_bmp, wm - 1);
+	}
+}
+
+static unsigned long
+tdb_alloc_data_blk(TdbHdr *dbh)
+{
+	return tdb_alloc_data_blks(dbh, 1);
+}
+
+/**
+ * Allocates @len bytes from a block pointed by write cursor @wcl or a new
+ * block from @alloc_blk if the current block is exhausted.
+ * The cursor is moved by CAS, so concurrent writers get different areas.
+ *
+ * @return byte offset of the allocated area or 0 on error.
+ */
+static unsigned long
+__tdb_alloc(TdbHdr *dbh, unsigned long *wcl, size_t len,
+	    unsigned long (*alloc_blk)(TdbHdr *))
+{
+	unsigned long rptr, nptr, blk = 0;
+
+	while (1) {
+		rptr = ACCESS_ONCE(*wcl);
+		if (likely(TDB_BLK_FITS(rptr, len))) {
+			nptr = rptr;
+		} else {
+			/* Use a new page and/or extent for the data. */
+			if (!blk) {
+				blk = alloc_blk(dbh);
+				if (!blk)
+					return 0;
+			}
+			nptr = blk;
+			if (unlikely((nptr & ~PAGE_MASK) + len > PAGE_SIZE)) {
+				/*
+				 * The first block in an extent has less room
+				 * than others, leave it for smaller chunks.
+				 */
+				if (cmpxchg(wcl, rptr, nptr) == rptr)
+					blk = 0;
+				continue;
+			}
 		}
-		return TDB_HTRIE_DALIGN(rptr);
+		if (cmpxchg(wcl, rptr, nptr + len) == rptr)
+			break;
 	}
+	if (blk && blk != nptr)
+		/* Other writer has moved the cursor to a new block. */
+		tdb_free_blk(dbh, blk);
+
+	return nptr;
 }
 
 /**
- * @return byte offset of the allocated data block and sets @len to actually
- * available room for writting if @len doesn't fit to block.
+ * @return byte offset of the allocated data block.
  *
  * Return 0 on error.
  */
 static unsigned long
 tdb_alloc_data(TdbHdr *dbh, size_t len)
 {
-	unsigned long rptr = dbh->d_wcl;
+	unsigned long rptr;
 
-	BUG_ON(len > PAGE_SIZE);
+	BUG_ON(len > TDB_HTRIE_CHUNK_MAX);
 
 	/* Never allocate too small chunks. */
 	if (len < TDB_HTRIE_MINDREC)
 		len = TDB_HTRIE_MINDREC;
 
-	if (unlikely((dbh->i_wm + 1) * TDB_EXT_SZ + len + dbh->d_wcl
-		      > dbh->dbsz + dbh->d_wm * TDB_EXT_SZ))
+	if (len > PAGE_SIZE)
+		/* Large chunks occupy whole blocks. */
+		rptr = tdb_alloc_data_blks(dbh, DIV_ROUND_UP(len, PAGE_SIZE));
+	else
+		rptr = __tdb_alloc(dbh, &tdb_cursor(dbh)->d_wcl, len,
+				   tdb_alloc_data_blk);
+	if (unlikely(!rptr)) {
+		tdb_cursor(dbh)->alloc_errs++;
 		return 0; /* not enough space */
-
-	if (TDB_BLK_ID(rptr + len) > TDB_BLK_ID(rptr)) {
-		/* Use a new page and/or extent for the data. */
-		rptr = tdb_alloc_data_blk(dbh);
-		if (!rptr)
-			return 0;
 	}
 
 	TDB_DBG("alloc dblk %#lx for len=%lu\n", rptr, len);
 	BUG_ON(TDB_HTRIE_DALIGN(rptr) != rptr);
 
-	dbh->d_wcl = rptr + len;
-
 	return rptr;
 }
 
@@ -263,61 +534,188 @@ tdb_alloc_data(TdbHdr *dbh, size_t len)
 static unsigned long
 tdb_alloc_index(TdbHdr *dbh)
 {
-	unsigned long rptr = dbh->i_wcl;
+	unsigned long rptr;
 
-	if (unlikely(TDB_BLK_ID(rptr + sizeof(TdbHtrieNode))
-		     > TDB_BLK_ID(rptr)))
-	{
-		/* Use a new page and/or extent for the data. */
-		rptr = tdb_alloc_index_blk(dbh);
-		if (!rptr)
-			return 0;
+	rptr = __tdb_alloc(dbh, &tdb_cursor(dbh)->i_wcl, sizeof(TdbHtrieNode),
+			   tdb_alloc_index_blk);
+	if (unlikely(!rptr)) {
+		tdb_cursor(dbh)->alloc_errs++;
+		return 0;
 	}
+	tdb_ext_set_meta(dbh, rptr);
 
 	TDB_DBG("alloc iblk %#lx\n", rptr);
 	BUG_ON(TDB_HTRIE_IALIGN(rptr) != rptr);
 
-	dbh->i_wcl = rptr + sizeof(TdbHtrieNode);
-
 	return rptr;
 }
 
 static void
-tdb_htrie_init_bucket(TdbBucket *b)
+tdb_htrie_init_bucket(TdbHdr *dbh, TdbBucket *b)
 {
 	b->coll_next = 0;
 	b->flags = 0;
+	if (!TDB_HTRIE_VARLENRECS(dbh))
+		*(unsigned long *)TDB_HTRIE_BUCKET_FPS(b) = 0;
+}
+
+/**
+ * Lock the bucket against other writers. Readers don't care about the lock.
+ * Writers can run in both process and softirq contexts, so BH is disabled
+ * while the lock is held.
+ *
+ * @return -EAGAIN if the bucket was replaced by burst while we waited for it.
+ */
+static int
+tdb_htrie_bckt_lock(TdbBucket *b)
+{
+	unsigned int f;
+
+	local_bh_disable();
+
+	while (1) {
+		f = ACCESS_ONCE(b->flags);
+		if (unlikely(f & TDB_HTRIE_BURST)) {
+			local_bh_enable();
+			return -EAGAIN;
+		}
+		if (!(f & TDB_HTRIE_BLOCKED)
+		    && cmpxchg(&b->flags, f, f | TDB_HTRIE_BLOCKED) == f)
+			return 0;
+		cpu_relax();
+	}
+}
+
+/**
+ * Unlock the bucket and set @set flags on it.
+ * Pin counter can be changed concurrently, so the flags are updated by CAS.
+ */
+static void
+tdb_htrie_bckt_unlock(TdbBucket *b, unsigned int set)
+{
+	unsigned int f;
+
+	/* Make all writes to the bucket visible before the unlock. */
+	smp_mb();
+	do
+		f = ACCESS_ONCE(b->flags);
+	while (cmpxchg(&b->flags, f, (f & ~TDB_HTRIE_BLOCKED) | set) != f);
+
+	local_bh_enable();
+}
+
+/**
+ * Pin the bucket, so burst doesn't move its records until the bucket is
+ * unpinned. The pin waits while other writer holds the bucket lock, so
+ * burst which started before us completes and we see the bucket replaced.
+ *
+ * @locked	- the caller holds the bucket lock;
+ * @return -EAGAIN if the bucket was replaced by burst.
+ */
+static int
+tdb_htrie_bckt_pin(TdbBucket *b, int locked)
+{
+	unsigned int f;
+
+	while (1) {
+		f = ACCESS_ONCE(b->flags);
+		if (unlikely(f & TDB_HTRIE_BURST))
+			return -EAGAIN;
+		if ((locked || !(f & TDB_HTRIE_BLOCKED))
+		    && cmpxchg(&b->flags, f, f + TDB_HTRIE_PIN) == f)
+			return 0;
+		cpu_relax();
+	}
+}
+
+static void
+tdb_htrie_bckt_unpin(TdbBucket *b)
+{
+	unsigned int f;
+
+	do {
+		f = ACCESS_ONCE(b->flags);
+		BUG_ON(!(f & TDB_HTRIE_PINS));
+	} while (cmpxchg(&b->flags, f, f - TDB_HTRIE_PIN) != f);
+}
+
+/**
+ * Get the bucket containing record @r. Buckets are aligned to
+ * TDB_HTRIE_MINDREC and records never cross the first TDB_HTRIE_MINDREC
+ * bytes of the bucket, except the first record.
+ */
+static TdbBucket *
+tdb_htrie_rec_bckt(TdbHdr *dbh, TdbRec *r)
+{
+	return TDB_PTR(dbh, TDB_HTRIE_OFF(dbh, r)
+			    & ~(unsigned long)(TDB_HTRIE_MINDREC - 1));
+}
+
+/**
+ * @return number of fixed-size record slots in a bucket.
+ */
+static inline unsigned int
+tdb_htrie_fslots(TdbHdr *dbh)
+{
+	size_t n = TDB_HTRIE_RALIGN(sizeof(TdbFRec) + dbh->rec_len);
+
+	n = (TDB_HTRIE_MINDREC - TDB_HTRIE_BCKT_HDR(dbh)) / n;
+
+	return n ? : 1;
+}
+
+/**
+ * Set fingerprint of fixed-size record @r in bucket @b to @key.
+ * Records in slots without fingerprints are found by full scan,
+ * see tdb_htrie_bscan_for_rec().
+ */
+static void
+tdb_htrie_set_fp(TdbHdr *dbh, TdbBucket *b, TdbFRec *r, unsigned long key)
+{
+	size_t i = ((char *)r - (char *)TDB_HTRIE_BUCKET_1ST(dbh, b))
+		   / TDB_HTRIE_RECLEN(dbh, r);
+
+	if (i < sizeof(long))
+		TDB_HTRIE_BUCKET_FPS(b)[i] = tdb_htrie_fp(key);
 }
 
 /**
  * Lookup for some room just after @b bucket if it's small enough.
  * Traverses the collision chain in hope to find some room somewhere.
+ * Freed variable-length records are reused only if the new record has
+ * exactly the same aligned length, so lock-free readers never see record
+ * boundaries changing, and only after the garbage collector makes sure
+ * that readers don't use them, see tdb_htrie_gc_age_rec().
  *
- * The function links the last small record with the new (returned) one.
+ * The first bucket in the chain must be locked by the caller.
  */
 static unsigned long
 tdb_htrie_smallrec_link(TdbHdr *dbh, size_t len, TdbBucket *bckt)
 {
-	unsigned long n, o = 0;
+	unsigned long o = 0;
 
 	if (TDB_HTRIE_VARLENRECS(dbh)) {
 		TdbVRec *r;
-		TDB_HTRIE_FOREACH_REC(dbh, bckt, r) {
-			n = (char *)r - (char *)bckt
-			    + TDB_HTRIE_RALIGN(sizeof(*r) + len);
-			if (!tdb_live_vsrec(r) && n <= TDB_HTRIE_MINDREC) {
-				/* Freed record - reuse. */
-				memset(r, 0, sizeof(*r) + TDB_HTRIE_VRLEN(r));
-				o = TDB_HTRIE_OFF(dbh, r);
-				goto done;
+		size_t n = TDB_HTRIE_RALIGN(sizeof(*r) + len);
+
+		for ( ; bckt; bckt = TDB_HTRIE_BUCKET_NEXT(dbh, bckt))
+			for (r = TDB_HTRIE_BUCKET_1ST(dbh, bckt);
+			     (char *)r - (char *)bckt + n <= TDB_HTRIE_MINDREC;
+			     r = (TdbVRec *)((char *)r
+					     + TDB_HTRIE_RECLEN(dbh, r)))
+			{
+				if (!r->len
+				    || ((r->len & TDB_HTRIE_VRREUSE)
+					&& TDB_HTRIE_RECLEN(dbh, r) == n))
+				{
+					o = TDB_HTRIE_OFF(dbh, r);
+					goto done;
+				}
 			}
-		}
 	} else {
 		TdbFRec *r;
 		TDB_HTRIE_FOREACH_REC(dbh, bckt, r) {
-			n = (char *)r - (char *)bckt
-			    + TDB_HTRIE_RALIGN(sizeof(*r) + len);
-			if (!tdb_live_fsrec(dbh, r) && n <= TDB_HTRIE_MINDREC) {
+			if (!tdb_live_fsrec(dbh, r)) {
 				/* Already freed record - just reuse. */
 				o = TDB_HTRIE_OFF(dbh, r);
 				goto done;
@@ -335,108 +733,112 @@ done:
 /**
  * Grow the tree.
  *
+ * The new index node and new buckets for all live records of @bckt are
+ * built privately and the node is linked with @node by single CAS.
+ * The old bucket stays untouched for lock-free readers, which probably
+ * still traverse it, and is left for garbage collector.
+ *
  * @node	- current index node at which least significant bits collision
  * 		  happened.
+ * @return 0 on success, -EAGAIN if the bucket was already burst by other
+ * writer, or -ENOMEM.
  */
 static int
-tdb_htrie_burst(TdbHdr *dbh, TdbHtrieNode **node, TdbBucket *bckt,
+tdb_htrie_burst(TdbHdr *dbh, TdbHtrieNode *node, TdbBucket *bckt,
 		unsigned long key, int bits)
 {
-	int i, free_nb;
-	unsigned int new_in_idx;
+	int i, r = -ENOMEM;
+	unsigned int new_in_idx, s;
 	unsigned long k, n;
-	TdbBucket *b = TDB_HTRIE_BUCKET_1ST(bckt);
 	TdbHtrieNode *new_in;
 	struct {
 		unsigned long	b;
-		unsigned char	off;
+		unsigned int	off;
 	} nb[TDB_HTRIE_FANOUT] = {{0, 0}};
 
+	if (tdb_htrie_bckt_lock(bckt))
+		return -EAGAIN;
+	/*
+	 * Nobody can pin the locked bucket, so just wait until current
+	 * users of its records unpin it.
+	 */
+	while (ACCESS_ONCE(bckt->flags) & TDB_HTRIE_PINS)
+		cpu_relax();
+
 	n = tdb_alloc_index(dbh);
 	if (!n)
-		return -ENOMEM;
+		goto err_unlock;
 	new_in = TDB_PTR(dbh, n);
 	new_in_idx = TDB_O2II(n);
 
-#define MOVE_RECORDS(Type, live)					\
+#define COPY_RECORDS(Type, live)					\
 do {									\
-	Type *r = (Type *)b;						\
-	k = TDB_HTRIE_IDX(r->key, bits);				\
-	/* Always leave first record in the same data block. */		\
-	new_in->shifts[k] = TDB_O2DI(TDB_HTRIE_OFF(dbh, bckt))		\
-			    | TDB_HTRIE_DBIT;				\
-	TDB_DBG("link bckt=%p w/ iblk=%#x by %#lx (key=%#lx)\n",	\
-		bckt, new_in_idx, k, r->key);				\
-	n = TDB_HTRIE_RALIGN(sizeof(*r) + __RECLEN(dbh, r));		\
-	nb[k].b = TDB_HTRIE_OFF(dbh, bckt);				\
-	nb[k].off = sizeof(*b) + n;					\
-	free_nb = -(long)k; /* remember which block we save & copy */	\
-	r = (Type *)((char *)r + n);					\
-	for ( ; ; r = (Type *)((char *)r + n)) {			\
-		unsigned long copied = (char *)r - (char *)bckt;	\
-		if (sizeof(*r) + copied >= TDB_HTRIE_MINDREC)		\
-			break; /* end of records */			\
-		n = TDB_HTRIE_RECLEN(dbh, r);				\
-		if (!live)						\
+	Type *r;							\
+	TdbBucket *b = bckt;						\
+	/* Burst never happens for collision chains. */			\
+	TDB_HTRIE_FOREACH_REC(dbh, b, r) {				\
+		if (!(live))						\
 			continue;					\
-		/* Small record cannot exceed TDB_HTRIE_MINDREC. */	\
-		BUG_ON(copied + n > TDB_HTRIE_MINDREC);			\
+		n = TDB_HTRIE_RECLEN(dbh, r);				\
 		k = TDB_HTRIE_IDX(r->key, bits);			\
 		if (!nb[k].b) {						\
-			nb[k].b = tdb_alloc_data(dbh, 0);		\
+			nb[k].b = tdb_alloc_data(dbh, TDB_HTRIE_DALIGN(	\
+						 TDB_HTRIE_BCKT_HDR(dbh) + n));\
 			if (!nb[k].b)					\
 				goto err_cleanup;			\
-			b = TDB_PTR(dbh, nb[k].b);			\
-			tdb_htrie_init_bucket(b);			\
-			memcpy(TDB_HTRIE_BUCKET_1ST(b), r, n);		\
-			nb[k].off = sizeof(*b) + n;			\
-			new_in->shifts[k] = TDB_O2DI(nb[k].b) | TDB_HTRIE_DBIT;\
-			/* We copied a record, clear its orignal place. */\
-			free_nb = free_nb > 0 ? free_nb : -free_nb;	\
-			TDB_DBG("copied rec=%p (len=%lu key=%#lx) to"	\
-				" new dblk=%#lx w/ idx=%#lx\n",		\
-				r, n, r->key, nb[k].b, k);		\
-		} else {						\
-			b = TDB_PTR(dbh, nb[k].b + nb[k].off);		\
-			memmove(b, r, n);				\
-			nb[k].off += n;					\
-			TDB_DBG("moved rec=%p (len=%lu key=%#lx) to"	\
-				" dblk=%#lx w/ idx=%#lx\n",		\
-				r, n, r->key, nb[k].b, k);		\
+			tdb_htrie_init_bucket(dbh, TDB_PTR(dbh, nb[k].b));\
+			nb[k].off = TDB_HTRIE_BCKT_HDR(dbh);		\
+			new_in->shifts[k] = TDB_O2DI(nb[k].b)		\
+					    | TDB_HTRIE_DBIT;		\
 		}							\
+		/* Small records always fit TDB_HTRIE_MINDREC. */	\
+		BUG_ON(nb[k].off > TDB_HTRIE_BCKT_HDR(dbh)		\
+		       && nb[k].off + n > TDB_HTRIE_MINDREC);		\
+		memcpy(TDB_PTR(dbh, nb[k].b + nb[k].off), r, n);	\
+		if (!TDB_HTRIE_VARLENRECS(dbh))				\
+			tdb_htrie_set_fp(dbh, TDB_PTR(dbh, nb[k].b),	\
+					 TDB_PTR(dbh, nb[k].b + nb[k].off),\
+					 r->key);			\
+		TDB_DBG("copied rec=%p (len=%lu key=%#lx) to"		\
+			" dblk=%#lx w/ idx=%#lx\n",			\
+			r, n, r->key, nb[k].b, k);			\
+		nb[k].off += n;						\
 	}								\
 } while (0)
 
 	if (TDB_HTRIE_VARLENRECS(dbh))
-		MOVE_RECORDS(TdbVRec, tdb_live_vsrec(r));
+		COPY_RECORDS(TdbVRec, tdb_live_vsrec(r));
 	else
-		MOVE_RECORDS(TdbFRec, tdb_live_fsrec(dbh, r));
+		COPY_RECORDS(TdbFRec, tdb_live_fsrec(dbh, r));
 
-#undef MOVE_RECORDS
+#undef COPY_RECORDS
 
-	/* Link the new index node with @node. */
-	TDB_DBG("link iblk=%p w/ iblk=%p (%#x) by idx=%#lx\n",
-		*node, new_in, new_in_idx, k);
+	/*
+	 * Link the new index node with @node.
+	 * The slot can be changed only by the bucket lock holder.
+	 */
 	k = TDB_HTRIE_IDX(key, bits - TDB_HTRIE_BITS);
-	(*node)->shifts[k] = new_in_idx;
-	*node = new_in;
-
-	/* Now we can safely remove all copied records. */
-	if (free_nb > 0) {
-		TDB_DBG("clear dblk=%#lx from %#x\n",
-			nb[free_nb].b, nb[free_nb].off);
-		memset(TDB_PTR(dbh, nb[free_nb].b + nb[free_nb].off), 0,
-		       TDB_HTRIE_MINDREC - nb[free_nb].off);
+	s = TDB_O2DI(TDB_HTRIE_OFF(dbh, bckt)) | TDB_HTRIE_DBIT;
+	TDB_DBG("link iblk=%p w/ iblk=%p (%#x) by idx=%#lx\n",
+		node, new_in, new_in_idx, k);
+	if (cmpxchg(&node->shifts[k], s, new_in_idx) != s) {
+		TDB_ERR("Concurrent update of locked bucket %#x\n", s);
+		r = -EAGAIN;
+		goto err_cleanup;
 	}
 
+	tdb_htrie_bckt_unlock(bckt, TDB_HTRIE_BURST);
+	tdb_cursor(dbh)->bursts++;
+
 	return 0;
 err_cleanup:
-	if (free_nb > 0)
-		for (i = 0; i < TDB_HTRIE_FANOUT; ++i)
-			if (i != free_nb && nb[i].b)
-				tdb_free_data_blk(TDB_PTR(dbh, nb[i].b));
+	for (i = 0; i < TDB_HTRIE_FANOUT; ++i)
+		if (nb[i].b)
+			tdb_free_data_blk(TDB_PTR(dbh, nb[i].b));
 	tdb_free_index_blk(new_in);
-	return -ENOMEM;
+err_unlock:
+	tdb_htrie_bckt_unlock(bckt, 0);
+	return r;
 }
 
 /**
@@ -450,6 +852,9 @@ err_cleanup:
  *
  * Least significant bits in our hash function have most entropy,
  * so we resolve the key from least significant bits to most significant.
+ *
+ * The function is lock-free: each slot is read once and all the data
+ * referenced by the slot was written before the slot was published.
  */
 static unsigned long
 tdb_htrie_descend(TdbHdr *dbh, TdbHtrieNode **node, unsigned long key,
@@ -460,7 +865,8 @@ tdb_htrie_descend(TdbHdr *dbh, TdbHtrieNode **node, unsigned long key,
 
 		BUG_ON(TDB_HTRIE_RESOLVED(*bits));
 
-		o = (*node)->shifts[TDB_HTRIE_IDX(key, *bits)];
+		o = ACCESS_ONCE((*node)->shifts[TDB_HTRIE_IDX(key, *bits)]);
+		smp_read_barrier_depends();
 
 		TDB_DBG("Descend iblk=%p key=%#lx bits=%d -> %#lx\n",
 			*node, key, *bits, o);
@@ -485,35 +891,61 @@ tdb_htrie_descend(TdbHdr *dbh, TdbHtrieNode **node, unsigned long key,
 	}
 }
 
+/**
+ * Write a new record to @off. The room can be either zeroed or freed
+ * record of the same size. Lock-free readers check variable-length record
+ * length (fixed-size record key) first, so the field is written the last.
+ */
 static TdbRec *
 tdb_htrie_create_rec(TdbHdr *dbh, unsigned long off, unsigned long key,
-		     void *data, size_t len, int init_bucket)
+		     void *data, size_t len)
 {
-	char *ptr = TDB_PTR(dbh, off);
-	TdbRec *r;
-
-	if (init_bucket) {
-		tdb_htrie_init_bucket((TdbBucket *)ptr);
-		ptr += sizeof(TdbBucket);
-	}
+	TdbRec *r = TDB_PTR(dbh, off);
 
-	r = (TdbRec *)ptr;
-	BUG_ON(r->key);
-	r->key = key;
 	if (TDB_HTRIE_VARLENRECS(dbh)) {
 		TdbVRec *vr = (TdbVRec *)r;
-		BUG_ON(vr->len || vr->chunk_next);
+		BUG_ON(tdb_live_vsrec(vr));
+		vr->key = key;
+		vr->expires = 0;
 		vr->chunk_next = 0;
-		vr->len = len;
-		ptr += sizeof(TdbVRec);
+		if (data)
+			memcpy(vr + 1, data, len);
+		smp_wmb();
+		ACCESS_ONCE(vr->len) = len;
 	} else {
-		ptr += sizeof(TdbFRec);
+		BUG_ON(tdb_live_fsrec(dbh, r));
+		r->expires = 0;
+		if (data)
+			memcpy(r + 1, data, len);
+		tdb_htrie_set_fp(dbh, tdb_htrie_rec_bckt(dbh, r), r, key);
+		smp_wmb();
+		ACCESS_ONCE(r->key) = key;
 	}
-	memcpy(ptr, data, len);
 
 	return r;
 }
 
+/**
+ * Allocate a new bucket with a record of length @len at its head.
+ * The bucket isn't linked with the tree.
+ */
+static TdbBucket *
+tdb_htrie_alloc_bckt(TdbHdr *dbh, unsigned long key, void *data, size_t *len)
+{
+	unsigned long o;
+	TdbBucket *b;
+
+	o = tdb_alloc_data(dbh, tdb_full_rec_len(dbh, len, 1));
+	if (!o)
+		return NULL;
+
+	b = TDB_PTR(dbh, o);
+	tdb_htrie_init_bucket(dbh, b);
+	tdb_htrie_create_rec(dbh, o + TDB_HTRIE_BCKT_HDR(dbh), key, data, *len);
+
+	return b;
+}
+
 /**
  * Add more data to @rec.
  */
@@ -526,7 +958,7 @@ tdb_htrie_extend_rec(TdbHdr *dbh, TdbVRec *rec, size_t size)
 	/* Cannot extend fixed-size records. */
 	BUG_ON(!TDB_HTRIE_VARLENRECS(dbh));
 
-	o = tdb_alloc_data(dbh, tdb_full_rec_len(dbh, &size));
+	o = tdb_alloc_data(dbh, tdb_full_rec_len(dbh, &size, 0));
 	if (!o)
 		return NULL;
 
@@ -540,42 +972,58 @@ tdb_htrie_extend_rec(TdbHdr *dbh, TdbVRec *rec, size_t size)
 		rec = TDB_PTR(dbh, TDB_DI2O(rec->chunk_next));
 	BUG_ON(!tdb_live_vsrec(rec));
 
-	rec->chunk_next = o;
+	rec->chunk_next = TDB_O2DI(o);
 
 	return chunk;
 }
 
 /**
- * @len returns number of copied data on success.
+ * Link a bucket with the tree. If there is no bucket for the key, then
+ * @nb is linked with @node at @bits. If there is a bucket and @data is
+ * small enough, then the record is placed to the existing bucket and @nb
+ * isn't used. Otherwise collision chain is grown or the bucket is burst.
+ *
+ * In TDB_INS_UNIQUE mode writers serialize on the bucket lock, a record with
+ * the same key is returned if it already exists, and the returned record is
+ * pinned. Writers must not mix the mode with plain inserts in one table.
+ *
+ * @nb can be allocated during previous tries, it's allocated on demand
+ * if NULL is passed and freed if it's not used.
  */
-TdbRec *
-tdb_htrie_insert(TdbHdr *dbh, unsigned long key, void *data, size_t *len)
+static TdbRec *
+__htrie_insert(TdbHdr *dbh, unsigned long key, void *data, size_t *len,
+	       TdbBucket *nb, int mode)
 {
-	int bits = 0;
-	unsigned long o;
-	TdbBucket *bckt;
+	int bits, r;
+	unsigned long o, k;
+	unsigned int *slot, bo;
+	TdbBucket *bckt, *b, *c;
 	TdbRec *rec;
-	TdbHtrieNode *node = TDB_HTRIE_ROOT(dbh);
-
-	/* Don't store empty data. */
-	if (unlikely(!*len))
-		return NULL;
+	TdbHtrieNode *node;
 
 retry:
+	bits = 0;
+	node = TDB_HTRIE_ROOT(dbh);
 	o = tdb_htrie_descend(dbh, &node, key, &bits);
 	if (!o) {
 		TDB_DBG("Create a new htrie node for key %#lx\n", key);
 
-		o = tdb_alloc_data(dbh, tdb_full_rec_len(dbh, len));
-		if (!o)
-			return NULL;
-
-		rec = tdb_htrie_create_rec(dbh, o, key, data, *len, 1);
+		if (!nb) {
+			nb = tdb_htrie_alloc_bckt(dbh, key, data, len);
+			if (!nb)
+				return NULL;
+			/* Nobody sees the bucket, so pin it w/o CAS. */
+			if (mode & TDB_INS_UNIQUE)
+				nb->flags = TDB_HTRIE_PIN;
+		}
+		bo = TDB_O2DI(TDB_HTRIE_OFF(dbh, nb)) | TDB_HTRIE_DBIT;
 
-		node->shifts[TDB_HTRIE_IDX(key, bits)] = TDB_O2DI(o)
-							 | TDB_HTRIE_DBIT;
+		slot = &node->shifts[TDB_HTRIE_IDX(key, bits)];
+		if (cmpxchg(slot, 0, bo))
+			/* Other writer was faster, descend once more. */
+			goto retry;
 
-		return rec;
+		return TDB_HTRIE_BUCKET_1ST(dbh, nb);
 	}
 
 	/*
@@ -584,6 +1032,21 @@ retry:
 	bckt = TDB_PTR(dbh, o);
 	BUG_ON(!bckt);
 
+	if (mode & TDB_INS_UNIQUE) {
+		if (tdb_htrie_bckt_lock(bckt))
+			goto retry;
+		rec = tdb_htrie_bscan_for_rec(dbh, bckt, key);
+		if (rec) {
+			b = tdb_htrie_rec_bckt(dbh, rec);
+			/* The bucket isn't burst while we hold the lock. */
+			tdb_htrie_bckt_pin(b, b == bckt);
+			tdb_htrie_bckt_unlock(bckt, 0);
+			if (nb)
+				tdb_free_data_blk(nb);
+			return rec;
+		}
+	}
+
 	/*
 	 * Try to place the small record in preallocated room for
 	 * small records. There could be full or partial key match.
@@ -591,16 +1054,29 @@ retry:
 	 * in collision chain, so we do this before processing
 	 * full key collision.
 	 */
-	if (*len < TDB_HTRIE_MINDREC) {
+	if ((mode & TDB_INS_AGGREGATE) && *len < TDB_HTRIE_MINDREC) {
 		/* Align small record length to 8 bytes. */
 		size_t n = TDB_HTRIE_RALIGN(*len);
 
 		TDB_DBG("Small record (len=%lu) collision on %d bits for"
 			" key %#lx\n", n, bits, key);
 
+		if (!(mode & TDB_INS_UNIQUE) && tdb_htrie_bckt_lock(bckt))
+			goto retry;
 		o = tdb_htrie_smallrec_link(dbh, n, bckt);
-		if (o)
-			return tdb_htrie_create_rec(dbh, o, key, data, *len, 0);
+		if (o) {
+			rec = tdb_htrie_create_rec(dbh, o, key, data, *len);
+			if (mode & TDB_INS_UNIQUE) {
+				b = tdb_htrie_rec_bckt(dbh, rec);
+				tdb_htrie_bckt_pin(b, b == bckt);
+			}
+			tdb_htrie_bckt_unlock(bckt, 0);
+			if (nb)
+				tdb_free_data_blk(nb);
+			return rec;
+		}
+		if (!(mode & TDB_INS_UNIQUE))
+			tdb_htrie_bckt_unlock(bckt, 0);
 	}
 
 	if (TDB_HTRIE_RESOLVED(bits)) {
@@ -608,16 +1084,41 @@ retry:
 			" add new record (len=%lu) to collision chain\n",
 			key, bits, *len);
 
-		BUG_ON(TDB_HTRIE_BUCKET_KEY(bckt) != key);
-		o = tdb_alloc_data(dbh, tdb_full_rec_len(dbh, len));
-		if (!o)
-			return NULL;
-		while (bckt->coll_next && !(bckt->flags & TDB_HTRIE_VRFREED))
-			bckt = TDB_HTRIE_BUCKET_NEXT(dbh, bckt);
-		bckt->coll_next = TDB_O2DI(o);
-		return tdb_htrie_create_rec(dbh, o, key, data, *len, 1);
+		/*
+		 * Expired fixed-size records are zeroed in place, so the
+		 * chain head can be a freed record with zero key.
+		 */
+		k = TDB_HTRIE_BUCKET_KEY(dbh, bckt);
+		BUG_ON(k != key && (k || TDB_HTRIE_VARLENRECS(dbh)));
+		if (!nb) {
+			nb = tdb_htrie_alloc_bckt(dbh, key, data, len);
+			if (!nb) {
+				if (mode & TDB_INS_UNIQUE)
+					tdb_htrie_bckt_unlock(bckt, 0);
+				return NULL;
+			}
+			if (mode & TDB_INS_UNIQUE)
+				nb->flags = TDB_HTRIE_PIN;
+		}
+		bo = TDB_O2DI(TDB_HTRIE_OFF(dbh, nb));
+
+		/* Append the bucket to the end of the chain. */
+		for (b = bckt; ; ) {
+			while ((c = TDB_HTRIE_BUCKET_NEXT(dbh, b)))
+				b = c;
+			if (!cmpxchg(&b->coll_next, 0, bo))
+				break;
+		}
+
+		if (mode & TDB_INS_UNIQUE)
+			tdb_htrie_bckt_unlock(bckt, 0);
+
+		return TDB_HTRIE_BUCKET_1ST(dbh, nb);
 	}
 
+	if (mode & TDB_INS_UNIQUE)
+		tdb_htrie_bckt_unlock(bckt, 0);
+
 	/*
 	 * But there is no room. Burst the node.
 	 * We should never see collision chains at this point.
@@ -629,40 +1130,1905 @@ retry:
 		" and new record (len=%lu) - burst the node\n",
 		bits, key, *len);
 
-	if (tdb_htrie_burst(dbh, &node, bckt, key, bits)) {
+	r = tdb_htrie_burst(dbh, node, bckt, key, bits);
+	if (r == -ENOMEM) {
 		TDB_ERR("Cannot burst node=%p and bckt=%p for key %#lx\n",
 			node, bckt, key);
+		if (nb)
+			tdb_free_data_blk(nb);
 		return NULL;
 	}
 	goto retry;
 }
 
-TdbBucket *
-tdb_htrie_lookup(TdbHdr *dbh, unsigned long key)
+/**
+ * @len returns number of copied data on success.
+ */
+TdbRec *
+tdb_htrie_insert(TdbHdr *dbh, unsigned long key, void *data, size_t *len)
 {
-	int bits = 0;
-	unsigned long o;
-	TdbHtrieNode *root = TDB_HTRIE_ROOT(dbh);
-
-	o = tdb_htrie_descend(dbh, &root, key, &bits);
-	if (!o)
+	/* Don't store empty data. */
+	if (unlikely(!*len))
 		return NULL;
 
-	return TDB_PTR(dbh, o);
+	return __htrie_insert(dbh, key, data, len, NULL, TDB_INS_AGGREGATE);
 }
 
-TdbHdr *
-tdb_htrie_init(void *p, size_t db_size, unsigned int rec_len)
-{
-	TdbHdr *hdr = (TdbHdr *)p;
-
-	if (hdr->magic != TDB_MAGIC)
+/**
+ * Allocate a record with zeroed room of @len bytes which isn't linked with
+ * the tree, so the caller can write the whole record and extend it by more
+ * chunks before it becomes visible to readers by tdb_htrie_publish_rec().
+ *
+ * @len returns actually allocated room for data.
+ */
+TdbRec *
+tdb_htrie_alloc_rec(TdbHdr *dbh, unsigned long key, size_t *len)
+{
+	TdbBucket *b;
+
+	if (unlikely(!*len))
+		return NULL;
+
+	b = tdb_htrie_alloc_bckt(dbh, key, NULL, len);
+	if (!b)
+		return NULL;
+
+	return TDB_HTRIE_BUCKET_1ST(dbh, b);
+}
+
+/**
+ * Make record allocated by tdb_htrie_alloc_rec() visible for readers.
+ * The record must not be modified after the call.
+ */
+int
+tdb_htrie_publish_rec(TdbHdr *dbh, TdbRec *rec)
+{
+	size_t len = TDB_HTRIE_VARLENRECS(dbh)
+		     ? TDB_HTRIE_VRLEN((TdbVRec *)rec)
+		     : dbh->rec_len;
+	TdbBucket *b = TDB_HTRIE_REC_BUCKET(dbh, rec);
+
+	return __htrie_insert(dbh, rec->key, NULL, &len, b, 0) ? 0 : -ENOMEM;
+}
+
+/**
+ * Get a fixed-size record with @key or create a new zeroed one, so there is
+ * exactly one record for the key. The returned record is pinned: it doesn't
+ * move (burst copies records to new buckets) until tdb_htrie_put_rec(),
+ * so the caller can update it in place. The caller must not sleep or
+ * write to the table while it holds the pin, otherwise burst of the bucket
+ * waits for the pin forever.
+ *
+ * Zero key with zeroed data is indistinguishable from free room, so the
+ * key must not be zero.
+ */
+TdbRec *
+tdb_htrie_get_rec(TdbHdr *dbh, unsigned long key)
+{
+	size_t len = dbh->rec_len;
+	TdbBucket *b;
+	TdbRec *r;
+
+	BUG_ON(TDB_HTRIE_VARLENRECS(dbh));
+	if (unlikely(!key))
+		return NULL;
+
+	/* Lock-free fast path for existing records. */
+	while ((b = tdb_htrie_lookup(dbh, key))) {
+		if (!(r = tdb_htrie_bscan_for_rec(dbh, b, key)))
+			break;
+		b = tdb_htrie_rec_bckt(dbh, r);
+		if (tdb_htrie_bckt_pin(b, 0))
+			continue;
+		/* The record could expire before we pinned it. */
+		if (likely(ACCESS_ONCE(r->key) == key))
+			return r;
+		tdb_htrie_bckt_unpin(b);
+	}
+
+	return __htrie_insert(dbh, key, NULL, &len, NULL,
+			      TDB_INS_AGGREGATE | TDB_INS_UNIQUE);
+}
+
+/**
+ * Release the record pinned by tdb_htrie_get_rec().
+ */
+void
+tdb_htrie_put_rec(TdbHdr *dbh, TdbRec *rec)
+{
+	/* CAS is a full memory barrier, so the record updates are released. */
+	tdb_htrie_bckt_unpin(tdb_htrie_rec_bckt(dbh, rec));
+}
+
+/**
+ * Free published variable-length record @rec like the replacement does.
+ * Readers which already found the record use it until the end of their
+ * RCU BH critical sections, the garbage collector reclaims it after that.
+ * @return 0 if the record is freed by the call.
+ */
+int
+tdb_htrie_remove_rec(TdbHdr *dbh, TdbRec *rec)
+{
+	TdbVRec *r = (TdbVRec *)rec;
+	unsigned int l;
+
+	BUG_ON(!TDB_HTRIE_VARLENRECS(dbh));
+
+	do {
+		l = ACCESS_ONCE(r->len);
+		if (!l || (l & TDB_HTRIE_VRFREED))
+			return -ENOENT;
+	} while (cmpxchg(&r->len, l, l | TDB_HTRIE_VRFREED) != l);
+
+	return 0;
+}
+
+/**
+ * Free record allocated by tdb_htrie_alloc_rec() which isn't published.
+ */
+void
+tdb_htrie_free_rec(TdbHdr *dbh, TdbRec *rec)
+{
+	if (TDB_HTRIE_VARLENRECS(dbh))
+		tdb_free_vsrec((TdbVRec *)rec);
+	else
+		tdb_free_fsrec(dbh, rec);
+	tdb_free_data_blk(TDB_HTRIE_REC_BUCKET(dbh, rec));
+}
+
+TdbBucket *
+tdb_htrie_lookup(TdbHdr *dbh, unsigned long key)
+{
+	int bits = 0;
+	unsigned long o;
+	TdbHtrieNode *root = TDB_HTRIE_ROOT(dbh);
+
+	o = tdb_htrie_descend(dbh, &root, key, &bits);
+	if (!o)
+		return NULL;
+
+	return TDB_PTR(dbh, o);
+}
+
+/**
+ * Descend the tree for @n keys at once: prefetch the next level node
+ * (or bucket) for each key before we dereference any of them, so cache
+ * misses of different keys overlap.
+ *
+ * @b stores found buckets or NULL for keys which aren't found.
+ */
+void
+tdb_htrie_lookup_many(TdbHdr *dbh, unsigned long *keys, int n, TdbBucket **b)
+{
+	int i, bits = 0, active = n;
+	unsigned int o;
+	TdbHtrieNode *node[TDB_LOOKUP_BATCH];
+
+	BUG_ON(n > TDB_LOOKUP_BATCH);
+
+	for (i = 0; i < n; ++i)
+		node[i] = TDB_HTRIE_ROOT(dbh);
+
+	/* All the keys are at the same tree level at each iteration. */
+	while (active) {
+		BUG_ON(TDB_HTRIE_RESOLVED(bits));
+
+		for (i = 0; i < n; ++i) {
+			if (!node[i])
+				continue;
+			o = ACCESS_ONCE(node[i]->shifts[TDB_HTRIE_IDX(keys[i],
+								      bits)]);
+			smp_read_barrier_depends();
+			if (o & TDB_HTRIE_DBIT) {
+				b[i] = TDB_PTR(dbh,
+					       TDB_DI2O(o ^ TDB_HTRIE_DBIT));
+				prefetch(b[i]);
+			} else if (o) {
+				node[i] = TDB_PTR(dbh, TDB_II2O(o));
+				prefetch(node[i]);
+				continue;
+			} else {
+				b[i] = NULL;
+			}
+			node[i] = NULL;
+			--active;
+		}
+		bits += TDB_HTRIE_BITS;
+	}
+}
+
+/**
+ * Find fixed-size record with @key in the collision chain @b by the keys
+ * fingerprints. Only records in slots with matching fingerprints are read,
+ * so typically just the first cache line of the bucket is touched on miss.
+ * Deleted records are zeroed, so records with non-zero key are live.
+ */
+static TdbFRec *
+tdb_htrie_bscan_fp(TdbHdr *dbh, TdbBucket *b, unsigned long key,
+		   unsigned int slots)
+{
+	unsigned long m, mask = slots < sizeof(long)
+				? (1UL << (slots * 8)) - 1 : ~0UL;
+	size_t n = TDB_HTRIE_RALIGN(sizeof(TdbFRec) + dbh->rec_len);
+	unsigned char fp = tdb_htrie_fp(key);
+	TdbFRec *r;
+
+	for ( ; b; b = TDB_HTRIE_BUCKET_NEXT(dbh, b)) {
+		m = ACCESS_ONCE(*(unsigned long *)TDB_HTRIE_BUCKET_FPS(b));
+		for (m = tdb_htrie_fp_match(m, fp) & mask; m; m &= m - 1) {
+			r = (TdbFRec *)((char *)TDB_HTRIE_BUCKET_1ST(dbh, b)
+					+ __ffs(m) / 8 * n);
+			if (ACCESS_ONCE(r->key) != key)
+				continue;
+			smp_rmb();
+			if (key || tdb_live_fsrec(dbh, r))
+				return r;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Find the first live record with @key in the collision chain @b.
+ * Lock-free, see tdb_htrie_create_rec() for the writers side.
+ */
+TdbRec *
+tdb_htrie_bscan_for_rec(TdbHdr *dbh, TdbBucket *b, unsigned long key)
+{
+	if (TDB_HTRIE_VARLENRECS(dbh)) {
+		TdbVRec *r;
+		TDB_HTRIE_FOREACH_REC(dbh, b, r) {
+			if (!tdb_live_vsrec(r))
+				continue;
+			smp_rmb();
+			if (r->key == key)
+				return (TdbRec *)r;
+		}
+	} else {
+		TdbFRec *r;
+		if (likely(tdb_htrie_fslots(dbh) <= sizeof(long)))
+			return tdb_htrie_bscan_fp(dbh, b, key,
+						  tdb_htrie_fslots(dbh));
+		TDB_HTRIE_FOREACH_REC(dbh, b, r) {
+			if (ACCESS_ONCE(r->key) != key)
+				continue;
+			smp_rmb();
+			if (tdb_live_fsrec(dbh, r))
+				return r;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * ------------------------------------------------------------------------
+ *	Records replacement
+ * ------------------------------------------------------------------------
+ *
+ * CLOCK algorithm: readers set access bit for variable-length records,
+ * see tdb_htrie_touch_rec(), and the clock hand moves through the tree
+ * subtrees clearing the bits and evicting records which weren't accessed
+ * since the previous pass. Evicted records are only marked as freed,
+ * their blocks are returned by garbage collector when there are no readers
+ * which can reference them.
+ *
+ * Fixed-size records are typically not a cache, so they aren't evicted.
+ */
+/* Number of subtrees (2 tree levels) for the clock hand. */
+#define TDB_CLOCK_HANDS		(TDB_HTRIE_FANOUT * TDB_HTRIE_FANOUT)
+
+/**
+ * Unlink bucket @b with all evicted records from @node slot @i.
+ * Only buckets w/o collision chains can be unlinked, so all writers lock
+ * the bucket before they modify it and see it replaced.
+ */
+static void
+tdb_htrie_unlink_bckt(TdbHdr *dbh, TdbHtrieNode *node, int i, TdbBucket *b)
+{
+	TdbVRec *r;
+	TdbBucket *bckt = b;
+	unsigned int s = TDB_O2DI(TDB_HTRIE_OFF(dbh, b)) | TDB_HTRIE_DBIT;
+
+	if (tdb_htrie_bckt_lock(b))
+		return;
+	/* Check that nobody placed new record in the bucket. */
+	TDB_HTRIE_FOREACH_REC(dbh, bckt, r)
+		if (tdb_live_vsrec(r))
+			goto unlock;
+	/* Writers can't link anything with the bucket after the CAS. */
+	if (cmpxchg(&node->shifts[i], s, 0) == s) {
+		tdb_htrie_bckt_unlock(b, TDB_HTRIE_BURST);
+		return;
+	}
+unlock:
+	tdb_htrie_bckt_unlock(b, 0);
+}
+
+/**
+ * Run one clock pass for the bucket @b.
+ * @return number of freed bytes.
+ */
+static size_t
+tdb_htrie_evict_bckt(TdbHdr *dbh, TdbBucket *b, int *alive)
+{
+	size_t freed = 0;
+	unsigned int l;
+	TdbVRec *r, *c;
+
+	TDB_HTRIE_FOREACH_REC(dbh, b, r) {
+		l = ACCESS_ONCE(r->len);
+		if (!l || (l & TDB_HTRIE_VRFREED))
+			continue;
+		if (l & TDB_HTRIE_VRACCESS) {
+			/* Give the record second chance. */
+			if (cmpxchg(&r->len, l, l & ~TDB_HTRIE_VRACCESS) == l) {
+				*alive = 1;
+				continue;
+			}
+			/* The record was freed concurrently. */
+			l = ACCESS_ONCE(r->len);
+			if (l & TDB_HTRIE_VRFREED)
+				continue;
+		}
+		if (cmpxchg(&r->len, l, l | TDB_HTRIE_VRFREED) != l) {
+			/* A reader just accessed the record. */
+			*alive = 1;
+			continue;
+		}
+		for (c = r; ; c = TDB_PTR(dbh, TDB_DI2O(c->chunk_next))) {
+			freed += TDB_HTRIE_VRLEN(c);
+			if (!c->chunk_next)
+				break;
+		}
+	}
+
+	return freed;
+}
+
+/**
+ * Run clock pass for subtree or bucket @o linked with slot @i of @node
+ * at @bits level.
+ */
+static size_t
+tdb_htrie_evict_slot(TdbHdr *dbh, TdbHtrieNode *node, int i, unsigned int o,
+		     int bits)
+{
+	int alive = 0;
+	size_t freed = 0;
+	TdbBucket *b;
+
+	if (!(o & TDB_HTRIE_DBIT)) {
+		node = TDB_PTR(dbh, TDB_II2O(o));
+		bits += TDB_HTRIE_BITS;
+		for (i = 0; i < TDB_HTRIE_FANOUT; ++i) {
+			o = ACCESS_ONCE(node->shifts[i]);
+			smp_read_barrier_depends();
+			if (o)
+				/* The tree depth is limited by key bits. */
+				freed += tdb_htrie_evict_slot(dbh, node, i, o,
+							      bits);
+		}
+		return freed;
+	}
+
+	b = TDB_PTR(dbh, TDB_DI2O(o ^ TDB_HTRIE_DBIT));
+	freed = tdb_htrie_evict_bckt(dbh, b, &alive);
+	if (!alive && !TDB_HTRIE_RESOLVED(bits + TDB_HTRIE_BITS)
+	    && !ACCESS_ONCE(b->coll_next))
+		tdb_htrie_unlink_bckt(dbh, node, i, b);
+
+	return freed;
+}
+
+/**
+ * Move the clock hand @hand through the tree until at least @need bytes
+ * of data are evicted. The hand makes at most two revolutions, so all
+ * the records are evicted if all of them were accessed.
+ * @return number of evicted bytes.
+ */
+size_t
+tdb_htrie_evict(TdbHdr *dbh, unsigned int *hand, size_t need)
+{
+	int n;
+	size_t freed = 0;
+	unsigned int o, h = *hand;
+	TdbHtrieNode *root = TDB_HTRIE_ROOT(dbh), *node;
+
+	if (!TDB_HTRIE_VARLENRECS(dbh))
+		return 0;
+
+	for (n = 0; n < TDB_CLOCK_HANDS * 2 && freed < need; ++n) {
+		h = (h + 1) % TDB_CLOCK_HANDS;
+		o = ACCESS_ONCE(root->shifts[h / TDB_HTRIE_FANOUT]);
+		smp_read_barrier_depends();
+		if (!o)
+			continue;
+		if (o & TDB_HTRIE_DBIT) {
+			/* Visit the bucket just once for all its subtrees. */
+			if (h % TDB_HTRIE_FANOUT)
+				continue;
+			freed += tdb_htrie_evict_slot(dbh, root,
+						      h / TDB_HTRIE_FANOUT,
+						      o, 0);
+			continue;
+		}
+		node = TDB_PTR(dbh, TDB_II2O(o));
+		o = ACCESS_ONCE(node->shifts[h % TDB_HTRIE_FANOUT]);
+		smp_read_barrier_depends();
+		if (o)
+			freed += tdb_htrie_evict_slot(dbh, node,
+						      h % TDB_HTRIE_FANOUT, o,
+						      TDB_HTRIE_BITS);
+	}
+	*hand = h;
+
+	TDB_DBG("CLOCK: %lu bytes evicted, hand=%u\n", freed, h);
+
+	return freed;
+}
+
+/**
+ * @return approximate number of free blocks in the database.
+ * Cold extents aren't accessed and their blocks are accounted as used,
+ * since they're unavailable for allocation.
+ */
+size_t
+tdb_htrie_free_blks(TdbHdr *dbh)
+{
+	int i;
+	unsigned long e, used = 0;
+
+	for (e = 0; e < dbh->dbsz / TDB_EXT_SZ; ++e) {
+		TdbExt *ext = tdb_ext(dbh, e * TDB_EXT_SZ);
+		if (tdb_test_bit(TDB_EXT_COLD(dbh), e)) {
+			used += TDB_EXT_SZ / PAGE_SIZE;
+			continue;
+		}
+		for (i = 0; i < TDB_BLK_BMP_2L; ++i)
+			used += hweight_long(ACCESS_ONCE(ext->b_bmp[i]));
+	}
+
+	return dbh->dbsz / PAGE_SIZE - used;
+}
+
+static void
+tdb_htrie_stat_bckt(TdbHdr *dbh, TdbBucket *b, TdbHtrieStat *st)
+{
+	int n = 0, chain = 0;
+	TdbBucket *bckt;
+
+	/* Cold extents aren't accessed. */
+	if (tdb_htrie_bckt_cold(dbh, b))
+		return;
+
+	for (bckt = b; bckt; bckt = TDB_HTRIE_BUCKET_NEXT(dbh, bckt))
+		++chain;
+
+	if (TDB_HTRIE_VARLENRECS(dbh)) {
+		TdbVRec *r;
+		TDB_HTRIE_FOREACH_REC(dbh, b, r)
+			n += tdb_live_vsrec(r);
+	} else {
+		TdbFRec *r;
+		TDB_HTRIE_FOREACH_REC(dbh, b, r)
+			n += tdb_live_fsrec(dbh, r);
+	}
+
+	st->recs += n;
+	st->chain[min(chain, TDB_STAT_HIST - 1)]++;
+	st->occupancy[min(n, TDB_STAT_HIST - 1)]++;
+}
+
+/**
+ * Account slot @i of index node @node at @depth and its subtree.
+ */
+static void
+tdb_htrie_stat_node(TdbHdr *dbh, TdbHtrieNode *node, int i, int depth,
+		    TdbHtrieStat *st)
+{
+	int j;
+	unsigned int o = ACCESS_ONCE(node->shifts[i]);
+
+	smp_read_barrier_depends();
+	if (!o)
+		return;
+	if (o & TDB_HTRIE_DBIT) {
+		st->leafs++;
+		st->depth[min(depth, TDB_STAT_HIST - 1)]++;
+		tdb_htrie_stat_bckt(dbh, TDB_PTR(dbh, TDB_DI2O(o
+							^ TDB_HTRIE_DBIT)),
+				    st);
+		return;
+	}
+
+	/* The tree depth is limited by key bits. */
+	node = TDB_PTR(dbh, TDB_II2O(o));
+	st->nodes++;
+	for (j = 0; j < TDB_HTRIE_FANOUT; ++j)
+		tdb_htrie_stat_node(dbh, node, j, depth + 1, st);
+}
+
+/**
+ * Start collecting the index and storage statistics to @st. The caller
+ * accounts extents by tdb_htrie_stat_exts() and the index by
+ * tdb_htrie_stat_slot() for each slot of the root index node, so large
+ * databases are walked in many short RCU read-side sections.
+ */
+void
+tdb_htrie_stat_start(TdbHdr *dbh, TdbHtrieStat *st)
+{
+	int i;
+	TdbCursor *c = TDB_CURS(dbh);
+
+	memset(st, 0, sizeof(*st));
+	st->blks = dbh->dbsz / PAGE_SIZE;
+	st->free_blks = st->blks;
+	st->i_wm = ACCESS_ONCE(dbh->i_wm);
+	st->d_wm = ACCESS_ONCE(dbh->d_wm);
+	/* The root index node. */
+	st->nodes = 1;
+
+	for (i = 0; i < TDB_CURS_N; ++i) {
+		st->bursts += ACCESS_ONCE(c[i].bursts);
+		st->alloc_errs += ACCESS_ONCE(c[i].alloc_errs);
+	}
+}
+
+/**
+ * Account used blocks of extents [@from, @to).
+ * Must be called under RCU read lock, like readers.
+ */
+void
+tdb_htrie_stat_exts(TdbHdr *dbh, TdbHtrieStat *st, unsigned long from,
+		    unsigned long to)
+{
+	int i;
+	unsigned long e, used;
+
+	/* The file can be shrunk since tdb_htrie_stat_start(). */
+	to = min(to, ACCESS_ONCE(dbh->dbsz) / TDB_EXT_SZ);
+	for (e = from; e < to; ++e) {
+		TdbExt *ext = tdb_ext(dbh, e * TDB_EXT_SZ);
+		if (tdb_test_bit(TDB_EXT_COLD(dbh), e)) {
+			st->cold_blks += TDB_EXT_SZ / PAGE_SIZE;
+			st->free_blks -= TDB_EXT_SZ / PAGE_SIZE;
+			continue;
+		}
+		for (used = 0, i = 0; i < TDB_BLK_BMP_2L; ++i)
+			used += hweight_long(ACCESS_ONCE(ext->b_bmp[i]));
+		if (e <= st->i_wm)
+			st->i_blks += used;
+		else
+			st->d_blks += used;
+		st->free_blks -= used;
+	}
+}
+
+/**
+ * Account the subtree of slot @i of the root index node.
+ * Must be called under RCU read lock, like readers.
+ */
+void
+tdb_htrie_stat_slot(TdbHdr *dbh, int i, TdbHtrieStat *st)
+{
+	tdb_htrie_stat_node(dbh, TDB_HTRIE_ROOT(dbh), i, 1, st);
+}
+
+/**
+ * Collect the index and storage statistics. Walks the whole index, so it's
+ * slow for large databases and must not be called on fast path.
+ * Can run concurrently with readers and writers, so the results are
+ * approximate. Must be called under RCU read lock, like readers.
+ */
+void
+tdb_htrie_stat(TdbHdr *dbh, TdbHtrieStat *st)
+{
+	int i;
+
+	tdb_htrie_stat_start(dbh, st);
+	tdb_htrie_stat_exts(dbh, st, 0, dbh->dbsz / TDB_EXT_SZ);
+	for (i = 0; i < TDB_HTRIE_FANOUT; ++i)
+		tdb_htrie_stat_slot(dbh, i, st);
+}
+
+/*
+ * ------------------------------------------------------------------------
+ *	Records expiration
+ * ------------------------------------------------------------------------
+ *
+ * Records with lifetime are indexed by hierarchical timer wheel which
+ * lives in the file, so the index survives restarts. The wheel time is
+ * wall clock time in seconds. Level @l slot @i keeps timers expiring in
+ * the ticks which have @i in bits [@l * TDB_TW_BITS, (@l + 1) * TDB_TW_BITS)
+ * and are at least TDB_TW_SLOTS^@l ticks ahead of the wheel clock. When the
+ * clock enters time range of a higher level slot, the slot timers are moved
+ * (cascaded) to lower levels.
+ *
+ * A timer keeps the record key and expiration time only, since burst moves
+ * records. On expiration all the records with the key which are expired
+ * according to their own @expires are freed, so records with extended
+ * lifetime survive.
+ *
+ * Timers are appended to slots lock-free. The collector advances the clock
+ * and detaches passed slots after RCU grace periods, see tdb_gc_collect(),
+ * so it never misses timers which are being added concurrently.
+ */
+#define TDB_TW_BITS		6
+#define TDB_TW_SLOTS		(1 << TDB_TW_BITS)
+#define TDB_TW_MASK		(TDB_TW_SLOTS - 1)
+#define TDB_TW_LEVELS		4
+#define TDB_TW_MAX		(1UL << (TDB_TW_BITS * TDB_TW_LEVELS))
+#define TDB_TW_BLK_SZ		512
+#define TDB_TW_BLK_N		((TDB_TW_BLK_SZ - sizeof(TdbTwBlk))	\
+				 / sizeof(TdbTwEntry))
+
+/**
+ * Timer wheel.
+ *
+ * @clk		- all the timers up to the tick are processed;
+ * @slots	- heads of timer blocks lists (in data blocks);
+ */
+typedef struct {
+	unsigned long	clk;
+	unsigned int	slots[TDB_TW_LEVELS][TDB_TW_SLOTS];
+} __attribute__((packed)) TdbTw;
+
+/**
+ * Block of timers in a wheel slot.
+ *
+ * @next	- next block in the slot list (in data blocks);
+ * @n		- number of used timers (can exceed TDB_TW_BLK_N when
+ * 		  the block is full);
+ */
+typedef struct {
+	unsigned int	next;
+	unsigned int	n;
+	unsigned long	_padding;
+} __attribute__((packed)) TdbTwBlk;
+
+typedef struct {
+	unsigned long	key;
+	unsigned long	expires;
+} __attribute__((packed)) TdbTwEntry;
+
+#define TDB_TW_ENTRY(b, i)	((TdbTwEntry *)((b) + 1) + (i))
+
+/**
+ * Get the timer wheel or create it if there is no one yet.
+ */
+static TdbTw *
+tdb_htrie_tw(TdbHdr *dbh, unsigned long now)
+{
+	unsigned long o;
+	TdbTw *tw;
+
+	if ((o = ACCESS_ONCE(dbh->tw)))
+		goto done;
+
+	if (!(o = tdb_alloc_data(dbh, TDB_HTRIE_DALIGN(sizeof(TdbTw)))))
+		return NULL;
+	tdb_ext_set_meta(dbh, o);
+	tw = TDB_PTR(dbh, o);
+	memset(tw, 0, sizeof(*tw));
+	tw->clk = now;
+	smp_wmb();
+	if (cmpxchg(&dbh->tw, 0, o))
+		/* Other writer was faster, leave the block for GC. */
+		o = ACCESS_ONCE(dbh->tw);
+done:
+	smp_read_barrier_depends();
+	return TDB_PTR(dbh, o);
+}
+
+/**
+ * Add a timer to the wheel slot according to the wheel clock.
+ */
+static int
+tdb_htrie_tw_add(TdbHdr *dbh, TdbTw *tw, unsigned long key,
+		 unsigned long expires)
+{
+	int l;
+	unsigned int *slot, h, n, bo;
+	unsigned long clk = ACCESS_ONCE(tw->clk), o, t = expires;
+	TdbTwBlk *b;
+	TdbTwEntry *e;
+
+	if (t <= clk)
+		t = clk + 1;
+	else if (t - clk >= TDB_TW_MAX)
+		t = clk + TDB_TW_MAX - 1;
+	for (l = 0; l < TDB_TW_LEVELS - 1; ++l)
+		if (t - clk < 1UL << (TDB_TW_BITS * (l + 1)))
+			break;
+	slot = &tw->slots[l][(t >> (TDB_TW_BITS * l)) & TDB_TW_MASK];
+
+	while (1) {
+		h = ACCESS_ONCE(*slot);
+		smp_read_barrier_depends();
+		if (h) {
+			b = TDB_PTR(dbh, TDB_DI2O(h));
+			while ((n = ACCESS_ONCE(b->n)) < TDB_TW_BLK_N) {
+				if (cmpxchg(&b->n, n, n + 1) != n)
+					continue;
+				e = TDB_TW_ENTRY(b, n);
+				e->expires = expires;
+				e->key = key;
+				return 0;
+			}
+		}
+
+		/* No room in the slot, add a new block at the list head. */
+		if (!(o = tdb_alloc_data(dbh, TDB_TW_BLK_SZ)))
+			return -ENOMEM;
+		tdb_ext_set_meta(dbh, o);
+		b = TDB_PTR(dbh, o);
+		bo = TDB_O2DI(o);
+		b->next = h;
+		b->n = 1;
+		e = TDB_TW_ENTRY(b, 0);
+		e->expires = expires;
+		e->key = key;
+		smp_wmb();
+		if (cmpxchg(slot, h, bo) == h)
+			return 0;
+		/* The slot was changed, leave the block for GC. */
+		b->n = 0;
+	}
+}
+
+/**
+ * Set the record lifetime. The record must not be seen by burst while the
+ * function runs, i.e. it must be either not published yet or pinned.
+ */
+int
+tdb_htrie_set_expires(TdbHdr *dbh, TdbRec *rec, unsigned int expires,
+		      unsigned long now)
+{
+	TdbTw *tw;
+
+	if (!(tw = tdb_htrie_tw(dbh, now)))
+		return -ENOMEM;
+
+	rec->expires = expires;
+
+	return tdb_htrie_tw_add(dbh, tw, rec->key, expires);
+}
+
+/**
+ * Move the wheel clock to @now, timers added after the call never go to
+ * slots for ticks before @now.
+ * @return the previous clock value.
+ */
+unsigned long
+tdb_htrie_tw_advance(TdbHdr *dbh, unsigned long now)
+{
+	unsigned long clk;
+	TdbTw *tw;
+
+	if (!ACCESS_ONCE(dbh->tw))
+		return now;
+	tw = TDB_PTR(dbh, dbh->tw);
+	clk = tw->clk;
+	if (now > clk)
+		ACCESS_ONCE(tw->clk) = now;
+
+	return clk;
+}
+
+static unsigned int
+__tdb_htrie_tw_detach(TdbHdr *dbh, TdbTw *tw, unsigned long from,
+		      unsigned long to)
+{
+	int l;
+	unsigned int h, list = 0;
+	unsigned long i, a, b;
+	TdbTwBlk *blk;
+
+	for (l = 0; l < TDB_TW_LEVELS; ++l) {
+		a = from >> (TDB_TW_BITS * l);
+		b = to >> (TDB_TW_BITS * l);
+		if (b - a > TDB_TW_SLOTS)
+			a = b - TDB_TW_SLOTS;
+		for (i = a + 1; i <= b; ++i) {
+			h = xchg(&tw->slots[l][i & TDB_TW_MASK], 0);
+			if (!h)
+				continue;
+			for (blk = TDB_PTR(dbh, TDB_DI2O(h)); blk->next; )
+				blk = TDB_PTR(dbh, TDB_DI2O(blk->next));
+			blk->next = list;
+			list = h;
+		}
+	}
+
+	return list;
+}
+
+/**
+ * Unlink slots for ticks in (@from, @to] from the wheel and concatenate
+ * the timer lists. Readers of the lists must wait until concurrent writers
+ * which could add timers to the slots finish.
+ * @return the list head (in data blocks) or 0 if there are no timers.
+ */
+unsigned int
+tdb_htrie_tw_detach(TdbHdr *dbh, unsigned long from, unsigned long to)
+{
+	if (!ACCESS_ONCE(dbh->tw) || to <= from)
+		return 0;
+
+	return __tdb_htrie_tw_detach(dbh, TDB_PTR(dbh, dbh->tw), from, to);
+}
+
+/**
+ * Unlink all the slots of the wheel at offset @tw_off, which can be
+ * replaced by tdb_htrie_tw_move(), see tdb_htrie_tw_detach().
+ */
+unsigned int
+tdb_htrie_tw_detach_all(TdbHdr *dbh, unsigned long tw_off)
+{
+	if (!tw_off)
+		return 0;
+
+	return __tdb_htrie_tw_detach(dbh, TDB_PTR(dbh, tw_off), 0,
+				     TDB_TW_MAX);
+}
+
+/**
+ * Replace the timer wheel by an empty one with the same clock if the wheel
+ * is beyond the file end, see tdb_htrie_shrink_start(). Timers of the old
+ * wheel must be detached and added to the new one.
+ *
+ * @old		- offset of the previous wheel;
+ */
+int
+tdb_htrie_tw_move(TdbHdr *dbh, unsigned long *old)
+{
+	unsigned long o;
+	TdbTw *tw, *ntw;
+
+	*old = o = ACCESS_ONCE(dbh->tw);
+	if (!o || o + sizeof(TdbTw) <= dbh->dbsz)
+		return 0;
+
+	if (!(o = tdb_alloc_data(dbh, TDB_HTRIE_DALIGN(sizeof(TdbTw)))))
+		return -ENOMEM;
+	tdb_ext_set_meta(dbh, o);
+	tw = TDB_PTR(dbh, *old);
+	ntw = TDB_PTR(dbh, o);
+	memset(ntw, 0, sizeof(*ntw));
+	ntw->clk = ACCESS_ONCE(tw->clk);
+	smp_wmb();
+	ACCESS_ONCE(dbh->tw) = o;
+
+	return 0;
+}
+
+/**
+ * Free all the records with @key which expire not later than @now.
+ * Fixed-size records are zeroed, so the bucket is locked against writers
+ * and pinned records aren't freed.
+ * @return number of freed records or -EBUSY if some of them are pinned.
+ */
+static int
+tdb_htrie_expire_key(TdbHdr *dbh, unsigned long key, unsigned long now)
+{
+	int n = 0, busy = 0;
+	unsigned int e, l;
+	TdbBucket *bckt, *b, *rb;
+
+	if (TDB_HTRIE_VARLENRECS(dbh)) {
+		TdbVRec *r;
+
+		if (!(b = tdb_htrie_lookup(dbh, key)))
+			return 0;
+		TDB_HTRIE_FOREACH_REC(dbh, b, r) {
+			e = ACCESS_ONCE(r->expires);
+			if (r->key != key || !e || e > now)
+				continue;
+			do {
+				l = ACCESS_ONCE(r->len);
+				if (!l || (l & TDB_HTRIE_VRFREED))
+					break;
+			} while (cmpxchg(&r->len, l, l | TDB_HTRIE_VRFREED)
+				 != l);
+			if (l && !(l & TDB_HTRIE_VRFREED))
+				++n;
+		}
+		return n;
+	} else {
+		TdbFRec *r;
+retry:
+		if (!(bckt = tdb_htrie_lookup(dbh, key)))
+			return 0;
+		if (tdb_htrie_bckt_lock(bckt))
+			goto retry;
+		b = bckt;
+		TDB_HTRIE_FOREACH_REC(dbh, b, r) {
+			e = ACCESS_ONCE(r->expires);
+			if (r->key != key || !e || e > now)
+				continue;
+			/*
+			 * Readers pin the bucket holding the record, which
+			 * isn't locked by writers for collision chains. Burst
+			 * never happens for the chains, so the lock succeeds.
+			 */
+			rb = tdb_htrie_rec_bckt(dbh, (TdbRec *)r);
+			if (rb != bckt)
+				tdb_htrie_bckt_lock(rb);
+			if (ACCESS_ONCE(rb->flags) & TDB_HTRIE_PINS) {
+				busy = 1;
+			} else {
+				/* Readers check the key first. */
+				ACCESS_ONCE(r->key) = 0;
+				smp_wmb();
+				tdb_free_fsrec(dbh, r);
+				++n;
+			}
+			if (rb != bckt)
+				tdb_htrie_bckt_unlock(rb, 0);
+		}
+		tdb_htrie_bckt_unlock(bckt, 0);
+	}
+
+	return busy ? -EBUSY : n;
+}
+
+/**
+ * Process timers block @blk: free expired records and move other timers
+ * to lower wheel levels.
+ *
+ * @freed	- incremented by the number of freed records;
+ * @return next block of the timers list.
+ */
+unsigned int
+tdb_htrie_tw_expire(TdbHdr *dbh, unsigned int blk, unsigned long now,
+		    size_t *freed)
+{
+	int r;
+	unsigned int i, n;
+	TdbTw *tw = TDB_PTR(dbh, dbh->tw);
+	TdbTwBlk *b = TDB_PTR(dbh, TDB_DI2O(blk));
+	TdbTwEntry *e;
+
+	n = min(b->n, (unsigned int)TDB_TW_BLK_N);
+	for (i = 0; i < n; ++i) {
+		e = TDB_TW_ENTRY(b, i);
+		if (e->expires <= now) {
+			r = tdb_htrie_expire_key(dbh, e->key, now);
+			if (r >= 0) {
+				*freed += r;
+				continue;
+			}
+			/* Some records are in use, try on the next tick. */
+		}
+		if (tdb_htrie_tw_add(dbh, tw, e->key, e->expires))
+			TDB_ERR("Cannot reschedule timer for key %#lx\n",
+				e->key);
+	}
+
+	return b->next;
+}
+
+/*
+ * ------------------------------------------------------------------------
+ *	Tiered storage
+ * ------------------------------------------------------------------------
+ *
+ * Large databases can keep only hot part of the file in memory. Extents
+ * which aren't locked in memory are marked as cold in the file header.
+ * Allocators never use cold extents, so writers never touch them w/o
+ * lookups. Readers check that all the blocks of the looked up bucket are
+ * in resident extents and request the extents from the memory manager if
+ * they aren't. Index nodes and timers are reached w/o lookups, so their
+ * extents are always resident.
+ */
+
+/**
+ * @return the first cold extent number plus one, which keeps the bucket
+ * @b, its collision chain or chunks of its records, or zero if all the
+ * blocks are resident. Blocks of cold extents are never accessed.
+ */
+unsigned long
+tdb_htrie_bckt_cold(TdbHdr *dbh, TdbBucket *b)
+{
+	unsigned long e, *cold = TDB_EXT_COLD(dbh);
+	TdbBucket *bckt;
+	TdbVRec *r, *c;
+
+#define TDB_COLD(p)	({ e = TDB_EXT_ID(TDB_HTRIE_OFF(dbh, p));	\
+			   tdb_test_bit(cold, e); })
+
+	for (bckt = b; bckt; bckt = TDB_HTRIE_BUCKET_NEXT(dbh, bckt))
+		if (TDB_COLD(bckt))
+			return e + 1;
+
+	if (!TDB_HTRIE_VARLENRECS(dbh))
+		return 0;
+
+	/* Large chunks never cross extent boundaries. */
+	TDB_HTRIE_FOREACH_REC(dbh, b, r) {
+		if (!tdb_live_vsrec(r))
+			continue;
+		smp_rmb();
+		for (c = r; c->chunk_next; ) {
+			c = TDB_PTR(dbh, TDB_DI2O(c->chunk_next));
+			if (TDB_COLD(c))
+				return e + 1;
+		}
+	}
+
+#undef TDB_COLD
+
+	return 0;
+}
+
+/**
+ * @return true if extent @e must be resident: it's used for index or
+ * timers, or writers allocate new blocks from it.
+ */
+int
+tdb_htrie_ext_pinned(TdbHdr *dbh, unsigned long e)
+{
+	int i;
+	TdbCursor *c = TDB_CURS(dbh);
+
+	if (e <= ACCESS_ONCE(dbh->i_wm) || e == ACCESS_ONCE(dbh->d_wm))
+		return 1;
+	if (test_bit(TDB_EXT_F_META, &tdb_ext(dbh, e * TDB_EXT_SZ)->flags))
+		return 1;
+	for (i = 0; i < TDB_CURS_N; ++i)
+		if (TDB_EXT_ID(ACCESS_ONCE(c[i].i_wcl)) == e
+		    || TDB_EXT_ID(ACCESS_ONCE(c[i].d_wcl)) == e)
+			return 1;
+
+	return 0;
+}
+
+/**
+ * Mark extent @e as cold (not resident) or resident. Extents must be marked
+ * as cold before their memory is unlocked and marked as resident after
+ * their memory is locked.
+ */
+void
+tdb_htrie_ext_set_cold(TdbHdr *dbh, unsigned long e, int cold)
+{
+	if (cold)
+		tdb_set_bit(TDB_EXT_COLD(dbh), e);
+	else
+		tdb_clear_bit(TDB_EXT_COLD(dbh), e);
+}
+
+int
+tdb_htrie_ext_cold(TdbHdr *dbh, unsigned long e)
+{
+	return tdb_test_bit(TDB_EXT_COLD(dbh), e);
+}
+
+/**
+ * @return number of free blocks in extent @e.
+ */
+unsigned int
+tdb_htrie_ext_free_blks(TdbHdr *dbh, unsigned long e)
+{
+	int i;
+	unsigned int used = 0;
+	TdbExt *ext = tdb_ext(dbh, e * TDB_EXT_SZ);
+
+	for (i = 0; i < TDB_BLK_BMP_2L; ++i)
+		used += hweight_long(ACCESS_ONCE(ext->b_bmp[i]));
+
+	return TDB_EXT_SZ / PAGE_SIZE - used;
+}
+
+/*
+ * ------------------------------------------------------------------------
+ *	Garbage collection
+ * ------------------------------------------------------------------------
+ *
+ * Lock-free readers can see unlinked blocks for some time, so blocks can't
+ * be freed immediately. Instead garbage collector marks all blocks reachable
+ * from the tree root and frees used blocks which aren't reachable, e.g. old
+ * buckets replaced by burst, unpublished records freed by writers and chunks
+ * of freed variable-length records. The caller must provide a bitmap of
+ * tdb_htrie_gc_bmp_sz() bytes for all the blocks in the database and call
+ * the functions in following order:
+ *
+ * 1. tdb_htrie_gc_snapshot() copies used blocks bitmaps. Blocks allocated
+ *    after the snapshot are never freed by current collection;
+ * 2. wait for all writers which could allocate blocks before the snapshot,
+ *    so all their blocks are linked with the tree or freed;
+ * 3. tdb_htrie_gc_mark() unsets all reachable blocks in the bitmap;
+ * 4. wait for all readers which could see unreachable blocks;
+ * 5. tdb_htrie_gc_sweep() frees all blocks left in the bitmap.
+ *
+ * The bitmap is private for the collector, so we don't need atomic
+ * operations on it.
+ */
+#define TDB_BLK_PER_EXT		(TDB_EXT_SZ / PAGE_SIZE)
+#define TDB_GC_MARK(b, o)	__clear_bit((unsigned long)(o) >> PAGE_SHIFT, b)
+
+size_t
+tdb_htrie_gc_bmp_sz(TdbHdr *dbh)
+{
+	return BITS_TO_LONGS(dbh->dbsz / PAGE_SIZE) * sizeof(long);
+}
+
+void
+tdb_htrie_gc_snapshot(TdbHdr *dbh, unsigned long *bmp)
+{
+	int i;
+	unsigned long e;
+
+	for (e = 0; e < dbh->dbsz / TDB_EXT_SZ; ++e) {
+		TdbExt *ext = tdb_ext(dbh, e * TDB_EXT_SZ);
+		for (i = 0; i < TDB_BLK_BMP_2L; ++i)
+			bmp[e * TDB_BLK_BMP_2L + i] = ACCESS_ONCE(ext->b_bmp[i]);
+	}
+}
+
+/**
+ * Freed variable-length records are reused in place, so a reader can't
+ * get overwritten data only if the room is reused after a grace period.
+ * The collection marks freed record @r as stale and the next collection,
+ * which runs after the grace period at the end of the current one, allows
+ * to reuse it.
+ */
+static void
+tdb_htrie_gc_age_rec(TdbVRec *r)
+{
+	unsigned int l, f;
+
+	do {
+		l = ACCESS_ONCE(r->len);
+		if (!(l & TDB_HTRIE_VRFREED) || (l & TDB_HTRIE_VRREUSE))
+			return;
+		f = (l & TDB_HTRIE_VRSTALE) ? TDB_HTRIE_VRREUSE
+					     : TDB_HTRIE_VRSTALE;
+	} while (cmpxchg(&r->len, l, l | f) != l);
+}
+
+static void
+tdb_htrie_gc_mark_bckt(TdbHdr *dbh, TdbBucket *b, unsigned long *bmp)
+{
+	unsigned long o, e;
+	TdbVRec *r, *c;
+	TdbBucket *bckt;
+
+	for (bckt = b; bckt; bckt = TDB_HTRIE_BUCKET_NEXT(dbh, bckt))
+		TDB_GC_MARK(bmp, TDB_HTRIE_OFF(dbh, bckt));
+
+	/* Fixed-size records live in their buckets only. */
+	if (!TDB_HTRIE_VARLENRECS(dbh))
+		return;
+
+	TDB_HTRIE_FOREACH_REC(dbh, b, r) {
+		if (!tdb_live_vsrec(r)) {
+			tdb_htrie_gc_age_rec(r);
+			continue;
+		}
+		smp_rmb();
+		for (c = r; c->chunk_next; ) {
+			c = TDB_PTR(dbh, TDB_DI2O(c->chunk_next));
+			o = TDB_HTRIE_OFF(dbh, c);
+			/* Large chunks span several blocks. */
+			for (e = o + TDB_HTRIE_RECLEN(dbh, c); o < e;
+			     o = (o & PAGE_MASK) + PAGE_SIZE)
+				TDB_GC_MARK(bmp, o);
+		}
+	}
+}
+
+static void
+tdb_htrie_gc_mark_node(TdbHdr *dbh, TdbHtrieNode *node, unsigned long *bmp)
+{
+	int i;
+	unsigned int o;
+
+	TDB_GC_MARK(bmp, TDB_HTRIE_OFF(dbh, node));
+
+	for (i = 0; i < TDB_HTRIE_FANOUT; ++i) {
+		o = ACCESS_ONCE(node->shifts[i]);
+		smp_read_barrier_depends();
+		if (!o)
+			continue;
+		if (o & TDB_HTRIE_DBIT)
+			tdb_htrie_gc_mark_bckt(dbh,
+					       TDB_PTR(dbh, TDB_DI2O(o
+							^ TDB_HTRIE_DBIT)),
+					       bmp);
+		else
+			/* The tree depth is limited by key bits. */
+			tdb_htrie_gc_mark_node(dbh, TDB_PTR(dbh, TDB_II2O(o)),
+					       bmp);
+	}
+}
+
+/**
+ * Mark the timer wheel and all the timer blocks linked with its slots.
+ * Slots detached by tdb_htrie_tw_detach() aren't reachable, so their
+ * blocks are freed by the sweep after they're processed.
+ */
+static void
+tdb_htrie_gc_mark_tw(TdbHdr *dbh, unsigned long *bmp)
+{
+	int i;
+	unsigned int o;
+	unsigned long tw_off = ACCESS_ONCE(dbh->tw);
+	TdbTw *tw;
+	TdbTwBlk *b;
+
+	if (!tw_off)
+		return;
+	TDB_GC_MARK(bmp, tw_off);
+	tw = TDB_PTR(dbh, tw_off);
+
+	for (i = 0; i < TDB_TW_LEVELS * TDB_TW_SLOTS; ++i) {
+		o = ACCESS_ONCE(tw->slots[i / TDB_TW_SLOTS][i % TDB_TW_SLOTS]);
+		smp_read_barrier_depends();
+		for ( ; o; o = ACCESS_ONCE(b->next)) {
+			b = TDB_PTR(dbh, TDB_DI2O(o));
+			TDB_GC_MARK(bmp, TDB_DI2O(o));
+		}
+	}
+}
+
+/**
+ * Unset all blocks reachable from the tree root in @bmp.
+ * Blocks pointed by the write cursors are also treated as reachable since
+ * writers continue to allocate space from them.
+ * Can run concurrently with readers and writers.
+ */
+void
+tdb_htrie_gc_mark(TdbHdr *dbh, unsigned long *bmp)
+{
+	int i;
+	unsigned long o;
+	TdbCursor *c = TDB_CURS(dbh);
+
+	/* The file header and the root node are never freed. */
+	for (o = 0; o < TDB_HTRIE_OFF(dbh, TDB_HTRIE_ROOT(dbh) + 1);
+	     o += PAGE_SIZE)
+		TDB_GC_MARK(bmp, o);
+	for (i = 0; i < TDB_CURS_N; ++i) {
+		TDB_GC_MARK(bmp, ACCESS_ONCE(c[i].i_wcl));
+		TDB_GC_MARK(bmp, ACCESS_ONCE(c[i].d_wcl));
+	}
+
+	tdb_htrie_gc_mark_node(dbh, TDB_HTRIE_ROOT(dbh), bmp);
+	tdb_htrie_gc_mark_tw(dbh, bmp);
+}
+
+/**
+ * Zero and free all the blocks set in @bmp.
+ * Extents with all free blocks are marked as free in the header bitmap.
+ * @return number of freed blocks.
+ */
+size_t
+tdb_htrie_gc_sweep(TdbHdr *dbh, unsigned long *bmp)
+{
+	int i;
+	unsigned long b, e = ~0UL, n = 0, o;
+	unsigned long nb = dbh->dbsz / PAGE_SIZE;
+	TdbExt *ext = NULL;
+
+	for_each_set_bit(b, bmp, nb) {
+		o = b * PAGE_SIZE;
+		if (e != TDB_EXT_ID(o)) {
+			e = TDB_EXT_ID(o);
+			ext = tdb_ext(dbh, o);
+		}
+		if (b % TDB_BLK_PER_EXT) {
+			memset(TDB_PTR(dbh, o), 0, PAGE_SIZE);
+		} else {
+			/* Keep the extent header in the first block. */
+			o = TDB_HTRIE_OFF(dbh, ext + 1);
+			memset(TDB_PTR(dbh, o), 0, PAGE_SIZE - (o & ~PAGE_MASK));
+		}
+		/* The block must be zeroed before allocators see it free. */
+		smp_wmb();
+		tdb_ext_free_blk(dbh, ext, b % TDB_BLK_PER_EXT);
+		++n;
+	}
+
+	for (e = 0; e < dbh->dbsz / TDB_EXT_SZ; ++e) {
+		ext = tdb_ext(dbh, e * TDB_EXT_SZ);
+		for (i = 0; i < TDB_BLK_BMP_2L; ++i)
+			if (ACCESS_ONCE(ext->b_bmp[i]))
+				break;
+		/*
+		 * The extent bitmap is just a hint for allocators,
+		 * so we don't care about races with them here.
+		 */
+		if (i == TDB_BLK_BMP_2L)
+			clear_bit(e % BITS_PER_LONG,
+				  &dbh->ext_bmp[e / BITS_PER_LONG]);
+	}
+
+	TDB_DBG("GC: freed %lu blocks\n", n);
+
+	return n;
+}
+
+/*
+ * ------------------------------------------------------------------------
+ *	Online resizing
+ * ------------------------------------------------------------------------
+ *
+ * The header bitmaps are sized for TDB_SHARD_MAX bytes, so a file grows
+ * w/o moving anything: new extents are appended to the file end and
+ * the data watermark moves to the new last extent.
+ *
+ * Shrinking evacuates extents beyond the new file end. Allocators don't
+ * use the extents since the file size is decreased, then the timer wheel
+ * is rebuilt, see tdb_htrie_tw_move(), and records having blocks in
+ * the extents are evicted, so their buckets are unlinked from the index.
+ * Index nodes, collision chains and fixed-size records aren't evacuated,
+ * so the file keeps its size if they are found in the extents.
+ */
+
+/**
+ * Make extents up to @size bytes available for allocators. The new extents
+ * must be zeroed and resident (unless they're cold).
+ */
+void
+tdb_htrie_grow(TdbHdr *dbh, unsigned long size)
+{
+	unsigned long e = size / TDB_EXT_SZ - 1;
+
+	/* Allocators must see the extents zeroed. */
+	smp_wmb();
+	ACCESS_ONCE(dbh->dbsz) = size;
+	tdb_set_bit(dbh->ext_bmp, e);
+	/*
+	 * Data grows from the new last extent towards the old data extents.
+	 * Allocators move the watermark by CAS, so they see the new value.
+	 */
+	ACCESS_ONCE(dbh->d_wm) = e;
+}
+
+/**
+ * Decrease the file size to @size bytes, so allocators stop using the
+ * extents beyond it. The extents must be evacuated by tdb_htrie_evacuate()
+ * after all the writers which could allocate blocks there finish.
+ * @return -EBUSY if the index watermark is beyond the new file end.
+ */
+int
+tdb_htrie_shrink_start(TdbHdr *dbh, unsigned long size)
+{
+	int i;
+	unsigned long o, n = size / TDB_EXT_SZ;
+	TdbCursor *c = TDB_CURS(dbh);
+
+	if (ACCESS_ONCE(dbh->i_wm) + 1 >= n)
+		return -EBUSY;
+
+	ACCESS_ONCE(dbh->dbsz) = size;
+	if (ACCESS_ONCE(dbh->d_wm) >= n)
+		ACCESS_ONCE(dbh->d_wm) = n - 1;
+
+	/* Writers move the cursors by CAS, so they allocate new blocks. */
+	for (i = 0; i < TDB_CURS_N; ++i) {
+		if ((o = ACCESS_ONCE(c[i].i_wcl)) >= size)
+			cmpxchg(&c[i].i_wcl, o, 0);
+		if ((o = ACCESS_ONCE(c[i].d_wcl)) >= size)
+			cmpxchg(&c[i].d_wcl, o, 0);
+	}
+
+	return 0;
+}
+
+/**
+ * @return true if record @r has a chunk beyond the file end.
+ */
+static int
+tdb_htrie_vsrec_far(TdbHdr *dbh, TdbVRec *r)
+{
+	for ( ; ; r = TDB_PTR(dbh, TDB_DI2O(r->chunk_next))) {
+		if (TDB_HTRIE_OFF(dbh, r) >= dbh->dbsz)
+			return 1;
+		if (!r->chunk_next)
+			return 0;
+	}
+}
+
+/**
+ * Evacuate subtree or bucket @o linked with slot @i of @node at @bits
+ * level. @return number of blocks beyond the file end which are still used.
+ */
+static unsigned long
+tdb_htrie_evac_slot(TdbHdr *dbh, TdbHtrieNode *node, int i, unsigned int o,
+		    int bits)
+{
+	int far = 0;
+	unsigned int l;
+	unsigned long busy = 0;
+	TdbBucket *b, *bckt;
+	TdbVRec *r;
+
+	if (!(o & TDB_HTRIE_DBIT)) {
+		/* Index nodes are never moved. */
+		if (TDB_II2O(o) >= dbh->dbsz)
+			++busy;
+		node = TDB_PTR(dbh, TDB_II2O(o));
+		bits += TDB_HTRIE_BITS;
+		for (i = 0; i < TDB_HTRIE_FANOUT; ++i) {
+			o = ACCESS_ONCE(node->shifts[i]);
+			smp_read_barrier_depends();
+			if (o)
+				/* The tree depth is limited by key bits. */
+				busy += tdb_htrie_evac_slot(dbh, node, i, o,
+							    bits);
+		}
+		return busy;
+	}
+
+	b = TDB_PTR(dbh, TDB_DI2O(o ^ TDB_HTRIE_DBIT));
+	for (bckt = b; bckt; bckt = TDB_HTRIE_BUCKET_NEXT(dbh, bckt))
+		if (TDB_HTRIE_OFF(dbh, bckt) >= dbh->dbsz)
+			far = 1;
+	if (!TDB_HTRIE_VARLENRECS(dbh))
+		return far;
+
+	bckt = b;
+	TDB_HTRIE_FOREACH_REC(dbh, bckt, r) {
+		if (!tdb_live_vsrec(r))
+			continue;
+		smp_rmb();
+		if (!tdb_htrie_vsrec_far(dbh, r))
+			continue;
+		do {
+			l = ACCESS_ONCE(r->len);
+			if (!l || (l & TDB_HTRIE_VRFREED))
+				break;
+		} while (cmpxchg(&r->len, l, l | TDB_HTRIE_VRFREED) != l);
+	}
+	if (!far)
+		return 0;
+
+	/* Only buckets w/o collision chains can be unlinked. */
+	if (TDB_HTRIE_RESOLVED(bits + TDB_HTRIE_BITS)
+	    || ACCESS_ONCE(b->coll_next))
+		return 1;
+	tdb_htrie_unlink_bckt(dbh, node, i, b);
+
+	return ACCESS_ONCE(node->shifts[i]) == o;
+}
+
+/**
+ * Evict all the records having blocks beyond the file end, so the index
+ * doesn't reference the blocks. Can run concurrently with readers and
+ * writers, but not with the collector.
+ * @return number of blocks beyond the file end which are still used.
+ */
+unsigned long
+tdb_htrie_evacuate(TdbHdr *dbh)
+{
+	int i;
+	unsigned int o;
+	unsigned long busy = 0;
+	TdbHtrieNode *root = TDB_HTRIE_ROOT(dbh);
+
+	for (i = 0; i < TDB_HTRIE_FANOUT; ++i) {
+		o = ACCESS_ONCE(root->shifts[i]);
+		smp_read_barrier_depends();
+		if (o)
+			busy += tdb_htrie_evac_slot(dbh, root, i, o, 0);
+	}
+
+	TDB_DBG("%lu blocks beyond %lu bytes aren't evacuated\n", busy,
+		dbh->dbsz);
+
+	return busy;
+}
+
+/**
+ * Forget extents between the file end and the previous file size @old.
+ * Nobody may reference the extents at the moment.
+ */
+void
+tdb_htrie_shrink_finish(TdbHdr *dbh, unsigned long old)
+{
+	unsigned long e;
+
+	for (e = dbh->dbsz / TDB_EXT_SZ; e < old / TDB_EXT_SZ; ++e) {
+		tdb_clear_bit(dbh->ext_bmp, e);
+		tdb_clear_bit(TDB_EXT_FULL(dbh), e);
+		tdb_clear_bit(TDB_EXT_COLD(dbh), e);
+	}
+}
+
+/*
+ * ------------------------------------------------------------------------
+ *	Crash recovery
+ * ------------------------------------------------------------------------
+ *
+ * Writers link completely written blocks with the tree by single CAS, so
+ * the tree in memory is always consistent. However, the kernel writes back
+ * dirty pages of the file in any order, so after a crash the file can keep
+ * a slot pointing to a block which was never written back, a half copied
+ * burst, a broken chunk chain or locked and pinned buckets.
+ *
+ * If the file wasn't closed cleanly, then the index is validated before
+ * the table is used: invalid pointers are cut, variable-length records with
+ * broken chunk chains are freed and the buckets are unlocked. The allocation
+ * state isn't trusted at all and is rebuilt from reachable blocks, just like
+ * garbage collection does with the snapshot of all the file blocks.
+ * The caller provides a bitmap of tdb_htrie_gc_bmp_sz() bytes and calls:
+ *
+ * 1. tdb_htrie_recover_start() resets the allocation state and validates
+ *    the file header and the timer wheel;
+ * 2. tdb_htrie_recover_slot() for each slot of the root index node,
+ *    the subtrees can be validated in parallel;
+ * 3. tdb_htrie_recover_exts() for each range of extents, the ranges can be
+ *    processed in parallel, to rebuild the blocks bitmaps and zero
+ *    unreachable blocks.
+ *
+ * Nobody may access the table until the recovery is done.
+ */
+
+/* Brent's cycle detection in a list walk. */
+typedef struct {
+	unsigned long	t;
+	unsigned long	pow;
+	unsigned long	lam;
+} TdbChainWalk;
+
+/**
+ * @return true if offset @o of the next list item was already seen.
+ */
+static int
+tdb_htrie_chain_loop(TdbChainWalk *w, unsigned long o)
+{
+	if (o == w->t)
+		return 1;
+	if (++w->lam == w->pow) {
+		w->t = o;
+		w->pow <<= 1;
+		w->lam = 0;
+	}
+	return 0;
+}
+
+/**
+ * @return true if @len bytes at offset @o lie in one extent and don't
+ * overlap the file header, the root node and the extent header.
+ */
+static int
+tdb_htrie_valid_off(TdbHdr *dbh, unsigned long o, size_t len)
+{
+	unsigned long e = TDB_EXT_O(o);
+	unsigned long min = e ? e + sizeof(TdbExt)
+			      : TDB_HTRIE_OFF(dbh, TDB_HTRIE_ROOT(dbh) + 1);
+
+	return o >= min && o + len <= dbh->dbsz
+	       && TDB_EXT_O(o + len - 1) == e;
+}
+
+/**
+ * Unset blocks of @len bytes at @o in @bmp. Different blocks of the same
+ * page can be marked concurrently, so the bitmap is updated atomically.
+ */
+static void
+tdb_htrie_recover_mark(unsigned long *bmp, unsigned long o, size_t len)
+{
+	unsigned long e;
+
+	for (e = o + len; o < e; o = (o & PAGE_MASK) + PAGE_SIZE)
+		clear_bit(o >> PAGE_SHIFT, bmp);
+}
+
+/**
+ * Validate chunks of variable-length record @r and mark them.
+ * @return false if the chunk chain is broken.
+ */
+static int
+tdb_htrie_recover_chunks(TdbHdr *dbh, TdbVRec *r, unsigned long *bmp)
+{
+	int pass;
+	unsigned long o;
+	TdbVRec *c;
+	TdbChainWalk w = { TDB_HTRIE_OFF(dbh, r), 1, 0 };
+
+	/* Validate the whole chain before marking any of its chunks. */
+	for (pass = 0; pass < 2; ++pass)
+		for (c = r; c->chunk_next; ) {
+			o = TDB_DI2O(c->chunk_next);
+			if (!pass && (!tdb_htrie_valid_off(dbh, o, sizeof(*c))
+				      || tdb_htrie_chain_loop(&w, o)))
+				return 0;
+			c = TDB_PTR(dbh, o);
+			if (!pass && (c->key != r->key
+				      || !TDB_HTRIE_VRLEN(c)
+				      || TDB_HTRIE_RECLEN(dbh, c)
+					 > TDB_HTRIE_CHUNK_MAX
+				      || !tdb_htrie_valid_off(dbh, o,
+						TDB_HTRIE_RECLEN(dbh, c))))
+				return 0;
+			if (pass)
+				tdb_htrie_recover_mark(bmp, o,
+						       TDB_HTRIE_RECLEN(dbh, c));
+		}
+
+	return 1;
+}
+
+/**
+ * Validate records of bucket @b. The first record can occupy the rest of
+ * the bucket block, other records must fit TDB_HTRIE_MINDREC.
+ */
+static void
+tdb_htrie_recover_recs(TdbHdr *dbh, TdbBucket *b, unsigned long *bmp)
+{
+	size_t n;
+	unsigned long o;
+
+	if (TDB_HTRIE_VARLENRECS(dbh)) {
+		TdbVRec *r = TDB_HTRIE_BUCKET_1ST(dbh, b);
+
+		for ( ; r->len; r = (TdbVRec *)((char *)r + n)) {
+			o = TDB_HTRIE_OFF(dbh, r);
+			n = TDB_HTRIE_RECLEN(dbh, r);
+			if (r == TDB_HTRIE_BUCKET_1ST(dbh, b)
+			    ? !TDB_BLK_FITS(o, n)
+			    : (char *)r - (char *)b + n > TDB_HTRIE_MINDREC)
+			{
+				/* Zero length ends the bucket. */
+				r->len = 0;
+				break;
+			}
+			if (tdb_live_vsrec(r)
+			    && !tdb_htrie_recover_chunks(dbh, r, bmp))
+				tdb_free_vsrec(r);
+			/* Nobody reads freed records after restart. */
+			if (r->len & TDB_HTRIE_VRFREED)
+				r->len |= TDB_HTRIE_VRSTALE
+					  | TDB_HTRIE_VRREUSE;
+			if ((char *)r - (char *)b + n + sizeof(*r)
+			    > TDB_HTRIE_MINDREC)
+				break;
+		}
+	} else {
+		TdbFRec *r;
+
+		/* Fingerprints could be written back w/o the records. */
+		*(unsigned long *)TDB_HTRIE_BUCKET_FPS(b) = 0;
+		for (r = TDB_HTRIE_BUCKET_1ST(dbh, b);
+		     r == TDB_HTRIE_BUCKET_1ST(dbh, b)
+		     || (char *)r - (char *)b + TDB_HTRIE_RECLEN(dbh, r)
+			<= TDB_HTRIE_MINDREC;
+		     r = (TdbFRec *)((char *)r + TDB_HTRIE_RECLEN(dbh, r)))
+			tdb_htrie_set_fp(dbh, b, r, r->key);
+	}
+}
+
+/**
+ * Validate collision chain starting at bucket @b.
+ */
+static void
+tdb_htrie_recover_bckt(TdbHdr *dbh, TdbBucket *b, unsigned long *bmp)
+{
+	unsigned long o;
+	TdbChainWalk w = { TDB_HTRIE_OFF(dbh, b), 1, 0 };
+
+	while (1) {
+		tdb_htrie_recover_mark(bmp, TDB_HTRIE_OFF(dbh, b),
+				       TDB_HTRIE_MINDREC);
+		/* Nobody holds the bucket after restart. */
+		b->flags = 0;
+		tdb_htrie_recover_recs(dbh, b, bmp);
+
+		if (!b->coll_next)
+			break;
+		o = TDB_DI2O(b->coll_next);
+		if (!tdb_htrie_valid_off(dbh, o, TDB_HTRIE_MINDREC)
+		    || tdb_htrie_chain_loop(&w, o))
+		{
+			TDB_ERR("Cut broken collision chain at %#lx\n",
+				TDB_HTRIE_OFF(dbh, b));
+			b->coll_next = 0;
+			break;
+		}
+		b = TDB_PTR(dbh, o);
+	}
+}
+
+/**
+ * Validate slot @i of index node @node, which resolves @bits of keys.
+ */
+static void
+tdb_htrie_recover_node(TdbHdr *dbh, TdbHtrieNode *node, int i, int bits,
+		       unsigned long *bmp)
+{
+	int j;
+	unsigned int s = node->shifts[i];
+	unsigned long o;
+	TdbHtrieNode *child;
+
+	if (!s)
+		return;
+
+	if (s & TDB_HTRIE_DBIT) {
+		o = TDB_DI2O(s ^ TDB_HTRIE_DBIT);
+		if (!tdb_htrie_valid_off(dbh, o, TDB_HTRIE_MINDREC))
+			goto cut;
+		tdb_htrie_recover_bckt(dbh, TDB_PTR(dbh, o), bmp);
+		return;
+	}
+
+	o = TDB_II2O(s);
+	/* The tree depth is limited by key bits. */
+	if (TDB_HTRIE_RESOLVED(bits + TDB_HTRIE_BITS)
+	    || !tdb_htrie_valid_off(dbh, o, sizeof(*child)))
+		goto cut;
+	tdb_htrie_recover_mark(bmp, o, sizeof(*child));
+	tdb_ext_set_meta(dbh, o);
+	child = TDB_PTR(dbh, o);
+	for (j = 0; j < TDB_HTRIE_FANOUT; ++j)
+		tdb_htrie_recover_node(dbh, child, j, bits + TDB_HTRIE_BITS,
+				       bmp);
+	return;
+cut:
+	TDB_ERR("Cut broken index slot %#x at %#lx\n", s,
+		TDB_HTRIE_OFF(dbh, node));
+	node->shifts[i] = 0;
+}
+
+/**
+ * Cut broken timer blocks lists of the timer wheel.
+ */
+static void
+tdb_htrie_recover_tw(TdbHdr *dbh, unsigned long *bmp)
+{
+	int i;
+	unsigned int *o;
+	TdbTw *tw;
+	TdbChainWalk w;
+
+	if (!dbh->tw)
+		return;
+	if (!tdb_htrie_valid_off(dbh, dbh->tw, sizeof(*tw))) {
+		TDB_ERR("Drop broken timer wheel at %#lx\n", dbh->tw);
+		dbh->tw = 0;
+		return;
+	}
+	tdb_htrie_recover_mark(bmp, dbh->tw, sizeof(*tw));
+	tdb_ext_set_meta(dbh, dbh->tw);
+	tw = TDB_PTR(dbh, dbh->tw);
+
+	for (i = 0; i < TDB_TW_LEVELS * TDB_TW_SLOTS; ++i) {
+		o = &tw->slots[i / TDB_TW_SLOTS][i % TDB_TW_SLOTS];
+		w = (TdbChainWalk){ 0, 1, 0 };
+		for ( ; *o; o = &((TdbTwBlk *)TDB_PTR(dbh, TDB_DI2O(*o)))->next)
+		{
+			if (!tdb_htrie_valid_off(dbh, TDB_DI2O(*o),
+						 TDB_TW_BLK_SZ)
+			    || tdb_htrie_chain_loop(&w, *o))
+			{
+				*o = 0;
+				break;
+			}
+			tdb_htrie_recover_mark(bmp, TDB_DI2O(*o),
+					       TDB_TW_BLK_SZ);
+			tdb_ext_set_meta(dbh, TDB_DI2O(*o));
+		}
+	}
+}
+
+/**
+ * Reset the allocation state of the file and validate its header.
+ * The blocks bitmaps are rebuilt by tdb_htrie_recover_exts() later.
+ */
+void
+tdb_htrie_recover_start(TdbHdr *dbh, unsigned long *bmp)
+{
+	int i;
+	unsigned long e, o, n = dbh->dbsz / TDB_EXT_SZ;
+	TdbCursor *c = TDB_CURS(dbh);
+
+	memset(bmp, 0xff, tdb_htrie_gc_bmp_sz(dbh));
+
+	memset(dbh->ext_bmp, 0, TDB_EXT_BMP_2L(dbh) * 2 * sizeof(long));
+	for (e = 0; e < n; ++e)
+		memset(tdb_ext(dbh, e * TDB_EXT_SZ), 0, sizeof(TdbExt));
+	set_bit(TDB_EXT_F_META, &tdb_ext(dbh, 0)->flags);
+	for (o = 0; o < TDB_HTRIE_OFF(dbh, TDB_HTRIE_ROOT(dbh) + 1);
+	     o += PAGE_SIZE)
+		tdb_htrie_recover_mark(bmp, o, 1);
+
+	/* Cursors point to blocks which can be not written back. */
+	for (i = 0; i < TDB_CURS_N; ++i) {
+		c[i].i_wcl = 0;
+		c[i].d_wcl = 0;
+	}
+	if (dbh->d_wm >= n)
+		dbh->d_wm = n - 1;
+	if (dbh->i_wm > dbh->d_wm)
+		dbh->i_wm = dbh->d_wm;
+
+	tdb_htrie_recover_tw(dbh, bmp);
+}
+
+/**
+ * Validate the subtree of slot @i of the root index node.
+ */
+void
+tdb_htrie_recover_slot(TdbHdr *dbh, int i, unsigned long *bmp)
+{
+	tdb_htrie_recover_node(dbh, TDB_HTRIE_ROOT(dbh), i, 0, bmp);
+}
+
+static int
+tdb_blk_zero(void *p, size_t len)
+{
+	unsigned long *w = p, *end = (unsigned long *)((char *)p + len);
+
+	for ( ; w < end; ++w)
+		if (*w)
+			return 0;
+	return 1;
+}
+
+/**
+ * Rebuild the blocks bitmaps of extents [@from, @to) by @bmp of unreachable
+ * blocks and zero the unreachable blocks, so allocators get zeroed blocks.
+ * Zeroed blocks aren't written, so clean pages aren't dirtied.
+ */
+void
+tdb_htrie_recover_exts(TdbHdr *dbh, unsigned long *bmp, unsigned long from,
+		       unsigned long to)
+{
+	int i;
+	unsigned long e, b, o, used;
+	TdbExt *ext;
+
+	for (e = from; e < to; ++e) {
+		ext = tdb_ext(dbh, e * TDB_EXT_SZ);
+		for (used = 0, i = 0; i < TDB_BLK_BMP_2L; ++i) {
+			ext->b_bmp[i] = ~bmp[e * TDB_BLK_BMP_2L + i];
+			if (ext->b_bmp[i] == ~0UL)
+				ext->b_full |= 1UL << i;
+			used |= ext->b_bmp[i];
+		}
+		for (b = 0; b < TDB_BLK_PER_EXT; ++b) {
+			if (tdb_test_bit(ext->b_bmp, b))
+				continue;
+			o = e * TDB_EXT_SZ + b * PAGE_SIZE;
+			/* Keep the extent header in the first block. */
+			if (!b)
+				o = TDB_HTRIE_OFF(dbh, ext + 1);
+			if (!tdb_blk_zero(TDB_PTR(dbh, o),
+					  PAGE_SIZE - (o & ~PAGE_MASK)))
+				memset(TDB_PTR(dbh, o), 0,
+				       PAGE_SIZE - (o & ~PAGE_MASK));
+		}
+
+		if (ext->b_full == TDB_EXT_FULL_MASK)
+			tdb_set_bit(TDB_EXT_FULL(dbh), e);
+		if (used || e == dbh->i_wm || e == dbh->d_wm)
+			tdb_set_bit(dbh->ext_bmp, e);
+	}
+}
+
+TdbHdr *
+tdb_htrie_init(void *p, size_t db_size, unsigned int rec_len)
+{
+	TdbHdr *hdr = (TdbHdr *)p;
+
+	if (hdr->magic != TDB_MAGIC || hdr->version != TDB_VERSION)
 		hdr = tdb_init_mapping(p, db_size, rec_len);
+	if (!hdr)
+		return NULL;
+	if (hdr->flags & TDB_F_SEQLOG) {
+		TDB_ERR("The database is a log\n");
+		return NULL;
+	}
+
+	/* Memory locking doesn't survive restarts. */
+	memset(TDB_EXT_COLD(hdr), 0, TDB_EXT_BMP_2L(hdr) * sizeof(long));
 
-	TDB_DBG("init db header: i_wcl=%lu d_wcl=%lu db_size=%lu rec_len=%u"
-		" i_wm=%u d_wm=%u\n",
-		hdr->i_wcl, hdr->d_wcl, hdr->dbsz, hdr->rec_len, hdr->i_wm,
-		hdr->d_wm);
+	TDB_DBG("init db header: db_size=%lu rec_len=%u i_wm=%u d_wm=%u\n",
+		hdr->dbsz, hdr->rec_len, hdr->i_wm, hdr->d_wm);
 
 	return hdr;
 }
@@ -21,8 +21,14 @@
 #ifndef __HTRIE_H__
 #define __HTRIE_H__
 
+#include <linux/smp.h>
+
 #include "tdb.h"
 
+#define TDB_MAGIC		0x434947414D424454UL /* "TDBMAGIC" */
+/* Increment on each incompatible change of the file layout. */
+#define TDB_VERSION		6
+
 #define TDB_EXT_BITS		21
 #define TDB_EXT_SZ		(1 << TDB_EXT_BITS)
 #define TDB_EXT_MASK		(~(TDB_EXT_SZ - 1))
@@ -42,6 +48,12 @@
 				 ~(L1_CACHE_BYTES - 1))
 #define TDB_HTRIE_DALIGN(n)	(((n) + TDB_HTRIE_MINDREC - 1)		\
 				 & ~(TDB_HTRIE_MINDREC - 1))
+/*
+ * Maximum size of variable-length record chunk. Large chunks occupy
+ * contiguous blocks of an extent, but the first chunk of a record lives
+ * in a bucket and is never larger than a block.
+ */
+#define TDB_HTRIE_CHUNK_MAX	(16 * PAGE_SIZE)
 #define TDB_HTRIE_BITS		4
 #define TDB_HTRIE_FANOUT	(1 << TDB_HTRIE_BITS)
 #define TDB_HTRIE_KMASK		(TDB_HTRIE_FANOUT - 1) /* key mask */
@@ -51,30 +63,66 @@
  * The most significant bit is used to flag data pointer/offset.
  * Index blocks are addressed by index of a L1_CACHE_BYTES-byte blocks in the file,
  * while data blocks are addressed by indexes of TDB_HTRIE_MINDREC blocks.
- * So theoretical size of the database shard which can be addressed is 256GB.
+ * So theoretical size of the database shard which can be addressed is 128GB
+ * for the index and 256GB for the data. Extents watermarks are 16-bit,
+ * so a file is also limited by 65536 extents, i.e. 128GB.
+ *
+ * Offsets are kept 32-bit to fit 16 slots in a cache line index node,
+ * so larger tables are split to files of at most TDB_SHARD_MAX bytes.
  */
 #define TDB_HTRIE_DBIT		(1U << (sizeof(int) * 8 - 1))
 #define TDB_HTRIE_OMASK		(TDB_HTRIE_DBIT - 1) /* offset mask */
+#define TDB_SHARD_MAX		(1UL << (16 + TDB_EXT_BITS))
+/* Maximum number of shards of a table, see tdb_shard(). */
+#define TDB_SHARDS_MAX		64
 #define TDB_HTRIE_IDX(k, b)	(((k) >> (b)) & TDB_HTRIE_KMASK)
-#define TDB_EXT_BMP_2L(h)	(((h)->dbsz / TDB_EXT_SZ + BITS_PER_LONG - 1)\
-				 / BITS_PER_LONG)
+/* Extent bitmaps are sized for the largest file, so files can grow. */
+#define TDB_EXT_BMP_2L(h)	(TDB_SHARD_MAX / TDB_EXT_SZ / BITS_PER_LONG)
 /* Get internal offset from a pointer. */
-#define TDB_HTRIE_OFF(h, p)	((char *)(p) - (char *)(h))
+#define TDB_HTRIE_OFF(h, p)	TDB_OFF(h, p)
 /* Base offset of extent containing pointer @p. */
 #define TDB_EXT_BASE(h, p)	TDB_EXT_O(TDB_HTRIE_OFF(h, p))
 
 /**
  * Header for bucket of small records.
  *
+ * Buckets are published by CAS on index node slots and collision chains
+ * grow by CAS on @coll_next, so lock-free readers always see either
+ * old or new consistent version of the tree. Writers changing a bucket
+ * content (placing small records into it or bursting it) serialize on
+ * TDB_HTRIE_BLOCKED bit of @flags. Burst also waits until all the pins
+ * of the bucket are released, so pinned records don't move.
+ *
+ * Buckets of fixed-size records are followed by a word of fingerprints,
+ * one byte for each record slot of the bucket, see tdb_htrie_fp_match().
+ *
  * @coll_next	- next record offset (in data blocks) in collision chain;
+ * @flags	- bucket state bits;
  */
 typedef struct {
 	unsigned int 	coll_next;
 	unsigned int	flags;
 } __attribute__((packed)) TdbBucket;
 
+/* Size of bucket header including fingerprints of fixed-size records. */
+#define TDB_HTRIE_BCKT_HDR(h)	(sizeof(TdbBucket)			\
+				 + (TDB_HTRIE_VARLENRECS(h) ? 0		\
+				    : sizeof(long)))
+#define TDB_HTRIE_BUCKET_FPS(b)	((unsigned char *)((b) + 1))
+
+#define TDB_HTRIE_BLOCKED	0x1	/* the bucket is locked by a writer */
+#define TDB_HTRIE_BURST		0x2	/* the bucket is replaced by burst */
+/* The rest of the flags count pins of the bucket records. */
+#define TDB_HTRIE_PIN		0x4
+#define TDB_HTRIE_PINS		(~(TDB_HTRIE_PIN - 1))
 #define TDB_HTRIE_VRFREED	TDB_HTRIE_DBIT
-#define TDB_HTRIE_VRLEN(r)	((r)->len & ~TDB_HTRIE_VRFREED)
+/* The record was accessed since the last eviction pass. */
+#define TDB_HTRIE_VRACCESS	(TDB_HTRIE_DBIT >> 1)
+/* The freed record was seen by the garbage collector. */
+#define TDB_HTRIE_VRSTALE	(TDB_HTRIE_DBIT >> 2)
+/* Readers don't see the freed record any more, so its room can be reused. */
+#define TDB_HTRIE_VRREUSE	(TDB_HTRIE_DBIT >> 3)
+#define TDB_HTRIE_VRLEN(r)	TDB_VREC_LEN(r)
 #define __RECLEN(h, r)							\
 	__builtin_choose_expr(__builtin_types_compatible_p(typeof(*(r)),\
 							   TdbVRec),	\
@@ -83,23 +131,88 @@ typedef struct {
 			      TDB_HTRIE_VRLEN((TdbVRec *)r),		\
 			      (h)->rec_len)
 #define TDB_HTRIE_RECLEN(h, r)	TDB_HTRIE_RALIGN(sizeof(*(r)) + __RECLEN(h, r))
-#define TDB_HTRIE_BUCKET_1ST(b)	((void *)((b) + 1))
-#define TDB_HTRIE_BUCKET_KEY(b)	(*(unsigned long *)TDB_HTRIE_BUCKET_1ST(b))
+#define TDB_HTRIE_BUCKET_1ST(h, b)					\
+	((void *)((char *)(b) + TDB_HTRIE_BCKT_HDR(h)))
+#define TDB_HTRIE_BUCKET_KEY(h, b)					\
+	(*(unsigned long *)TDB_HTRIE_BUCKET_1ST(h, b))
+/* Get bucket by the first record in it. */
+#define TDB_HTRIE_REC_BUCKET(h, r)					\
+	((TdbBucket *)((char *)(r) - TDB_HTRIE_BCKT_HDR(h)))
 /* Iterate over buckets in collision chain. */
-#define TDB_HTRIE_BUCKET_NEXT(h, b) ((b)->coll_next			\
-				     ? TDB_PTR(h, TDB_DI2O((b)->coll_next))\
-				     : NULL)				\
+#define TDB_HTRIE_BUCKET_NEXT(h, b)					\
+({									\
+	unsigned int _c = ACCESS_ONCE((b)->coll_next);			\
+	smp_read_barrier_depends();					\
+	_c ? TDB_PTR(h, TDB_DI2O(_c)) : NULL;				\
+})
 
+/**
+ * Allocation cursors of a CPU. Each CPU allocates index and data from
+ * its own blocks, so writers on different CPUs don't contend on the cursors
+ * and don't share cache lines of their new records.
+ *
+ * The cursors also keep the CPU statistics counters, so the counters don't
+ * need atomic operations or separate cache lines. The counters are
+ * approximate since writers can migrate to other CPUs.
+ *
+ * @i_wcl	- index block next to write (byte offset);
+ * @d_wcl	- data block next to write (byte offset);
+ * @bursts	- number of burst buckets;
+ * @alloc_errs	- number of failed index and data allocations;
+ * @l_seq	- current segment of SEQLOG table, zero if there is no one;
+ */
+typedef struct {
+	unsigned long	i_wcl;
+	unsigned long	d_wcl;
+	unsigned long	bursts;
+	unsigned long	alloc_errs;
+	unsigned long	l_seq;
+	unsigned char	_padding[L1_CACHE_BYTES - sizeof(long) * 5];
+} __attribute__((packed)) TdbCursor;
+
+/*
+ * Maximum number of cursors in the file header. CPUs with larger ids share
+ * cursors, which is still correct since the cursors are moved by CAS.
+ */
+#define TDB_CURS_N		64
+
+/* Bitmap of extents without free blocks. */
+#define TDB_EXT_FULL(h)		((h)->ext_bmp + TDB_EXT_BMP_2L(h))
+/* Bitmap of cold (not locked in memory) extents, see tiered storage. */
+#define TDB_EXT_COLD(h)		((h)->ext_bmp + TDB_EXT_BMP_2L(h) * 2)
+#define TDB_CURS(h)							\
+	((TdbCursor *)((char *)(h)					\
+		       + TDB_HTRIE_IALIGN(sizeof(TdbHdr)		\
+					  + TDB_EXT_BMP_2L(h) * 3	\
+					    * sizeof(long))))
 #define TDB_HDR_SZ(h)							\
-	(sizeof(TdbHdr) + TDB_EXT_BMP_2L(h) * sizeof(long))
+	((char *)(TDB_CURS(h) + TDB_CURS_N) - (char *)(h))
 #define TDB_HTRIE_ROOT(h)						\
 	(TdbHtrieNode *)((char *)(h) + TDB_HDR_SZ(h) + sizeof(TdbExt))
 
+/**
+ * @return allocation cursors of current CPU. Writers can migrate to
+ * other CPUs, so the cursors are still updated by CAS.
+ */
+static inline TdbCursor *
+tdb_cursor(TdbHdr *dbh)
+{
+	return TDB_CURS(dbh) + raw_smp_processor_id() % TDB_CURS_N;
+}
+
+/* Variable-length records are placed sequentially, zero length ends them. */
+#define __RECEND(r)							\
+	__builtin_choose_expr(__builtin_types_compatible_p(typeof(*(r)),\
+							   TdbVRec),	\
+			      !ACCESS_ONCE(((TdbVRec *)r)->len), 0)
+
 /**
  * Iterate over all records in collision chain.
  * Buckets are inspected according to following rules:
  * - if first record is > TDB_HTRIE_MINDREC, then only it is observer;
- * - all records which fit TDB_HTRIE_MINDREC.
+ * - all records which fit TDB_HTRIE_MINDREC;
+ * - variable-length records are inspected until the first empty one,
+ *   so readers never step into a record which is being written right now.
  *
  * @d	- database handler;
  * @b	- bucket to iterate over;
@@ -107,14 +220,13 @@ typedef struct {
  */
 #define TDB_HTRIE_FOREACH_REC(d, b, r)					\
 	for ( ; b; b = TDB_HTRIE_BUCKET_NEXT(d, b))			\
-		for (r = TDB_HTRIE_BUCKET_1ST(b);			\
-		     ({ long _n = (char *)r - (char *)b + sizeof(*r);	\
-		        /* Crash if small records exceed small block	\
-			 * boundary. */					\
-			BUG_ON(_n < TDB_HTRIE_MINDREC			\
-			       && r != TDB_HTRIE_BUCKET_1ST(b)		\
-			       && _n + __RECLEN(d, r) > TDB_HTRIE_MINDREC);\
-			_n <= TDB_HTRIE_MINDREC; });			\
+		for (r = TDB_HTRIE_BUCKET_1ST(d, b);			\
+		     ({ long _o = (char *)r - (char *)b;		\
+			(r == TDB_HTRIE_BUCKET_1ST(d, b)		\
+			 || (_o + sizeof(*r) <= TDB_HTRIE_MINDREC	\
+			     && _o + TDB_HTRIE_RECLEN(d, r)		\
+				<= TDB_HTRIE_MINDREC))			\
+			&& !__RECEND(r); });				\
 		     r = (typeof(r))((char *)r + TDB_HTRIE_RECLEN(d, r)))
 
 static inline int
@@ -125,20 +237,103 @@ tdb_live_fsrec(TdbHdr *dbh, TdbFRec *rec)
 		     / sizeof(long);
 
 	for (i = 0; i < len; ++i)
-		res = !!((unsigned long *)rec)[i];
+		res |= !!((unsigned long *)rec)[i];
 	return res;
 }
 
+/**
+ * Key fingerprint of fixed-size record. The index resolves keys from
+ * the least significant bits, so records of a bucket have the same lower
+ * bits and differ in the upper ones. The most significant bits choose
+ * the table shard and are the same for all the shard records, so they're
+ * skipped.
+ */
+static inline unsigned char
+tdb_htrie_fp(unsigned long key)
+{
+	return key >> (BITS_PER_LONG - 16);
+}
+
+/**
+ * Compare all the fingerprints of a bucket @fps with @fp at once (SWAR).
+ * @return word with the most significant bit set in each matching byte.
+ */
+static inline unsigned long
+tdb_htrie_fp_match(unsigned long fps, unsigned char fp)
+{
+	const unsigned long lo7 = 0x7f7f7f7f7f7f7f7fUL;
+	unsigned long x = fps ^ (0x0101010101010101UL * fp);
+
+	/* Exact zero bytes check: carries don't cross the bytes. */
+	return ~(((x & lo7) + lo7) | x | lo7);
+}
+
 static inline int
 tdb_live_vsrec(TdbVRec *rec)
 {
 	return rec->len && !(rec->len & TDB_HTRIE_VRFREED);
 }
 
+/**
+ * Set the record access bit for the replacement algorithm.
+ * Don't write the cache line if the bit is already set.
+ */
+static inline void
+tdb_htrie_touch_rec(TdbVRec *rec)
+{
+	unsigned int l = ACCESS_ONCE(rec->len);
+
+	if (!(l & TDB_HTRIE_VRACCESS))
+		cmpxchg(&rec->len, l, l | TDB_HTRIE_VRACCESS);
+}
+
 TdbVRec *tdb_htrie_extend_rec(TdbHdr *dbh, TdbVRec *rec, size_t size);
 TdbRec *tdb_htrie_insert(TdbHdr *dbh, unsigned long key, void *data,
 			 size_t *len);
+TdbRec *tdb_htrie_alloc_rec(TdbHdr *dbh, unsigned long key, size_t *len);
+int tdb_htrie_publish_rec(TdbHdr *dbh, TdbRec *rec);
+TdbRec *tdb_htrie_get_rec(TdbHdr *dbh, unsigned long key);
+void tdb_htrie_put_rec(TdbHdr *dbh, TdbRec *rec);
+void tdb_htrie_free_rec(TdbHdr *dbh, TdbRec *rec);
+int tdb_htrie_remove_rec(TdbHdr *dbh, TdbRec *rec);
 TdbBucket *tdb_htrie_lookup(TdbHdr *dbh, unsigned long key);
+void tdb_htrie_lookup_many(TdbHdr *dbh, unsigned long *keys, int n,
+			   TdbBucket **b);
+TdbRec *tdb_htrie_bscan_for_rec(TdbHdr *dbh, TdbBucket *b,
+				unsigned long key);
+size_t tdb_htrie_evict(TdbHdr *dbh, unsigned int *hand, size_t need);
+size_t tdb_htrie_free_blks(TdbHdr *dbh);
+void tdb_htrie_stat(TdbHdr *dbh, TdbHtrieStat *st);
+void tdb_htrie_stat_start(TdbHdr *dbh, TdbHtrieStat *st);
+void tdb_htrie_stat_exts(TdbHdr *dbh, TdbHtrieStat *st, unsigned long from,
+			 unsigned long to);
+void tdb_htrie_stat_slot(TdbHdr *dbh, int i, TdbHtrieStat *st);
+unsigned long tdb_htrie_bckt_cold(TdbHdr *dbh, TdbBucket *b);
+int tdb_htrie_ext_pinned(TdbHdr *dbh, unsigned long e);
+void tdb_htrie_ext_set_cold(TdbHdr *dbh, unsigned long e, int cold);
+int tdb_htrie_ext_cold(TdbHdr *dbh, unsigned long e);
+unsigned int tdb_htrie_ext_free_blks(TdbHdr *dbh, unsigned long e);
+int tdb_htrie_set_expires(TdbHdr *dbh, TdbRec *rec, unsigned int expires,
+			  unsigned long now);
+unsigned long tdb_htrie_tw_advance(TdbHdr *dbh, unsigned long now);
+unsigned int tdb_htrie_tw_detach(TdbHdr *dbh, unsigned long from,
+				 unsigned long to);
+unsigned int tdb_htrie_tw_detach_all(TdbHdr *dbh, unsigned long tw_off);
+int tdb_htrie_tw_move(TdbHdr *dbh, unsigned long *old);
+unsigned int tdb_htrie_tw_expire(TdbHdr *dbh, unsigned int blk,
+				 unsigned long now, size_t *freed);
+size_t tdb_htrie_gc_bmp_sz(TdbHdr *dbh);
+void tdb_htrie_gc_snapshot(TdbHdr *dbh, unsigned long *bmp);
+void tdb_htrie_gc_mark(TdbHdr *dbh, unsigned long *bmp);
+size_t tdb_htrie_gc_sweep(TdbHdr *dbh, unsigned long *bmp);
+void tdb_htrie_grow(TdbHdr *dbh, unsigned long size);
+int tdb_htrie_shrink_start(TdbHdr *dbh, unsigned long size);
+unsigned long tdb_htrie_evacuate(TdbHdr *dbh);
+void tdb_htrie_shrink_finish(TdbHdr *dbh, unsigned long old);
+void tdb_htrie_recover_start(TdbHdr *dbh, unsigned long *bmp);
+void tdb_htrie_recover_slot(TdbHdr *dbh, int i, unsigned long *bmp);
+void tdb_htrie_recover_exts(TdbHdr *dbh, unsigned long *bmp,
+			    unsigned long from, unsigned long to);
 TdbHdr *tdb_htrie_init(void *p, size_t db_size, unsigned int rec_len);
 
 #endif /* __HTRIE_H__ */
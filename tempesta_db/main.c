@@ -19,11 +19,21 @@
  * this program; if not, write to the Free Software Foundation, Inc., 59
  * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
+#include <linux/log2.h>
+#include <linux/mmu_context.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
 #include <linux/slab.h>
+#include <linux/time.h>
+#include <linux/topology.h>
+#include <linux/vmalloc.h>
 
 #include "file.h"
+#include "gc.h"
 #include "htrie.h"
+#include "seqlog.h"
 #include "work.h"
 
 MODULE_AUTHOR("NatSys Lab. (http://natsys-lab.com)");
@@ -33,14 +43,97 @@ MODULE_LICENSE("GPL");
 
 static struct workqueue_struct *tdb_wq;
 static struct kmem_cache *tw_cache;
+static struct kmem_cache *fw_cache;
+/* All opened tables. */
+static LIST_HEAD(tdb_tbls);
+static DEFINE_MUTEX(tdb_tbls_mtx);
+
+static void
+tdb_queue_work(TDB *db, struct work_struct *work)
+{
+	if (db->node == NUMA_NO_NODE)
+		queue_work(tdb_wq, work);
+	else
+		queue_work_on(cpumask_first(cpumask_of_node(db->node)), tdb_wq,
+			      work);
+}
+
+/**
+ * @return true if table @db can have cold extents: it's tiered or its file
+ * is still populated in background, see tdb_prefault().
+ */
+static inline int
+tdb_has_cold(TDB *db)
+{
+	return db->hot_sz || atomic_read(&db->pf_n);
+}
+
+/**
+ * Tiered storage: @return true if all the blocks of bucket @b are resident
+ * and mark the bucket extent as recently used. Must be called in RCU BH
+ * read-side critical section, which also protects the bucket access.
+ */
+static int
+tdb_bckt_resident(TDB *db, TdbBucket *b)
+{
+	unsigned long e;
+
+	if (!tdb_has_cold(db))
+		return 1;
+	if (tdb_htrie_bckt_cold(db->hdr, b))
+		return 0;
+	if (!db->hot_sz)
+		return 1;
+
+	e = TDB_EXT_ID(TDB_HTRIE_OFF(db->hdr, b));
+	if (!test_bit(e, db->ref_bmp))
+		set_bit(e, db->ref_bmp);
+
+	return 1;
+}
+
+/**
+ * Writers modify existing buckets, so they fail on cold buckets and fault
+ * them in for following writes.
+ */
+static int
+tdb_wr_resident(TDB *db, unsigned long key)
+{
+	TdbBucket *b;
+
+	if (!tdb_has_cold(db))
+		return 1;
+
+	b = tdb_htrie_lookup(db->hdr, key);
+	if (!b || tdb_bckt_resident(db, b))
+		return 1;
+
+	tdb_fault_in(db, key, NULL, NULL);
+	return 0;
+}
 
 TdbRec *
 tdb_entry_create(TDB *db, unsigned long key, void *data, size_t *len)
 {
-	TdbRec *r = tdb_htrie_insert(db->hdr, key, data, len);
-	if (!r)
+	TdbRec *r;
+
+	db = tdb_shard(db, key);
+	rcu_read_lock_bh();
+	if (!tdb_wr_resident(db, key)) {
+		rcu_read_unlock_bh();
+		this_cpu_inc(db->stat->errors);
+		return NULL;
+	}
+	r = tdb_htrie_insert(db->hdr, key, data, len);
+	rcu_read_unlock_bh();
+	if (r) {
+		this_cpu_inc(db->stat->inserts);
+	} else {
+		this_cpu_inc(db->stat->errors);
 		TDB_ERR("Cannot create cache entry for %.*s\n",
 			(int)*len, (char *)data);
+		tdb_gc_wakeup();
+	}
 
 	return r;
 }
@@ -55,77 +148,872 @@ EXPORT_SYMBOL(tdb_entry_create);
 TdbVRec *
 tdb_entry_add(TDB *db, TdbVRec *r, size_t size)
 {
-	return tdb_htrie_extend_rec(db->hdr, r, size);
+	TdbVRec *c;
+
+	db = tdb_shard(db, r->key);
+	rcu_read_lock_bh();
+	c = tdb_htrie_extend_rec(db->hdr, r, size);
+	rcu_read_unlock_bh();
+	if (!c)
+		tdb_gc_wakeup();
+
+	return c;
 }
 EXPORT_SYMBOL(tdb_entry_add);
 
+/**
+ * Allocate a new record of @len bytes which is invisible for readers until
+ * tdb_entry_publish() is called for it. Use the function to write large
+ * (probably chunked by tdb_entry_add()) records which must be seen by
+ * concurrent readers either complete or not at all.
+ *
+ * @len returns number of bytes available in the first record chunk.
+ *
+ * Garbage collector must not free blocks of the record while it's not
+ * linked with the tree, so the record is written in one RCU BH read-side
+ * critical section, which is closed by tdb_entry_publish() or
+ * tdb_entry_free(). That is, the caller can't sleep while it writes
+ * the record.
+ */
+TdbRec *
+tdb_entry_alloc(TDB *db, unsigned long key, size_t *len)
+{
+	TdbRec *r;
+
+	db = tdb_shard(db, key);
+	if (!db->hdr)
+		return NULL;
+
+	rcu_read_lock_bh();
+	r = tdb_wr_resident(db, key) ? tdb_htrie_alloc_rec(db->hdr, key, len)
+				     : NULL;
+	if (!r) {
+		rcu_read_unlock_bh();
+		this_cpu_inc(db->stat->errors);
+		tdb_gc_wakeup();
+	}
+
+	return r;
+}
+EXPORT_SYMBOL(tdb_entry_alloc);
+
+int
+tdb_entry_publish(TDB *db, TdbRec *r)
+{
+	int ret;
+
+	db = tdb_shard(db, r->key);
+	ret = tdb_htrie_publish_rec(db->hdr, r);
+
+	if (ret) {
+		this_cpu_inc(db->stat->errors);
+		rcu_read_unlock_bh();
+		tdb_gc_wakeup();
+	} else {
+		this_cpu_inc(db->stat->inserts);
+		rcu_read_unlock_bh();
+	}
+
+	return ret;
+}
+EXPORT_SYMBOL(tdb_entry_publish);
+
+/**
+ * Free not published record allocated by tdb_entry_alloc().
+ */
+void
+tdb_entry_free(TDB *db, TdbRec *r)
+{
+	db = tdb_shard(db, r->key);
+	tdb_htrie_free_rec(db->hdr, r);
+	rcu_read_unlock_bh();
+}
+EXPORT_SYMBOL(tdb_entry_free);
+
+/**
+ * Remove published variable-length record @r, e.g. replaced by a newer
+ * record with the same key. The caller must run in softirq or RCU BH
+ * read-side critical section, see tdb_lookup().
+ */
+void
+tdb_entry_remove(TDB *db, TdbRec *r)
+{
+	db = tdb_shard(db, r->key);
+	tdb_htrie_remove_rec(db->hdr, r);
+}
+EXPORT_SYMBOL(tdb_entry_remove);
+
+/**
+ * Set lifetime @ttl (in seconds) of the record @r. The record is freed by
+ * the garbage collector within TDB_GC_INTERVAL seconds after it expires.
+ *
+ * Burst moves records, so the record must be either allocated by
+ * tdb_entry_alloc() and not published yet or pinned by
+ * tdb_rec_get_or_create(). Records returned by tdb_entry_create() can
+ * be moved concurrently, so the lifetime may be lost for them.
+ */
+int
+tdb_entry_set_ttl(TDB *db, TdbRec *r, unsigned int ttl)
+{
+	unsigned long now = get_seconds();
+	int ret;
+
+	db = tdb_shard(db, r->key);
+	ret = tdb_htrie_set_expires(db->hdr, r, now + ttl, now);
+	if (ret)
+		tdb_gc_wakeup();
+
+	return ret;
+}
+EXPORT_SYMBOL(tdb_entry_set_ttl);
+
+/**
+ * Lookup the first record with @key.
+ * The function is lock-free and can be called concurrently with database
+ * updates. The caller must run in softirq or RCU BH read-side critical
+ * section while it uses the record.
+ */
 void *
 tdb_lookup(TDB *db, unsigned long key)
 {
-	TdbFRec *r;
+	TdbRec *r;
 	TdbBucket *b;
 
+	db = tdb_shard(db, key);
 	/* @db can be uninitialized, see tdb_open(). */
 	if (!db->hdr)
 		return NULL;
-	BUG_ON(!TDB_HTRIE_VARLENRECS(db->hdr));
+
+	this_cpu_inc(db->stat->lookups);
 
 	b = tdb_htrie_lookup(db->hdr, key);
-	if (!b)
+	if (!b || !tdb_bckt_resident(db, b))
 		return NULL;
 
-	TDB_HTRIE_FOREACH_REC(db->hdr, b, r)
-		if (tdb_live_fsrec(db->hdr, r))
-			return r;
+	r = tdb_htrie_bscan_for_rec(db->hdr, b, key);
+	if (!r)
+		return NULL;
+	this_cpu_inc(db->stat->hits);
+	if (TDB_HTRIE_VARLENRECS(db->hdr))
+		tdb_htrie_touch_rec((TdbVRec *)r);
 
-	return NULL;
+	return r;
 }
 EXPORT_SYMBOL(tdb_lookup);
 
+static void
+__tdb_lookup_many(TDB *db, unsigned long *keys, int n, void **recs)
+{
+	int i, j, batch, hits = 0;
+	TdbRec *r;
+	TdbBucket *b[TDB_LOOKUP_BATCH];
+
+	if (!db->hdr) {
+		memset(recs, 0, sizeof(*recs) * n);
+		return;
+	}
+
+	for (i = 0; i < n; i += batch) {
+		batch = min(n - i, TDB_LOOKUP_BATCH);
+
+		tdb_htrie_lookup_many(db->hdr, keys + i, batch, b);
+
+		for (j = 0; j < batch; ++j) {
+			r = b[j] && tdb_bckt_resident(db, b[j])
+			    ? tdb_htrie_bscan_for_rec(db->hdr, b[j], keys[i + j])
+			    : NULL;
+			if (r && TDB_HTRIE_VARLENRECS(db->hdr))
+				tdb_htrie_touch_rec((TdbVRec *)r);
+			hits += !!r;
+			recs[i + j] = r;
+		}
+	}
+
+	this_cpu_add(db->stat->lookups, n);
+	this_cpu_add(db->stat->hits, hits);
+}
+
+/**
+ * Lookup @n keys from @keys and store the first found record for each key
+ * in @recs (or NULL if there is no record for the key). The keys are
+ * descended through the index by batches of TDB_LOOKUP_BATCH keys with
+ * interleaved prefetching, so this is faster than @n tdb_lookup() calls
+ * on large databases. The same context rules as for tdb_lookup() apply.
+ *
+ * Keys of a shard set are grouped by their shards, so each batch descends
+ * one index.
+ */
+void
+tdb_lookup_many(TDB *db, unsigned long *keys, int n, void **recs)
+{
+	int i, j, k, m, batch;
+	unsigned int done;
+	unsigned long k_sh[TDB_LOOKUP_BATCH];
+	void *r_sh[TDB_LOOKUP_BATCH];
+	int idx[TDB_LOOKUP_BATCH];
+	TDB *sh;
+
+	if (!db->shards) {
+		__tdb_lookup_many(db, keys, n, recs);
+		return;
+	}
+
+	for (i = 0; i < n; i += batch) {
+		batch = min(n - i, TDB_LOOKUP_BATCH);
+		for (done = 0, j = 0; j < batch; ++j) {
+			if (done & (1 << j))
+				continue;
+			sh = tdb_shard(db, keys[i + j]);
+			for (m = 0, k = j; k < batch; ++k)
+				if (!(done & (1 << k))
+				    && tdb_shard(db, keys[i + k]) == sh)
+				{
+					done |= 1 << k;
+					idx[m] = i + k;
+					k_sh[m++] = keys[i + k];
+				}
+			__tdb_lookup_many(sh, k_sh, m, r_sh);
+			for (k = 0; k < m; ++k)
+				recs[idx[k]] = r_sh[k];
+		}
+	}
+}
+EXPORT_SYMBOL(tdb_lookup_many);
+
+/**
+ * Tiered storage: @return true if records with @key are resident or there
+ * are no such records, so tdb_lookup() finds them.
+ */
+int
+tdb_resident(TDB *db, unsigned long key)
+{
+	int r = 1;
+	TdbBucket *b;
+
+	db = tdb_shard(db, key);
+	if (!db->hdr || !tdb_has_cold(db))
+		return 1;
+
+	rcu_read_lock_bh();
+	b = tdb_htrie_lookup(db->hdr, key);
+	if (b)
+		r = tdb_bckt_resident(db, b);
+	rcu_read_unlock_bh();
+
+	return r;
+}
+EXPORT_SYMBOL(tdb_resident);
+
+/**
+ * Make extents with records for the key resident one by one.
+ * The memory manager doesn't unlock recently used extents,
+ * so the loop ends quickly.
+ */
+static void
+tdb_fault_in_work(struct work_struct *work)
+{
+	TdbFaultWork *fw = (TdbFaultWork *)work;
+	TDB *db = fw->db;
+	TdbBucket *b;
+	unsigned long e;
+
+	while (1) {
+		rcu_read_lock_bh();
+		b = tdb_htrie_lookup(db->hdr, fw->key);
+		e = b ? tdb_htrie_bckt_cold(db->hdr, b) : 0;
+		rcu_read_unlock_bh();
+		if (!e || tdb_gc_promote(db, e - 1))
+			break;
+	}
+
+	if (fw->fn)
+		fw->fn(fw->arg);
+	kmem_cache_free(fw_cache, fw);
+}
+
+/**
+ * Fault in records with @key from disk, so they become visible for lookups.
+ * @fn is called with @arg from process context when the records are
+ * resident. Can be called from softirq.
+ *
+ * @return 0 if the fault in is scheduled.
+ */
+int
+tdb_fault_in(TDB *db, unsigned long key, void (*fn)(void *arg), void *arg)
+{
+	TdbFaultWork *fw;
+
+	db = tdb_shard(db, key);
+	fw = kmem_cache_alloc(fw_cache, GFP_ATOMIC);
+	if (!fw)
+		return -ENOMEM;
+	INIT_WORK(&fw->work, tdb_fault_in_work);
+	fw->db = db;
+	fw->key = key;
+	fw->fn = fn;
+	fw->arg = arg;
+
+	tdb_queue_work(db, &fw->work);
+
+	return 0;
+}
+EXPORT_SYMBOL(tdb_fault_in);
+
+/**
+ * Get fixed-size record with @key or create a new one with zeroed data.
+ * There is at most one record for a key, so fixed-size tables can keep
+ * mutable per-key state, e.g. counters, which is updated in place.
+ * Such tables must not be written by tdb_entry_create().
+ *
+ * Memory ordering contract:
+ * - the record doesn't move until tdb_rec_put(), so the pointer is stable
+ *   in between. The caller is in RCU BH read-side critical section, so it
+ *   must not sleep. It also must not write to the table or get one more
+ *   record from it before tdb_rec_put();
+ * - many callers can hold the same record at once, so the data must be
+ *   updated by atomic operations or under a lock kept in the data;
+ * - the function has acquire semantics and tdb_rec_put() has release
+ *   semantics, so all the updates made by a caller before tdb_rec_put()
+ *   are visible to each next caller for the same key;
+ * - tdb_lookup() readers can see the record while it's updated, so only
+ *   aligned machine words of the data are read consistently by them.
+ */
+TdbRec *
+tdb_rec_get_or_create(TDB *db, unsigned long key)
+{
+	TdbRec *r;
+
+	db = tdb_shard(db, key);
+	if (!db->hdr)
+		return NULL;
+
+	rcu_read_lock_bh();
+	r = tdb_wr_resident(db, key) ? tdb_htrie_get_rec(db->hdr, key) : NULL;
+	if (!r) {
+		rcu_read_unlock_bh();
+		this_cpu_inc(db->stat->errors);
+		tdb_gc_wakeup();
+	}
+
+	return r;
+}
+EXPORT_SYMBOL(tdb_rec_get_or_create);
+
+void
+tdb_rec_put(TDB *db, TdbRec *r)
+{
+	db = tdb_shard(db, r->key);
+	tdb_htrie_put_rec(db->hdr, r);
+	rcu_read_unlock_bh();
+}
+EXPORT_SYMBOL(tdb_rec_put);
+
+/**
+ * Call @fn for data of the record with @key, the record is created if it
+ * doesn't exist. @fn runs with the rules of tdb_rec_get_or_create().
+ *
+ * @return result of @fn or -ENOMEM if the record can't be created.
+ */
+int
+tdb_rec_update(TDB *db, unsigned long key, int (*fn)(void *data, void *arg),
+	       void *arg)
+{
+	int r;
+	TdbRec *rec;
+
+	if (!(rec = tdb_rec_get_or_create(db, key)))
+		return -ENOMEM;
+	r = fn(rec->data, arg);
+	tdb_rec_put(db, rec);
+
+	return r;
+}
+EXPORT_SYMBOL(tdb_rec_update);
+
+/**
+ * Append record with data @data of @len bytes to SEQLOG table @db.
+ * The record gets current time as its timestamp.
+ */
+int
+tdb_log_append(TDB *db, const void *data, size_t len)
+{
+	int r = tdb_seqlog_append(db->hdr, data, len, get_seconds());
+
+	if (r)
+		this_cpu_inc(db->stat->errors);
+	else
+		this_cpu_inc(db->stat->inserts);
+
+	return r;
+}
+EXPORT_SYMBOL(tdb_log_append);
+
+/**
+ * Read the record at position @pos of SEQLOG table @db to @buf and advance
+ * the position, see tdb_seqlog_read(). The reader can sleep between calls.
+ */
+long
+tdb_log_read(TDB *db, TdbLogPos *pos, void *buf, size_t size)
+{
+	return tdb_seqlog_read(db->hdr, pos, buf, size);
+}
+EXPORT_SYMBOL(tdb_log_read);
+
+/**
+ * Queue work @work on @i'th CPU of the database node, so works of one
+ * database run in parallel.
+ */
+static void
+tdb_queue_work_on(TDB *db, struct work_struct *work, int i)
+{
+	int cpu;
+	const struct cpumask *mask = db->node == NUMA_NO_NODE
+				     ? cpu_online_mask
+				     : cpumask_of_node(db->node);
+
+	i %= cpumask_weight(mask);
+	for (cpu = cpumask_first(mask); i; --i)
+		cpu = cpumask_next(cpu, mask);
+
+	queue_work_on(cpu, tdb_wq, work);
+}
+
+static void
+tdb_recover_slot(struct work_struct *work)
+{
+	TdbRecoverWork *rw = (TdbRecoverWork *)work;
+
+	/* Cold pages of tiered tables are faulted in. */
+	use_mm(&init_mm);
+	tdb_htrie_recover_slot(rw->hdr, rw->from, rw->bmp);
+	unuse_mm(&init_mm);
+}
+
+static void
+tdb_recover_exts(struct work_struct *work)
+{
+	TdbRecoverWork *rw = (TdbRecoverWork *)work;
+
+	use_mm(&init_mm);
+	tdb_htrie_recover_exts(rw->hdr, rw->bmp, rw->from, rw->to);
+	unuse_mm(&init_mm);
+}
+
+/**
+ * Recover file @hdr of table @db after a crash. The index subtrees and
+ * then the extents are processed in parallel on the node CPUs.
+ */
+static int
+tdb_recover(TDB *db, TdbHdr *hdr)
+{
+	int i;
+	unsigned long *bmp, n = hdr->dbsz / TDB_EXT_SZ;
+	TdbRecoverWork *rw;
+
+	TDB_ERR("%s wasn't closed cleanly, recover it (the last checkpoint"
+		" was %lu seconds ago)\n", db->path,
+		get_seconds() - hdr->ckpt);
+
+	bmp = vmalloc(tdb_htrie_gc_bmp_sz(hdr));
+	if (!bmp)
+		return -ENOMEM;
+	rw = kmalloc(sizeof(*rw) * TDB_HTRIE_FANOUT, GFP_KERNEL);
+	if (!rw) {
+		vfree(bmp);
+		return -ENOMEM;
+	}
+
+	tdb_htrie_recover_start(hdr, bmp);
+
+	for (i = 0; i < TDB_HTRIE_FANOUT; ++i) {
+		INIT_WORK(&rw[i].work, tdb_recover_slot);
+		rw[i].hdr = hdr;
+		rw[i].bmp = bmp;
+		rw[i].from = i;
+		tdb_queue_work_on(db, &rw[i].work, i);
+	}
+	for (i = 0; i < TDB_HTRIE_FANOUT; ++i)
+		flush_work(&rw[i].work);
+
+	/* All the reachable blocks are marked, rebuild the extents. */
+	for (i = 0; i < TDB_HTRIE_FANOUT; ++i) {
+		INIT_WORK(&rw[i].work, tdb_recover_exts);
+		rw[i].from = n * i / TDB_HTRIE_FANOUT;
+		rw[i].to = n * (i + 1) / TDB_HTRIE_FANOUT;
+		tdb_queue_work_on(db, &rw[i].work, i);
+	}
+	for (i = 0; i < TDB_HTRIE_FANOUT; ++i)
+		flush_work(&rw[i].work);
+
+	kfree(rw);
+	vfree(bmp);
+
+	TDB_DBG("%s is recovered, %lu free blocks\n", db->path,
+		tdb_htrie_free_blks(hdr));
+
+	return 0;
+}
+
+/**
+ * Populate extents of the work range which are cold (if the work populates
+ * the file in background) or resident (if the table waits for them).
+ */
+static void
+tdb_prefault_exts(struct work_struct *work)
+{
+	TdbPrefaultWork *pw = (TdbPrefaultWork *)work;
+	TDB *db = pw->db;
+	unsigned long e;
+	int r;
+
+	for (e = pw->from; e < ACCESS_ONCE(pw->to); ++e) {
+		if (tdb_htrie_ext_cold(pw->hdr, e) != pw->cold)
+			continue;
+		r = tdb_file_populate(pw->hdr, e);
+		if (r) {
+			/* Readers fault in cold extents on demand. */
+			TDB_ERR("Cannot populate extent %lu of %s, %d\n", e,
+				db->path, r);
+			pw->r = r;
+			continue;
+		}
+		if (pw->cold) {
+			/* The extent is populated, so readers can access it. */
+			smp_wmb();
+			tdb_htrie_ext_set_cold(pw->hdr, e, 0);
+		}
+		cond_resched();
+	}
+
+	if (pw->cold && atomic_dec_and_test(&db->pf_n))
+		TDB_DBG("%s is populated\n", db->path);
+}
+
+/**
+ * Populate file @hdr of table @db, which is locked in memory, on all the
+ * node CPUs in parallel. Only the index and the extents used by writers
+ * are populated before the table becomes available. Other extents are
+ * marked as cold and populated in background, so lookups of their records
+ * fail until the records are faulted in by tdb_fault_in() like in tiered
+ * mode. Prefaulting of large files takes minutes, so the cache is usable
+ * during the time.
+ */
+static int
+tdb_prefault(TDB *db, TdbHdr *hdr)
+{
+	int i, nw, r = 0;
+	unsigned long e, cold = 0, n = hdr->dbsz / TDB_EXT_SZ;
+	TdbPrefaultWork *pw;
+
+	nw = db->node == NUMA_NO_NODE
+	     ? num_online_cpus()
+	     : cpumask_weight(cpumask_of_node(db->node));
+	nw = min_t(unsigned long, nw, n);
+	pw = kzalloc(sizeof(*pw) * nw, GFP_KERNEL);
+	if (!pw)
+		return -ENOMEM;
+
+	for (e = 0; e < n; ++e)
+		if (!tdb_gc_spare(hdr, e) && !tdb_htrie_ext_pinned(hdr, e)) {
+			tdb_htrie_ext_set_cold(hdr, e, 1);
+			++cold;
+		}
+
+	for (i = 0; i < nw; ++i) {
+		INIT_WORK(&pw[i].work, tdb_prefault_exts);
+		pw[i].db = db;
+		pw[i].hdr = hdr;
+		pw[i].from = n * i / nw;
+		pw[i].to = n * (i + 1) / nw;
+		tdb_queue_work_on(db, &pw[i].work, i);
+	}
+	for (i = 0; i < nw; ++i) {
+		flush_work(&pw[i].work);
+		if (pw[i].r)
+			r = pw[i].r;
+	}
+	if (r || !cold) {
+		kfree(pw);
+		return r;
+	}
+
+	TDB_DBG("Populate %lu extents of %s in background\n", cold, db->path);
+
+	/* Readers must see the cold extents before the header is published. */
+	atomic_set(&db->pf_n, nw);
+	db->pf = pw;
+	db->pf_nw = nw;
+	for (i = 0; i < nw; ++i) {
+		INIT_WORK(&pw[i].work, tdb_prefault_exts);
+		pw[i].cold = 1;
+		tdb_queue_work_on(db, &pw[i].work, i);
+	}
+
+	return 0;
+}
+
+/**
+ * Stop background prefaulting of table @db and wait for the works.
+ */
+static void
+tdb_prefault_stop(TDB *db)
+{
+	int i;
+
+	if (!db->pf)
+		return;
+
+	for (i = 0; i < db->pf_nw; ++i)
+		ACCESS_ONCE(db->pf[i].to) = db->pf[i].from;
+	for (i = 0; i < db->pf_nw; ++i)
+		flush_work(&db->pf[i].work);
+
+	kfree(db->pf);
+	db->pf = NULL;
+}
+
 /**
  * Work queue wrapper for tdb_file_open() (real file open).
+ * Files which weren't closed cleanly are recovered and the index is
+ * populated before the table header is published for readers and writers.
  */
 static void
 tdb_open_db(struct work_struct *work)
 {
 	TdbWork *tw = (TdbWork *)work;
 	TDB *db = tw->db;
+	TdbHdr *hdr;
 
-	if (tdb_file_open(db, tw->fsize))
+	if (tdb_file_open(db, tw->fsize)) {
 		TDB_ERR("Cannot open db\n");
+		goto out;
+	}
+	hdr = db->hdr;
+	db->hdr = NULL;
 
-	db->hdr = tdb_htrie_init(db->hdr, db->filp->f_inode->i_size, tw->rsize);
-	if (!db->hdr)
+	if (db->flags & TDB_F_SEQLOG)
+		hdr = tdb_seqlog_init(hdr, db->filp->f_inode->i_size);
+	else
+		hdr = tdb_htrie_init(hdr, db->filp->f_inode->i_size,
+				     tw->rsize);
+	if (!hdr) {
 		TDB_ERR("Cannot initialize db header\n");
+		goto out;
+	}
 
+	if (!(db->flags & TDB_F_SEQLOG)) {
+		if (!(hdr->flags & TDB_F_CLEAN) && tdb_recover(db, hdr)) {
+			TDB_ERR("Cannot recover db %s\n", db->path);
+			goto err_close;
+		}
+		if (!db->hot_sz && tdb_prefault(db, hdr)) {
+			TDB_ERR("Cannot populate db %s\n", db->path);
+			goto err_close;
+		}
+		/* Recover the file if it's not closed by tdb_close_clean(). */
+		hdr->flags &= ~TDB_F_CLEAN;
+		tdb_file_sync(db, 0, PAGE_SIZE);
+	}
+
+	/* The header must be initialized before readers see it. */
+	smp_wmb();
+	db->hdr = hdr;
+
+	if (tdb_gc_register(db))
+		TDB_ERR("Cannot register db for garbage collection\n");
+	goto out;
+err_close:
+	db->hdr = hdr;
+	tdb_file_close(db);
+out:
 	kmem_cache_free(tw_cache, tw);
 }
 
+static TDB *
+__tdb_get_tbl(const char *name, int node)
+{
+	TDB *db;
+
+	list_for_each_entry(db, &tdb_tbls, tbl_list)
+		if (db->node == node && !strcmp(db->name, name))
+			return db;
+
+	return NULL;
+}
+
 /**
- * Open database file and @return its descriptor.
- *
- * The function must not be called from softirq!
+ * Allocate descriptor of table (or shard) @shard and the work opening
+ * its file. The file isn't opened until the work is queued.
  */
-TDB *
-tdb_open(const char *path, unsigned int fsize, unsigned int rec_size)
+static TDB *
+tdb_alloc_tbl(const char *path, const char *name, unsigned long fsize,
+	      unsigned long hot_size, unsigned int rec_size, int node,
+	      unsigned int flags, int shard, TdbWork **tw)
 {
 	TDB *db;
-	TdbWork *tw;
 
 	db = kzalloc(sizeof(TDB), GFP_KERNEL);
 	if (!db)
 		return NULL;
 	strncpy(db->path, path, TDB_PATH_LEN - 1);
+	strcpy(db->name, name);
+	db->node = node;
+	db->rec_len = rec_size;
+	db->flags = flags;
+	db->shard = shard;
+	if (hot_size && hot_size < fsize)
+		db->hot_sz = max_t(unsigned long, hot_size & TDB_EXT_MASK,
+				   TDB_EXT_SZ);
+	INIT_LIST_HEAD(&db->list);
+	INIT_LIST_HEAD(&db->tbl_list);
+
+	db->stat = alloc_percpu(TdbStat);
+	if (!db->stat)
+		goto err_stat;
 
-	tw = kmem_cache_alloc(tw_cache, GFP_KERNEL);
-	if (!tw)
+	*tw = kmem_cache_alloc(tw_cache, GFP_KERNEL);
+	if (!*tw)
 		goto err_cache;
-	INIT_WORK(&tw->work, tdb_open_db);
-	tw->db = db;
-	tw->fsize = fsize;
-	tw->rsize = rec_size;
+	INIT_WORK(&(*tw)->work, tdb_open_db);
+	(*tw)->db = db;
+	(*tw)->fsize = fsize;
+	(*tw)->rsize = rec_size;
+
+	return db;
+err_cache:
+	free_percpu(db->stat);
+err_stat:
+	kfree(db);
+	return NULL;
+}
 
-	queue_work(tdb_wq, (struct work_struct *)tw);
+/**
+ * Write back the table file and mark it as clean, so it isn't recovered
+ * on next opening. Nobody may write to the table at the moment.
+ */
+static void
+tdb_close_clean(TDB *db)
+{
+	if (!db->hdr || (db->flags & TDB_F_SEQLOG))
+		return;
+	if (tdb_file_sync(db, 0, db->hdr->dbsz))
+		return;
+	db->hdr->flags |= TDB_F_CLEAN;
+	tdb_file_sync(db, 0, PAGE_SIZE);
+}
+
+static void
+tdb_free_tbl(TDB *db)
+{
+	int i;
+
+	if (db->shards) {
+		for (i = 0; i < (1 << db->shard_bits); ++i)
+			if (db->shards[i])
+				tdb_free_tbl(db->shards[i]);
+		kfree(db->shards);
+	} else {
+		tdb_prefault_stop(db);
+		tdb_gc_unregister(db);
+		tdb_close_clean(db);
+		/* Unmapping can be done from process context. */
+		tdb_file_close(db);
+		free_percpu(db->stat);
+	}
+	kfree(db);
+}
+
+/**
+ * Allocate set of @n shards of table @name, see tdb_shard().
+ * The set descriptor has no file and is used for routing only.
+ */
+static TDB *
+tdb_alloc_set(const char *path, const char *name, unsigned long fsize,
+	      unsigned long hot_size, unsigned int rec_size, int node,
+	      int n, TdbWork **tw)
+{
+	int i;
+	TDB *db;
+
+	db = kzalloc(sizeof(TDB), GFP_KERNEL);
+	if (!db)
+		return NULL;
+	strncpy(db->path, path, TDB_PATH_LEN - 1);
+	strcpy(db->name, name);
+	db->node = node;
+	db->rec_len = rec_size;
+	db->shard = -1;
+	db->shard_bits = ilog2(n);
+	INIT_LIST_HEAD(&db->list);
+	INIT_LIST_HEAD(&db->tbl_list);
+
+	db->shards = kcalloc(n, sizeof(TDB *), GFP_KERNEL);
+	if (!db->shards)
+		goto err;
+
+	for (i = 0; i < n; ++i) {
+		db->shards[i] = tdb_alloc_tbl(path, name, fsize / n,
+					      hot_size / n, rec_size, node, 0,
+					      i, &tw[i]);
+		if (!db->shards[i])
+			goto err;
+	}
+
+	return db;
+err:
+	while (--i >= 0)
+		kmem_cache_free(tw_cache, tw[i]);
+	tdb_free_tbl(db);
+	return NULL;
+}
+
+static TDB *
+__tdb_open(const char *path, const char *name, unsigned long fsize,
+	   unsigned long hot_size, unsigned int rec_size, int node,
+	   unsigned int flags)
+{
+	int i, n = 1;
+	TDB *db;
+	TdbWork *tw[TDB_SHARDS_MAX];
+
+	/* The database consists of whole extents. */
+	fsize &= TDB_EXT_MASK;
+	if (!fsize) {
+		TDB_ERR("Too small database size\n");
+		return NULL;
+	}
+	if (fsize > TDB_SHARD_MAX) {
+		n = roundup_pow_of_two(DIV_ROUND_UP(fsize, TDB_SHARD_MAX));
+		if (n > TDB_SHARDS_MAX || (flags & TDB_F_SEQLOG)) {
+			TDB_ERR("Too large database size\n");
+			return NULL;
+		}
+	}
+	if (!*name || strlen(name) >= TDB_TBLNAME_LEN || strchr(name, '/')) {
+		TDB_ERR("Bad table name '%s'\n", name);
+		return NULL;
+	}
+
+	mutex_lock(&tdb_tbls_mtx);
+	if (__tdb_get_tbl(name, node)) {
+		mutex_unlock(&tdb_tbls_mtx);
+		TDB_ERR("Table '%s' is already opened\n", name);
+		return NULL;
+	}
+	if (n > 1)
+		db = tdb_alloc_set(path, name, fsize, hot_size, rec_size, node,
+				   n, tw);
+	else
+		db = tdb_alloc_tbl(path, name, fsize, hot_size, rec_size, node,
+				   flags, -1, tw);
+	if (db)
+		list_add_tail(&db->tbl_list, &tdb_tbls);
+	mutex_unlock(&tdb_tbls_mtx);
+	if (!db)
+		return NULL;
+
+	for (i = 0; i < n; ++i)
+		tdb_queue_work(db, (struct work_struct *)tw[i]);
 
 	/*
 	 * FIXME at this point the caller can use the DB descriptor,
@@ -133,35 +1021,295 @@ tdb_open(const char *path, unsigned int fsize, unsigned int rec_size)
 	 * Put conditional wait here.
 	 */
 	return db;
-err_cache:
-	kfree(db);
-	return NULL;
+}
+
+/**
+ * Open table @name and @return its descriptor. The table is stored in
+ * file @path/@name.tdb, so tables under the same directory must have
+ * different names. Each table has its own records length @rec_size
+ * (zero for variable-length records) and file size @fsize.
+ *
+ * If @hot_size isn't zero, then the table works in tiered mode: only index
+ * and @hot_size bytes of recently used data are kept in memory and other
+ * data extents are paged out. Records from cold extents are invisible for
+ * lookups until they're faulted in by tdb_fault_in(). Otherwise the whole
+ * file is locked in memory and populated in background, see tdb_prefault().
+ * The file can be resized later by tdb_resize().
+ *
+ * If @node isn't NUMA_NO_NODE, then the database file is opened and
+ * populated on a CPU of the node, so its memory is allocated at the node,
+ * and the file name is suffixed by the node number. The database should
+ * be accessed from the node CPUs only.
+ *
+ * Tables larger than TDB_SHARD_MAX are split to power of two number of
+ * shards, each with its own index and file suffixed by the shard number.
+ * Records are routed to the shards by the most significant bits of their
+ * keys, see tdb_shard().
+ *
+ * The function must not be called from softirq!
+ */
+TDB *
+tdb_open(const char *path, const char *name, unsigned long fsize,
+	 unsigned long hot_size, unsigned int rec_size, int node)
+{
+	return __tdb_open(path, name, fsize, hot_size, rec_size, node, 0);
 }
 EXPORT_SYMBOL(tdb_open);
 
+/**
+ * Open append-only log @name, see tdb_open() for the arguments.
+ * The log has no index and its records are read in order of appending
+ * by tdb_log_read(). The first extent of the file keeps the header
+ * and other extents keep the log records, so the log file must have
+ * at least two extents.
+ */
+TDB *
+tdb_open_log(const char *path, const char *name, unsigned long fsize,
+	     int node)
+{
+	return __tdb_open(path, name, fsize, 0, 0, node, TDB_F_SEQLOG);
+}
+EXPORT_SYMBOL(tdb_open_log);
+
 void
 tdb_close(TDB *db)
 {
-	/* Unmapping can be done from process context. */
-	tdb_file_close(db);
+	mutex_lock(&tdb_tbls_mtx);
+	list_del(&db->tbl_list);
+	mutex_unlock(&tdb_tbls_mtx);
 
-	kfree(db);
+	tdb_free_tbl(db);
 }
 EXPORT_SYMBOL(tdb_close);
 
+/**
+ * Grow or shrink opened table @db to @fsize bytes. Shards of a set are
+ * resized evenly, so the number of shards doesn't change. A growing table
+ * is extended and populated, see tdb_prefault(), before the new extents
+ * are used. A shrinking table evicts records from the extents beyond the
+ * new file end and returns -EBUSY if index or collision buckets are there.
+ *
+ * The function must not be called from softirq!
+ */
+int
+tdb_resize(TDB *db, unsigned long fsize)
+{
+	int i, r;
+
+	if (db->shards) {
+		for (i = 0; i < (1 << db->shard_bits); ++i) {
+			r = tdb_resize(db->shards[i], fsize >> db->shard_bits);
+			if (r)
+				return r;
+		}
+		return 0;
+	}
+
+	fsize &= TDB_EXT_MASK;
+	if (!fsize || (db->flags & TDB_F_SEQLOG))
+		return -EINVAL;
+	if (!db->hdr)
+		return -EAGAIN;
+	/* The file isn't populated yet. */
+	if (atomic_read(&db->pf_n))
+		return -EBUSY;
+
+	return tdb_gc_resize(db, fsize);
+}
+EXPORT_SYMBOL(tdb_resize);
+
+/**
+ * @return opened table @name for NUMA node @node or NULL.
+ * The caller is responsible to not close the table while it uses it.
+ */
+TDB *
+tdb_get_tbl(const char *name, int node)
+{
+	TDB *db;
+
+	mutex_lock(&tdb_tbls_mtx);
+	db = __tdb_get_tbl(name, node);
+	mutex_unlock(&tdb_tbls_mtx);
+
+	return db;
+}
+EXPORT_SYMBOL(tdb_get_tbl);
+
+/**
+ * Call @fn for each opened table in order of opening until @fn returns
+ * non-zero. Tables can't be opened or closed while @fn runs, so @fn
+ * must not call tdb_open() or tdb_close().
+ *
+ * @return the last result of @fn.
+ */
+int
+tdb_for_each_tbl(int (*fn)(TDB *db, void *arg), void *arg)
+{
+	int r = 0;
+	TDB *db;
+
+	mutex_lock(&tdb_tbls_mtx);
+	list_for_each_entry(db, &tdb_tbls, tbl_list)
+		if ((r = fn(db, arg)))
+			break;
+	mutex_unlock(&tdb_tbls_mtx);
+
+	return r;
+}
+EXPORT_SYMBOL(tdb_for_each_tbl);
+
+/**
+ * Fill @info by the table description and statistics.
+ * The counters are read without synchronization with writers,
+ * so they're approximate.
+ */
+void
+tdb_info(TDB *db, TdbInfo *info)
+{
+	int i, cpu;
+	TdbHdr *dbh = ACCESS_ONCE(db->hdr);
+
+	memset(info, 0, sizeof(*info));
+	info->name = db->name;
+	info->path = db->path;
+	info->node = db->node;
+	info->rec_len = db->rec_len;
+	if (db->shards) {
+		/* Sum the shards, the path is of the first one. */
+		for (i = 0; i < (1 << db->shard_bits); ++i) {
+			TdbInfo si;
+
+			tdb_info(db->shards[i], &si);
+			info->dbsz += si.dbsz;
+			info->free_blks += si.free_blks;
+			info->stat.lookups += si.stat.lookups;
+			info->stat.hits += si.stat.hits;
+			info->stat.inserts += si.stat.inserts;
+			info->stat.errors += si.stat.errors;
+		}
+		info->path = db->shards[0]->path;
+		return;
+	}
+	if (dbh) {
+		info->dbsz = dbh->dbsz;
+		if (!(db->flags & TDB_F_SEQLOG))
+			info->free_blks = tdb_htrie_free_blks(dbh);
+	}
+
+	for_each_possible_cpu(cpu) {
+		TdbStat *s = per_cpu_ptr(db->stat, cpu);
+		info->stat.lookups += s->lookups;
+		info->stat.hits += s->hits;
+		info->stat.inserts += s->inserts;
+		info->stat.errors += s->errors;
+	}
+}
+EXPORT_SYMBOL(tdb_info);
+
+/**
+ * Sum index and storage statistics of shards of set @db,
+ * the watermarks are the maximum ones.
+ */
+static int
+tdb_htrie_info_set(TDB *db, TdbHtrieStat *st)
+{
+	int i, j, r = 0;
+	TdbHtrieStat *s;
+
+	s = kmalloc(sizeof(*s), GFP_KERNEL);
+	if (!s)
+		return -ENOMEM;
+
+	memset(st, 0, sizeof(*st));
+	for (i = 0; i < (1 << db->shard_bits); ++i) {
+		if ((r = tdb_htrie_info(db->shards[i], s)))
+			goto out;
+		st->blks += s->blks;
+		st->free_blks += s->free_blks;
+		st->i_blks += s->i_blks;
+		st->d_blks += s->d_blks;
+		st->cold_blks += s->cold_blks;
+		st->i_wm = max(st->i_wm, s->i_wm);
+		st->d_wm = max(st->d_wm, s->d_wm);
+		st->nodes += s->nodes;
+		st->leafs += s->leafs;
+		st->recs += s->recs;
+		st->bursts += s->bursts;
+		st->alloc_errs += s->alloc_errs;
+		for (j = 0; j < TDB_STAT_HIST; ++j) {
+			st->depth[j] += s->depth[j];
+			st->chain[j] += s->chain[j];
+			st->occupancy[j] += s->occupancy[j];
+		}
+	}
+out:
+	kfree(s);
+	return r;
+}
+
+/**
+ * Collect index and storage statistics of the table.
+ * The whole index is walked, so use it for diagnostics only.
+ * @return -ENOENT if the table file isn't opened or -EINVAL if the table
+ * has no index.
+ */
+int
+tdb_htrie_info(TDB *db, TdbHtrieStat *st)
+{
+	int i;
+	unsigned long e;
+	TdbHdr *dbh = ACCESS_ONCE(db->hdr);
+
+	if (db->shards)
+		return tdb_htrie_info_set(db, st);
+	if (!dbh)
+		return -ENOENT;
+	if (db->flags & TDB_F_SEQLOG)
+		return -EINVAL;
+
+	/* Don't stall RCU and softirqs for the whole walk. */
+	tdb_htrie_stat_start(dbh, st);
+	for (e = 0; e < st->blks * PAGE_SIZE / TDB_EXT_SZ; ++e) {
+		rcu_read_lock_bh();
+		tdb_htrie_stat_exts(dbh, st, e, e + 1);
+		rcu_read_unlock_bh();
+		cond_resched();
+	}
+	for (i = 0; i < TDB_HTRIE_FANOUT; ++i) {
+		rcu_read_lock_bh();
+		tdb_htrie_stat_slot(dbh, i, st);
+		rcu_read_unlock_bh();
+		cond_resched();
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL(tdb_htrie_info);
+
 static int __init
 tdb_init(void)
 {
 	tw_cache = KMEM_CACHE(tdb_work_t, 0);
 	if (!tw_cache)
 		return -ENOMEM;
+	fw_cache = KMEM_CACHE(tdb_fault_work_t, 0);
+	if (!fw_cache)
+		goto err_fw;
 
-	tdb_wq = create_singlethread_workqueue("tdb_wq");
+	/* Bound work queue to open NUMA shards on their nodes CPUs. */
+	tdb_wq = alloc_workqueue("tdb_wq", WQ_MEM_RECLAIM, 0);
 	if (!tdb_wq)
 		goto err_wq;
 
+	if (tdb_gc_init())
+		goto err_gc;
+
 	return 0;
+err_gc:
+	destroy_workqueue(tdb_wq);
 err_wq:
+	kmem_cache_destroy(fw_cache);
+err_fw:
 	kmem_cache_destroy(tw_cache);
 	return -ENOMEM;
 }
@@ -169,7 +1317,9 @@ err_wq:
 static void __exit
 tdb_exit(void)
 {
+	tdb_gc_exit();
 	destroy_workqueue(tdb_wq);
+	kmem_cache_destroy(fw_cache);
 	kmem_cache_destroy(tw_cache);
 }
 
@@ -0,0 +1,315 @@
+/**
+ *		Tempesta DB
+ *
+ * Append-only log (SEQLOG) tables.
+ *
+ * The log has no index: records are appended to segments, which are the file
+ * extents reused as a ring. Each CPU appends records to its own segment,
+ * so writers on different CPUs don't contend. Segments are numbered in order
+ * of their opening by writers and readers follow the segments in the order,
+ * i.e. records of different CPUs are ordered by their segments only.
+ *
+ * Space of a segment is reserved by CAS on its tail and the records are
+ * committed in order of the reservations, so readers see only completely
+ * written records. A segment is closed when it has no room for a new record
+ * or, by the collector, when its CPU doesn't write to it for a while, so
+ * readers don't wait for idle CPUs forever.
+ *
+ * The log doesn't wait for readers: the oldest segment is overwritten when
+ * a new one is opened. Readers copy records out and check that the segment
+ * wasn't reused while they copied, so they can run in any context and also
+ * in user space on a shared mapping of the file.
+ *
+ * Copyright (C) 2014 Tempesta Technologies Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include <linux/bottom_half.h>
+#include <linux/smp.h>
+
+#include "seqlog.h"
+
+/* @idle value of new segments, so they aren't closed by the first flush. */
+#define TDB_LOG_IDLE_NEW	(~0U)
+
+static TdbLogSeg *
+tdb_seqlog_seg(TdbHdr *dbh, unsigned long seq)
+{
+	return TDB_PTR(dbh, (1 + seq % TDB_LOG_SEG_N(dbh)) * TDB_EXT_SZ);
+}
+
+/**
+ * Close segment @seq if it's still open and isn't reused by the ring.
+ */
+static void
+tdb_seqlog_close(TdbLogSeg *seg, unsigned long seq)
+{
+	unsigned long t;
+
+	do {
+		t = ACCESS_ONCE(seg->tail);
+		if (TDB_LOG_SEQ(t) != (unsigned int)seq
+		    || (t & TDB_LOG_CLOSED))
+			return;
+	} while (cmpxchg(&seg->tail, t, t | TDB_LOG_CLOSED) != t);
+}
+
+/**
+ * Open a new segment for writers of cursor @c instead of segment @old.
+ */
+static void
+tdb_seqlog_open(TdbHdr *dbh, TdbCursor *c, unsigned long old)
+{
+	unsigned long seq, v;
+	TdbLogSeg *seg;
+
+	do
+		seq = ACCESS_ONCE(dbh->l_seq);
+	while (cmpxchg(&dbh->l_seq, seq, seq + 1) != seq);
+
+	seg = tdb_seqlog_seg(dbh, seq);
+	v = TDB_LOG_MKOFF(seq, 0);
+	/*
+	 * Set the committed length first, so writers which are still
+	 * committing to the previous user of the segment see it's reused.
+	 */
+	ACCESS_ONCE(seg->len) = v;
+	seg->idle = TDB_LOG_IDLE_NEW;
+	smp_wmb();
+	ACCESS_ONCE(seg->tail) = v;
+
+	TDB_DBG("open log segment %lu\n", seq);
+
+	if (cmpxchg(&c->l_seq, old, seq) != old)
+		/* Other writer opened a segment, let readers skip ours. */
+		tdb_seqlog_close(seg, seq);
+}
+
+/**
+ * Append record with data @data of @len bytes and timestamp @ts to the log.
+ * The record is lost if the ring is reused while it's being written.
+ *
+ * @return 0 on success, -E2BIG if the record is too large or -ESTALE if
+ * the record is lost.
+ */
+int
+tdb_seqlog_append(TdbHdr *dbh, const void *data, size_t len, unsigned int ts)
+{
+	int r = 0;
+	unsigned long seq, t, l;
+	size_t n = TDB_HTRIE_RALIGN(sizeof(TdbLRec) + len);
+	TdbCursor *c;
+	TdbLogSeg *seg;
+	TdbLRec *rec;
+
+	if (n > TDB_LOG_REC_MAX)
+		return -E2BIG;
+
+	local_bh_disable();
+
+	c = tdb_cursor(dbh);
+	while (1) {
+		seq = ACCESS_ONCE(c->l_seq);
+		if (unlikely(!seq)) {
+			tdb_seqlog_open(dbh, c, 0);
+			continue;
+		}
+		seg = tdb_seqlog_seg(dbh, seq);
+		t = ACCESS_ONCE(seg->tail);
+		if (unlikely(TDB_LOG_SEQ(t) != (unsigned int)seq
+			     || (t & TDB_LOG_CLOSED)
+			     || TDB_LOG_OFF(t) + n > TDB_LOG_SEG_SZ))
+		{
+			tdb_seqlog_close(seg, seq);
+			tdb_seqlog_open(dbh, c, seq);
+			continue;
+		}
+		if (cmpxchg(&seg->tail, t, t + n) == t)
+			break;
+	}
+
+	rec = (TdbLRec *)(TDB_LOG_DATA(seg) + TDB_LOG_OFF(t));
+	rec->len = len;
+	rec->ts = ts;
+	memcpy(rec->data, data, len);
+
+	/*
+	 * Commit the record after all the records reserved before it.
+	 * Only the record writer moves the committed length from @t,
+	 * so CAS fails only if the segment is reused.
+	 */
+	smp_wmb();
+	while (1) {
+		l = ACCESS_ONCE(seg->len);
+		if (l == t && cmpxchg(&seg->len, t, t + n) == t)
+			break;
+		if (TDB_LOG_SEQ(l) != (unsigned int)seq) {
+			r = -ESTALE;
+			break;
+		}
+		cpu_relax();
+	}
+
+	local_bh_enable();
+
+	return r;
+}
+
+/**
+ * Copy the record at position @pos to @buf of @size bytes and move @pos
+ * to the next record. Segments which were overwritten before the reader
+ * read them are skipped and accounted in @pos->lost.
+ *
+ * @return the record length, zero if there are no new records or -ENOSPC
+ * if @buf is too small for the record.
+ */
+long
+tdb_seqlog_read(TdbHdr *dbh, TdbLogPos *pos, void *buf, size_t size)
+{
+	unsigned int len, ts;
+	unsigned long l, t, head, n = TDB_LOG_SEG_N(dbh);
+	TdbLogSeg *seg;
+	TdbLRec *rec;
+
+	while (1) {
+		head = ACCESS_ONCE(dbh->l_seq);
+		smp_rmb();
+		/* Segment @seq is reused by segment @seq + @n. */
+		if (!pos->seq || pos->seq + n < head) {
+			unsigned long old = head > n ? head - n : 1;
+			if (pos->seq)
+				pos->lost += old - pos->seq;
+			pos->seq = old;
+			pos->off = 0;
+		}
+
+		seg = tdb_seqlog_seg(dbh, pos->seq);
+		l = ACCESS_ONCE(seg->len);
+		t = ACCESS_ONCE(seg->tail);
+		smp_rmb();
+		/* The segment isn't opened yet or is just reused. */
+		if (TDB_LOG_SEQ(l) != (unsigned int)pos->seq)
+			return 0;
+
+		if (pos->off < TDB_LOG_OFF(l)) {
+			rec = (TdbLRec *)(TDB_LOG_DATA(seg) + pos->off);
+			len = ACCESS_ONCE(rec->len);
+			ts = ACCESS_ONCE(rec->ts);
+			if (len <= size
+			    && len <= TDB_LOG_SEG_SZ - pos->off - sizeof(*rec))
+				memcpy(buf, rec->data, len);
+			smp_rmb();
+			if (pos->seq + n < ACCESS_ONCE(dbh->l_seq))
+				continue;
+			if (len > size)
+				return -ENOSPC;
+			pos->off += TDB_HTRIE_RALIGN(sizeof(*rec) + len);
+			pos->ts = ts;
+			return len;
+		}
+
+		/* All the records are read, go to the next closed segment. */
+		if (TDB_LOG_SEQ(t) != (unsigned int)pos->seq
+		    || !(t & TDB_LOG_CLOSED)
+		    || TDB_LOG_OFF(t) != TDB_LOG_OFF(l))
+			return 0;
+		++pos->seq;
+		pos->off = 0;
+	}
+}
+
+/**
+ * Close segments which weren't written since the previous call, so readers
+ * don't wait for the segments of idle CPUs. Called by the collector.
+ */
+void
+tdb_seqlog_flush(TdbHdr *dbh)
+{
+	int i;
+
+	for (i = 0; i < TDB_CURS_N; ++i) {
+		unsigned long t, seq = ACCESS_ONCE(TDB_CURS(dbh)[i].l_seq);
+		TdbLogSeg *seg;
+
+		if (!seq)
+			continue;
+		seg = tdb_seqlog_seg(dbh, seq);
+		t = ACCESS_ONCE(seg->tail);
+		if (TDB_LOG_SEQ(t) != (unsigned int)seq
+		    || (t & TDB_LOG_CLOSED))
+			continue;
+		if (TDB_LOG_OFF(t) == seg->idle)
+			tdb_seqlog_close(seg, seq);
+		else
+			seg->idle = TDB_LOG_OFF(t);
+	}
+}
+
+/**
+ * Close segments which were open on shutdown. Records which were reserved,
+ * but weren't committed, are dropped.
+ */
+static void
+tdb_seqlog_recover(TdbHdr *hdr)
+{
+	int i;
+	unsigned long s, n = TDB_LOG_SEG_N(hdr);
+
+	for (s = hdr->l_seq > n ? hdr->l_seq - n : 1; s < hdr->l_seq; ++s) {
+		TdbLogSeg *seg = tdb_seqlog_seg(hdr, s);
+		if (TDB_LOG_SEQ(seg->len) != (unsigned int)s)
+			seg->len = TDB_LOG_MKOFF(s, 0);
+		seg->tail = seg->len | TDB_LOG_CLOSED;
+	}
+
+	for (i = 0; i < TDB_CURS_N; ++i)
+		TDB_CURS(hdr)[i].l_seq = 0;
+}
+
+TdbHdr *
+tdb_seqlog_init(void *p, size_t db_size)
+{
+	unsigned long e;
+	TdbHdr *hdr = (TdbHdr *)p;
+
+	if (hdr->magic == TDB_MAGIC && hdr->version == TDB_VERSION) {
+		if (!(hdr->flags & TDB_F_SEQLOG)) {
+			TDB_ERR("The database isn't a log\n");
+			return NULL;
+		}
+		tdb_seqlog_recover(hdr);
+		goto out;
+	}
+
+	if (db_size < TDB_EXT_SZ * 2) {
+		TDB_ERR("Too small log size\n");
+		return NULL;
+	}
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->dbsz = db_size;
+	memset(TDB_CURS(hdr), 0, sizeof(TdbCursor) * TDB_CURS_N);
+	for (e = 1; e < db_size / TDB_EXT_SZ; ++e)
+		memset(TDB_PTR(hdr, e * TDB_EXT_SZ), 0, sizeof(TdbLogSeg));
+	hdr->flags = TDB_F_SEQLOG;
+	hdr->l_seq = 1;
+	hdr->version = TDB_VERSION;
+	hdr->magic = TDB_MAGIC;
+out:
+	TDB_DBG("init log header: db_size=%lu l_seq=%lu\n",
+		hdr->dbsz, hdr->l_seq);
+
+	return hdr;
+}
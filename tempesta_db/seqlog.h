@@ -0,0 +1,77 @@
+/**
+ *		Tempesta DB
+ *
+ * Copyright (C) 2014 Tempesta Technologies Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __SEQLOG_H__
+#define __SEQLOG_H__
+
+#include "htrie.h"
+
+/**
+ * Header of SEQLOG segment, the segment occupies the whole extent.
+ * Both @tail and @len keep the lower half of the segment sequence number
+ * in their most significant bits, see TDB_LOG_MKOFF().
+ *
+ * @tail	- reserved space of the segment and TDB_LOG_CLOSED flag;
+ * @len		- space of the segment occupied by committed records;
+ * @idle	- reserved space seen by the previous tdb_seqlog_flush();
+ */
+typedef struct {
+	unsigned long	tail;
+	unsigned long	len;
+	unsigned int	idle;
+	unsigned char	_padding[L1_CACHE_BYTES - sizeof(long) * 2
+				 - sizeof(int)];
+} __attribute__((packed)) TdbLogSeg;
+
+/**
+ * SEQLOG record.
+ *
+ * @len		- the record data length;
+ * @ts		- the record timestamp (in seconds);
+ */
+typedef struct {
+	unsigned int	len;
+	unsigned int	ts;
+	char		data[0];
+} __attribute__((packed)) TdbLRec;
+
+/* No more records can be added to the segment. */
+#define TDB_LOG_CLOSED		(1UL << 31)
+#define TDB_LOG_MKOFF(s, o)	(((unsigned long)(unsigned int)(s) << 32) \
+				 | (o))
+#define TDB_LOG_SEQ(v)		((unsigned int)((v) >> 32))
+#define TDB_LOG_OFF(v)		((unsigned int)(v) & ~TDB_LOG_CLOSED)
+/* Segments data follow their headers. */
+#define TDB_LOG_DATA(s)		((char *)((s) + 1))
+#define TDB_LOG_SEG_SZ		(TDB_EXT_SZ - sizeof(TdbLogSeg))
+/* The first extent keeps the file header, the rest are the segments. */
+#define TDB_LOG_SEG_N(h)	((h)->dbsz / TDB_EXT_SZ - 1)
+/*
+ * Maximum size of a record with its header. The rest of a segment is
+ * wasted if the next record doesn't fit it, so the records are small.
+ */
+#define TDB_LOG_REC_MAX		(16 * PAGE_SIZE)
+
+int tdb_seqlog_append(TdbHdr *dbh, const void *data, size_t len,
+		      unsigned int ts);
+long tdb_seqlog_read(TdbHdr *dbh, TdbLogPos *pos, void *buf, size_t size);
+void tdb_seqlog_flush(TdbHdr *dbh);
+TdbHdr *tdb_seqlog_init(void *p, size_t db_size);
+
+#endif /* __SEQLOG_H__ */
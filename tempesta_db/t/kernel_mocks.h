@@ -0,0 +1,198 @@
+/**
+ *		Tempesta DB
+ *
+ * User-space definitions of the kernel primitives used by Tempesta DB core.
+ * The stub headers in linux/ include the file, so the kernel sources are
+ * compiled in user space without any changes.
+ *
+ * Copyright (C) 2014 NatSys Lab. (info@natsys-lab.com).
+ * Copyright (C) 2014 Tempesta Technologies Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __KERNEL_MOCKS_H__
+#define __KERNEL_MOCKS_H__
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef TDB_CL_SZ
+#error "Unknown size of cache line"
+#endif
+
+#define L1_CACHE_BYTES		TDB_CL_SZ
+#define PAGE_SHIFT		12
+#define PAGE_SIZE		(1UL << PAGE_SHIFT)
+#define PAGE_MASK		(~(PAGE_SIZE - 1))
+#define BITS_PER_LONG		64
+#define BITS_TO_LONGS(n)	(((n) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+/* Sparse annotations. */
+#define __percpu
+
+#define likely(e)		__builtin_expect(!!(e), 1)
+#define unlikely(e)		__builtin_expect(!!(e), 0)
+
+/* Unlike assert(), kernel BUG_ON() evaluates its argument in any build. */
+#define BUG()								\
+do {									\
+	fprintf(stderr, "BUG at %s:%d\n", __FILE__, __LINE__);		\
+	abort();							\
+} while (0)
+#define BUG_ON(c)							\
+do {									\
+	if (unlikely(c))						\
+		BUG();							\
+} while (0)
+
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+#define min(a, b)		((a) < (b) ? (a) : (b))
+#define max(a, b)		((a) > (b) ? (a) : (b))
+
+#define pr_debug(...)		printf(__VA_ARGS__)
+#define pr_err(...)		fprintf(stderr, __VA_ARGS__)
+
+struct file;
+
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+/*
+ * ------------------------------------------------------------------------
+ *	Memory ordering and atomic operations (x86-64 only)
+ * ------------------------------------------------------------------------
+ */
+#define barrier()		asm volatile("" : : : "memory")
+#define ACCESS_ONCE(x)		(*(volatile typeof(x) *)&(x))
+#define cpu_relax()		asm volatile("rep; nop" : : : "memory")
+
+/* x86 doesn't reorder stores with stores and loads with loads. */
+#define smp_mb()		asm volatile("mfence" : : : "memory")
+#define smp_rmb()		barrier()
+#define smp_wmb()		barrier()
+#define smp_read_barrier_depends() do { } while (0)
+
+/* Atomic bit operations are full barriers on x86. */
+#define smp_mb__after_clear_bit() barrier()
+
+#define cmpxchg(p, o, n)	__sync_val_compare_and_swap((p), (o), (n))
+#define xchg(p, v)		__sync_lock_test_and_set((p), (v))
+
+typedef struct {
+	int counter;
+} atomic_t;
+
+/*
+ * Softirqs are emulated by threads which never preempt each other
+ * on the same CPU, so there is nothing to disable.
+ */
+#define local_bh_disable()	barrier()
+#define local_bh_enable()	barrier()
+
+/* Used as a hint only, so thread migration doesn't matter. */
+int sched_getcpu(void);
+#define raw_smp_processor_id()	sched_getcpu()
+
+#define prefetch(x)		__builtin_prefetch(x)
+#define prefetchw(x)		__builtin_prefetch(x, 1)
+
+/*
+ * ------------------------------------------------------------------------
+ *	Bit operations
+ * ------------------------------------------------------------------------
+ */
+#define BIT_WORD(nr)		((nr) / BITS_PER_LONG)
+#define BIT_MASK(nr)		(1UL << ((nr) % BITS_PER_LONG))
+
+static inline void
+set_bit(unsigned int nr, volatile unsigned long *addr)
+{
+	__sync_fetch_and_or(addr + BIT_WORD(nr), BIT_MASK(nr));
+}
+
+static inline void
+clear_bit(unsigned int nr, volatile unsigned long *addr)
+{
+	__sync_fetch_and_and(addr + BIT_WORD(nr), ~BIT_MASK(nr));
+}
+
+static inline int
+test_and_set_bit(unsigned int nr, volatile unsigned long *addr)
+{
+	unsigned long m = BIT_MASK(nr);
+
+	return !!(__sync_fetch_and_or(addr + BIT_WORD(nr), m) & m);
+}
+
+static inline void
+__set_bit(unsigned int nr, unsigned long *addr)
+{
+	addr[BIT_WORD(nr)] |= BIT_MASK(nr);
+}
+
+static inline void
+__clear_bit(unsigned int nr, unsigned long *addr)
+{
+	addr[BIT_WORD(nr)] &= ~BIT_MASK(nr);
+}
+
+static inline int
+test_bit(unsigned int nr, const volatile unsigned long *addr)
+{
+	return !!(addr[BIT_WORD(nr)] & BIT_MASK(nr));
+}
+
+/* The result is undefined if @word has no zero bits. */
+static inline unsigned long
+ffz(unsigned long word)
+{
+	return __builtin_ctzl(~word);
+}
+
+#define __ffs(w)		((unsigned long)__builtin_ctzl(w))
+#define __fls(w)		((unsigned long)(BITS_PER_LONG - 1		\
+					 - __builtin_clzl(w)))
+#define hweight_long(w)		__builtin_popcountl(w)
+
+static inline unsigned long
+find_next_bit(const unsigned long *addr, unsigned long size,
+	      unsigned long off)
+{
+	unsigned long w;
+
+	if (off >= size)
+		return size;
+	w = addr[BIT_WORD(off)] & (~0UL << (off % BITS_PER_LONG));
+	off &= ~(BITS_PER_LONG - 1);
+	while (!w) {
+		off += BITS_PER_LONG;
+		if (off >= size)
+			return size;
+		w = addr[BIT_WORD(off)];
+	}
+	off += __builtin_ctzl(w);
+
+	return min(off, size);
+}
+
+#define for_each_set_bit(bit, addr, size)				\
+	for ((bit) = find_next_bit((addr), (size), 0);			\
+	     (bit) < (size);						\
+	     (bit) = find_next_bit((addr), (size), (bit) + 1))
+
+#endif /* __KERNEL_MOCKS_H__ */
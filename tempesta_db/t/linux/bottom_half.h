@@ -0,0 +1,4 @@
+/*
+ * User-space stub for <linux/bottom_half.h>, see kernel_mocks.h.
+ */
+#include "../kernel_mocks.h"
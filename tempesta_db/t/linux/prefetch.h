@@ -0,0 +1,4 @@
+/*
+ * User-space stub for <linux/prefetch.h>, see kernel_mocks.h.
+ */
+#include "../kernel_mocks.h"
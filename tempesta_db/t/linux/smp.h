@@ -0,0 +1,4 @@
+/*
+ * User-space stub for <linux/smp.h>, see kernel_mocks.h.
+ */
+#include "../kernel_mocks.h"
@@ -0,0 +1,515 @@
+/**
+ * Tempesta DB HTrie multi-threaded benchmark.
+ *
+ * The benchmark is linked with the kernel htrie.c compiled in user space,
+ * so TDB changes can be measured without loading the kernel modules.
+ * Each run fills a fresh table by all the threads (insert phase) and
+ * then runs mixed lookups and inserts (mixed phase). Lookup keys are chosen
+ * by uniform or Zipf distribution, while inserts add new keys. Throughput is measured over all
+ * operations, while latency is measured for each @sample'th operation
+ * only to not to slow down the workload by the clock calls.
+ *
+ * Copyright (C) 2014 NatSys Lab. (info@natsys-lab.com).
+ * Copyright (C) 2014 Tempesta Technologies Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../htrie.h"
+
+#undef TDB_ERR
+#define TDB_ERR(...)							\
+do {									\
+	fprintf(stderr, "Error: " __VA_ARGS__);				\
+	exit(1);							\
+} while (0)
+
+#define TDB_VREC_MIN		64
+#define TDB_VREC_MAX		1024
+
+enum {
+	DIST_UNIFORM,
+	DIST_ZIPF,
+};
+
+/**
+ * Benchmark parameters.
+ *
+ * @threads	- number of worker threads;
+ * @keys	- number of distinct keys, all of them are inserted
+ * 		  at insert phase;
+ * @ops		- number of operations per thread at mixed phase;
+ * @reads	- percent of lookups at mixed phase;
+ * @rec_len	- fixed-size records length;
+ * @db_sz	- table size in bytes, zero means estimation by the number
+ * 		  of records;
+ * @theta	- Zipf distribution skew;
+ * @sample	- measure latency of each @sample'th operation;
+ * @batch	- number of keys looked up by tdb_htrie_lookup_many() at once,
+ * 		  1 means plain tdb_htrie_lookup();
+ * @var, @fix	- run the benchmarks for variable/fixed-size records;
+ * @dist	- bitmap of key distributions to run;
+ */
+static struct {
+	int		threads;
+	unsigned long	keys;
+	unsigned long	ops;
+	int		reads;
+	unsigned int	rec_len;
+	size_t		db_sz;
+	double		theta;
+	int		sample;
+	int		batch;
+	int		var;
+	int		fix;
+	int		dist;
+} cfg = {
+	.threads	= 0,
+	.keys		= 1000000,
+	.ops		= 1000000,
+	.reads		= 90,
+	.rec_len	= 16,
+	.db_sz		= 0,
+	.theta		= 0.99,
+	.sample		= 16,
+	.batch		= 1,
+	.var		= 1,
+	.fix		= 1,
+	.dist		= (1 << DIST_UNIFORM) | (1 << DIST_ZIPF),
+};
+
+/**
+ * Zipf distribution generator by Gray et al., "Quickly Generating
+ * Billion-Record Synthetic Databases", SIGMOD 1994. Ranks are scrambled
+ * by tdb_bench_key(), so the hottest keys aren't neighbours in the index.
+ */
+static struct {
+	double		zetan;
+	double		alpha;
+	double		eta;
+	double		half_pow_theta;
+} zipf;
+
+static void
+zipf_init(unsigned long n, double theta)
+{
+	unsigned long i;
+	double zeta2 = 1.0 + pow(0.5, theta);
+
+	zipf.zetan = 0;
+	for (i = 1; i <= n; ++i)
+		zipf.zetan += 1.0 / pow(i, theta);
+	zipf.alpha = 1.0 / (1.0 - theta);
+	zipf.eta = (1.0 - pow(2.0 / n, 1.0 - theta))
+		   / (1.0 - zeta2 / zipf.zetan);
+	zipf.half_pow_theta = pow(0.5, theta);
+}
+
+/**
+ * Per-thread state, cache line aligned to avoid false sharing.
+ *
+ * @lat		- latency samples in nanoseconds;
+ * @n_lat	- number of samples in @lat;
+ * @hits	- number of successful lookups;
+ * @fails	- number of failed inserts (the table is full);
+ * @inserts	- number of new keys inserted at mixed phase;
+ */
+typedef struct {
+	pthread_t	thr;
+	int		id;
+	int		dist;
+	int		phase;
+	unsigned long	rnd;
+	unsigned long	*lat;
+	unsigned long	n_lat;
+	unsigned long	hits;
+	unsigned long	fails;
+	unsigned long	inserts;
+} __attribute__((aligned(TDB_CL_SZ))) BenchThread;
+
+enum {
+	PHASE_INSERT,
+	PHASE_MIXED,
+};
+
+static TdbHdr *dbh;
+static pthread_barrier_t start_barrier;
+
+/* xorshift64* generator. */
+static inline unsigned long
+bench_rand(BenchThread *bt)
+{
+	bt->rnd ^= bt->rnd >> 12;
+	bt->rnd ^= bt->rnd << 25;
+	bt->rnd ^= bt->rnd >> 27;
+	return bt->rnd * 0x2545F4914F6CDD1DUL;
+}
+
+static inline double
+bench_rand01(BenchThread *bt)
+{
+	return (bench_rand(bt) >> 11) * (1.0 / (1UL << 53));
+}
+
+static inline unsigned long
+bench_key_idx(BenchThread *bt)
+{
+	double u, uz;
+
+	if (bt->dist == DIST_UNIFORM)
+		return bench_rand(bt) % cfg.keys;
+
+	u = bench_rand01(bt);
+	uz = u * zipf.zetan;
+	if (uz < 1.0)
+		return 0;
+	if (uz < 1.0 + zipf.half_pow_theta)
+		return 1;
+	return (unsigned long)(cfg.keys
+			       * pow(zipf.eta * u - zipf.eta + 1, zipf.alpha))
+	       % cfg.keys;
+}
+
+/* Spread key indexes over the whole key space (splitmix64 finalizer). */
+static inline unsigned long
+tdb_bench_key(unsigned long i)
+{
+	unsigned long k = i + 0x9E3779B97F4A7C15UL;
+
+	k = (k ^ (k >> 30)) * 0xBF58476D1CE4E5B9UL;
+	k = (k ^ (k >> 27)) * 0x94D049BB133111EBUL;
+	return k ^ (k >> 31);
+}
+
+static inline unsigned long
+bench_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void
+bench_insert(BenchThread *bt, unsigned long key)
+{
+	char data[TDB_VREC_MAX];
+	size_t len = TDB_HTRIE_VARLENRECS(dbh)
+		     ? TDB_VREC_MIN + key % (TDB_VREC_MAX - TDB_VREC_MIN)
+		     : dbh->rec_len;
+
+	memset(data, (char)key, len);
+	if (!tdb_htrie_insert(dbh, key, data, &len))
+		++bt->fails;
+}
+
+static void
+bench_lookup(BenchThread *bt, unsigned long *keys, int n)
+{
+	int i;
+	TdbBucket *b[TDB_LOOKUP_BATCH];
+
+	if (n == 1)
+		b[0] = tdb_htrie_lookup(dbh, keys[0]);
+	else
+		tdb_htrie_lookup_many(dbh, keys, n, b);
+
+	for (i = 0; i < n; ++i)
+		if (b[i] && tdb_htrie_bscan_for_rec(dbh, b[i], keys[i]))
+			++bt->hits;
+}
+
+static void *
+bench_thread(void *arg)
+{
+	int i, n;
+	unsigned long op, ops, it, key, t0 = 0;
+	unsigned long keys[TDB_LOOKUP_BATCH];
+	BenchThread *bt = arg;
+	cpu_set_t cpus;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(bt->id % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+	pthread_barrier_wait(&start_barrier);
+
+	if (bt->phase == PHASE_INSERT) {
+		/* Each thread inserts its own slice of the key space. */
+		for (op = bt->id; op < cfg.keys; op += cfg.threads) {
+			int smp = !(op % cfg.sample);
+			if (smp)
+				t0 = bench_ns();
+			bench_insert(bt, tdb_bench_key(op));
+			if (smp)
+				bt->lat[bt->n_lat++] = bench_ns() - t0;
+		}
+		return NULL;
+	}
+
+	ops = cfg.ops;
+	for (op = 0, it = 0; op < ops; op += n, ++it) {
+		int smp = !(it % cfg.sample);
+		if (smp)
+			t0 = bench_ns();
+		if (bench_rand(bt) % 100 < cfg.reads) {
+			n = min((unsigned long)cfg.batch, ops - op);
+			for (i = 0; i < n; ++i)
+				keys[i] = tdb_bench_key(bench_key_idx(bt));
+			bench_lookup(bt, keys, n);
+		} else {
+			/*
+			 * The index keeps all the records for the same key,
+			 * so insert new keys only to not to grow collision
+			 * chains of hot keys.
+			 */
+			n = 1;
+			key = tdb_bench_key(cfg.keys + bt->inserts++ * cfg.threads
+					    + bt->id);
+			bench_insert(bt, key);
+		}
+		if (smp)
+			bt->lat[bt->n_lat++] = bench_ns() - t0;
+	}
+
+	return NULL;
+}
+
+static int
+lat_cmp(const void *a, const void *b)
+{
+	unsigned long x = *(unsigned long *)a, y = *(unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+bench_phase(BenchThread *bt, int phase, const char *name)
+{
+	int t;
+	unsigned long i, n = 0, ops, hits = 0, fails = 0, t0, t1;
+	unsigned long *lat;
+
+	pthread_barrier_init(&start_barrier, NULL, cfg.threads + 1);
+	for (t = 0; t < cfg.threads; ++t) {
+		bt[t].phase = phase;
+		bt[t].n_lat = bt[t].hits = bt[t].fails = bt[t].inserts = 0;
+		if (pthread_create(&bt[t].thr, NULL, bench_thread, &bt[t]))
+			TDB_ERR("cannot create thread\n");
+	}
+	pthread_barrier_wait(&start_barrier);
+	t0 = bench_ns();
+	for (t = 0; t < cfg.threads; ++t)
+		pthread_join(bt[t].thr, NULL);
+	t1 = bench_ns();
+	pthread_barrier_destroy(&start_barrier);
+
+	ops = phase == PHASE_INSERT ? cfg.keys : cfg.ops * cfg.threads;
+	for (t = 0; t < cfg.threads; ++t) {
+		n += bt[t].n_lat;
+		hits += bt[t].hits;
+		fails += bt[t].fails;
+	}
+	if (!(lat = malloc(n * sizeof(*lat))))
+		TDB_ERR("cannot allocate latency samples\n");
+	for (t = 0, n = 0; t < cfg.threads; ++t)
+		for (i = 0; i < bt[t].n_lat; ++i)
+			lat[n++] = bt[t].lat[i];
+	qsort(lat, n, sizeof(*lat), lat_cmp);
+
+	printf("  %-6s %8.3f Mops/s  p50=%luns p99=%luns p999=%luns",
+	       name, (double)ops * 1000 / (t1 - t0),
+	       n ? lat[n / 2] : 0, n ? lat[n * 99 / 100] : 0,
+	       n ? lat[n * 999 / 1000] : 0);
+	if (phase == PHASE_MIXED)
+		printf("  hits=%lu", hits);
+	if (fails)
+		printf("  full=%lu", fails);
+	printf("\n");
+
+	free(lat);
+}
+
+static void
+bench_run(unsigned int rec_len, int dist)
+{
+	int t;
+	void *addr;
+	BenchThread *bt;
+	unsigned long n_lat, recs;
+	size_t db_sz = cfg.db_sz;
+
+	if (!db_sz) {
+		/*
+		 * Give each record a whole bucket or the largest record
+		 * with its header plus the index and some spare room.
+		 */
+		recs = cfg.keys + cfg.ops * cfg.threads * (100 - cfg.reads)
+				  / 100;
+		db_sz = recs * (rec_len ? TDB_HTRIE_MINDREC
+					: TDB_VREC_MAX + sizeof(TdbVRec))
+			* 5 / 4 + 8 * TDB_EXT_SZ;
+		db_sz = (db_sz + TDB_EXT_SZ - 1) & TDB_EXT_MASK;
+	}
+
+	printf("%s records, %s keys (%lu keys, %d threads, %d%% reads,"
+	       " batch %d, %luMB):\n",
+	       rec_len ? "fixed-size" : "variable-size",
+	       dist == DIST_ZIPF ? "zipf" : "uniform", cfg.keys, cfg.threads,
+	       cfg.reads, cfg.batch, db_sz >> 20);
+
+	addr = mmap(NULL, db_sz, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (addr == MAP_FAILED)
+		TDB_ERR("cannot allocate %lu bytes for the table\n", db_sz);
+	if (!(dbh = tdb_htrie_init(addr, db_sz, rec_len)))
+		TDB_ERR("cannot initialize the table\n");
+
+	if (posix_memalign((void **)&bt, TDB_CL_SZ,
+			   cfg.threads * sizeof(*bt)))
+		TDB_ERR("cannot allocate threads\n");
+	memset(bt, 0, cfg.threads * sizeof(*bt));
+	n_lat = (max(cfg.ops, cfg.keys / cfg.threads + 1) + cfg.batch)
+		/ cfg.sample + 1;
+	for (t = 0; t < cfg.threads; ++t) {
+		bt[t].id = t;
+		bt[t].dist = dist;
+		bt[t].rnd = tdb_bench_key(t) | 1;
+		if (!(bt[t].lat = malloc(n_lat * sizeof(*bt[t].lat))))
+			TDB_ERR("cannot allocate latency samples\n");
+	}
+
+	bench_phase(bt, PHASE_INSERT, "insert");
+	bench_phase(bt, PHASE_MIXED, "mixed");
+
+	for (t = 0; t < cfg.threads; ++t)
+		free(bt[t].lat);
+	free(bt);
+	munmap(addr, db_sz);
+}
+
+static void
+usage(const char *prog)
+{
+	printf("\nUsage: %s [options]\n"
+	       "  -t <n>      number of threads (default: number of CPUs)\n"
+	       "  -k <n>      number of keys (default %lu)\n"
+	       "  -n <n>      mixed phase operations per thread"
+	       " (default %lu)\n"
+	       "  -r <pct>    percent of lookups at mixed phase"
+	       " (default %d)\n"
+	       "  -b <n>      lookup batch size, up to %d (default %d)\n"
+	       "  -f <len>    fixed-size records length (default %u)\n"
+	       "  -m <MB>     table size in megabytes"
+	       " (default: estimated by records number)\n"
+	       "  -d <dist>   key distribution: uniform or zipf"
+	       " (default both)\n"
+	       "  -z <theta>  Zipf distribution skew (default %.2f)\n"
+	       "  -s <n>      sample latency of each n'th operation"
+	       " (default %d)\n"
+	       "  -V          variable-size records only\n"
+	       "  -F          fixed-size records only\n\n",
+	       prog, cfg.keys, cfg.ops, cfg.reads, TDB_LOOKUP_BATCH,
+	       cfg.batch, cfg.rec_len, cfg.theta,
+	       cfg.sample);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int c, d;
+
+	while ((c = getopt(argc, argv, "t:k:n:r:b:f:m:d:z:s:VFh")) != -1) {
+		switch (c) {
+		case 't':
+			cfg.threads = atoi(optarg);
+			break;
+		case 'k':
+			cfg.keys = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			cfg.ops = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			cfg.reads = atoi(optarg);
+			break;
+		case 'b':
+			cfg.batch = atoi(optarg);
+			break;
+		case 'f':
+			cfg.rec_len = atoi(optarg);
+			break;
+		case 'm':
+			cfg.db_sz = strtoul(optarg, NULL, 0) << 20;
+			break;
+		case 'd':
+			if (!strcmp(optarg, "uniform"))
+				cfg.dist = 1 << DIST_UNIFORM;
+			else if (!strcmp(optarg, "zipf"))
+				cfg.dist = 1 << DIST_ZIPF;
+			else
+				usage(argv[0]);
+			break;
+		case 'z':
+			cfg.theta = atof(optarg);
+			break;
+		case 's':
+			cfg.sample = atoi(optarg);
+			break;
+		case 'V':
+			cfg.fix = 0;
+			break;
+		case 'F':
+			cfg.var = 0;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!cfg.threads)
+		cfg.threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cfg.threads < 1 || !cfg.keys || cfg.reads < 0 || cfg.reads > 100
+	    || cfg.batch < 1 || cfg.batch > TDB_LOOKUP_BATCH
+	    || cfg.sample < 1 || cfg.theta <= 0 || cfg.theta >= 1
+	    || cfg.rec_len < sizeof(long) || cfg.db_sz % TDB_EXT_SZ
+	    || (cfg.db_sz && cfg.db_sz < 2 * TDB_EXT_SZ))
+		usage(argv[0]);
+
+	if (cfg.dist & (1 << DIST_ZIPF))
+		zipf_init(cfg.keys, cfg.theta);
+
+	for (d = DIST_UNIFORM; d <= DIST_ZIPF; ++d) {
+		if (!(cfg.dist & (1 << d)))
+			continue;
+		if (cfg.fix)
+			bench_run(cfg.rec_len, d);
+		if (cfg.var)
+			bench_run(0, d);
+	}
+
+	return 0;
+}
@@ -1,17 +1,12 @@
 /**
  * Unit test for Tempesta DB HTrie storage.
  *
- * If index is not SEQLOG (i.e. no index at all), then to improve space locality
- * for large data sets index records grow from lower addresses to higher while
- * data records grow towards them, from maximum to minimum addresses.
+ * The test is linked with the kernel htrie.c compiled in user space against
+ * kernel_mocks.h, so it checks exactly the same code which runs in
+ * the kernel module.
  *
  * TODO
  * - consistensy checking and recovery
- * - garbage collection
- * - eviction
- * - reduce number of memset(.., 0, ..) calls
- * - freeing interface for eviction thread
- * - unit test for concurrency
  *
  * Copyright (C) 2014 NatSys Lab. (info@natsys-lab.com).
  * Copyright (C) 2014 Tempesta Technologies Ltd.
@@ -35,6 +30,7 @@
 #include <cpuid.h>
 #include <fcntl.h>
 #include <immintrin.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -43,282 +39,20 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 
-/*
- * ------------------------------------------------------------------------
- *	Kernel stubs
- * ------------------------------------------------------------------------
- */
-#ifndef TDB_CL_SZ
-#error "Unknown size of cache line"
-#endif
-
-#define PAGE_SIZE	4096
-#define BITS_PER_LONG	64
-#ifndef ENOMEM
-#define ENOMEM		1
-#endif
-
-#define likely(e)	__builtin_expect((e), 1)
-#define unlikely(e)	__builtin_expect((e), 0)
-
-#define BUG_ON(c)	assert(!(c))
-#define BUG()		abort()
+#include "../htrie.h"
+#include "../seqlog.h"
 
+#undef TDB_ERR
 #define TDB_ERR(...)							\
 do {									\
 	fprintf(stderr, "Error: " __VA_ARGS__);				\
 	exit(1);							\
 } while (0)
 
-#ifndef NDEBUG
-#define TDB_DBG(...)	printf("\t" __VA_ARGS__)
-#else
-#define TDB_DBG(...)
-#endif
-
-#define LOCK_PREFIX "\n\tlock; "
-#define IS_IMMEDIATE(nr)		(__builtin_constant_p(nr))
-#define BITOP_ADDR(x) "+m" (*(volatile long *) (x))
-#define CONST_MASK_ADDR(nr, addr)	BITOP_ADDR((void *)(addr) + ((nr)>>3))
-#define CONST_MASK(nr)			(1 << ((nr) & 7))
-
-static inline void
-set_bit(unsigned int nr, volatile unsigned long *addr)
-{
-	if (IS_IMMEDIATE(nr)) {
-		asm volatile(LOCK_PREFIX "orb %1,%0"
-			: CONST_MASK_ADDR(nr, addr)
-			: "iq" ((unsigned char)CONST_MASK(nr))
-			: "memory");
-	} else {
-		asm volatile(LOCK_PREFIX "bts %1,%0"
-			: BITOP_ADDR(addr) : "Ir" (nr) : "memory");
-	}
-}
-
-static inline unsigned long
-ffz(unsigned long word)
-{
-	asm("rep; bsf %1,%0"
-		: "=r" (word)
-		: "r" (~word));
-	return word;
-}
-
-/*
- * ------------------------------------------------------------------------
- *	Tempesta DB index and data manipulations
- * ------------------------------------------------------------------------
- */
-#define TDB_MAGIC		0x434947414D424454UL /* "TDBMAGIC" */
 #define TDB_MAP_ADDR		0x600000000000
-#define TDB_BLK_SZ		PAGE_SIZE
-#define TDB_BLK_MASK		(~(TDB_BLK_SZ - 1))
-#define TDB_EXT_BITS		21
-#define TDB_EXT_SZ		(1 << TDB_EXT_BITS)
-#define TDB_EXT_MASK		(~(TDB_EXT_SZ - 1))
-#define TDB_BLK_BMP_2L		(TDB_EXT_SZ / TDB_BLK_SZ / BITS_PER_LONG)
-/* Get current extent by an offset in it. */
-#define TDB_EXT_O(o)		((unsigned long)(o) & TDB_EXT_MASK)
-/* Get extent id by a record offset. */
-#define TDB_EXT_ID(o)		(TDB_EXT_O(o) >> TDB_EXT_BITS)
-/* Get block index in an extent. */
-#define TDB_BLK_ID(x)		(((x) & TDB_BLK_MASK) & ~TDB_EXT_MASK)
-
-/* True if the tree keeps variable length records. */
-#define TDB_HTRIE_VARLENRECS(h)	(!(h)->rec_len)
-/**
- * We use very small index nodes size of only one cache line.
- * So overall memory footprint of the index is mininal by a cost of more LLC
- * or main memory transfers. However, smaller memory usage means better TLB
- * utilization on huge worksets.
- */
-#define TDB_HTRIE_NODE_SZ	TDB_CL_SZ
-/*
- * There is no sense to allocate a new resolving node for each new small
- * (less than cache line size) data record. So we place small records in
- * 2 cache lines in sequential order and burst the node only when there
- * is no room.
- */
-#define TDB_HTRIE_MINDREC	(TDB_CL_SZ * 2)
-/* Each record in the tree must be at least 8-byte aligned. */
-#define TDB_HTRIE_RALIGN(n)	(((unsigned long)(n) + 7) & ~7UL)
-#define TDB_HTRIE_IALIGN(n)	(((n) + TDB_CL_SZ - 1) & ~(TDB_CL_SZ - 1))
-#define TDB_HTRIE_DALIGN(n)	(((n) + TDB_HTRIE_MINDREC - 1)		\
-				 & ~(TDB_HTRIE_MINDREC - 1))
-#define TDB_HTRIE_BITS		4
-#define TDB_HTRIE_FANOUT	(1 << TDB_HTRIE_BITS)
-#define TDB_HTRIE_KMASK		(TDB_HTRIE_FANOUT - 1) /* key mask */
-#define TDB_HTRIE_RESOLVED(b)	((b) + TDB_HTRIE_BITS >= BITS_PER_LONG)
-/*
- * We use 31 bits to address index and data blocks.
- * The most significant bit is used to flag data pointer/offset.
- * Index blocks are addressed by index of a TDB_CL_SZ-byte blocks in the file,
- * while data blocks are addressed by indexes of TDB_HTRIE_MINDREC blocks.
- * So theoretical size of the database shard which can be addressed is 256GB.
- */
-#define TDB_HTRIE_DBIT		(1U << (sizeof(int) * 8 - 1))
-#define TDB_HTRIE_OMASK		(TDB_HTRIE_DBIT - 1) /* offset mask */
-#define TDB_HTRIE_IDX(k, b)	(((k) >> (b)) & TDB_HTRIE_KMASK)
-#define TDB_EXT_BMP_2L(h)	(((h)->dbsz / TDB_EXT_SZ + BITS_PER_LONG - 1)\
-				 / BITS_PER_LONG)
-/* Convert internal offsets to system pointer. */
-#define TDB_HTRIE_PTR(h, o)	(void *)((char *)(h) + (o))
-/* Get internal offset from a pointer. */
-#define TDB_HTRIE_OFF(h, p)	((char *)(p) - (char *)(h))
-/* Get index and data block indexes by byte offset and vise versa. */
-#define TDB_HTRIE_O2DI(o)	((o) / TDB_HTRIE_MINDREC)
-#define TDB_HTRIE_O2II(o)	((o) / TDB_HTRIE_NODE_SZ)
-#define TDB_HTRIE_DI2O(i)	((i) * TDB_HTRIE_MINDREC)
-#define TDB_HTRIE_II2O(i)	((i) * TDB_HTRIE_NODE_SZ)
-/* Base offset of extent containing pointer @p. */
-#define TDB_EXT_BASE(h, p)	TDB_EXT_O(TDB_HTRIE_OFF(h, p))
-
-/**
- * Tempesta DB file descriptor.
- *
- * We store independent records in at least cache line size data blocks
- * to avoid false sharing.
- *
- * @dbsz	- the database size in bytes;
- * @rec_len	- fixed-size records length or zero for variable-length records;
- * @i_wcl	- index block next to write (byte offset);
- * @d_wcl	- data block next to write (byte offset);
- * @ext_bmp	- bitmap of used/free extents.
- * 		  Must be small and cache line aligned;
- * @i_wm, @d_wm	- watermarks (in extents) for index and data correspondingly.
- * 		  The watermarks grow towards each other and their meeting
- * 		  signals that the data file is full;
- */
-typedef struct {
-	unsigned long	magic;
-	unsigned long	dbsz;
-	unsigned long	i_wcl;
-	unsigned long	d_wcl;
-	unsigned int	rec_len;
-	unsigned short	i_wm;
-	unsigned short	d_wm;
-	unsigned char	_padding[8 * 3];
-	unsigned long	ext_bmp[0];
-} __attribute__((packed)) TdbHdr;
-
-/**
- * Tempesta DB extent descriptor.
- *
- * @b_bmp	- bitmap of used/free blocks;
- */
-typedef struct {
-	unsigned long	b_bmp[TDB_BLK_BMP_2L];
-} __attribute__((packed)) TdbExt;
-
-/**
- * Tempesta DB HTrie node.
- * This is exactly one cache line.
- * Each shift in @shifts determine index of a node in file including extent
- * and/or file headers, i.e. they start from 2 or 3.
- */
-typedef struct {
-	unsigned int	shifts[TDB_HTRIE_FANOUT];
-} __attribute__((packed)) TdbHtrieNode;
-
-/**
- * Header for bucket of small records.
- *
- * @coll_next	- next record offset (in data blocks) in collision chain;
- */
-typedef struct {
-	unsigned int 	coll_next;
-	unsigned int	flags;
-} __attribute__((packed)) TdbBucket;
-
-/**
- * Fixed-size (and typically small) records.
- */
-typedef struct {
-	unsigned long	key; /* must be the first */
-	char		data[0];
-} __attribute__((packed)) TdbFRec;
-
-/**
- * Variable-size (typically large) record.
- *
- * @chunk_next	- offset of next data chunk (also with TdbRecord as header)
- * @len		- data length of current chunk
- */
-typedef struct {
-	unsigned long	key; /* must be the first */
-	unsigned int	chunk_next;
-	unsigned int	len;
-	char		data[0];
-} __attribute__((packed)) TdbVRec;
-
-/* Common interface for database records of all kinds. */
-typedef TdbFRec TdbRec;
-
-#define TDB_HTRIE_VRFREED	TDB_HTRIE_DBIT
-#define TDB_HTRIE_VRLEN(r)	((r)->len & ~TDB_HTRIE_VRFREED)
-#define __RECLEN(h, r)							\
-	__builtin_choose_expr(__builtin_types_compatible_p(typeof(*(r)),\
-							   TdbVRec),	\
-			      /* The type cast is only to avoid compiler \
-			       * error, @r is always TdbVRec. */	\
-			      TDB_HTRIE_VRLEN((TdbVRec *)r),		\
-			      (h)->rec_len)
-#define TDB_HTRIE_RECLEN(h, r)	TDB_HTRIE_RALIGN(sizeof(*(r)) + __RECLEN(h, r))
-#define TDB_HTRIE_BUCKET_1ST(b)	((void *)((b) + 1))
-#define TDB_HTRIE_BUCKET_KEY(b)	(*(unsigned long *)TDB_HTRIE_BUCKET_1ST(b))
-/* Iterate over buckets in collision chain. */
-#define TDB_HTRIE_BUCKET_NEXT(h, b)					\
-({									\
-	(b)->coll_next							\
-	? TDB_HTRIE_PTR(h, TDB_HTRIE_DI2O((b)->coll_next))		\
-	: NULL;								\
- })
-
-#define TDB_HDR_SZ(h)							\
-	(sizeof(TdbHdr) + TDB_EXT_BMP_2L(h) * sizeof(long))
-#define TDB_HTRIE_ROOT(h)						\
-	(TdbHtrieNode *)((char *)(h) + TDB_HDR_SZ(h) + sizeof(TdbExt))
-
-/**
- * Iterate over all records in collision chain.
- * Buckets are inspected according to following rules:
- * - if first record is > TDB_HTRIE_MINDREC, then only it is observer;
- * - all records which fit TDB_HTRIE_MINDREC.
- *
- * @d	- database handler;
- * @b	- bucket to iterate over;
- * @r	- record pointer;
- */
-#define TDB_HTRIE_FOREACH_REC(d, b, r)					\
-	for ( ; b; b = TDB_HTRIE_BUCKET_NEXT(d, b))			\
-		for (r = TDB_HTRIE_BUCKET_1ST(b);			\
-		     ({ long _n = (char *)r - (char *)b + sizeof(*r);	\
-		        /* Crash if small records exceed small block	\
-			 * boundary. */					\
-			BUG_ON(_n < TDB_HTRIE_MINDREC			\
-			       && r != TDB_HTRIE_BUCKET_1ST(b)		\
-			       && _n + __RECLEN(d, r) > TDB_HTRIE_MINDREC);\
-			_n <= TDB_HTRIE_MINDREC; });			\
-		     r = (typeof(r))((char *)r + TDB_HTRIE_RECLEN(d, r)))
-
-static inline TdbExt *
-tdb_ext(TdbHdr *dbh, void *ptr)
-{
-	unsigned long e = TDB_EXT_O(ptr);
-
-	if (e == (unsigned long)dbh)
-		e += TDB_HDR_SZ(dbh); /* first extent */
-	return (TdbExt *)e;
-}
 
-static inline void
-tdb_set_bit(unsigned long *bmp, unsigned int nr)
-{
-	set_bit(nr % BITS_PER_LONG, bmp + nr / BITS_PER_LONG);
-}
 
-unsigned long
+static unsigned long
 tdb_hash_calc(const char *data, size_t len)
 {
 #define MUL	sizeof(long)
@@ -373,931 +107,1589 @@ tdb_hash_calc(const char *data, size_t len)
 	return h;
 #undef MUL
 }
-
-static TdbHdr *
-tdb_init_mapping(void *p, size_t db_size, unsigned int rec_len)
-{
-	TdbHdr *hdr = (TdbHdr *)p;
-
-	/* Use variable-size records for large stored data. */
-	if (rec_len > TDB_BLK_SZ / 2)
-		return NULL;
-
-	/* Zero whole area. */
-	memset(hdr, 0, db_size);
-
-	hdr->magic = TDB_MAGIC;
-	hdr->dbsz = db_size;
-	hdr->rec_len = rec_len;
-	/* Set index write cache line just after rool index node. */
-	hdr->i_wcl = TDB_HTRIE_IALIGN(TDB_HDR_SZ(hdr) + sizeof(TdbExt)
-				      + sizeof(TdbHtrieNode));
-	/* Data grows from the last extent to begin. */
-	hdr->d_wm = db_size / TDB_EXT_SZ - 1;
-	hdr->d_wcl = TDB_HTRIE_DALIGN(hdr->d_wm * TDB_EXT_SZ + sizeof(TdbExt));
-
-	/* Set first (current) extents and blocks as used. */
-	set_bit(0, hdr->ext_bmp);
-	set_bit(BITS_PER_LONG - 1, &hdr->ext_bmp[TDB_EXT_BMP_2L(hdr) - 1]);
-	set_bit(0, tdb_ext(hdr, hdr)->b_bmp);
-	set_bit(0, tdb_ext(hdr, TDB_HTRIE_PTR(hdr, hdr->d_wcl))->b_bmp);
-
-	return hdr;
-}
-
 /*
- * @return aligned and shrinked (if necessary) length to allocate data block.
- * Can be significanly less than @len for chunked data.
+ * ------------------------------------------------------------------------
+ *	Testing routines
+ * ------------------------------------------------------------------------
  */
-static size_t
-tdb_full_rec_len(TdbHdr *dbh, size_t *len)
-{
-	size_t align_len, rhl;
+#define TDB_VSF_SZ		(2UL * 1024 * 1024 * 1024)
+#define TDB_FSF_SZ		(16UL * 1024 * 1024)
 
-	rhl = TDB_HTRIE_VARLENRECS(dbh) ? sizeof(TdbVRec) : sizeof(TdbFRec);
+#if 0
+#include "urls.h"
+#else
+typedef struct {
+	char	*body;
+	size_t	len;
+} TestUrl;
 
-	/* Allocate at least 2 cache lines for small data records. */
-	align_len = TDB_HTRIE_DALIGN(*len + rhl);
+static TestUrl urls[] = {
+	{"", 0},
+	{"http://www.w3.org/1999/02/22-rdf-syntax-ns#", 0},
+	{"http://ns.adobe.com/iX/1.0/", 0},
+	{"http://www.w3.org/1999/02/22-rdf-syntax-ns#", 0},
+	{"http://purl.org/dc/elements/1.1/", 0},
+	{"http://www.cse.unsw.edu.au/~disy/papers/", 0},
+	{"http://developer.intel.com/design/itanium/family", 0},
+	{"http://www.caldera.com/developers/community/contrib/aim.html", 0},
+	{"http://www.sparc.org/standards.html", 0},
+	{"http://www.xplain.com", 0},
+	{"http://www.mactech.com/misc/about_mt.html", 0},
+	{"http://www.mactech.com/", 0},
+	{"http://www.google-analytics.com/urchin.js", 0},
+	{"http://www.betterram.com/", 0},
+	{"http://www.mactechdomains.com/", 0},
+	{"http://www.mactechsupplies.com/store.php?nfid=34", 0},
+	{"http://www.mactech.com/cables/", 0},
+	{"http://www.xplain.com", 0},
+	{"http://www.amazon.com/exec/obidos/redirect?link_code=ur2&amp;camp=178"
+	 "9&amp;tag=mactechmagazi-20&amp;creative=9325&amp;path=external-search"
+	 "\%3Fsearch-type=ss\%26keyword=ipod\%26index=pc-hardware", 0},
+	{"http://store.mactech.com/mactech/riskfree/offer.html?FROM=MTRF", 0},
+	{"http://www.google.com/", 0},
+	{"http://www.google.com/logos/Logo_25wht.gif", 0},
+	{"http://www.xplain.com", 0},
+	{NULL, 0}
+};
+#endif
 
-	if (align_len > TDB_BLK_SZ) {
-		*len -= align_len - TDB_BLK_SZ;
-		align_len = TDB_BLK_SZ;
-	}
+static unsigned int ints[] = {
+	0, 324, 2324345, 10, 4000111222, 2111222999, 2, 3, 4, 5, 6, 7, 100,
+	3999888999, 4222999888, 2500600800, 65535, 200, 2000, 20000, 200000,
+	2000000, 20000000, 200000000, 2000000000, 2000000001, 10, 11, 12, 13,
+	4000111222, 3111222999, 4294967290, 32424, 9986, 7344, 23354, 6876437
+};
 
-	return align_len;
-}
+/* Concurrent test: threads, keys per thread and database size. */
+#define TDB_CT_THREADS		4
+#define TDB_CT_KEYS		20000
+#define TDB_CT_SZ		(256UL * 1024 * 1024)
 
-static inline void
-tdb_free_index_blk(TdbHtrieNode *node)
+static unsigned long
+tv_to_ms(const struct timeval *tv)
 {
-	/* Just zero the block and leave it for garbage collector. */
-	memset(node, 0, sizeof(*node));
+	return ((unsigned long)tv->tv_sec * 1000000 + tv->tv_usec) / 1000;
 }
 
-static inline void
-tdb_free_data_blk(TdbBucket *bckt)
+unsigned long
+test_hash_calc_dummy(const char *data, size_t len)
 {
-	bckt->flags |= TDB_HTRIE_VRFREED;
-}
+	int i;
+	unsigned long h = 0;
 
-static inline void
-tdb_free_fsrec(TdbHdr *dbh, TdbFRec *rec)
-{
-	memset(rec, 0, TDB_HTRIE_RALIGN(sizeof(*rec) + dbh->rec_len));
+	for (i = 0; i < len; ++i)
+		h += data[i] * (i + 1);
+
+	return h;
 }
 
-static inline int
-tdb_live_fsrec(TdbHdr *dbh, TdbFRec *rec)
+/**
+ * Benchmark for SSE 4.2 and trivial C hash function.
+ */
+void
+hash_calc_benchmark(void)
 {
-	int i, res = 0;
-	size_t len = TDB_HTRIE_RALIGN(sizeof(*rec) + dbh->rec_len)
-		     / sizeof(long);
+#define N 1024
+	int r __attribute__((unused)), i, acc = 0;
+	TestUrl *u;
+	struct timeval tv0, tv1;
 
-	for (i = 0; i < len; ++i)
-		res = !!((unsigned long *)rec)[i];
-	return res;
-}
+	r = gettimeofday(&tv0, NULL);
+	assert(!r);
+	for (i = 0; i < N; ++i)
+		for (u = urls; u->body; ++u)
+			acc += tdb_hash_calc(u->body, u->len);
+	r = gettimeofday(&tv1, NULL);
+	assert(!r);
+	printf("tdb hash: time=%lums ignore_val=%d\n",
+	       tv_to_ms(&tv1) - tv_to_ms(&tv0), acc);
 
-static inline void
-tdb_free_vsrec(TdbVRec *rec)
-{
-	rec->len |= TDB_HTRIE_VRFREED;
+	r = gettimeofday(&tv0, NULL);
+	assert(!r);
+	for (i = 0; i < N; ++i)
+		for (u = urls; u->body; ++u)
+			acc += test_hash_calc_dummy(u->body, u->len);
+	r = gettimeofday(&tv1, NULL);
+	assert(!r);
+	printf("dummy hash: time=%lums ignore_val=%d\n",
+	       tv_to_ms(&tv1) - tv_to_ms(&tv0), acc);
+#undef N
 }
 
-static inline int
-tdb_live_vsrec(TdbVRec *rec)
+void *
+tdb_htrie_open(const char *fname, size_t size)
 {
-	return rec->len && !(rec->len & TDB_HTRIE_VRFREED);
-}
+	int fd;
+	void *p;
+	struct stat sb = { 0 };
 
-/**
- * Allocates a free block (system page) in extent @e.
- * @return start of available room (offset in bytes) at the block.
- */
-static inline unsigned long
-tdb_alloc_blk(TdbHdr *dbh, TdbExt *e)
-{
-	int i;
-	unsigned long r;
+	if ((fd = open(fname, O_RDWR|O_CREAT, 0600)) < 0)
+		TDB_ERR("open failure");
 
-	for (i = 0; i < TDB_BLK_BMP_2L; ++i) {
-		if (!(e->b_bmp[i] ^ ~0UL))
-			continue;
+	if (fstat(fd, &sb) < 0)
+		TDB_ERR("no file");
 
-		r = ffz(e->b_bmp[i]);
-		set_bit(r, &e->b_bmp[i]);
-		r = TDB_EXT_BASE(dbh, e) + r * TDB_BLK_SZ;
-		if (!r) {
-			r += sizeof(*e);
-			if (TDB_EXT_O(e) == TDB_EXT_O(dbh))
-				r += TDB_HDR_SZ(dbh);
-		}
-		return r;
-	}
+	if (sb.st_size != size)
+		if (fallocate(fd, 0, 0, size))
+			TDB_ERR("fallocate failure");
 
-	return 0;
-}
+	/* Use MAP_SHARED to carry changes to underlying file. */
+	p = mmap((void *)TDB_MAP_ADDR, size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		TDB_ERR("cannot mmap the file");
+	printf("maped to %p\n", p);
 
-static unsigned long
-tdb_alloc_index_blk(TdbHdr *dbh)
-{
-	unsigned long rptr;
-	TdbExt *e = tdb_ext(dbh, TDB_HTRIE_PTR(dbh, dbh->i_wcl));
+	if (mlock(p, size))
+		TDB_ERR("mlock failure");
 
-	while (1) {
-		rptr = tdb_alloc_blk(dbh, e);
-		if (!rptr) {
-			unsigned long eo;
-			if (TDB_HTRIE_OFF(dbh, e) + TDB_EXT_SZ * 2 > dbh->d_wm)
-				return 0;
-			e = (TdbExt *)(TDB_EXT_O(e) + TDB_EXT_SZ);
-			eo = TDB_EXT_ID(TDB_HTRIE_OFF(dbh, e));
-			if (dbh->i_wm < eo)
-				dbh->i_wm = eo;
-			tdb_set_bit(dbh->ext_bmp,
-				    TDB_EXT_ID(TDB_EXT_BASE(dbh, e)));
-			continue;
-		}
-		return TDB_HTRIE_IALIGN(rptr);
-	}
+	/* Start from empty database on each run. */
+	((TdbHdr *)p)->magic = 0;
+
+	return p;
 }
 
-static unsigned long
-tdb_alloc_data_blk(TdbHdr *dbh)
+/**
+ * Just free the memory region, the file will be closed on program exit.
+ */
+void
+tdb_htrie_pure_close(void *addr, size_t size)
 {
-	unsigned long rptr;
-	TdbExt *e = tdb_ext(dbh, TDB_HTRIE_PTR(dbh, dbh->d_wcl));
-
-	while (1) {
-		rptr = tdb_alloc_blk(dbh, e);
-		if (!rptr) {
-			/* No room in current extent, try the next one. */
-			unsigned long eo;
-			if (TDB_HTRIE_OFF(dbh, e) <  dbh->i_wm + TDB_EXT_SZ * 2)
-				return 0;
-			e = (TdbExt *)((char *)e - TDB_EXT_SZ);
-			eo = TDB_EXT_ID(TDB_HTRIE_OFF(dbh, e));
-			if (dbh->d_wm > eo)
-				dbh->d_wm = eo;
-			tdb_set_bit(dbh->ext_bmp,
-				    TDB_EXT_ID(TDB_EXT_BASE(dbh, e)));
-			continue;
-		}
-		return TDB_HTRIE_DALIGN(rptr);
-	}
+	munlock(addr, size);
+	munmap(addr, size);
 }
 
 /**
- * @return byte offset of the allocated data block and sets @len to actually
- * available room for writting if @len doesn't fit to block.
- *
- * Return 0 on error.
+ * Compare the record (all its chunks) with @data.
  */
-static unsigned long
-tdb_alloc_data(TdbHdr *dbh, size_t len)
+static int
+tdb_htrie_vrec_eq(TdbHdr *dbh, TdbVRec *r, const char *data, size_t len)
 {
-	unsigned long rptr = dbh->d_wcl;
-
-	BUG_ON(len > TDB_BLK_SZ);
+	size_t n, off = 0;
 
-	/* Never allocate too small chunks. */
-	if (len < TDB_HTRIE_MINDREC)
-		len = TDB_HTRIE_MINDREC;
-
-	if (unlikely((dbh->i_wm + 1) * TDB_EXT_SZ + len + dbh->d_wcl
-		      > dbh->dbsz + dbh->d_wm * TDB_EXT_SZ))
-		return 0; /* not enough space */
-
-	if (TDB_BLK_ID(rptr + len) > TDB_BLK_ID(rptr)) {
-		/* Use a new page and/or extent for the data. */
-		rptr = tdb_alloc_data_blk(dbh);
-		if (!rptr)
+	while (1) {
+		n = TDB_HTRIE_VRLEN(r);
+		if (off + n > len || memcmp(r->data, data + off, n))
 			return 0;
+		off += n;
+		if (!r->chunk_next)
+			break;
+		r = TDB_PTR(dbh, TDB_DI2O(r->chunk_next));
 	}
 
-	TDB_DBG("alloc dblk %#lx for len=%lu\n", rptr, len);
-	BUG_ON(TDB_HTRIE_DALIGN(rptr) != rptr);
-
-	dbh->d_wcl = rptr + len;
-
-	return rptr;
+	return off == len;
 }
 
 /**
- * Allocates a new index block.
- * @return byte offset of the block.
+ * Store variable-size record in the database copying the data
+ * to as many chunks as required.
  */
-static unsigned long
-tdb_alloc_index(TdbHdr *dbh)
+static TdbVRec *
+tdb_htrie_put_vrec(TdbHdr *dbh, unsigned long key, const char *data,
+		   size_t len)
 {
-	unsigned long rptr = dbh->i_wcl;
-
-	if (unlikely(TDB_BLK_ID(rptr + sizeof(TdbHtrieNode))
-		     > TDB_BLK_ID(rptr)))
-	{
-		/* Use a new page and/or extent for the data. */
-		rptr = tdb_alloc_index_blk(dbh);
-		if (!rptr)
-			return 0;
-	}
+	size_t copied = len;
+	TdbVRec *rec, *chunk;
 
-	TDB_DBG("alloc iblk %#lx\n", rptr);
-	BUG_ON(TDB_HTRIE_IALIGN(rptr) != rptr);
+	rec = (TdbVRec *)tdb_htrie_insert(dbh, key, (void *)data, &copied);
+	if (!rec)
+		return NULL;
 
-	dbh->i_wcl = rptr + sizeof(TdbHtrieNode);
+	for (chunk = rec; copied < len; copied += TDB_HTRIE_VRLEN(chunk)) {
+		chunk = tdb_htrie_extend_rec(dbh, chunk, len - copied);
+		if (!chunk)
+			return NULL;
+		memcpy(chunk->data, data + copied, TDB_HTRIE_VRLEN(chunk));
+	}
 
-	return rptr;
+	return rec;
 }
 
-TdbHdr *
-tdb_htrie_init(void *p, size_t db_size, unsigned int rec_len)
+void
+tdb_htrie_test_varsz(const char *fname)
 {
-	TdbHdr *hdr = (TdbHdr *)p;
+	char *addr;
+	int r __attribute__((unused));
+	TestUrl *u;
+	TdbHdr *dbh;
+	struct timeval tv0, tv1;
 
-	if (hdr->magic != TDB_MAGIC)
-		hdr = tdb_init_mapping(p, db_size, rec_len);
+	printf("\n----------- Variable size records test -------------\n");
 
-	TDB_DBG("init db header: i_wcl=%lu d_wcl=%lu db_size=%lu rec_len=%u"
-		" i_wm=%u d_wm=%u\n",
-		hdr->i_wcl, hdr->d_wcl, hdr->dbsz, hdr->rec_len, hdr->i_wm,
-		hdr->d_wm);
+	addr = tdb_htrie_open(fname, TDB_VSF_SZ);
 
-	return hdr;
-}
+	dbh = tdb_htrie_init(addr, TDB_VSF_SZ, 0);
+	if (!dbh)
+		TDB_ERR("cannot initialize htrie for urls");
 
-static void
-tdb_htrie_init_bucket(TdbBucket *b)
-{
-	b->coll_next = 0;
-	b->flags = 0;
-}
+	r = gettimeofday(&tv0, NULL);
+	assert(!r);
 
-/**
- * Lookup for some room just after @b bucket if it's small enough.
- * Traverses the collision chain in hope to find some room somewhere.
- *
- * The function links the last small record with the new (returned) one.
- */
-static unsigned long
-tdb_htrie_smallrec_link(TdbHdr *dbh, size_t len, TdbBucket *bckt)
-{
-	unsigned long n, o = 0;
+	/* Store records. */
+	for (u = urls; u->body; ++u) {
+		unsigned long k = tdb_hash_calc(u->body, u->len);
 
-	if (TDB_HTRIE_VARLENRECS(dbh)) {
-		TdbVRec *r;
-		TDB_HTRIE_FOREACH_REC(dbh, bckt, r) {
-			n = (char *)r - (char *)bckt
-			    + TDB_HTRIE_RALIGN(sizeof(*r) + len);
-			if (!tdb_live_vsrec(r) && n <= TDB_HTRIE_MINDREC) {
-				/* Freed record - reuse. */
-				memset(r, 0, sizeof(*r) + TDB_HTRIE_VRLEN(r));
-				o = TDB_HTRIE_OFF(dbh, r);
-				goto done;
-			}
+		printf("insert [%.40s...] (len=%lu)\n", u->body, u->len);
+		fflush(NULL);
+
+		if (!tdb_htrie_put_vrec(dbh, k, u->body, u->len))
+			TDB_ERR("cannot insert URL [%.20s...]\n", u->body);
+	}
+
+	/* Read records. */
+	for (u = urls; u->body; ++u) {
+		unsigned long k = tdb_hash_calc(u->body, u->len);
+		TdbBucket *b;
+		TdbVRec *rec;
+
+		printf("results for [%.40s...] lookup:\n", u->body);
+		fflush(NULL);
+
+		b = tdb_htrie_lookup(dbh, k);
+		if (!b)
+			TDB_ERR("can't find URL [%.20s...]\n", u->body);
+
+		TDB_HTRIE_FOREACH_REC(dbh, b, rec) {
+			if (!tdb_live_vsrec(rec))
+				continue;
+			printf("\t[%.64s...] key=%#lx bckt=%p\n", rec->data,
+			       rec->key, b);
+			if (rec->key == k
+			    && !tdb_htrie_vrec_eq(dbh, rec, u->body, u->len))
+				TDB_ERR("bad data for URL [%.20s...]\n",
+					u->body);
 		}
-	} else {
-		TdbFRec *r;
-		TDB_HTRIE_FOREACH_REC(dbh, bckt, r) {
-			n = (char *)r - (char *)bckt
-			    + TDB_HTRIE_RALIGN(sizeof(*r) + len);
-			if (!tdb_live_fsrec(dbh, r) && n <= TDB_HTRIE_MINDREC) {
-				/* Already freed record - just reuse. */
-				o = TDB_HTRIE_OFF(dbh, r);
-				goto done;
+		fflush(NULL);
+	}
+
+	r = gettimeofday(&tv1, NULL);
+	assert(!r);
+
+	printf("tdb htrie urls test: time=%lums\n",
+		tv_to_ms(&tv1) - tv_to_ms(&tv0));
+
+	tdb_htrie_pure_close(addr, TDB_VSF_SZ);
+}
+
+void
+tdb_htrie_test_fixsz(const char *fname)
+{
+	int r __attribute__((unused));
+	char *addr;
+	unsigned int *i;
+	TdbHdr *dbh;
+	struct timeval tv0, tv1;
+
+	printf("\n----------- Fixed size records test -------------\n");
+
+	addr = tdb_htrie_open(fname, TDB_FSF_SZ);
+
+	dbh = tdb_htrie_init(addr, TDB_FSF_SZ, sizeof(ints[0]));
+	if (!dbh)
+		TDB_ERR("cannot initialize htrie for ints");
+
+	r = gettimeofday(&tv0, NULL);
+	assert(!r);
+
+	/* Store records. */
+	for (i = ints; i < ints + sizeof(ints) / sizeof(ints[0]); ++i) {
+		size_t copied = sizeof(*i);
+		TdbRec *rec __attribute__((unused));
+
+		printf("insert int %u\n", *i);
+		fflush(NULL);
+
+		rec = tdb_htrie_insert(dbh, *i, i, &copied);
+		assert(rec && copied == sizeof(*i));
+	}
+
+	/* Read records. */
+	for (i = ints; i < ints + sizeof(ints) / sizeof(ints[0]); ++i) {
+		TdbBucket *b;
+		TdbFRec *rec;
+
+		printf("results for int %u lookup:\n", *i);
+		fflush(NULL);
+
+		b = tdb_htrie_lookup(dbh, *i);
+		if (!b)
+			TDB_ERR("can't find int %u\n", *i);
+
+		/* Zero key with zero data is indistinguishable from free room. */
+		rec = tdb_htrie_bscan_for_rec(dbh, b, *i);
+		if (*i && (!rec || *(unsigned int *)rec->data != *i))
+			TDB_ERR("bad record for int %u\n", *i);
+
+		TDB_HTRIE_FOREACH_REC(dbh, b, rec) {
+			if (tdb_live_fsrec(dbh, rec)) {
+				printf("\t(%#x) %u bckt=%p\n",
+				       *(unsigned int *)rec->data,
+				       *(unsigned int *)rec->data, b);
+				fflush(NULL);
 			}
 		}
 	}
 
-done:
-	TDB_DBG("Small record aggregation dblk=%#lx bckt=%#lx len=%lu\n",
-		o, TDB_HTRIE_OFF(dbh, bckt), len);
+	r = gettimeofday(&tv1, NULL);
+	assert(!r);
+
+	printf("tdb htrie ints test: time=%lums\n",
+		tv_to_ms(&tv1) - tv_to_ms(&tv0));
 
-	return o;
+	tdb_htrie_pure_close(addr, TDB_FSF_SZ);
 }
 
-/**
- * Grow the tree.
- *
- * @node	- current index node at which least significant bits collision
- * 		  happened.
+/*
+ * Concurrent test: writers insert disjoint key sets while readers look up
+ * the keys which are already inserted. Each record keeps its key in the
+ * first 8 bytes of data, so readers can check that they never see
+ * partially written records.
  */
+static TdbHdr *ct_dbh;
+static volatile int ct_progress[TDB_CT_THREADS];
+static volatile int ct_done;
+
+static unsigned long
+ct_key(int t, int i)
+{
+	unsigned long k = ((unsigned long)t * TDB_CT_KEYS + i + 1)
+			  * 0x9E3779B97F4A7C15UL;
+
+	/* Make some keys collide in all bits used by the index. */
+	if (!(i % 50))
+		k = 0xABCDEF00UL + i % 7;
+
+	return k;
+}
+
 static int
-tdb_htrie_burst(TdbHdr *dbh, TdbHtrieNode **node, TdbBucket *bckt,
-		unsigned long key, int bits)
+ct_find(unsigned long key)
 {
-	int i, free_nb;
-	unsigned int new_in_idx;
-	unsigned long k, n;
-	TdbBucket *b = TDB_HTRIE_BUCKET_1ST(bckt);
-	TdbHtrieNode *new_in;
-	struct {
-		unsigned long	b;
-		unsigned char	off;
-	} nb[TDB_HTRIE_FANOUT] = {{0, 0}};
-
-	n = tdb_alloc_index(dbh);
-	if (!n)
-		return -ENOMEM;
-	new_in = TDB_HTRIE_PTR(dbh, n);
-	new_in_idx = TDB_HTRIE_O2II(n);
-
-#define MOVE_RECORDS(Type, live)					\
-do {									\
-	Type *r = (Type *)b;						\
-	k = TDB_HTRIE_IDX(r->key, bits);				\
-	/* Always leave first record in the same data block. */		\
-	new_in->shifts[k] = TDB_HTRIE_O2DI(TDB_HTRIE_OFF(dbh, bckt))	\
-			    | TDB_HTRIE_DBIT;				\
-	TDB_DBG("link bckt=%p w/ iblk=%#x by %#lx (key=%#lx)\n",	\
-		bckt, new_in_idx, k, r->key);				\
-	n = TDB_HTRIE_RALIGN(sizeof(*r) + __RECLEN(dbh, r));		\
-	nb[k].b = TDB_HTRIE_OFF(dbh, bckt);				\
-	nb[k].off = sizeof(*b) + n;					\
-	free_nb = -(long)k; /* remember which block we save & copy */	\
-	r = (Type *)((char *)r + n);					\
-	for ( ; ; r = (Type *)((char *)r + n)) {			\
-		unsigned long copied = (char *)r - (char *)bckt;	\
-		if (sizeof(*r) + copied >= TDB_HTRIE_MINDREC)		\
-			break; /* end of records */			\
-		n = TDB_HTRIE_RECLEN(dbh, r);				\
-		if (!live)						\
-			continue;					\
-		/* Small record cannot exceed TDB_HTRIE_MINDREC. */	\
-		BUG_ON(copied + n > TDB_HTRIE_MINDREC);			\
-		k = TDB_HTRIE_IDX(r->key, bits);			\
-		if (!nb[k].b) {						\
-			nb[k].b = tdb_alloc_data(dbh, 0);		\
-			if (!nb[k].b)					\
-				goto err_cleanup;			\
-			b = TDB_HTRIE_PTR(dbh, nb[k].b);		\
-			tdb_htrie_init_bucket(b);			\
-			memcpy(TDB_HTRIE_BUCKET_1ST(b), r, n);		\
-			nb[k].off = sizeof(*b) + n;			\
-			new_in->shifts[k] = TDB_HTRIE_O2DI(nb[k].b)	\
-					    | TDB_HTRIE_DBIT;		\
-			/* We copied a record, clear its orignal place. */\
-			free_nb = free_nb > 0 ? free_nb : -free_nb;	\
-			TDB_DBG("copied rec=%p (len=%lu key=%#lx) to"	\
-				" new dblk=%#lx w/ idx=%#lx\n",		\
-				r, n, r->key, nb[k].b, k);		\
-		} else {						\
-			b = TDB_HTRIE_PTR(dbh, nb[k].b + nb[k].off);	\
-			memmove(b, r, n);				\
-			nb[k].off += n;					\
-			TDB_DBG("moved rec=%p (len=%lu key=%#lx) to"	\
-				" dblk=%#lx w/ idx=%#lx\n",		\
-				r, n, r->key, nb[k].b, k);		\
-		}							\
-	}								\
-} while (0)
+	TdbBucket *b = tdb_htrie_lookup(ct_dbh, key);
+
+	if (!b)
+		return 0;
 
-	if (TDB_HTRIE_VARLENRECS(dbh))
-		MOVE_RECORDS(TdbVRec, tdb_live_vsrec(r));
-	else
-		MOVE_RECORDS(TdbFRec, tdb_live_fsrec(dbh, r));
-
-#undef MOVE_RECORDS
-
-	/* Link the new index node with @node. */
-	TDB_DBG("link iblk=%p w/ iblk=%p (%#x) by idx=%#lx\n",
-		*node, new_in, new_in_idx, k);
-	k = TDB_HTRIE_IDX(key, bits - TDB_HTRIE_BITS);
-	(*node)->shifts[k] = new_in_idx;
-	*node = new_in;
-
-	/* Now we can safely remove all copied records. */
-	if (free_nb > 0) {
-		TDB_DBG("clear dblk=%#lx from %#x\n",
-			nb[free_nb].b, nb[free_nb].off);
-		memset(TDB_HTRIE_PTR(dbh, nb[free_nb].b + nb[free_nb].off),
-		       0, TDB_HTRIE_MINDREC - nb[free_nb].off);
+	if (TDB_HTRIE_VARLENRECS(ct_dbh)) {
+		TdbVRec *r;
+		TDB_HTRIE_FOREACH_REC(ct_dbh, b, r)
+			if (tdb_live_vsrec(r) && r->key == key
+			    && *(unsigned long *)r->data == key)
+				return 1;
+	} else {
+		TdbFRec *r;
+		TDB_HTRIE_FOREACH_REC(ct_dbh, b, r)
+			if (r->key == key && *(unsigned long *)r->data == key)
+				return 1;
 	}
 
 	return 0;
-err_cleanup:
-	if (free_nb > 0)
-		for (i = 0; i < TDB_HTRIE_FANOUT; ++i)
-			if (i != free_nb && nb[i].b)
-				tdb_free_data_blk(TDB_HTRIE_PTR(dbh, nb[i].b));
-	tdb_free_index_blk(new_in);
-	return -ENOMEM;
 }
 
-/**
- * Descend the the tree starting at @node.
- *
- * @retrurn byte offset of data (w/o TDB_HTRIE_DBIT bit) on success
- * or 0 if key @key was not found.
- * When function exits @node stores the last index node.
- * @bits - number of bits (from less significant to most significant) from
- * which we should start descending and the stored number of resolved bits.
- *
- * Least significant bits in our hash function have most entropy,
- * so we resolve the key from least significant bits to most significant.
- */
-static unsigned long
-tdb_htrie_descend(TdbHdr *dbh, TdbHtrieNode **node, unsigned long key,
-		  int *bits)
+static void *
+ct_writer(void *arg)
 {
-	while (1) {
-		unsigned long o;
-
-		BUG_ON(TDB_HTRIE_RESOLVED(*bits));
-
-		o = (*node)->shifts[TDB_HTRIE_IDX(key, *bits)];
-
-		TDB_DBG("Descend iblk=%p key=%#lx bits=%d -> %#lx\n",
-			*node, key, *bits, o);
-		BUG_ON(o
-		       && (TDB_HTRIE_DI2O(o & ~TDB_HTRIE_DBIT)
-				< TDB_HDR_SZ(dbh) + sizeof(TdbExt)
-			   || TDB_HTRIE_DI2O(o & ~TDB_HTRIE_DBIT)
-				> dbh->dbsz));
-
-		if (o & TDB_HTRIE_DBIT) {
-			/* We're at a data pointer - resolve it. */
-			*bits += TDB_HTRIE_BITS;
-			o ^= TDB_HTRIE_DBIT;
-			BUG_ON(!o);
-			return TDB_HTRIE_DI2O(o);
-		} else {
-			if (!o)
-				return 0; /* cannot descend deeper */
-			*node = TDB_HTRIE_PTR(dbh, TDB_HTRIE_II2O(o));
-			*bits += TDB_HTRIE_BITS;
-		}
+	int i, t = (long)arg;
+	char data[256];
+
+	for (i = 0; i < TDB_CT_KEYS; ++i) {
+		unsigned long k = ct_key(t, i);
+		size_t len = TDB_HTRIE_VARLENRECS(ct_dbh)
+			     ? sizeof(k) + i % 150
+			     : ct_dbh->rec_len;
+
+		memcpy(data, &k, sizeof(k));
+		memset(data + sizeof(k), (char)k, len - sizeof(k));
+		if (!tdb_htrie_insert(ct_dbh, k, data, &len))
+			TDB_ERR("cannot insert key %#lx\n", k);
+
+		__sync_synchronize();
+		ct_progress[t] = i + 1;
 	}
+
+	return NULL;
 }
 
-static TdbRec *
-tdb_htrie_create_rec(TdbHdr *dbh, unsigned long off, unsigned long key,
-		     void *data, size_t len, int init_bucket)
+static void *
+ct_reader(void *arg)
 {
-	char *ptr = TDB_HTRIE_PTR(dbh, off);
-	TdbRec *r;
+	int t, n;
+	unsigned long lookups = 0;
+
+	while (!ct_done)
+		for (t = 0; t < TDB_CT_THREADS; ++t) {
+			if (!(n = ct_progress[t]))
+				continue;
+			++lookups;
+			if (!ct_find(ct_key(t, rand() % n)))
+				TDB_ERR("reader can't find inserted key\n");
+		}
 
-	if (init_bucket) {
-		tdb_htrie_init_bucket((TdbBucket *)ptr);
-		ptr += sizeof(TdbBucket);
-	}
+	printf("reader: %lu lookups\n", lookups);
 
-	r = (TdbRec *)ptr;
-	BUG_ON(r->key);
-	r->key = key;
-	if (TDB_HTRIE_VARLENRECS(dbh)) {
-		TdbVRec *vr = (TdbVRec *)r;
-		BUG_ON(vr->len || vr->chunk_next);
-		vr->chunk_next = 0;
-		vr->len = len;
-		ptr += sizeof(TdbVRec);
-	} else {
-		ptr += sizeof(TdbFRec);
-	}
-	memcpy(ptr, data, len);
+	return NULL;
+}
 
-	return r;
+void
+tdb_htrie_test_concurrent(unsigned int rec_len)
+{
+	int t, i;
+	void *addr;
+	pthread_t wr[TDB_CT_THREADS], rd;
+
+	printf("\n----------- Concurrent %s records test -------------\n",
+	       rec_len ? "fixed size" : "variable size");
+
+	addr = mmap(NULL, TDB_CT_SZ, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		TDB_ERR("cannot allocate memory for concurrent test");
+
+	ct_dbh = tdb_htrie_init(addr, TDB_CT_SZ, rec_len);
+	if (!ct_dbh)
+		TDB_ERR("cannot initialize htrie for concurrent test");
+	ct_done = 0;
+	memset((void *)ct_progress, 0, sizeof(ct_progress));
+
+	if (pthread_create(&rd, NULL, ct_reader, NULL))
+		TDB_ERR("cannot create reader thread");
+	for (t = 0; t < TDB_CT_THREADS; ++t)
+		if (pthread_create(&wr[t], NULL, ct_writer, (void *)(long)t))
+			TDB_ERR("cannot create writer thread");
+	for (t = 0; t < TDB_CT_THREADS; ++t)
+		pthread_join(wr[t], NULL);
+	ct_done = 1;
+	pthread_join(rd, NULL);
+
+	for (t = 0; t < TDB_CT_THREADS; ++t)
+		for (i = 0; i < TDB_CT_KEYS; ++i)
+			if (!ct_find(ct_key(t, i)))
+				TDB_ERR("can't find key %#lx\n", ct_key(t, i));
+
+	printf("tdb htrie concurrent test: %d keys, i_wm=%u d_wm=%u\n",
+	       TDB_CT_THREADS * TDB_CT_KEYS, ct_dbh->i_wm, ct_dbh->d_wm);
+
+	munmap(addr, TDB_CT_SZ);
 }
 
-/**
- * Add more data to @rec.
- *
- * TODO update semantic to return TdbVRec *.
+/*
+ * In-place updates test: threads increment counters of random keys
+ * concurrently while the counters are created and the index grows.
  */
-void *
-tdb_htrie_extend_rec(TdbHdr *dbh, TdbRec *rec, size_t *size)
+#define TDB_UT_KEYS		5000
+#define TDB_UT_INCS		200000
+
+static unsigned long
+ut_key(int i)
 {
-	unsigned long o;
-	TdbVRec *chunk, *r = (TdbVRec *)rec;
+	return (i + 1) * 0x9E3779B97F4A7C15UL;
+}
 
-	/* Cannot extend fixed-size records. */
-	BUG_ON(!TDB_HTRIE_VARLENRECS(dbh));
+static void *
+ut_thread(void *arg)
+{
+	int i;
+	unsigned int seed = (long)arg;
+	TdbRec *r;
 
-	o = tdb_alloc_data(dbh, tdb_full_rec_len(dbh, size));
-	if (!o)
-		return NULL;
+	for (i = 0; i < TDB_UT_INCS; ++i) {
+		r = tdb_htrie_get_rec(ct_dbh, ut_key(rand_r(&seed)
+						     % TDB_UT_KEYS));
+		if (!r)
+			TDB_ERR("cannot get record for update\n");
+		__sync_fetch_and_add((unsigned long *)r->data, 1);
+		tdb_htrie_put_rec(ct_dbh, r);
+	}
 
-	chunk = TDB_HTRIE_PTR(dbh, o);
-	chunk->key = r->key;
-	chunk->chunk_next = 0;
-	chunk->len = *size;
+	return NULL;
+}
 
-	while (r->chunk_next)
-		r = TDB_HTRIE_PTR(dbh, TDB_HTRIE_DI2O(r->chunk_next));
-	BUG_ON(!tdb_live_vsrec(r));
+void
+tdb_htrie_test_update(void)
+{
+	int t, i, n;
+	void *addr;
+	unsigned long k, sum = 0;
+	pthread_t thr[TDB_CT_THREADS];
+
+	printf("\n----------- Concurrent in-place updates test -------------\n");
+
+	addr = mmap(NULL, TDB_FSF_SZ, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		TDB_ERR("cannot allocate memory for updates test");
+	ct_dbh = tdb_htrie_init(addr, TDB_FSF_SZ, sizeof(unsigned long));
+	if (!ct_dbh)
+		TDB_ERR("cannot initialize htrie for updates test");
+
+	for (t = 0; t < TDB_CT_THREADS; ++t)
+		if (pthread_create(&thr[t], NULL, ut_thread,
+				   (void *)(long)t + 1))
+			TDB_ERR("cannot create update thread");
+	for (t = 0; t < TDB_CT_THREADS; ++t)
+		pthread_join(thr[t], NULL);
+
+	for (i = 0; i < TDB_UT_KEYS; ++i) {
+		TdbFRec *r;
+		TdbBucket *b;
 
-	r->chunk_next = o;
+		k = ut_key(i);
+		if (!(b = tdb_htrie_lookup(ct_dbh, k)))
+			continue;
+		n = 0;
+		TDB_HTRIE_FOREACH_REC(ct_dbh, b, r)
+			if (r->key == k && tdb_live_fsrec(ct_dbh, r)) {
+				sum += *(unsigned long *)r->data;
+				++n;
+			}
+		if (n > 1)
+			TDB_ERR("%d records for key %#lx\n", n, k);
+	}
+	printf("tdb htrie updates test: %lu increments of %d\n", sum,
+	       TDB_CT_THREADS * TDB_UT_INCS);
+	if (sum != TDB_CT_THREADS * TDB_UT_INCS)
+		TDB_ERR("lost updates\n");
 
-	return chunk + 1;
+	munmap(addr, TDB_FSF_SZ);
 }
 
 /**
- * @len returns number of copied data on success.
+ * Records expiration test: every third record lives for a short time,
+ * every third one lives for a long time (its timer is cascaded through
+ * the wheel levels) and the rest records live forever.
  */
-TdbRec *
-tdb_htrie_insert(TdbHdr *dbh, unsigned long key, void *data, size_t *len)
-{
-	int bits = 0;
-	unsigned long o;
-	TdbBucket *bckt;
-	TdbRec *rec;
-	TdbHtrieNode *node = TDB_HTRIE_ROOT(dbh);
-
-	/* Don't store empty data. */
-	if (unlikely(!*len))
-		return NULL;
+#define TDB_TT_KEYS		3000
+#define TDB_TT_BASE		1000000UL
+#define TDB_TT_SHORT		10
+#define TDB_TT_LONG		5000
+#define TDB_TT_STEP		7
 
-retry:
-	o = tdb_htrie_descend(dbh, &node, key, &bits);
-	if (!o) {
-		TDB_DBG("Create a new htrie node for key %#lx\n", key);
+static int
+tt_alive(TdbHdr *dbh, unsigned long key)
+{
+	TdbBucket *b = tdb_htrie_lookup(dbh, key);
+	TdbRec *r = b ? tdb_htrie_bscan_for_rec(dbh, b, key) : NULL;
 
-		o = tdb_alloc_data(dbh, tdb_full_rec_len(dbh, len));
-		if (!o)
-			return NULL;
+	if (!r)
+		return 0;
+	return TDB_HTRIE_VARLENRECS(dbh) ? tdb_live_vsrec((TdbVRec *)r)
+					 : r->key == key;
+}
 
-		rec = tdb_htrie_create_rec(dbh, o, key, data, *len, 1);
+static void
+tt_check(TdbHdr *dbh, int expired)
+{
+	int i;
 
-		node->shifts[TDB_HTRIE_IDX(key, bits)] = TDB_HTRIE_O2DI(o)
-							 | TDB_HTRIE_DBIT;
+	for (i = 0; i < TDB_TT_KEYS; ++i) {
+		int exp = i % 3 < expired;
 
-		return rec;
+		if (tt_alive(dbh, ut_key(i)) == exp)
+			TDB_ERR("record %d (rec_len=%u) is %s\n", i,
+				dbh->rec_len, exp ? "alive" : "lost");
 	}
+}
 
-	/*
-	 * HTrie collision.
-	 */
-	bckt = TDB_HTRIE_PTR(dbh, o);
-	BUG_ON(!bckt);
+static void
+tt_expire(TdbHdr *dbh, unsigned long from, unsigned long to, size_t *n)
+{
+	unsigned int tl;
 
-	/*
-	 * Try to place the small record in preallocated room for
-	 * small records. There could be full or partial key match.
-	 * Small and large variable-length records can be intermixed
-	 * in collision chain, so we do this before processing
-	 * full key collision.
-	 */
-	if (*len < TDB_HTRIE_MINDREC) {
-		/* Align small record length to 8 bytes. */
-		size_t n = TDB_HTRIE_RALIGN(*len);
+	tdb_htrie_tw_advance(dbh, to);
+	for (tl = tdb_htrie_tw_detach(dbh, from, to); tl; )
+		tl = tdb_htrie_tw_expire(dbh, tl, to, n);
+}
 
-		TDB_DBG("Small record (len=%lu) collision on %d bits for"
-			" key %#lx\n", n, bits, key);
+static void
+tdb_htrie_test_ttl(unsigned int rec_len)
+{
+	int i;
+	void *addr;
+	size_t len, n = 0;
+	unsigned long t;
+	unsigned int ttl[3] = { TDB_TT_SHORT, TDB_TT_LONG, 0 };
+	TdbHdr *dbh;
+	TdbRec *r;
 
-		o = tdb_htrie_smallrec_link(dbh, n, bckt);
-		if (o)
-			return tdb_htrie_create_rec(dbh, o, key, data, *len, 0);
-	}
+	printf("\n----------- Records expiration test (rec_len=%u) -----------\n",
+	       rec_len);
 
-	if (TDB_HTRIE_RESOLVED(bits)) {
-		TDB_DBG("Hash full key %#lx collision on %d bits,"
-			" add new record (len=%lu) to collision chain\n",
-			key, bits, *len);
+	addr = mmap(NULL, TDB_FSF_SZ, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		TDB_ERR("cannot allocate memory for expiration test");
+	dbh = tdb_htrie_init(addr, TDB_FSF_SZ, rec_len);
+	if (!dbh)
+		TDB_ERR("cannot initialize htrie for expiration test");
 
-		BUG_ON(TDB_HTRIE_BUCKET_KEY(bckt) != key);
-		o = tdb_alloc_data(dbh, tdb_full_rec_len(dbh, len));
-		if (!o)
-			return NULL;
-		while (bckt->coll_next && !(bckt->flags & TDB_HTRIE_VRFREED))
-			bckt = TDB_HTRIE_BUCKET_NEXT(dbh, bckt);
-		bckt->coll_next = TDB_HTRIE_O2DI(o);
-		return tdb_htrie_create_rec(dbh, o, key, data, *len, 1);
+	for (i = 0; i < TDB_TT_KEYS; ++i) {
+		len = rec_len ? : 200;
+		if (rec_len) {
+			if (!(r = tdb_htrie_get_rec(dbh, ut_key(i))))
+				TDB_ERR("cannot get record %d\n", i);
+		} else {
+			if (!(r = tdb_htrie_alloc_rec(dbh, ut_key(i), &len)))
+				TDB_ERR("cannot allocate record %d\n", i);
+			memset(((TdbVRec *)r)->data, i, len);
+		}
+		if (ttl[i % 3]
+		    && tdb_htrie_set_expires(dbh, r, TDB_TT_BASE + ttl[i % 3],
+					     TDB_TT_BASE))
+			TDB_ERR("cannot set lifetime of record %d\n", i);
+		if (rec_len)
+			tdb_htrie_put_rec(dbh, r);
+		else if (tdb_htrie_publish_rec(dbh, r))
+			TDB_ERR("cannot publish record %d\n", i);
 	}
+	tt_check(dbh, 0);
+
+	/* Nothing expires before the deadline. */
+	tt_expire(dbh, TDB_TT_BASE, TDB_TT_BASE + TDB_TT_SHORT - 1, &n);
+	tt_check(dbh, 0);
+	tt_expire(dbh, TDB_TT_BASE + TDB_TT_SHORT - 1,
+		  TDB_TT_BASE + TDB_TT_SHORT, &n);
+	tt_check(dbh, 1);
+
+	for (t = TDB_TT_BASE + TDB_TT_SHORT;
+	     t < TDB_TT_BASE + TDB_TT_LONG - TDB_TT_STEP; t += TDB_TT_STEP)
+		tt_expire(dbh, t, t + TDB_TT_STEP, &n);
+	tt_check(dbh, 1);
+	tt_expire(dbh, t, TDB_TT_BASE + TDB_TT_LONG + TDB_TT_STEP, &n);
+	tt_check(dbh, 2);
+
+	printf("tdb htrie expiration test: %lu records expired\n", n);
+	if (n != TDB_TT_KEYS / 3 * 2)
+		TDB_ERR("bad number of expired records\n");
+
+	munmap(addr, TDB_FSF_SZ);
+}
 
-	/*
-	 * But there is no room. Burst the node.
-	 * We should never see collision chains at this point.
-	 */
-	BUG_ON(bckt->coll_next);
-	BUG_ON(bits < TDB_HTRIE_BITS);
+/**
+ * Large fixed-size records of the same key make a collision chain of
+ * buckets with one record each. Expire the chain head and insert the key
+ * once more: the new record is appended to the chain with freed head.
+ */
+#define TDB_TC_RECS		4
+#define TDB_TC_KEY		0x7a3f1d5bUL
 
-	TDB_DBG("Least significant bits %d collision for key %#lx"
-		" and new record (len=%lu) - burst the node\n",
-		bits, key, *len);
+void
+tdb_htrie_test_expire_chain(void)
+{
+	int i, n = 0;
+	void *addr;
+	size_t len, freed = 0;
+	unsigned long data[TDB_HTRIE_MINDREC / sizeof(long)] = { 0 };
+	TdbHdr *dbh;
+	TdbBucket *b;
+	TdbFRec *r;
 
-	if (tdb_htrie_burst(dbh, &node, bckt, key, bits)) {
-		TDB_ERR("Cannot burst node=%p and bckt=%p for key %#lx\n",
-			node, bckt, key);
-		return NULL;
-	}
-	goto retry;
-}
+	printf("\n----------- Expired collision chain head test -----------\n");
 
-TdbBucket *
-tdb_htrie_lookup(TdbHdr *dbh, unsigned long key)
-{
-	int bits = 0;
-	unsigned long o;
-	TdbHtrieNode *root = TDB_HTRIE_ROOT(dbh);
+	addr = mmap(NULL, TDB_FSF_SZ, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		TDB_ERR("cannot allocate memory for collision chain test");
+	dbh = tdb_htrie_init(addr, TDB_FSF_SZ, sizeof(data));
+	if (!dbh)
+		TDB_ERR("cannot initialize htrie for collision chain test");
+
+	for (i = 0; i <= TDB_TC_RECS; ++i) {
+		data[0] = i + 1;
+		len = sizeof(data);
+		if (i == TDB_TC_RECS)
+			/* Free the chain head. */
+			tt_expire(dbh, TDB_TT_BASE,
+				  TDB_TT_BASE + TDB_TT_SHORT, &freed);
+		if (!(r = (TdbFRec *)tdb_htrie_insert(dbh, TDB_TC_KEY, data,
+						      &len)))
+			TDB_ERR("cannot insert record %d\n", i);
+		if (!i && tdb_htrie_set_expires(dbh, (TdbRec *)r,
+						TDB_TT_BASE + TDB_TT_SHORT,
+						TDB_TT_BASE))
+			TDB_ERR("cannot set lifetime of the chain head\n");
+	}
+	if (freed != 1)
+		TDB_ERR("bad number of expired records: %lu\n", freed);
 
-	o = tdb_htrie_descend(dbh, &root, key, &bits);
-	if (!o)
-		return NULL;
+	if (!(b = tdb_htrie_lookup(dbh, TDB_TC_KEY)))
+		TDB_ERR("cannot find the collision chain\n");
+	TDB_HTRIE_FOREACH_REC(dbh, b, r) {
+		if (!tdb_live_fsrec(dbh, r))
+			continue;
+		if (r->key != TDB_TC_KEY || *(unsigned long *)r->data < 2)
+			TDB_ERR("bad record %lu in the collision chain\n",
+				*(unsigned long *)r->data);
+		++n;
+	}
+	printf("tdb htrie collision chain test: %d live records\n", n);
+	if (n != TDB_TC_RECS)
+		TDB_ERR("bad number of live records in the chain\n");
 
-	return TDB_HTRIE_PTR(dbh, o);
+	munmap(addr, TDB_FSF_SZ);
 }
 
-/*
- * ------------------------------------------------------------------------
- *	Testing routines
- * ------------------------------------------------------------------------
+/**
+ * Large records are stored in chunks of several contiguous blocks.
+ * Check that garbage collector doesn't free blocks of large chunks except
+ * the first one and that the chunks are freed after eviction.
  */
-#define TDB_VSF_SZ		(2UL * 1024 * 1024 * 1024)
-#define TDB_FSF_SZ		(16UL * 1024 * 1024)
+#define TDB_LT_KEYS		64
+#define TDB_LT_MAXLEN		(1024 * 1024)
 
-#if 0
-#include "urls.h"
-#else
-typedef struct {
-	char	*body;
-	size_t	len;
-} TestUrl;
+void
+tdb_htrie_test_large(void)
+{
+	int i, chunks = 0;
+	void *addr;
+	char *data;
+	size_t len, free0;
+	unsigned int hand = 0;
+	unsigned long *bmp;
+	TdbHdr *dbh;
+	TdbBucket *b;
+	TdbVRec *r, *c;
 
-static TestUrl urls[] = {
-	{"", 0},
-	{"http://www.w3.org/1999/02/22-rdf-syntax-ns#", 0},
-	{"http://ns.adobe.com/iX/1.0/", 0},
-	{"http://www.w3.org/1999/02/22-rdf-syntax-ns#", 0},
-	{"http://purl.org/dc/elements/1.1/", 0},
-	{"http://www.cse.unsw.edu.au/~disy/papers/", 0},
-	{"http://developer.intel.com/design/itanium/family", 0},
-	{"http://www.caldera.com/developers/community/contrib/aim.html", 0},
-	{"http://www.sparc.org/standards.html", 0},
-	{"http://www.xplain.com", 0},
-	{"http://www.mactech.com/misc/about_mt.html", 0},
-	{"http://www.mactech.com/", 0},
-	{"http://www.google-analytics.com/urchin.js", 0},
-	{"http://www.betterram.com/", 0},
-	{"http://www.mactechdomains.com/", 0},
-	{"http://www.mactechsupplies.com/store.php?nfid=34", 0},
-	{"http://www.mactech.com/cables/", 0},
-	{"http://www.xplain.com", 0},
-	{"http://www.amazon.com/exec/obidos/redirect?link_code=ur2&amp;camp=178"
-	 "9&amp;tag=mactechmagazi-20&amp;creative=9325&amp;path=external-search"
-	 "\%3Fsearch-type=ss\%26keyword=ipod\%26index=pc-hardware", 0},
-	{"http://store.mactech.com/mactech/riskfree/offer.html?FROM=MTRF", 0},
-	{"http://www.google.com/", 0},
-	{"http://www.google.com/logos/Logo_25wht.gif", 0},
-	{"http://www.xplain.com", 0},
-	{NULL, 0}
-};
-#endif
+	printf("\n----------- Large records test -------------\n");
 
-static unsigned int ints[] = {
-	0, 324, 2324345, 10, 4000111222, 2111222999, 2, 3, 4, 5, 6, 7, 100,
-	3999888999, 4222999888, 2500600800, 65535, 200, 2000, 20000, 200000,
-	2000000, 20000000, 200000000, 2000000000, 2000000001, 10, 11, 12, 13,
-	4000111222, 3111222999, 4294967290, 32424, 9986, 7344, 23354, 6876437
-};
+	addr = mmap(NULL, TDB_CT_SZ, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		TDB_ERR("cannot allocate memory for large records test");
+	dbh = tdb_htrie_init(addr, TDB_CT_SZ, 0);
+	if (!dbh)
+		TDB_ERR("cannot initialize htrie for large records test");
+	bmp = calloc(1, tdb_htrie_gc_bmp_sz(dbh));
+	data = malloc(TDB_LT_MAXLEN);
+	assert(bmp && data);
+	free0 = tdb_htrie_free_blks(dbh);
+
+	for (i = 0; i < TDB_LT_MAXLEN; ++i)
+		data[i] = i * 7 + i / 4096;
+	for (i = 0; i < TDB_LT_KEYS; ++i) {
+		len = TDB_LT_MAXLEN / TDB_LT_KEYS * (i + 1) - i * 13;
+		if (!tdb_htrie_put_vrec(dbh, ut_key(i), data + i, len))
+			TDB_ERR("cannot insert large record %d\n", i);
+	}
 
-static inline unsigned long
-tv_to_ms(const struct timeval *tv)
-{
-	return ((unsigned long)tv->tv_sec * 1000000 + tv->tv_usec) / 1000;
+	/* Freed blocks are zeroed, so the records data is checked below. */
+	tdb_htrie_gc_snapshot(dbh, bmp);
+	tdb_htrie_gc_mark(dbh, bmp);
+	tdb_htrie_gc_sweep(dbh, bmp);
+
+	for (i = 0; i < TDB_LT_KEYS; ++i) {
+		len = TDB_LT_MAXLEN / TDB_LT_KEYS * (i + 1) - i * 13;
+		if (!(b = tdb_htrie_lookup(dbh, ut_key(i)))
+		    || !(r = (TdbVRec *)tdb_htrie_bscan_for_rec(dbh, b,
+								ut_key(i))))
+			TDB_ERR("cannot find large record %d\n", i);
+		if (!tdb_htrie_vrec_eq(dbh, r, data + i, len))
+			TDB_ERR("bad data of large record %d\n", i);
+		for (c = r; c->chunk_next; ++chunks)
+			c = TDB_PTR(dbh, TDB_DI2O(c->chunk_next));
+	}
+	printf("tdb htrie large records test: %d chunks for %d records\n",
+	       chunks, TDB_LT_KEYS);
+	if (chunks > (TDB_LT_MAXLEN / 2 / TDB_HTRIE_CHUNK_MAX + 1) * TDB_LT_KEYS)
+		TDB_ERR("too many chunks\n");
+
+	tdb_htrie_evict(dbh, &hand, ~0UL);
+	tdb_htrie_gc_snapshot(dbh, bmp);
+	tdb_htrie_gc_mark(dbh, bmp);
+	tdb_htrie_gc_sweep(dbh, bmp);
+	if (tdb_htrie_free_blks(dbh) + 16 < free0)
+		TDB_ERR("large chunks aren't freed: %lu of %lu blocks free\n",
+			tdb_htrie_free_blks(dbh), free0);
+
+	free(data);
+	free(bmp);
+	munmap(addr, TDB_CT_SZ);
 }
 
-unsigned long
-test_hash_calc_dummy(const char *data, size_t len)
+/**
+ * Check that the index statistics are consistent with inserted records.
+ */
+#define TDB_ST_KEYS		10000
+
+void
+tdb_htrie_test_stat(void)
 {
 	int i;
-	unsigned long h = 0;
+	void *addr;
+	unsigned long recs = 0, leafs = 0, chains = 0;
+	TdbHdr *dbh;
+	TdbRec *r;
+	TdbHtrieStat st;
 
-	for (i = 0; i < len; ++i)
-		h += data[i] * (i + 1);
+	printf("\n----------- Index statistics test -------------\n");
 
-	return h;
+	addr = mmap(NULL, TDB_FSF_SZ, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		TDB_ERR("cannot allocate memory for statistics test");
+	dbh = tdb_htrie_init(addr, TDB_FSF_SZ, sizeof(unsigned long));
+	if (!dbh)
+		TDB_ERR("cannot initialize htrie for statistics test");
+
+	for (i = 0; i < TDB_ST_KEYS; ++i) {
+		if (!(r = tdb_htrie_get_rec(dbh, ut_key(i))))
+			TDB_ERR("cannot get record %d\n", i);
+		tdb_htrie_put_rec(dbh, r);
+	}
+
+	tdb_htrie_stat(dbh, &st);
+	for (i = 0; i < TDB_STAT_HIST; ++i) {
+		recs += st.occupancy[i] * i;
+		leafs += st.depth[i];
+		chains += st.chain[i];
+	}
+	printf("tdb htrie statistics test: nodes=%lu leafs=%lu recs=%lu"
+	       " bursts=%lu i_blks=%lu d_blks=%lu free=%lu\n",
+	       st.nodes, st.leafs, st.recs, st.bursts, st.i_blks, st.d_blks,
+	       st.free_blks);
+	if (st.recs != TDB_ST_KEYS || recs != TDB_ST_KEYS)
+		TDB_ERR("bad number of records\n");
+	if (leafs != st.leafs || chains != st.leafs)
+		TDB_ERR("inconsistent histograms\n");
+	if (!st.bursts || st.nodes != st.bursts + 1 || st.alloc_errs)
+		TDB_ERR("bad index nodes statistics\n");
+	if (st.i_blks + st.d_blks + st.free_blks != st.blks)
+		TDB_ERR("bad blocks statistics\n");
+
+	munmap(addr, TDB_FSF_SZ);
 }
 
 /**
- * Benchmark for SSE 4.2 and trivial C hash function.
+ * Batched lookups must find the same buckets as single key lookups for
+ * hits, misses and duplicate keys in batches of any size.
  */
+#define TDB_LM_KEYS		4000
+
 void
-hash_calc_benchmark(void)
+tdb_htrie_test_lookup_many(void)
 {
-#define N 1024
-	int r __attribute__((unused)), i, acc = 0;
-	TestUrl *u;
-	struct timeval tv0, tv1;
+	int i, n, k, hits = 0, idx[TDB_LOOKUP_BATCH];
+	void *addr;
+	unsigned long keys[TDB_LOOKUP_BATCH];
+	TdbHdr *dbh;
+	TdbRec *r;
+	TdbBucket *b[TDB_LOOKUP_BATCH];
 
-	r = gettimeofday(&tv0, NULL);
-	assert(!r);
-	for (i = 0; i < N; ++i)
-		for (u = urls; u->body; ++u)
-			acc += tdb_hash_calc(u->body, u->len);
-	r = gettimeofday(&tv1, NULL);
-	assert(!r);
-	printf("tdb hash: time=%lums ignore_val=%d\n",
-	       tv_to_ms(&tv1) - tv_to_ms(&tv0), acc);
+	printf("\n----------- Batched lookups test -------------\n");
 
-	r = gettimeofday(&tv0, NULL);
-	assert(!r);
-	for (i = 0; i < N; ++i)
-		for (u = urls; u->body; ++u)
-			acc += test_hash_calc_dummy(u->body, u->len);
-	r = gettimeofday(&tv1, NULL);
-	assert(!r);
-	printf("dummy hash: time=%lums ignore_val=%d\n",
-	       tv_to_ms(&tv1) - tv_to_ms(&tv0), acc);
-#undef N
+	addr = mmap(NULL, TDB_FSF_SZ, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		TDB_ERR("cannot allocate memory for batched lookups test");
+	dbh = tdb_htrie_init(addr, TDB_FSF_SZ, sizeof(unsigned long));
+	if (!dbh)
+		TDB_ERR("cannot initialize htrie for batched lookups test");
+
+	/* Odd keys are misses. */
+	for (i = 0; i < TDB_LM_KEYS; i += 2) {
+		if (!(r = tdb_htrie_get_rec(dbh, ut_key(i))))
+			TDB_ERR("cannot get record %d\n", i);
+		tdb_htrie_put_rec(dbh, r);
+	}
+
+	for (n = 1; n <= TDB_LOOKUP_BATCH; ++n) {
+		for (i = 0; i < TDB_LM_KEYS; i += n) {
+			for (k = 0; k < n; ++k) {
+				/* Every third key is a duplicate. */
+				idx[k] = k && !(k % 3) ? idx[k - 1]
+						       : (i + k) * 7
+							 % TDB_LM_KEYS;
+				keys[k] = ut_key(idx[k]);
+			}
+			tdb_htrie_lookup_many(dbh, keys, n, b);
+			for (k = 0; k < n; ++k) {
+				if (b[k] != tdb_htrie_lookup(dbh, keys[k]))
+					TDB_ERR("bad bucket for key %#lx in"
+						" batch of %d\n", keys[k], n);
+				r = b[k] ? tdb_htrie_bscan_for_rec(dbh, b[k],
+								   keys[k])
+					 : NULL;
+				if (!r != !!(idx[k] & 1))
+					TDB_ERR("bad record for key %d\n",
+						idx[k]);
+				hits += !!r;
+			}
+		}
+	}
+
+	printf("tdb htrie batched lookups test: %d hits\n", hits);
+
+	munmap(addr, TDB_FSF_SZ);
 }
 
-void *
-tdb_htrie_open(const char *fname, size_t size)
+/**
+ * Tiered storage: check that readers detect buckets and chunks in cold
+ * extents and that allocators never use cold extents.
+ */
+#define TDB_TRT_KEYS		512
+#define TDB_TRT_LEN		(3 * PAGE_SIZE)
+
+void
+tdb_htrie_test_tier(void)
 {
-	int fd;
-	void *p;
-	struct stat sb;
+	int i;
+	void *addr;
+	char *data;
+	size_t n = 0;
+	unsigned long e, ne = TDB_FSF_SZ / TDB_EXT_SZ, bcold = 0;
+	TdbHdr *dbh;
+	TdbBucket *b;
+	TdbVRec *r;
 
-	if (stat(fname, &sb) < 0) {
-		printf("filesize: %ld\n", sb.st_size);
-		TDB_ERR("no file");
+	printf("\n----------- Tiered storage test -------------\n");
+
+	addr = mmap(NULL, TDB_FSF_SZ, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		TDB_ERR("cannot allocate memory for tiered storage test");
+	dbh = tdb_htrie_init(addr, TDB_FSF_SZ, 0);
+	if (!dbh)
+		TDB_ERR("cannot initialize htrie for tiered storage test");
+	data = calloc(1, TDB_TRT_LEN);
+	assert(data);
+
+	/* Leave only the first and the last extents for allocations. */
+	for (e = 1; e < ne - 1; ++e)
+		tdb_htrie_ext_set_cold(dbh, e, 1);
+	for (i = 0; i < TDB_TRT_KEYS; ++i, ++n)
+		if (!tdb_htrie_put_vrec(dbh, ut_key(i), data, TDB_TRT_LEN))
+			break;
+	if (!n || n == TDB_TRT_KEYS)
+		TDB_ERR("bad number of records in resident extents: %lu\n", n);
+	for (e = 1; e < ne - 1; ++e)
+		if (tdb_htrie_ext_free_blks(dbh, e) != TDB_EXT_SZ / PAGE_SIZE)
+			TDB_ERR("cold extent %lu is used\n", e);
+
+	/* Make the last extent cold, all its records become invisible. */
+	tdb_htrie_ext_set_cold(dbh, ne - 1, 1);
+	for (i = 0; i < n; ++i) {
+		if (!(b = tdb_htrie_lookup(dbh, ut_key(i))))
+			TDB_ERR("cannot find bucket for record %d\n", i);
+		e = tdb_htrie_bckt_cold(dbh, b);
+		if (e && e != ne)
+			TDB_ERR("bad cold extent %lu for record %d\n", e, i);
+		bcold += !!e;
+	}
+	for (e = 1; e < ne; ++e)
+		tdb_htrie_ext_set_cold(dbh, e, 0);
+	for (i = 0; i < n; ++i) {
+		b = tdb_htrie_lookup(dbh, ut_key(i));
+		if (tdb_htrie_bckt_cold(dbh, b))
+			TDB_ERR("resident record %d is cold\n", i);
+		r = (TdbVRec *)tdb_htrie_bscan_for_rec(dbh, b, ut_key(i));
+		if (!r || !tdb_htrie_vrec_eq(dbh, r, data, TDB_TRT_LEN))
+			TDB_ERR("bad record %d\n", i);
 	}
+	printf("tdb htrie tiered storage test: %lu records, %lu cold\n",
+	       n, bcold);
+	if (!bcold || tdb_htrie_ext_pinned(dbh, 1) || !tdb_htrie_ext_pinned(dbh, 0))
+		TDB_ERR("bad extents state\n");
 
-	if ((fd = open(fname, O_RDWR|O_CREAT)) < 0)
-        	TDB_ERR("open failure");
+	free(data);
+	munmap(addr, TDB_FSF_SZ);
+}
 
-	if (sb.st_size != size)
-		if (fallocate(fd, 0, 0, size))
-			TDB_ERR("fallocate failure");
+/**
+ * Fill the database until it's full, evict all the records and check that
+ * garbage collector returns all the data blocks to the free lists.
+ */
+void
+tdb_htrie_test_gc(void)
+{
+	int i, n;
+	void *addr;
+	size_t free0, freed;
+	unsigned int hand = 0;
+	unsigned long *bmp;
+	TdbHdr *dbh;
+	char data[3000];
 
-	/* Use MAP_SHARED to carry changes to underlying file. */
-	p = mmap((void *)TDB_MAP_ADDR, size, PROT_READ | PROT_WRITE,
-		 MAP_SHARED, fd, 0);
-	if (p == MAP_FAILED)
-		TDB_ERR("cannot mmap the file");
-	printf("maped to %p\n", p);
+	printf("\n----------- Eviction and GC test -------------\n");
 
-	if (mlock(p, size))
-		TDB_ERR("mlock failure");
+	addr = mmap(NULL, TDB_FSF_SZ, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		TDB_ERR("cannot allocate memory for GC test");
+	dbh = tdb_htrie_init(addr, TDB_FSF_SZ, 0);
+	if (!dbh)
+		TDB_ERR("cannot initialize htrie for GC test");
+	bmp = calloc(1, tdb_htrie_gc_bmp_sz(dbh));
+	assert(bmp);
+	free0 = tdb_htrie_free_blks(dbh);
+
+	for (n = 0; ; ++n) {
+		memset(data, n, sizeof(data));
+		if (!tdb_htrie_put_vrec(dbh, ct_key(0, n), data,
+					100 + n * 37 % sizeof(data)))
+			break;
+	}
+	printf("%d records inserted, %lu free blocks\n", n,
+	       tdb_htrie_free_blks(dbh));
+
+	/* Nobody touched the records, so the first pass evicts everything. */
+	tdb_htrie_evict(dbh, &hand, ~0UL);
+	tdb_htrie_gc_snapshot(dbh, bmp);
+	tdb_htrie_gc_mark(dbh, bmp);
+	freed = tdb_htrie_gc_sweep(dbh, bmp);
+
+	for (i = 0; i < n; ++i) {
+		TdbBucket *b = tdb_htrie_lookup(dbh, ct_key(0, i));
+		TdbVRec *r = b ? (TdbVRec *)tdb_htrie_bscan_for_rec(dbh, b,
+							ct_key(0, i)) : NULL;
+		if (r && tdb_live_vsrec(r))
+			TDB_ERR("record %d is alive after eviction\n", i);
+	}
+	printf("tdb htrie GC test: %lu blocks freed, %lu of %lu blocks free\n",
+	       freed, tdb_htrie_free_blks(dbh), free0);
+	if (!freed || tdb_htrie_free_blks(dbh) < free0 / 2)
+		TDB_ERR("GC returned too few blocks\n");
 
-	return p;
+	free(bmp);
+	munmap(addr, TDB_FSF_SZ);
 }
 
 /**
- * Just free the memory region, the file will be closed on program exit.
+ * Freed small records are reused in place only after two garbage
+ * collections, so lock-free readers never see the records overwritten.
  */
-void
-tdb_htrie_pure_close(void *addr, size_t size)
+#define TDB_RU_KEY		0x5c1e93UL
+
+static void
+ru_gc(TdbHdr *dbh, unsigned long *bmp)
 {
-	munlock(addr, size);
-	munmap(addr, size);
+	tdb_htrie_gc_snapshot(dbh, bmp);
+	tdb_htrie_gc_mark(dbh, bmp);
+	tdb_htrie_gc_sweep(dbh, bmp);
 }
 
 void
-tdb_htrie_test_varsz(const char *fname)
+tdb_htrie_test_reuse(void)
 {
-	char *addr;
-	int r __attribute__((unused));
-	TestUrl *u;
+	int i;
+	void *addr;
+	size_t len;
+	unsigned long data = 0, *bmp;
 	TdbHdr *dbh;
-	struct timeval tv0, tv1;
+	TdbRec *r0, *r;
 
-	printf("\n----------- Variable size records test -------------\n");
+	printf("\n----------- Freed records reuse test -------------\n");
 
-	addr = tdb_htrie_open(fname, TDB_VSF_SZ);
-
-	dbh = tdb_htrie_init(addr, TDB_VSF_SZ, 0);
+	addr = mmap(NULL, TDB_FSF_SZ, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		TDB_ERR("cannot allocate memory for reuse test");
+	dbh = tdb_htrie_init(addr, TDB_FSF_SZ, 0);
 	if (!dbh)
-		TDB_ERR("cannot initialize htrie for urls");
-
-	r = gettimeofday(&tv0, NULL);
-	assert(!r);
+		TDB_ERR("cannot initialize htrie for reuse test");
+	bmp = calloc(1, tdb_htrie_gc_bmp_sz(dbh));
+	assert(bmp);
+
+	len = sizeof(data);
+	if (!(r0 = tdb_htrie_insert(dbh, TDB_RU_KEY, &data, &len)))
+		TDB_ERR("cannot insert the first record\n");
+	if (tdb_htrie_remove_rec(dbh, r0))
+		TDB_ERR("cannot remove the first record\n");
+
+	for (i = 1; i <= 3; ++i) {
+		data = i;
+		len = sizeof(data);
+		if (!(r = tdb_htrie_insert(dbh, TDB_RU_KEY, &data, &len)))
+			TDB_ERR("cannot insert record %d\n", i);
+		if ((r == r0) != (i == 3))
+			TDB_ERR("freed record is %sreused after %d GC\n",
+				i == 3 ? "not " : "", i - 1);
+		ru_gc(dbh, bmp);
+	}
 
-	/* Store records. */
-	for (u = urls; u->body; ++u) {
-		unsigned long k = tdb_hash_calc(u->body, u->len);
-		size_t copied = 0, to_copy = u->len;
-		char *p;
-		TdbRec *rec;
+	r = tdb_htrie_bscan_for_rec(dbh, tdb_htrie_lookup(dbh, TDB_RU_KEY),
+				    TDB_RU_KEY);
+	if (!r || !tdb_live_vsrec((TdbVRec *)r))
+		TDB_ERR("cannot find the records\n");
+	printf("tdb htrie reuse test: passed\n");
 
-		printf("insert [%.40s...] (len=%lu)\n", u->body, u->len);
-		fflush(NULL);
+	free(bmp);
+	munmap(addr, TDB_FSF_SZ);
+}
 
-		rec = tdb_htrie_insert(dbh, k, u->body, &to_copy);
-		assert((u->len && rec) || (!u->len && !rec));
+/**
+ * Check fingerprints matching and lookups of fixed-size records with
+ * the same fingerprints and the same lower bits of keys.
+ */
+void
+tdb_htrie_test_fp(void)
+{
+	int i;
+	void *addr;
+	unsigned long k, data[2] = { 0 };
+	size_t len = sizeof(data);
+	TdbHdr *dbh;
 
-		copied += to_copy;
-		to_copy = u->len - to_copy;
+	printf("\n----------- Fingerprints test -------------\n");
 
-		while (copied != u->len) {
-			p = tdb_htrie_extend_rec(dbh, rec, &to_copy);
-			assert(p);
+	if (tdb_htrie_fp_match(0x0011223344556677UL, 0x55) != 0x800000UL
+	    || tdb_htrie_fp_match(0x0101000001010000UL, 0) != 0x808000008080UL
+	    || tdb_htrie_fp_match(0x8080808080808080UL, 0x80) != ~0UL / 0xff * 0x80)
+		TDB_ERR("bad fingerprints matching\n");
 
-			memcpy(p, u->body + copied, to_copy);
+	addr = mmap(NULL, TDB_FSF_SZ, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		TDB_ERR("cannot allocate memory for fingerprints test");
+	dbh = tdb_htrie_init(addr, TDB_FSF_SZ, sizeof(data));
+	if (!dbh)
+		TDB_ERR("cannot initialize htrie for fingerprints test");
+
+	/* Half of the keys have the same fingerprint. */
+	for (i = 0; i < 1000; ++i) {
+		k = (i % 2 ? 0x00AB000000000000UL : (unsigned long)i << 48)
+		    | (i * 16 + 5);
+		data[0] = k;
+		if (!tdb_htrie_insert(dbh, k, data, &len))
+			TDB_ERR("cannot insert key %#lx\n", k);
+	}
+	for (i = 0; i < 1000; ++i) {
+		TdbFRec *r;
+		TdbBucket *b;
 
-			copied += to_copy;
-			to_copy = u->len - to_copy;
-		}
+		k = (i % 2 ? 0x00AB000000000000UL : (unsigned long)i << 48)
+		    | (i * 16 + 5);
+		b = tdb_htrie_lookup(dbh, k);
+		r = b ? tdb_htrie_bscan_for_rec(dbh, b, k) : NULL;
+		if (!r || *(unsigned long *)r->data != k)
+			TDB_ERR("cannot find key %#lx\n", k);
+		b = tdb_htrie_lookup(dbh, k ^ 0x0001000000000000UL);
+		if (b && tdb_htrie_bscan_for_rec(dbh, b,
+						 k ^ 0x0001000000000000UL))
+			TDB_ERR("found absent key %#lx\n",
+				k ^ 0x0001000000000000UL);
 	}
+	printf("tdb htrie fingerprints test: 1000 keys\n");
 
-	/* Read records. */
-	for (u = urls; u->body; ++u) {
-		unsigned long k = tdb_hash_calc(u->body, u->len);
-		TdbBucket *b;
+	munmap(addr, TDB_FSF_SZ);
+}
 
-		printf("results for [%.40s...] lookup:\n", u->body);
-		fflush(NULL);
+/*
+ * Crash recovery test: damage the file like a crash in the middle of writes
+ * does and check that the recovery cuts the broken parts only and that
+ * the table is writable after the recovery.
+ */
+#define TDB_RT_KEYS		2000
 
-		b = tdb_htrie_lookup(dbh, k);
-		if (!b) {
-			fprintf(stderr, "ERROR: can't find URL [%.20s...]\n",
-				u->body);
-			fflush(NULL);
+static char rt_lost[TDB_RT_KEYS];
+
+static size_t
+rt_len(int i)
+{
+	return i % 50 ? 100 + i * 37 % 3000 : 20000;
+}
+
+void
+tdb_htrie_test_recover(void)
+{
+	int i, lost = 0;
+	void *addr;
+	char *data;
+	size_t freed;
+	unsigned long *bmp;
+	TdbHdr *dbh;
+	TdbBucket *b, *bad;
+	TdbVRec *r;
+
+	printf("\n----------- Crash recovery test -------------\n");
+
+	addr = mmap(NULL, TDB_FSF_SZ, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		TDB_ERR("cannot allocate memory for recovery test");
+	dbh = tdb_htrie_init(addr, TDB_FSF_SZ, 0);
+	if (!dbh || !(dbh->flags & TDB_F_CLEAN))
+		TDB_ERR("cannot initialize htrie for recovery test");
+	bmp = calloc(1, tdb_htrie_gc_bmp_sz(dbh));
+	data = malloc(20000);
+	assert(bmp && data);
+
+	for (i = 0; i < 20000; ++i)
+		data[i] = i * 7 + i / 4096;
+	for (i = 0; i < TDB_RT_KEYS; ++i)
+		if (!tdb_htrie_put_vrec(dbh, ut_key(i), data + i % 100,
+					rt_len(i)))
+			TDB_ERR("cannot insert record %d\n", i);
+
+	/* Locked and pinned bucket with looped collision chain. */
+	b = tdb_htrie_lookup(dbh, ut_key(1));
+	b->flags = TDB_HTRIE_BLOCKED | TDB_HTRIE_BURST | TDB_HTRIE_PIN * 3;
+	b->coll_next = TDB_O2DI(TDB_HTRIE_OFF(dbh, b));
+	/* Collision chain pointing out of the file. */
+	b = tdb_htrie_lookup(dbh, ut_key(2));
+	b->coll_next = dbh->dbsz / TDB_HTRIE_MINDREC;
+	/* Broken chunk chain of a large record. */
+	b = tdb_htrie_lookup(dbh, ut_key(50));
+	r = (TdbVRec *)tdb_htrie_bscan_for_rec(dbh, b, ut_key(50));
+	r->chunk_next = 1;
+	/* Garbage length of the first record crossing the bucket block. */
+	bad = tdb_htrie_lookup(dbh, ut_key(3));
+	for (i = 0; i < TDB_RT_KEYS; ++i)
+		rt_lost[i] = i == 50 || tdb_htrie_lookup(dbh, ut_key(i)) == bad;
+	((TdbVRec *)TDB_HTRIE_BUCKET_1ST(dbh, bad))->len = PAGE_SIZE;
+	/* Cursors pointing to a block, which wasn't written back. */
+	TDB_CURS(dbh)->d_wcl = dbh->dbsz - TDB_HTRIE_MINDREC;
+	/* Garbage in a free block. */
+	memset(TDB_PTR(dbh, dbh->dbsz / 2), 0xa5, PAGE_SIZE);
+
+	tdb_htrie_recover_start(dbh, bmp);
+	for (i = 0; i < TDB_HTRIE_FANOUT; ++i)
+		tdb_htrie_recover_slot(dbh, i, bmp);
+	tdb_htrie_recover_exts(dbh, bmp, 0, dbh->dbsz / TDB_EXT_SZ);
+
+	for (i = 0; i < TDB_RT_KEYS; ++i) {
+		b = tdb_htrie_lookup(dbh, ut_key(i));
+		r = b ? (TdbVRec *)tdb_htrie_bscan_for_rec(dbh, b, ut_key(i))
+		      : NULL;
+		if (rt_lost[i]) {
+			lost += !r;
 			continue;
 		}
-
-		if (TDB_HTRIE_VARLENRECS(dbh)) {
-			TdbVRec *r;
-			TDB_HTRIE_FOREACH_REC(dbh, b, r) {
-				if (tdb_live_vsrec(r)) {
-					printf("\t[%.64s...] key=%#lx"
-					       " bckt=%p\n", r->data,
-					       tdb_hash_calc(r->data, r->len),
-					       b);
-					fflush(NULL);
-				}
-			}
-		} else {
-			BUG();
+		if (!r || !tdb_htrie_vrec_eq(dbh, r, data + i % 100,
+					     rt_len(i)))
+			TDB_ERR("record %d is lost by recovery\n", i);
+	}
+	if (lost < 2 || *(char *)TDB_PTR(dbh, dbh->dbsz / 2))
+		TDB_ERR("broken data survived recovery\n");
+
+	/* All the garbage is freed by the recovery. */
+	tdb_htrie_gc_snapshot(dbh, bmp);
+	tdb_htrie_gc_mark(dbh, bmp);
+	freed = tdb_htrie_gc_sweep(dbh, bmp);
+	if (freed)
+		TDB_ERR("recovery left %lu garbage blocks\n", freed);
+
+	/* The buckets are unlocked and the allocators are consistent. */
+	for (i = 0; i < TDB_RT_KEYS / 10; ++i)
+		if (!tdb_htrie_put_vrec(dbh, ut_key(i), data + 1, 200))
+			TDB_ERR("cannot insert record %d after recovery\n", i);
+	for (i = 0; i < TDB_RT_KEYS; ++i) {
+		b = tdb_htrie_lookup(dbh, ut_key(i));
+		r = b ? (TdbVRec *)tdb_htrie_bscan_for_rec(dbh, b, ut_key(i))
+		      : NULL;
+		if (i < TDB_RT_KEYS / 10) {
+			if (!r)
+				TDB_ERR("cannot find record %d after"
+					" recovery\n", i);
+			continue;
 		}
+		if (!rt_lost[i]
+		    && (!r || !tdb_htrie_vrec_eq(dbh, r, data + i % 100,
+						 rt_len(i))))
+			TDB_ERR("record %d is overwritten after recovery\n", i);
 	}
+	printf("tdb htrie recovery test: %d records lost, %lu free blocks\n",
+	       lost, tdb_htrie_free_blks(dbh));
 
-	r = gettimeofday(&tv1, NULL);
-	assert(!r);
+	free(data);
+	free(bmp);
+	munmap(addr, TDB_FSF_SZ);
+}
 
-	printf("tdb htrie urls test: time=%lums\n",
-		tv_to_ms(&tv1) - tv_to_ms(&tv0));
+/*
+ * Online resizing test: grow a half of the file, write records to the new
+ * extents, shrink the file back and check that only the records from
+ * the evacuated extents are lost, that the timers survive the wheel rebuild
+ * and that nothing is allocated beyond the file end after the shrinking.
+ */
+#define TDB_RST_KEYS		6000
+#define TDB_RST_LEN		300
 
-	tdb_htrie_pure_close(addr, TDB_VSF_SZ);
+static unsigned long
+rst_far(TdbHdr *dbh, void *p, unsigned long lim)
+{
+	return TDB_HTRIE_OFF(dbh, p) >= lim;
 }
 
 void
-tdb_htrie_test_fixsz(const char *fname)
+tdb_htrie_test_resize(void)
 {
-	int r __attribute__((unused));
-	char *addr;
-	unsigned int *i;
+	int i, n = TDB_RST_KEYS, lost = 0, exp = 0;
+	void *addr;
+	char data[TDB_RST_LEN];
+	size_t len, freed = 0;
+	unsigned int tl;
+	unsigned long tw, half = TDB_FSF_SZ / 2, *bmp;
+	static char far[TDB_RST_KEYS];
 	TdbHdr *dbh;
-	struct timeval tv0, tv1;
+	TdbRec *r;
 
-	printf("\n----------- Fixed size records test -------------\n");
+	printf("\n----------- Online resizing test -------------\n");
 
-	addr = tdb_htrie_open(fname, TDB_FSF_SZ);
-
-	dbh = tdb_htrie_init(addr, TDB_FSF_SZ, sizeof(ints[0]));
+	addr = mmap(NULL, TDB_FSF_SZ, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		TDB_ERR("cannot allocate memory for resizing test");
+	dbh = tdb_htrie_init(addr, half, 0);
 	if (!dbh)
-		TDB_ERR("cannot initialize htrie for ints");
+		TDB_ERR("cannot initialize htrie for resizing test");
+	bmp = calloc(1, tdb_htrie_gc_bmp_sz(dbh) * 2);
+	assert(bmp);
+	memset(data, 0x5a, sizeof(data));
+
+	for (i = 0; i < n; ++i) {
+		if (i == n * 3 / 4)
+			tdb_htrie_grow(dbh, TDB_FSF_SZ);
+		len = TDB_RST_LEN;
+		if (!tdb_htrie_insert(dbh, ut_key(i), data, &len))
+			TDB_ERR("cannot insert record %d\n", i);
+	}
+	/*
+	 * Each tenth record gets a lifetime, so the timer wheel is allocated
+	 * in the new extents. There are no concurrent bursts, so the records
+	 * don't need pinning.
+	 */
+	for (i = 0; i < n; i += 10) {
+		TdbBucket *b = tdb_htrie_lookup(dbh, ut_key(i));
+		r = tdb_htrie_bscan_for_rec(dbh, b, ut_key(i));
+		if (!r || tdb_htrie_set_expires(dbh, r, 100, 1))
+			TDB_ERR("cannot set lifetime of record %d\n", i);
+	}
+	if (dbh->tw < half)
+		TDB_ERR("the timer wheel isn't in the new extents\n");
+
+	/* Shrink the file back. */
+	for (i = 0; i < n; ++i) {
+		TdbBucket *b = tdb_htrie_lookup(dbh, ut_key(i));
+		r = tdb_htrie_bscan_for_rec(dbh, b, ut_key(i));
+		if (!r)
+			TDB_ERR("record %d is lost before shrinking\n", i);
+		far[i] = rst_far(dbh, r, half) || rst_far(dbh, b, half);
+	}
+	if (tdb_htrie_shrink_start(dbh, half) || dbh->d_wm >= half / TDB_EXT_SZ)
+		TDB_ERR("cannot shrink the file\n");
+	if (tdb_htrie_tw_move(dbh, &tw))
+		TDB_ERR("cannot move the timer wheel\n");
+	for (tl = tdb_htrie_tw_detach_all(dbh, tw); tl; )
+		tl = tdb_htrie_tw_expire(dbh, tl, 0, &freed);
+	if (dbh->tw >= half || tdb_htrie_evacuate(dbh))
+		TDB_ERR("cannot evacuate the extents\n");
+	tdb_htrie_shrink_finish(dbh, TDB_FSF_SZ);
+
+	for (i = 0; i < n; ++i) {
+		TdbBucket *b = tdb_htrie_lookup(dbh, ut_key(i));
+		TdbVRec *vr = b ? (TdbVRec *)tdb_htrie_bscan_for_rec(dbh, b,
+								     ut_key(i))
+				: NULL;
+		if (far[i]) {
+			if (vr)
+				TDB_ERR("record %d survived evacuation\n", i);
+			++lost;
+			continue;
+		}
+		if (!vr || !tdb_htrie_vrec_eq(dbh, vr, data, TDB_RST_LEN))
+			TDB_ERR("record %d is lost by shrinking\n", i);
+	}
+	if (!lost || lost == n)
+		TDB_ERR("bad number of evacuated records %d\n", lost);
+
+	/* The timers are moved to the new wheel. */
+	tt_expire(dbh, 1, 100, &freed);
+	for (i = 0; i < n; ++i)
+		if (!far[i] && i % 10 == 0) {
+			if (tt_alive(dbh, ut_key(i)))
+				TDB_ERR("record %d isn't expired\n", i);
+			++exp;
+		}
+	if (freed != exp)
+		TDB_ERR("bad number of expired records %lu\n", freed);
+
+	/* The collector and allocators don't see the evacuated extents. */
+	tdb_htrie_gc_snapshot(dbh, bmp);
+	tdb_htrie_gc_mark(dbh, bmp);
+	tdb_htrie_gc_sweep(dbh, bmp);
+	for (i = 0; i < n; ++i) {
+		len = TDB_RST_LEN;
+		if (!far[i])
+			continue;
+		r = tdb_htrie_insert(dbh, ut_key(i), data, &len);
+		if (!r)
+			break;
+		if (TDB_HTRIE_OFF(dbh, r) >= half)
+			TDB_ERR("record %d is beyond the file end\n", i);
+	}
+	printf("tdb htrie resizing test: %d records, %d evacuated, %d expired\n",
+	       n, lost, exp);
 
-	r = gettimeofday(&tv0, NULL);
-	assert(!r);
+	free(bmp);
+	munmap(addr, TDB_FSF_SZ);
+}
 
-	/* Store records. */
-	for (i = ints; i < ints + sizeof(ints) / sizeof(ints[0]); ++i) {
-		size_t copied = sizeof(*i);
-		TdbRec *rec __attribute__((unused));
+/*
+ * SEQLOG test: writers append records concurrently with a reader following
+ * the log, so the reader must see each record exactly once. Each record
+ * keeps its writer and number, followed by a pattern of the number.
+ */
+#define TDB_SLT_RECS		20000
+#define TDB_SLT_SZ		(18UL * 1024 * 1024)
+#define TDB_SLT_SMALL_SZ	(4UL * TDB_EXT_SZ)
 
-		printf("insert int %u\n", *i);
-		fflush(NULL);
+static unsigned char slt_seen[TDB_CT_THREADS][TDB_SLT_RECS];
 
-		rec = tdb_htrie_insert(dbh, *i, i, &copied);
-		assert(rec && copied == sizeof(*i));
-	}
+static size_t
+slt_rec(char *data, int t, int i)
+{
+	size_t len = sizeof(int) * 2 + i % 200;
 
-	/* Read records. */
-	for (i = ints; i < ints + sizeof(ints) / sizeof(ints[0]); ++i) {
-		TdbBucket *b;
+	memcpy(data, &t, sizeof(int));
+	memcpy(data + sizeof(int), &i, sizeof(int));
+	memset(data + sizeof(int) * 2, (char)i, len - sizeof(int) * 2);
 
-		printf("results for int %u lookup:\n", *i);
-		fflush(NULL);
+	return len;
+}
 
-		b = tdb_htrie_lookup(dbh, *i);
-		if (!b) {
-			fprintf(stderr, "ERROR: can't find int %u\n", *i);
-			fflush(NULL);
-			continue;
-		}
+static void
+slt_check(const char *data, long len, int once)
+{
+	int t, i;
+	char exp[256];
+
+	memcpy(&t, data, sizeof(int));
+	memcpy(&i, data + sizeof(int), sizeof(int));
+	if (t < 0 || t >= TDB_CT_THREADS || i < 0 || i >= TDB_SLT_RECS
+	    || len != slt_rec(exp, t, i) || memcmp(data, exp, len))
+		TDB_ERR("bad log record of %ld bytes\n", len);
+	if (once && slt_seen[t][i]++)
+		TDB_ERR("log record %d of writer %d is read twice\n", i, t);
+}
 
-		if (TDB_HTRIE_VARLENRECS(dbh)) {
-			BUG();
-		} else {
-			TdbFRec *r;
-			TDB_HTRIE_FOREACH_REC(dbh, b, r) {
-				if (tdb_live_fsrec(dbh, r)) {
-					printf("\t(%#x) %u bckt=%p\n",
-					       *(unsigned int *)r->data,
-					       *(unsigned int *)r->data, b);
-					fflush(NULL);
-				}
-			}
+static void *
+slt_writer(void *arg)
+{
+	int i, t = (long)arg;
+	char data[256];
+
+	for (i = 0; i < TDB_SLT_RECS; ++i) {
+		size_t len = slt_rec(data, t, i);
+		if (tdb_seqlog_append(ct_dbh, data, len, i))
+			TDB_ERR("cannot append log record %d\n", i);
+	}
+
+	return NULL;
+}
+
+static void *
+slt_reader(void *arg)
+{
+	long len;
+	char data[256];
+	unsigned long n = 0;
+	TdbLogPos *pos = arg;
+
+	while (1) {
+		int done = ct_done;
+
+		__sync_synchronize();
+		len = tdb_seqlog_read(ct_dbh, pos, data, sizeof(data));
+		if (len < 0)
+			TDB_ERR("cannot read log record, %ld\n", len);
+		if (len) {
+			slt_check(data, len, 1);
+			++n;
+		} else if (done) {
+			break;
 		}
 	}
 
-	r = gettimeofday(&tv1, NULL);
-	assert(!r);
+	printf("reader: %lu records\n", n);
 
-	printf("tdb htrie ints test: time=%lums\n",
-		tv_to_ms(&tv1) - tv_to_ms(&tv0));
+	return NULL;
+}
 
-	tdb_htrie_pure_close(addr, TDB_FSF_SZ);
+void
+tdb_htrie_test_seqlog(void)
+{
+	int t, i, n;
+	long len;
+	void *addr;
+	char data[256];
+	TdbLogPos pos = { 0 };
+	pthread_t wr[TDB_CT_THREADS], rd;
+
+	printf("\n----------- SEQLOG test -------------\n");
+
+	addr = mmap(NULL, TDB_SLT_SZ, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		TDB_ERR("cannot allocate memory for SEQLOG test");
+	ct_dbh = tdb_seqlog_init(addr, TDB_SLT_SZ);
+	if (!ct_dbh)
+		TDB_ERR("cannot initialize SEQLOG");
+	if (tdb_htrie_init(addr, TDB_SLT_SZ, 0))
+		TDB_ERR("the log is opened as htrie\n");
+	ct_done = 0;
+
+	if (pthread_create(&rd, NULL, slt_reader, &pos))
+		TDB_ERR("cannot create reader thread");
+	for (t = 0; t < TDB_CT_THREADS; ++t)
+		if (pthread_create(&wr[t], NULL, slt_writer, (void *)(long)t))
+			TDB_ERR("cannot create writer thread");
+	for (t = 0; t < TDB_CT_THREADS; ++t)
+		pthread_join(wr[t], NULL);
+	/* Close the segments of the stopped writers. */
+	tdb_seqlog_flush(ct_dbh);
+	tdb_seqlog_flush(ct_dbh);
+	ct_done = 1;
+	pthread_join(rd, NULL);
+
+	for (t = 0; t < TDB_CT_THREADS; ++t)
+		for (i = 0; i < TDB_SLT_RECS; ++i)
+			if (!slt_seen[t][i])
+				TDB_ERR("log record %d of writer %d is lost\n",
+					i, t);
+	if (pos.lost)
+		TDB_ERR("%lu log segments are lost\n", pos.lost);
+	printf("tdb seqlog concurrent test: %d records in %lu segments\n",
+	       TDB_CT_THREADS * TDB_SLT_RECS, ct_dbh->l_seq - 1);
+	munmap(addr, TDB_SLT_SZ);
+
+	/* Overwrite the small log many times and read what survived. */
+	addr = mmap(NULL, TDB_SLT_SMALL_SZ, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		TDB_ERR("cannot allocate memory for SEQLOG test");
+	ct_dbh = tdb_seqlog_init(addr, TDB_SLT_SMALL_SZ);
+	if (!ct_dbh)
+		TDB_ERR("cannot initialize SEQLOG");
+	memset(&pos, 0, sizeof(pos));
+	for (i = 0; i < TDB_SLT_RECS * 10; ++i) {
+		len = slt_rec(data, 0, i % TDB_SLT_RECS);
+		if (tdb_seqlog_append(ct_dbh, data, len, i))
+			TDB_ERR("cannot append log record %d\n", i);
+		/* The reader starts and then lags behind the writer. */
+		if (i == 1 && tdb_seqlog_read(ct_dbh, &pos, data,
+					      sizeof(data)) <= 0)
+			TDB_ERR("cannot read the first log record\n");
+	}
+	/* Reopen the log, so the last segment is closed by recovery. */
+	ct_dbh = tdb_seqlog_init(addr, TDB_SLT_SMALL_SZ);
+	if (!ct_dbh)
+		TDB_ERR("cannot reopen SEQLOG");
+
+	if (tdb_seqlog_read(ct_dbh, &pos, data, 1) != -ENOSPC)
+		TDB_ERR("log record is read to too small buffer\n");
+	for (n = 0; (len = tdb_seqlog_read(ct_dbh, &pos, data,
+					   sizeof(data))); ++n)
+	{
+		if (len < 0)
+			TDB_ERR("cannot read log record, %ld\n", len);
+		slt_check(data, len, 0);
+	}
+	memcpy(&i, data + sizeof(int), sizeof(int));
+	printf("tdb seqlog ring test: %d records read, %lu segments lost\n",
+	       n, pos.lost);
+	if (!n || !pos.lost || i != TDB_SLT_RECS - 1
+	    || pos.ts != TDB_SLT_RECS * 10 - 1)
+		TDB_ERR("bad log ring state\n");
+	munmap(addr, TDB_SLT_SMALL_SZ);
 }
 
 void
@@ -1305,6 +1697,22 @@ tdb_htrie_test(const char *vsf, const char *fsf)
 {
 	tdb_htrie_test_varsz(vsf);
 	tdb_htrie_test_fixsz(fsf);
+	tdb_htrie_test_concurrent(0);
+	tdb_htrie_test_concurrent(sizeof(unsigned long) * 2);
+	tdb_htrie_test_update();
+	tdb_htrie_test_ttl(0);
+	tdb_htrie_test_ttl(sizeof(unsigned long));
+	tdb_htrie_test_expire_chain();
+	tdb_htrie_test_large();
+	tdb_htrie_test_stat();
+	tdb_htrie_test_lookup_many();
+	tdb_htrie_test_tier();
+	tdb_htrie_test_gc();
+	tdb_htrie_test_reuse();
+	tdb_htrie_test_fp();
+	tdb_htrie_test_recover();
+	tdb_htrie_test_resize();
+	tdb_htrie_test_seqlog();
 }
 
 int
@@ -1313,7 +1721,7 @@ main(int argc, char *argv[])
 	unsigned int eax, ebx, ecx = 0, edx;
 	TestUrl *u;
 	struct rlimit rlim = { TDB_VSF_SZ, TDB_VSF_SZ * 2};
-	
+
 	if (argc < 3) {
 		printf("\nUsage: %s <vsf> <fsf>\n"
 		       "  vsf    - file name for variable-size records test\n"
@@ -1327,7 +1735,7 @@ main(int argc, char *argv[])
 		TDB_ERR("cannot set RLIMIT_MEMLOCK");
 
 	__get_cpuid(1, &eax, &ebx, &ecx, &edx);
-	   
+
 	if (!(ecx & bit_SSE4_2))
 		TDB_ERR("SSE4.2 is not supported");
 
@@ -25,8 +25,14 @@
 
 #include <linux/fs.h>
 
-#define TDB_FNAME	"data"
 #define TDB_PATH_LEN	128
+/* Maximum table name length including terminating zero. */
+#define TDB_TBLNAME_LEN	32
+#define TDB_SUFFIX	".tdb"
+/* Room for NUMA node suffix of the file name. */
+#define TDB_NODE_SFX_LEN	8
+/* Room for shard number suffix of the file name. */
+#define TDB_SHARD_SFX_LEN	8
 
 /**
  * Tempesta DB file descriptor.
@@ -36,55 +42,212 @@
  *
  * @dbsz	- the database size in bytes;
  * @rec_len	- fixed-size records length or zero for variable-length records;
- * @i_wcl	- index block next to write (byte offset);
- * @d_wcl	- data block next to write (byte offset);
- * @ext_bmp	- bitmap of used/free extents.
+ * @ext_bmp	- bitmap of used/free extents followed by bitmaps of full
+ * 		  and cold extents and per-CPU allocation cursors,
+ * 		  see TDB_HDR_SZ().
  * 		  Must be small and cache line aligned;
  * @i_wm, @d_wm	- watermarks (in extents) for index and data correspondingly.
  * 		  The watermarks grow towards each other and their meeting
  * 		  signals that the data file is full;
+ * @tw		- byte offset of records expiration timer wheel, zero if
+ * 		  no record was given a lifetime yet;
+ * @version	- the file format version;
+ * @flags	- TDB_F_* table type and state flags;
+ * @l_seq	- sequence number of the next segment of SEQLOG table;
+ * @ckpt	- time (in seconds) of the last checkpoint, i.e. the last
+ * 		  write back of the whole file;
  */
 typedef struct {
 	unsigned long	magic;
 	unsigned long	dbsz;
-	unsigned long	i_wcl;
-	unsigned long	d_wcl;
 	unsigned int	rec_len;
 	unsigned short	i_wm;
 	unsigned short	d_wm;
-	unsigned char	_padding[8 * 3];
+	unsigned long	tw;
+	unsigned int	version;
+	unsigned int	flags;
+	unsigned long	l_seq;
+	unsigned long	ckpt;
+	unsigned char	_padding[8];
 	unsigned long	ext_bmp[0];
 } __attribute__((packed)) TdbHdr;
 
-/* Database handle descriptor. */
+/* Append-only log without index, see tdb_open_log(). */
+#define TDB_F_SEQLOG		0x1
+/* The file was written back and closed, so it doesn't need recovery. */
+#define TDB_F_CLEAN		0x2
+
+/**
+ * Per-CPU operations counters of a table.
+ *
+ * @lookups	- number of looked up keys;
+ * @hits	- number of found keys;
+ * @inserts	- number of created records;
+ * @errors	- number of failed records creations;
+ */
 typedef struct {
+	unsigned long	lookups;
+	unsigned long	hits;
+	unsigned long	inserts;
+	unsigned long	errors;
+} TdbStat;
+
+/**
+ * Database handle descriptor.
+ * Tables larger than TDB_SHARD_MAX are sets of shards, each with its own
+ * file and descriptor, and the set descriptor has no file, see tdb_shard().
+ */
+typedef struct tdb_t {
 	TdbHdr		*hdr;
 	struct file	*filp;	/* mmap'ed file */
+	unsigned long	map_sz;	/* size of the file mapping */
+	struct list_head list;	/* list of databases for garbage collector */
+	struct list_head tbl_list; /* list of all opened tables */
+	unsigned long	*gc_bmp; /* garbage collector blocks bitmap */
+	unsigned int	clock_hand; /* records replacement position */
+	int		node;	/* NUMA node of the database memory */
+	unsigned int	rec_len; /* requested records length */
+	unsigned int	flags;	/* requested TDB_F_* table type */
+	unsigned long	hot_sz;	/* locked memory size in tiered mode */
+	unsigned long	*ref_bmp; /* recently accessed extents */
+	unsigned long	hot_n;	/* number of resident extents */
+	unsigned long	tier_hand; /* extents demotion position */
+	struct tdb_prefault_work_t *pf; /* works populating the file */
+	int		pf_nw;	/* number of the prefault works */
+	atomic_t	pf_n;	/* number of running prefault works */
+	TdbStat __percpu *stat;
+	struct tdb_t	**shards; /* shards of the set or NULL */
+	unsigned int	shard_bits; /* log2 of number of the shards */
+	int		shard;	/* shard number or -1 for whole table */
+	char		name[TDB_TBLNAME_LEN];
 	char		path[TDB_PATH_LEN /* path to mmaped file */
-			     + sizeof(TDB_FNAME)];
+			     + TDB_TBLNAME_LEN + sizeof(TDB_SUFFIX)
+			     + TDB_NODE_SFX_LEN + TDB_SHARD_SFX_LEN];
 } TDB;
 
+/**
+ * @return the shard of table @db keeping records with @key. The most
+ * significant bits of the key choose the shard, so keys must be well
+ * distributed hashes.
+ */
+static inline TDB *
+tdb_shard(TDB *db, unsigned long key)
+{
+	if (!db->shards)
+		return db;
+	return db->shards[key >> (BITS_PER_LONG - db->shard_bits)];
+}
+
+/**
+ * Table description and statistics, see tdb_info().
+ *
+ * @dbsz	- the file size in bytes, zero if the file isn't opened yet;
+ * @free_blks	- approximate number of free data and index blocks;
+ * @stat	- operation counters summed over all CPUs;
+ */
+typedef struct {
+	const char	*name;
+	const char	*path;
+	int		node;
+	unsigned int	rec_len;
+	unsigned long	dbsz;
+	size_t		free_blks;
+	TdbStat		stat;
+} TdbInfo;
+
+/* Size of index statistics histograms, the last slot counts the tail. */
+#define TDB_STAT_HIST		17
+
+/**
+ * Index and storage statistics, see tdb_htrie_info().
+ * Blocks of extents below the index watermark are accounted as index blocks
+ * and the rest used blocks are accounted as data blocks.
+ *
+ * @blks	- total number of blocks;
+ * @free_blks	- number of free blocks;
+ * @i_blks	- used blocks of index extents;
+ * @d_blks	- used blocks of data extents;
+ * @cold_blks	- blocks of cold extents, which aren't inspected;
+ * @i_wm	- index watermark (extent number);
+ * @d_wm	- data watermark (extent number);
+ * @nodes	- number of index nodes;
+ * @leafs	- number of index slots pointing to data buckets;
+ * @recs	- number of live records;
+ * @bursts	- number of burst buckets;
+ * @alloc_errs	- number of failed index and data allocations;
+ * @depth	- histogram of leafs depth (index nodes on the path);
+ * @chain	- histogram of collision chains length (buckets per leaf);
+ * @occupancy	- histogram of live records per leaf;
+ * 		  leafs in cold extents are accounted in @depth only;
+ */
+typedef struct {
+	unsigned long	blks;
+	unsigned long	free_blks;
+	unsigned long	i_blks;
+	unsigned long	d_blks;
+	unsigned long	cold_blks;
+	unsigned long	i_wm;
+	unsigned long	d_wm;
+	unsigned long	nodes;
+	unsigned long	leafs;
+	unsigned long	recs;
+	unsigned long	bursts;
+	unsigned long	alloc_errs;
+	unsigned long	depth[TDB_STAT_HIST];
+	unsigned long	chain[TDB_STAT_HIST];
+	unsigned long	occupancy[TDB_STAT_HIST];
+} TdbHtrieStat;
+
 /**
  * Fixed-size (and typically small) records.
+ *
+ * @expires	- wall clock time (in seconds) at which the record expires,
+ * 		  zero for records without lifetime;
  */
 typedef struct {
 	unsigned long	key; /* must be the first */
+	unsigned int	expires;
+	unsigned int	_padding;
 	char		data[0];
 } __attribute__((packed)) TdbFRec;
 
 /**
  * Variable-size (typically large) record.
  *
+ * @expires	- the same as for TdbFRec, meaningful for the first chunk only;
  * @chunk_next	- offset of next data chunk (also with TdbRec as header)
- * @len		- data length of current chunk
+ * @len		- data length of current chunk, the most significant bits
+ * 		  of the first chunk length keep the record state, so use
+ * 		  TDB_VREC_LEN() to get the length;
  */
 typedef struct {
 	unsigned long	key; /* must be the first */
+	unsigned int	expires; /* must be the second */
 	unsigned int	chunk_next;
 	unsigned int	len;
+	unsigned int	_padding;
 	char		data[0];
 } __attribute__((packed)) TdbVRec;
 
+#define TDB_VREC_FLAGS		0xf0000000U
+#define TDB_VREC_LEN(r)		((r)->len & ~TDB_VREC_FLAGS)
+
+/**
+ * Reader position in SEQLOG table, zeroed position points to the oldest
+ * record of the log.
+ *
+ * @seq		- sequence number of the current segment;
+ * @off		- offset of the next record in the segment;
+ * @ts		- timestamp of the last read record;
+ * @lost	- number of segments overwritten before they were read;
+ */
+typedef struct {
+	unsigned long	seq;
+	unsigned long	off;
+	unsigned long	ts;
+	unsigned long	lost;
+} TdbLogPos;
+
 /* Common interface for database records of all kinds. */
 typedef TdbFRec TdbRec;
 
@@ -103,14 +266,18 @@ typedef TdbFRec TdbRec;
  */
 #define TDB_HTRIE_MINDREC	(L1_CACHE_BYTES * 2)
 
-/* Convert internal offsets to system pointer. */
+/* Convert internal offsets to system pointer and vise versa. */
 #define TDB_PTR(h, o)		(void *)((char *)(h) + (o))
+#define TDB_OFF(h, p)		((char *)(p) - (char *)(h))
 /* Get index and data block indexes by byte offset and vise versa. */
 #define TDB_O2DI(o)		((o) / TDB_HTRIE_MINDREC)
 #define TDB_O2II(o)		((o) / TDB_HTRIE_NODE_SZ)
 #define TDB_DI2O(i)		((i) * TDB_HTRIE_MINDREC)
 #define TDB_II2O(i)		((i) * TDB_HTRIE_NODE_SZ)
 
+/* Maximum number of keys descended at once by tdb_lookup_many(). */
+#define TDB_LOOKUP_BATCH	16
+
 #define TDB_BANNER		"[tdb] "
 
 #ifdef DEBUG
@@ -120,12 +287,60 @@ typedef TdbFRec TdbRec;
 #endif
 #define TDB_ERR(...)		pr_err(TDB_BANNER "ERROR: " __VA_ARGS__)
 
+/*
+ * Readers must call tdb_lookup() and use the returned record in softirq
+ * context or under rcu_read_lock_bh(), otherwise garbage collector can
+ * free the record blocks.
+ */
 TdbRec *tdb_entry_create(TDB *db, unsigned long key, void *data, size_t *len);
 TdbVRec *tdb_entry_add(TDB *db, TdbVRec *r, size_t size);
+TdbRec *tdb_entry_alloc(TDB *db, unsigned long key, size_t *len);
+int tdb_entry_publish(TDB *db, TdbRec *r);
+void tdb_entry_free(TDB *db, TdbRec *r);
+void tdb_entry_remove(TDB *db, TdbRec *r);
+int tdb_entry_set_ttl(TDB *db, TdbRec *r, unsigned int ttl);
 void *tdb_lookup(TDB *db, unsigned long key);
+void tdb_lookup_many(TDB *db, unsigned long *keys, int n, void **recs);
+
+/*
+ * Tiered storage: records in cold extents are invisible for lookups
+ * until they're faulted in.
+ */
+int tdb_resident(TDB *db, unsigned long key);
+int tdb_fault_in(TDB *db, unsigned long key, void (*fn)(void *arg),
+		 void *arg);
+
+/*
+ * In-place updates of fixed-size records,
+ * see tdb_rec_get_or_create() for the memory ordering contract.
+ */
+TdbRec *tdb_rec_get_or_create(TDB *db, unsigned long key);
+void tdb_rec_put(TDB *db, TdbRec *r);
+int tdb_rec_update(TDB *db, unsigned long key,
+		   int (*fn)(void *data, void *arg), void *arg);
 
-/* Open/close database handler. */
-TDB *tdb_open(const char *path, unsigned int fsize, unsigned int rec_size);
+/*
+ * SEQLOG tables: writers append records from any context including softirq,
+ * readers follow the log and copy the records out.
+ */
+int tdb_log_append(TDB *db, const void *data, size_t len);
+long tdb_log_read(TDB *db, TdbLogPos *pos, void *buf, size_t size);
+
+/*
+ * Open/close database table. Each table is identified by its name and
+ * NUMA node and is stored in its own file under @path.
+ */
+TDB *tdb_open(const char *path, const char *name, unsigned long fsize,
+	      unsigned long hot_size, unsigned int rec_size, int node);
+TDB *tdb_open_log(const char *path, const char *name, unsigned long fsize,
+		  int node);
 void tdb_close(TDB *db);
+int tdb_resize(TDB *db, unsigned long fsize);
+
+/* Tables registry. */
+TDB *tdb_get_tbl(const char *name, int node);
+int tdb_for_each_tbl(int (*fn)(TDB *db, void *arg), void *arg);
+void tdb_info(TDB *db, TdbInfo *info);
+int tdb_htrie_info(TDB *db, TdbHtrieStat *st);
 
 #endif /* __TDB_H__ */
@@ -34,4 +34,33 @@ typedef struct tdb_work_t {
 	unsigned int		rsize;
 } TdbWork;
 
+/* Work to fault in records of a tiered table. */
+typedef struct tdb_fault_work_t {
+	struct work_struct	work;
+	TDB			*db;
+	unsigned long		key;
+	void			(*fn)(void *arg);
+	void			*arg;
+} TdbFaultWork;
+
+/* Work to recover a part of database file, see tdb_htrie_recover_start(). */
+typedef struct tdb_recover_work_t {
+	struct work_struct	work;
+	TdbHdr			*hdr;
+	unsigned long		*bmp;
+	unsigned long		from;
+	unsigned long		to;
+} TdbRecoverWork;
+
+/* Work to populate a range of extents, see tdb_prefault(). */
+typedef struct tdb_prefault_work_t {
+	struct work_struct	work;
+	TDB			*db;
+	TdbHdr			*hdr;
+	unsigned long		from;
+	unsigned long		to;
+	int			cold;
+	int			r;
+} TdbPrefaultWork;
+
 #endif /* __WORK_H__ */
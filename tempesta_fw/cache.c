@@ -6,12 +6,9 @@
  * specific stuff. The cache is backed by physical storage layer.
  *
  * TODO:
- * 1. Cache-Control, Expires, ETag, Last-Modified, Vary and some other
- *    RFC 2616 HTTP cache control facilities are not supported yet.
+ * 1. Some RFC 7234 HTTP cache control facilities are not supported yet.
  *    RFC 3143 also affects the caching design.
  *
- * 2. Purge cache by individual entities (e.g. curl -X PURGE <URL>)
- *
  * Copyright (C) 2012-2014 NatSys Lab. (info@natsys-lab.com).
  * Copyright (C) 2014 Tempesta Technologies Ltd.
  *
@@ -29,10 +26,15 @@
  * this program; if not, write to the Free Software Foundation, Inc., 59
  * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
+#include <linux/ctype.h>
 #include <linux/freezer.h>
+#include <linux/hashtable.h>
 #include <linux/ipv6.h>
 #include <linux/kthread.h>
+#include <linux/random.h>
+#include <linux/slab.h>
 #include <linux/tcp.h>
+#include <linux/timer.h>
 #include <linux/topology.h>
 #include <linux/workqueue.h>
 
@@ -40,21 +42,33 @@
 
 #include "tempesta.h"
 #include "cache.h"
+#include "debugfs.h"
 #include "http_msg.h"
 #include "lib.h"
 
 /*
  * @trec	- Database record descriptor.
+ * @date	- time when the response was received or revalidated
+ * @lifetime	- freshness lifetime of the response in seconds
+ * @swr		- time in seconds after @lifetime while the stale response
+ *		  is served and refreshed in background, RFC 5861
  * @key		- the cache enty key (URI + Host header)
  * @hdr_lens	- array of size @hdr_num with all HTTP header lengths
+ * @vgen	- random generation of the variants table, see
+ *		  tfw_cache_variant_key()
+ * @cond	- conditional header of length @cond_len to revalidate the entry
+ * @vary	- normalized Vary header of length @vary_len, see
+ *		  tfw_cache_vary_norm(); if set, then the entry isn't
+ *		  a response, but a table of the response variants
  * @hdrs	- pointer to list of HTTP headers (with trailing CRLFs)
  * @body	- pointer to response body (with a prepending CRLF)
- * @resp	- Linked response if the entry is just created from recent
- * 		  message and NULL if loaded from database.
  *
- * Members from @trec to @body_len are directly written to database file.
+ * Members from @trec to @vgen are directly written to database file.
  * Data pointers from @key to @body are converted from pointers to offsets
- * on database writing.
+ * on database writing. The entry is fully written before it's published
+ * in the database and is never changed after that, except @date and
+ * @lifetime updated on revalidation, so concurrent readers on other CPUs
+ * can use it w/o any locking.
  */
 typedef struct {
 	TdbVRec		trec;
@@ -62,20 +76,45 @@ typedef struct {
 	unsigned int	hdr_num;
 	unsigned int	key_len;
 	unsigned long	body_len;
+	unsigned long	date;
+	unsigned int	lifetime;
+	unsigned int	swr;
+	unsigned int	cond_len;
+	unsigned int	vary_len;
+	unsigned int	vgen;
 	/* db direct write bound */
 	char	*key;
 	unsigned int	*hdr_lens;
+	char		*cond;
+	char		*vary;
 	char		*hdrs;
 	char		*body;
-	/* db conversion bound */
-	TfwHttpResp	*resp;
 } TfwCacheEntry;
 
-/* Work to copy response body to database. */
+/* Maximum length of the conditional header revalidating an entry. */
+#define TFW_CACHE_COND_MAX	256
+/* Lifetime of responses w/o explicit expiration time. */
+#define TFW_CACHE_LIFETIME_INF	UINT_MAX
+/* Maximum length of normalized Vary header. */
+#define TFW_CACHE_VARY_MAX	256
+/* FNV-1a hash parameters for variant keys. */
+#define TFW_CACHE_FNV_BASIS	2166136261UL
+#define TFW_CACHE_FNV_PRIME	16777619UL
+
+/*
+ * Work to copy response body to database or to process a request.
+ * @list links requests waiting for the same response, see
+ * tfw_cache_collapse().
+ */
 typedef struct tfw_cache_work_t {
 	struct work_struct	work;
+	struct list_head	list;
 	union {
-		TfwCacheEntry			*ce;
+		struct {
+			TfwHttpResp		*resp;
+			TfwHttpReq		*req;
+			unsigned long		key;
+		} _c;
 		struct {
 			TfwHttpReq		*req;
 			tfw_http_req_cache_cb_t	action;
@@ -83,25 +122,148 @@ typedef struct tfw_cache_work_t {
 			unsigned long		key;
 		} _r;
 	} _u;
-#define cw_ce	_u.ce
+#define cw_resp	_u._c.resp
+#define cw_creq	_u._c.req
+#define cw_ckey	_u._c.key
 #define cw_req	_u._r.req
 #define cw_act	_u._r.action
 #define cw_data	_u._r.data
 #define cw_key	_u._r.key
 } TfwCWork;
 
-static TDB *db;
+/*
+ * The cache is sharded among NUMA nodes: each node has its own database
+ * which is accessed by the node CPUs only, so there are no remote memory
+ * accesses to the cache entries.
+ *
+ * @db		- the node database shard;
+ * @nr_cpus	- number of online CPUs of the node;
+ * @cpu		- the node CPUs identifiers;
+ */
+typedef struct {
+	TDB		*db;
+	int		nr_cpus;
+	int		*cpu;
+} TfwCacheNode;
+
+static TfwCacheNode c_nodes[MAX_NUMNODES];
+/* Nodes with CPUs among which the cache keys are distributed. */
+static int c_node_ids[MAX_NUMNODES];
+static int c_nodes_n;
+
+/*
+ * Request forwarded to a backend on a cache miss. Following requests for
+ * the same key wait for the response on @waiters instead of going to
+ * the backend too.
+ *
+ * @timer	- forwards the waiting requests if there is no response
+ *		  for too long or frees the hit-for-pass entry;
+ * @key		- the cache entry key;
+ * @pass	- hit-for-pass entry: the response for the key isn't
+ *		  cacheable, so following requests aren't collapsed;
+ * @waiters	- list of TfwCWork for the waiting requests;
+ */
+typedef struct {
+	struct hlist_node	hentry;
+	struct timer_list	timer;
+	unsigned long		key;
+	int			pass;
+	struct list_head	waiters;
+} TfwCachePending;
+
+typedef struct {
+	struct hlist_head	list;
+	spinlock_t		lock;
+} TfwCachePendBucket;
+
+#define TFW_CACHE_PEND_BITS	10
+/* Forward the waiting requests if the backend doesn't answer for so long. */
+#define TFW_CACHE_PEND_TO	(HZ * 5)
+/* Don't collapse requests with uncacheable responses for so long. */
+#define TFW_CACHE_PASS_TO	(HZ * 120)
+
+static TfwCachePendBucket c_pend[1 << TFW_CACHE_PEND_BITS] = {
+	[0 ... ((1 << TFW_CACHE_PEND_BITS) - 1)] = {
+		HLIST_HEAD_INIT,
+		__SPIN_LOCK_UNLOCKED(lock)
+	}
+};
+
+#define TFW_CACHE_VARY_LOCK_BITS	6
+
+/* Serialize creation of the variants tables, see tfw_cache_variants(). */
+static spinlock_t c_vary_lock[1 << TFW_CACHE_VARY_LOCK_BITS] = {
+	[0 ... ((1 << TFW_CACHE_VARY_LOCK_BITS) - 1)]
+		= __SPIN_LOCK_UNLOCKED(c_vary_lock)
+};
+
+/*
+ * Secondary index of the cache entries by host and URI, so single entries,
+ * all entries of a host or entries with some URI prefix can be purged w/o
+ * scanning the whole database. The index isn't persistent and can refer
+ * entries already evicted by TDB, the references are dropped on purging.
+ * The oldest index entries are evicted if there are too many of them, so
+ * the index doesn't cover all the cache entries in this case and purging
+ * by the index is best-effort, see @c_idx_lost.
+ *
+ * @hentry	- link in the index by the host name;
+ * @ents	- list of TfwCacheIdxEnt for the host;
+ * @len		- length of the lower case host @name;
+ */
+typedef struct {
+	struct hlist_node	hentry;
+	struct list_head	ents;
+	unsigned int		len;
+	char			name[0];
+} TfwCacheIdxHost;
+
+/*
+ * @hentry	- link in the index by the cache entry key;
+ * @host_list	- link in the host entries list;
+ * @lru		- link in the list of all the entries in insertion order;
+ * @host	- host of the cache entry;
+ * @key		- the cache entry key;
+ * @uri_len	- length of the entry @uri;
+ */
+typedef struct {
+	struct hlist_node	hentry;
+	struct list_head	host_list;
+	struct list_head	lru;
+	TfwCacheIdxHost		*host;
+	unsigned long		key;
+	unsigned int		uri_len;
+	char			uri[0];
+} TfwCacheIdxEnt;
+
+#define TFW_CACHE_IDX_BITS	12
+#define TFW_CACHE_IDX_HBITS	8
+#define TFW_CACHE_IDX_MAX	(1 << 18)
+/* Host name with port. */
+#define TFW_CACHE_HOST_MAX	256
+
+static DEFINE_HASHTABLE(c_idx_keys, TFW_CACHE_IDX_BITS);
+static DEFINE_HASHTABLE(c_idx_hosts, TFW_CACHE_IDX_HBITS);
+static LIST_HEAD(c_idx_lru);
+static unsigned int c_idx_n;
+/* Number of the cache entries missed in the index. */
+static unsigned long c_idx_lost;
+static DEFINE_SPINLOCK(c_idx_lock);
+
 static struct task_struct *cache_mgr_thr;
 static struct workqueue_struct *cache_wq;
 static struct kmem_cache *c_cache;
 
 /**
  * Calculates search key for the request URI and Host header.
+ * The key is calculated once and kept in the request.
  */
 static unsigned long
 tfw_cache_key_calc(TfwHttpReq *req)
 {
-	return tfw_http_req_key_calc(req);
+	if (!req->cache_key)
+		req->cache_key = tfw_http_req_key_calc(req);
+
+	return req->cache_key;
 }
 
 /**
@@ -115,22 +277,439 @@ tfw_cache_entry_key_copy(TfwCacheEntry *ce, TfwHttpReq *req)
 
 /**
  * Get NUMA node by the cache key.
+ *
+ * TDB resolves keys starting from least significant bits,
+ * so use the most significant bits to choose a node shard.
  */
 static int
 tfw_cache_key_node(unsigned long key)
 {
-	/* TODO distribute keys among NUMA nodes. */
-	return numa_node_id();
+	return c_node_ids[(key >> (BITS_PER_LONG / 2)) % c_nodes_n];
+}
+
+/**
+ * Get the table shard keeping entries with @key. The cache entries are
+ * addressed by offsets from the shard file header, so the shard, not
+ * the whole table, is used for the entries.
+ */
+static TDB *
+tfw_cache_key_db(unsigned long key)
+{
+	return tdb_shard(c_nodes[tfw_cache_key_node(key)].db, key);
 }
 
 /**
  * Get a CPU identifier from @node to schedule a work.
+ * Works from different CPUs are spread among the node CPUs.
+ *
+ * CPU hotplug isn't supported, the node CPUs are fixed on module load.
  */
 static int
 tfw_cache_sched_work_cpu(int node)
 {
-	/* TODO schedule the CPU */
-	return smp_processor_id();
+	TfwCacheNode *cn = &c_nodes[node];
+
+	return cn->cpu[smp_processor_id() % cn->nr_cpus];
+}
+
+static void tfw_cache_req_process_node(struct work_struct *work);
+
+/**
+ * Forward the request from a work to backend w/o cache lookup.
+ * The callback owns the forwarded request.
+ */
+static void
+tfw_cache_req_forward(struct work_struct *work)
+{
+	TfwCWork *cw = (TfwCWork *)work;
+
+	/* The request and the callback expect softirq context. */
+	local_bh_disable();
+	cw->cw_act(cw->cw_req, NULL, cw->cw_data);
+	local_bh_enable();
+
+	kmem_cache_free(c_cache, cw);
+}
+
+/**
+ * Process requests @waiters waiting for the response for @key.
+ * If the response is cached (@hit), then the requests are served from
+ * the cache, otherwise they're forwarded to backend.
+ */
+static void
+tfw_cache_collapse_queue(struct list_head *waiters, unsigned long key,
+			 int hit)
+{
+	TfwCWork *cw, *tmp;
+	int cpu = tfw_cache_sched_work_cpu(tfw_cache_key_node(key));
+
+	list_for_each_entry_safe(cw, tmp, waiters, list) {
+		if (!hit)
+			INIT_WORK(&cw->work, tfw_cache_req_forward);
+		queue_work_on(cpu, cache_wq, (struct work_struct *)cw);
+	}
+}
+
+/**
+ * Process the waiting requests of pending entry @cp and free the entry.
+ */
+static void
+tfw_cache_collapse_release(TfwCachePending *cp, int hit)
+{
+	tfw_cache_collapse_queue(&cp->waiters, cp->key, hit);
+	kfree(cp);
+}
+
+/**
+ * There is no response for the forwarded request for too long, probably
+ * the request or the response is lost, so forward all the waiting
+ * requests.
+ */
+static void
+tfw_cache_collapse_timeout(unsigned long data)
+{
+	TfwCachePending *cp = (TfwCachePending *)data;
+	TfwCachePendBucket *hb = &c_pend[hash_min(cp->key,
+						  TFW_CACHE_PEND_BITS)];
+
+	spin_lock(&hb->lock);
+	/* The entry is woken up or turned to hit-for-pass concurrently. */
+	if (hlist_unhashed(&cp->hentry) || timer_pending(&cp->timer)) {
+		spin_unlock(&hb->lock);
+		return;
+	}
+	hlist_del_init(&cp->hentry);
+	spin_unlock(&hb->lock);
+
+	tfw_cache_collapse_release(cp, 0);
+}
+
+/**
+ * Collapse concurrent cache misses on the same @key: the first missed
+ * request is forwarded to backend and registered as pending, while
+ * the following requests wait for its response. @key is the variant key
+ * if the responses vary by request headers, so requests for different
+ * variants don't wait for each other.
+ * @return 0 if @req is parked and processed later by
+ * tfw_cache_collapse_wake() or non-zero if it must be forwarded, -EAGAIN
+ * means that the response isn't cacheable, see tfw_cache_collapse_pass().
+ * If @req is NULL, then the caller only checks whether a request for
+ * the key is already forwarded and nothing is parked.
+ */
+static int
+tfw_cache_collapse(TfwHttpReq *req, unsigned long key,
+		   tfw_http_req_cache_cb_t action, void *data)
+{
+	TfwCachePending *cp;
+	TfwCachePendBucket *hb;
+	TfwCWork *cw;
+	int r = 0;
+
+	hb = &c_pend[hash_min(key, TFW_CACHE_PEND_BITS)];
+
+	spin_lock_bh(&hb->lock);
+
+	hlist_for_each_entry(cp, &hb->list, hentry)
+		if (cp->key == key)
+			break;
+	if (!cp) {
+		/*
+		 * We're the first, forward the request. The request wakes
+		 * up the waiters when it gets the response or fails.
+		 */
+		cp = kmalloc(sizeof(*cp), GFP_ATOMIC);
+		if (cp) {
+			cp->key = key;
+			cp->pass = 0;
+			INIT_LIST_HEAD(&cp->waiters);
+			hlist_add_head(&cp->hentry, &hb->list);
+			setup_timer(&cp->timer, tfw_cache_collapse_timeout,
+				    (unsigned long)cp);
+			mod_timer(&cp->timer, jiffies + TFW_CACHE_PEND_TO);
+			if (req) {
+				req->flags |= TFW_HTTP_CACHE_COLLAPSE;
+				req->collapse_key = key;
+			}
+		}
+		r = -ENOENT;
+		goto out;
+	}
+	if (cp->pass) {
+		r = -EAGAIN;
+		goto out;
+	}
+	if (!req)
+		goto out;
+
+	cw = kmem_cache_alloc(c_cache, GFP_ATOMIC);
+	if (!cw) {
+		r = -ENOMEM;
+		goto out;
+	}
+	INIT_WORK(&cw->work, tfw_cache_req_process_node);
+	cw->cw_req = req;
+	cw->cw_act = action;
+	cw->cw_data = data;
+	/* The request is looked up again by the primary key. */
+	cw->cw_key = tfw_cache_key_calc(req);
+	list_add_tail(&cw->list, &cp->waiters);
+out:
+	spin_unlock_bh(&hb->lock);
+
+	return r;
+}
+
+/**
+ * The response for @key is received or the forwarded request failed,
+ * so process all the requests waiting for it.
+ */
+static void
+tfw_cache_collapse_wake(unsigned long key, int hit)
+{
+	TfwCachePending *cp;
+	TfwCachePendBucket *hb;
+
+	hb = &c_pend[hash_min(key, TFW_CACHE_PEND_BITS)];
+
+	spin_lock_bh(&hb->lock);
+	hlist_for_each_entry(cp, &hb->list, hentry)
+		if (cp->key == key) {
+			hlist_del_init(&cp->hentry);
+			break;
+		}
+	spin_unlock_bh(&hb->lock);
+
+	if (!cp)
+		return;
+
+	/* Wait for the timer, it doesn't touch the unlinked entry. */
+	del_timer_sync(&cp->timer);
+	tfw_cache_collapse_release(cp, hit);
+}
+
+/**
+ * Wake up the requests waiting for the response for @req if the request
+ * is forwarded as the first one for its key, see tfw_cache_collapse().
+ */
+static void
+tfw_cache_collapse_done(TfwHttpReq *req, int hit)
+{
+	if (!(req->flags & TFW_HTTP_CACHE_COLLAPSE))
+		return;
+	req->flags &= ~TFW_HTTP_CACHE_COLLAPSE;
+	tfw_cache_collapse_wake(req->collapse_key, hit);
+}
+
+/**
+ * The response for @req isn't cacheable, so forward the requests waiting
+ * for it and don't collapse requests for the key for TFW_CACHE_PASS_TO.
+ */
+static void
+tfw_cache_collapse_pass(TfwHttpReq *req)
+{
+	TfwCachePending *cp;
+	TfwCachePendBucket *hb;
+	unsigned long key = req->collapse_key;
+	LIST_HEAD(waiters);
+
+	if (!(req->flags & TFW_HTTP_CACHE_COLLAPSE))
+		return;
+	req->flags &= ~TFW_HTTP_CACHE_COLLAPSE;
+
+	hb = &c_pend[hash_min(key, TFW_CACHE_PEND_BITS)];
+
+	spin_lock_bh(&hb->lock);
+	hlist_for_each_entry(cp, &hb->list, hentry)
+		if (cp->key == key) {
+			list_splice_init(&cp->waiters, &waiters);
+			cp->pass = 1;
+			mod_timer(&cp->timer, jiffies + TFW_CACHE_PASS_TO);
+			break;
+		}
+	spin_unlock_bh(&hb->lock);
+
+	tfw_cache_collapse_queue(&waiters, key, 0);
+}
+
+/**
+ * The request forwarded to backend by the cache callback fails, e.g. it
+ * can't be sent or the connection is closed, so forward the requests
+ * waiting for its response.
+ */
+void
+tfw_cache_abort(TfwHttpReq *req)
+{
+	tfw_cache_collapse_done(req, 0);
+}
+
+/**
+ * Free all the pending entries and pass their waiting requests to the
+ * callbacks, which own the requests and their sessions.
+ * Called on module unloading.
+ */
+static void
+tfw_cache_collapse_purge(void)
+{
+	int i;
+	TfwCachePending *cp;
+	TfwCWork *cw, *tw;
+
+	for (i = 0; i < ARRAY_SIZE(c_pend); ++i) {
+		TfwCachePendBucket *hb = &c_pend[i];
+
+		while (1) {
+			spin_lock_bh(&hb->lock);
+			cp = hlist_entry_safe(hb->list.first, TfwCachePending,
+					      hentry);
+			if (cp)
+				hlist_del_init(&cp->hentry);
+			spin_unlock_bh(&hb->lock);
+			if (!cp)
+				break;
+
+			del_timer_sync(&cp->timer);
+			list_for_each_entry_safe(cw, tw, &cp->waiters, list) {
+				local_bh_disable();
+				cw->cw_act(cw->cw_req, NULL, cw->cw_data);
+				local_bh_enable();
+				kmem_cache_free(c_cache, cw);
+			}
+			kfree(cp);
+		}
+	}
+}
+
+/**
+ * @return freshness lifetime of response @resp in seconds, RFC 7234 4.2.1.
+ * Responses w/o explicit expiration time are fresh until they're evicted.
+ */
+static unsigned int
+tfw_cache_lifetime(TfwHttpResp *resp)
+{
+	TfwCacheControl *cc = &resp->cache_ctl;
+	unsigned long now;
+
+	if (cc->flags & TFW_HTTP_CC_NO_CACHE)
+		return 0;
+	if (cc->flags & TFW_HTTP_CC_S_MAXAGE)
+		return cc->s_maxage;
+	if (cc->flags & TFW_HTTP_CC_MAX_AGE)
+		return cc->max_age;
+	if (resp->expires) {
+		now = get_seconds();
+		return resp->expires > now ? resp->expires - now : 0;
+	}
+
+	return TFW_CACHE_LIFETIME_INF;
+}
+
+/**
+ * The cache entry can be used for @req w/o revalidation.
+ * @date and @lifetime are updated concurrently on revalidation, but a mix
+ * of their old and new values is still a valid freshness estimation.
+ */
+static int
+tfw_cache_entry_fresh(TfwCacheEntry *ce, TfwHttpReq *req)
+{
+	unsigned int lifetime = ACCESS_ONCE(ce->lifetime);
+
+	if (req->cache_ctl.flags & TFW_HTTP_CC_NO_CACHE)
+		return 0;
+	if (lifetime == TFW_CACHE_LIFETIME_INF)
+		return 1;
+
+	return get_seconds() - ACCESS_ONCE(ce->date) < lifetime;
+}
+
+/**
+ * The stale cache entry can still be sent to the client while it's
+ * refreshed in background.
+ */
+static int
+tfw_cache_entry_swr(TfwCacheEntry *ce, TfwHttpReq *req)
+{
+	unsigned int swr = ACCESS_ONCE(ce->swr);
+
+	if (!swr || (req->cache_ctl.flags & TFW_HTTP_CC_NO_CACHE))
+		return 0;
+
+	return get_seconds() - ACCESS_ONCE(ce->date)
+	       < (unsigned long)ACCESS_ONCE(ce->lifetime) + swr;
+}
+
+static unsigned int
+__cache_cond_hdr(char *buf, const char *name, size_t n, const TfwStr *val)
+{
+	if (n + val->len + 2 > TFW_CACHE_COND_MAX)
+		return 0;
+	memcpy(buf, name, n);
+	memcpy(buf + n, val->ptr, val->len);
+	memcpy(buf + n + val->len, "\r\n", 2);
+
+	return n + val->len + 2;
+}
+
+#define TFW_CACHE_COND_HDR(buf, name, val)				\
+	__cache_cond_hdr(buf, name, sizeof(name) - 1, val)
+
+/**
+ * Build conditional header revalidating cached response @resp in @buf
+ * of TFW_CACHE_COND_MAX bytes. ETag is preferred over Last-Modified,
+ * RFC 7232 2.4.
+ * @return the header length or 0 if the response has no validators.
+ */
+static unsigned int
+tfw_cache_cond_build(char *buf, TfwHttpResp *resp)
+{
+	if (resp->etag.len)
+		return TFW_CACHE_COND_HDR(buf, "If-None-Match: ", &resp->etag);
+	if (resp->last_modified.len)
+		return TFW_CACHE_COND_HDR(buf, "If-Modified-Since: ",
+					  &resp->last_modified);
+	return 0;
+}
+
+/**
+ * The client request has its own validators, RFC 7232 3.2 and 3.3.
+ */
+static int
+tfw_cache_req_conditional(TfwHttpReq *req)
+{
+	int i;
+	TfwHttpHdrTbl *ht = req->h_tbl;
+
+	for (i = 0; ht && i < ht->size; ++i) {
+		TfwStr *hdr = &ht->tbl[i].field;
+		if (hdr->ptr
+		    && (tfw_str_eq_cstr(hdr, "if-none-match:", 14,
+					TFW_STR_EQ_PREFIX_CASEI)
+			|| tfw_str_eq_cstr(hdr, "if-modified-since:", 18,
+					   TFW_STR_EQ_PREFIX_CASEI)))
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Make @req conditional to revalidate stale cache entry @ce.
+ * The request is forwarded to backend and if the entry is still valid,
+ * then the backend answers with 304, see tfw_cache_refresh().
+ * Conditional client requests are forwarded as is, so the client gets
+ * 304 for its own validators.
+ */
+static void
+tfw_cache_revalidate(TDB *db, TfwCacheEntry *ce, TfwHttpReq *req)
+{
+	char *cond = TDB_PTR(db->hdr, (unsigned long)ce->cond);
+
+	if (!ce->cond_len || (req->flags & TFW_HTTP_CACHE_REVAL)
+	    || tfw_cache_req_conditional(req))
+		return;
+	if (tfw_http_msg_hdr_add((TfwHttpMsg *)req, cond, ce->cond_len)
+	    != TFW_PASS)
+		return;
+	req->flags |= TFW_HTTP_CACHE_REVAL;
 }
 
 /**
@@ -141,59 +720,640 @@ tfw_cache_sched_work_cpu(int node)
  * so it tries to minimizae total number of allocations regardles
  * how many chunks are copied.
  */
-static long
-tfw_cache_copy_str(char **p, TdbVRec **trec, TfwStr *src, size_t tot_len)
+static long
+tfw_cache_copy_str(TDB *db, char **p, TdbVRec **trec, TfwStr *src,
+		   size_t tot_len)
+{
+	long copied = 0;
+
+	BUG_ON(src->flags & (TFW_STR_COMPOUND | TFW_STR_COMPOUND2));
+
+	while (copied < src->len) {
+		int room = (char *)(*trec + 1) + (*trec)->len - *p;
+		BUG_ON(room < 0);
+		if (!room) {
+			BUG_ON(tot_len < copied);
+			*trec = tdb_entry_add(db, *trec, tot_len - copied);
+			if (!*trec)
+				return -ENOMEM;
+			*p = (char *)(*trec + 1);
+			room = (*trec)->len;
+		}
+		room = min((long)room, src->len - copied);
+		memcpy(*p, (char *)src->ptr + copied, room);
+		*p += room;
+		copied += room;
+	}
+
+	return copied;
+}
+
+/**
+ * Copies TfwStr (probably compound) to TdbRec.
+ * @return number of copied bytes (@src overall length).
+ */
+static long
+tfw_cache_copy_str_compound(TDB *db, char **p, TdbVRec **trec, TfwStr *src,
+			    size_t tot_len)
+{
+	int i;
+	long copied = 0;
+
+	BUG_ON(!tot_len);
+
+	if (!(src->flags & TFW_STR_COMPOUND))
+		return tfw_cache_copy_str(db, p, trec, src, tot_len);
+
+	for (i = 0; i < src->len; ++i) {
+		long n = tfw_cache_copy_str(db, p, trec,
+					    (TfwStr *)src->ptr + i,
+					    tot_len - copied);
+		if (n < 0)
+			return n;
+		copied += n;
+		BUG_ON(tot_len < copied);
+	}
+
+	return copied;
+}
+
+/**
+ * Remove older entries shadowing just published entry @ce, e.g. stale
+ * entries which are replaced by a new response on revalidation.
+ */
+static void
+tfw_cache_replace(TDB *db, TfwCacheEntry *ce)
+{
+	TfwCacheEntry *old;
+
+	rcu_read_lock_bh();
+	while ((old = tdb_lookup(db, ce->trec.key)) && old != ce)
+		tdb_entry_remove(db, (TdbRec *)old);
+	rcu_read_unlock_bh();
+}
+
+/**
+ * Normalize Vary header value @vary to @buf of TFW_CACHE_VARY_MAX bytes:
+ * the header names are converted to lower case and each of them is
+ * terminated by ':', so they can be matched against request headers as is.
+ * @return length of the normalized value or negative value if the response
+ * varies by all the request (Vary: *) or the value is too long.
+ */
+static int
+tfw_cache_vary_norm(char *buf, const TfwStr *vary)
+{
+	int n = 0;
+	const TfwStr *c;
+
+	TFW_STR_FOR_EACH_CHUNK(c, vary) {
+		const unsigned char *p = c->ptr, *end = p + c->len;
+
+		for ( ; p < end; ++p) {
+			if (isspace(*p))
+				continue;
+			if (*p == '*' || iscntrl(*p) || !isascii(*p))
+				return -EINVAL;
+			if (n == TFW_CACHE_VARY_MAX)
+				return -E2BIG;
+			if (*p == ',') {
+				if (n && buf[n - 1] != ':')
+					buf[n++] = ':';
+				continue;
+			}
+			buf[n++] = tolower(*p);
+		}
+	}
+	if (n && buf[n - 1] != ':') {
+		if (n == TFW_CACHE_VARY_MAX)
+			return -E2BIG;
+		buf[n++] = ':';
+	}
+
+	return n;
+}
+
+/**
+ * Add normalized value of the request header @hdr, i.e. in lower case and
+ * w/o spaces, to the variant hash @h.
+ */
+static unsigned long
+tfw_cache_vary_hash_hdr(unsigned long h, const TfwStr *hdr)
+{
+	int val = 0;
+	const TfwStr *c;
+
+	TFW_STR_FOR_EACH_CHUNK(c, hdr) {
+		const unsigned char *p = c->ptr, *end = p + c->len;
+
+		for ( ; p < end; ++p) {
+			if (!val) {
+				/* Skip the header name. */
+				val = *p == ':';
+				continue;
+			}
+			if (!isspace(*p))
+				h = (h ^ tolower(*p)) * TFW_CACHE_FNV_PRIME;
+		}
+	}
+
+	return h;
+}
+
+/**
+ * Calculate key of the response variant for @req by the request headers
+ * listed in normalized Vary @vary of the variants table with generation
+ * @vgen. The variant key differs from the primary @key in the low bits
+ * only, so the variant is stored on the same NUMA node.
+ */
+static unsigned long
+tfw_cache_variant_key(unsigned long key, unsigned int vgen, const char *vary,
+		      unsigned int vary_len, TfwHttpReq *req)
+{
+	int i;
+	const char *name, *end = vary + vary_len;
+	TfwHttpHdrTbl *ht = req->h_tbl;
+	unsigned long h = TFW_CACHE_FNV_BASIS ^ vgen;
+	unsigned long mask = (1UL << (BITS_PER_LONG / 2)) - 1;
+
+	for (name = vary; name < end; ) {
+		const char *p = memchr(name, ':', end - name);
+		int n;
+
+		if (unlikely(!p))
+			break;
+		n = p - name + 1;
+
+		for (i = 0; ht && i < ht->size; ++i) {
+			TfwStr *hdr = &ht->tbl[i].field;
+			if (hdr->ptr
+			    && tfw_str_eq_cstr(hdr, name, n,
+					       TFW_STR_EQ_PREFIX_CASEI))
+				h = tfw_cache_vary_hash_hdr(h, hdr);
+		}
+		/* Separate values of different headers. */
+		h = (h ^ ',') * TFW_CACHE_FNV_PRIME;
+		name += n;
+	}
+
+	/* The variant key must differ from the primary one. */
+	h &= mask;
+	return key ^ (h ? : 1);
+}
+
+/**
+ * Look up the cache entry for @req with primary @key. If the responses for
+ * the key vary by the request headers, then the entry found by the key is
+ * the variants table and the response is looked up by the variant key.
+ * @db and @key are updated to the variant database shard and key.
+ * Must be called under rcu_read_lock_bh().
+ */
+static TfwCacheEntry *
+tfw_cache_lookup(TDB **db, unsigned long *key, TfwHttpReq *req)
+{
+	char *vary;
+	TfwCacheEntry *ce = tdb_lookup(*db, *key);
+
+	if (!ce || !ce->vary_len)
+		return ce;
+
+	vary = TDB_PTR((*db)->hdr, (unsigned long)ce->vary);
+	*key = tfw_cache_variant_key(*key, ce->vgen, vary, ce->vary_len, req);
+	*db = tfw_cache_key_db(*key);
+
+	return tdb_lookup(*db, *key);
+}
+
+/**
+ * Remove all the records with @key from the database.
+ * @return number of removed records.
+ */
+static int
+tfw_cache_remove(unsigned long key)
+{
+	int n = 0;
+	TfwCacheEntry *ce;
+	TDB *db = tfw_cache_key_db(key);
+
+	rcu_read_lock_bh();
+	while ((ce = tdb_lookup(db, key))) {
+		tdb_entry_remove(db, (TdbRec *)ce);
+		++n;
+	}
+	rcu_read_unlock_bh();
+
+	return n;
+}
+
+/**
+ * Copy string @s of up to @max bytes to @buf.
+ * @return length of the string or negative value if it doesn't fit @buf.
+ */
+static int
+tfw_cache_str_copy(char *buf, size_t max, const TfwStr *s)
+{
+	size_t n = 0;
+	const TfwStr *c;
+
+	TFW_STR_FOR_EACH_CHUNK(c, s) {
+		if (n + c->len > max)
+			return -E2BIG;
+		memcpy(buf + n, c->ptr, c->len);
+		n += c->len;
+	}
+
+	return n;
+}
+
+/**
+ * Copy lower case host name of @req to @buf of TFW_CACHE_HOST_MAX bytes.
+ */
+static int
+tfw_cache_req_host(TfwHttpReq *req, char *buf)
+{
+	int i, n = tfw_cache_str_copy(buf, TFW_CACHE_HOST_MAX, &req->host);
+
+	for (i = 0; i < n; ++i)
+		buf[i] = tolower(buf[i]);
+
+	return n;
+}
+
+static unsigned long
+tfw_cache_host_hash(const char *name, unsigned int len)
+{
+	TfwStr s = { .ptr = (void *)name, .len = len };
+
+	return tfw_hash_str(&s);
+}
+
+/**
+ * Find index entries of host @name.
+ * Must be called under c_idx_lock.
+ */
+static TfwCacheIdxHost *
+tfw_cache_idx_host(const char *name, unsigned int len, unsigned long hash)
+{
+	TfwCacheIdxHost *h;
+
+	hash_for_each_possible(c_idx_hosts, h, hentry, hash)
+		if (h->len == len && !memcmp(h->name, name, len))
+			return h;
+
+	return NULL;
+}
+
+/**
+ * Must be called under c_idx_lock.
+ */
+static TfwCacheIdxEnt *
+tfw_cache_idx_ent(unsigned long key)
+{
+	TfwCacheIdxEnt *e;
+
+	hash_for_each_possible(c_idx_keys, e, hentry, key)
+		if (e->key == key)
+			return e;
+
+	return NULL;
+}
+
+/**
+ * Unlink index entry @e from the index, but not from the host list.
+ * Must be called under c_idx_lock.
+ */
+static void
+tfw_cache_idx_unlink(TfwCacheIdxEnt *e)
+{
+	hash_del(&e->hentry);
+	list_del(&e->lru);
+	--c_idx_n;
+}
+
+/**
+ * Remove index entry @e. The host is freed by the caller when the host
+ * has no entries any more, so the host list can be traversed.
+ * Must be called under c_idx_lock.
+ */
+static void
+tfw_cache_idx_del(TfwCacheIdxEnt *e)
+{
+	tfw_cache_idx_unlink(e);
+	list_del(&e->host_list);
+	kfree(e);
+}
+
+static void
+tfw_cache_idx_host_put(TfwCacheIdxHost *h)
+{
+	if (!list_empty(&h->ents))
+		return;
+	hash_del(&h->hentry);
+	kfree(h);
+}
+
+static void
+tfw_cache_idx_lost(void)
+{
+	spin_lock_bh(&c_idx_lock);
+	++c_idx_lost;
+	spin_unlock_bh(&c_idx_lock);
+}
+
+/**
+ * Add the cache entry with @key for @req to the secondary index.
+ * Errors aren't fatal: the entry just can't be purged by the host or
+ * URI prefix, but such purges are reported as best-effort.
+ */
+static void
+tfw_cache_idx_add(TfwHttpReq *req, unsigned long key)
+{
+	int hlen, ulen;
+	unsigned long hash;
+	char host[TFW_CACHE_HOST_MAX];
+	TfwCacheIdxHost *h;
+	TfwCacheIdxEnt *e, *old;
+
+	hlen = tfw_cache_req_host(req, host);
+	ulen = tfw_str_len(&req->uri);
+	if (hlen < 0 || ulen < 0)
+		goto lost;
+	hash = tfw_cache_host_hash(host, hlen);
+
+	e = kmalloc(sizeof(*e) + ulen, GFP_ATOMIC);
+	if (!e)
+		goto lost;
+	e->key = key;
+	e->uri_len = tfw_cache_str_copy(e->uri, ulen, &req->uri);
+
+	spin_lock_bh(&c_idx_lock);
+
+	/* The entry is replaced by a new response, e.g. on revalidation. */
+	if (tfw_cache_idx_ent(key))
+		goto err;
+
+	h = tfw_cache_idx_host(host, hlen, hash);
+	if (!h) {
+		h = kmalloc(sizeof(*h) + hlen, GFP_ATOMIC);
+		if (!h) {
+			++c_idx_lost;
+			goto err;
+		}
+		INIT_LIST_HEAD(&h->ents);
+		h->len = hlen;
+		memcpy(h->name, host, hlen);
+		hash_add(c_idx_hosts, &h->hentry, hash);
+	}
+	e->host = h;
+	list_add_tail(&e->host_list, &h->ents);
+	list_add_tail(&e->lru, &c_idx_lru);
+	hash_add(c_idx_keys, &e->hentry, key);
+
+	if (++c_idx_n > TFW_CACHE_IDX_MAX) {
+		old = list_first_entry(&c_idx_lru, TfwCacheIdxEnt, lru);
+		h = old->host;
+		tfw_cache_idx_del(old);
+		tfw_cache_idx_host_put(h);
+		++c_idx_lost;
+	}
+
+	spin_unlock_bh(&c_idx_lock);
+	return;
+err:
+	spin_unlock_bh(&c_idx_lock);
+	kfree(e);
+	return;
+lost:
+	tfw_cache_idx_lost();
+}
+
+static void
+tfw_cache_idx_purge(void)
+{
+	TfwCacheIdxEnt *e, *tmp;
+
+	list_for_each_entry_safe(e, tmp, &c_idx_lru, lru) {
+		TfwCacheIdxHost *h = e->host;
+		tfw_cache_idx_del(e);
+		tfw_cache_idx_host_put(h);
+	}
+}
+
+/**
+ * Purge the cache entries of @host (in lower case) with URI @uri or,
+ * if @prefix is true, with URIs starting with @uri. Empty @uri prefix
+ * purges all the host entries. @partial is set if the index misses some
+ * cache entries, so the purge is best-effort.
+ * @return number of purged database records.
+ */
+int
+tfw_cache_purge(const char *host, size_t hlen, const char *uri, size_t ulen,
+		int prefix, int *partial)
+{
+	int n = 0;
+	TfwCacheIdxHost *h;
+	TfwCacheIdxEnt *e, *tmp;
+	LIST_HEAD(purged);
+
+	*partial = 0;
+	if (!tfw_cfg.cache)
+		return 0;
+
+	/* Only collect the index entries under the lock. */
+	spin_lock_bh(&c_idx_lock);
+
+	*partial = !!c_idx_lost;
+
+	h = tfw_cache_idx_host(host, hlen, tfw_cache_host_hash(host, hlen));
+	if (!h)
+		goto out;
+	list_for_each_entry_safe(e, tmp, &h->ents, host_list) {
+		if (e->uri_len < ulen || (!prefix && e->uri_len != ulen)
+		    || memcmp(e->uri, uri, ulen))
+			continue;
+		tfw_cache_idx_unlink(e);
+		list_move_tail(&e->host_list, &purged);
+	}
+	tfw_cache_idx_host_put(h);
+out:
+	spin_unlock_bh(&c_idx_lock);
+
+	list_for_each_entry_safe(e, tmp, &purged, host_list) {
+		n += tfw_cache_remove(e->key);
+		kfree(e);
+	}
+
+	return n;
+}
+
+/**
+ * Purge the cache entries for PURGE request @req. URI ending with '*'
+ * purges all the host entries with the URI prefix, @partial is set if
+ * the purge is best-effort, see tfw_cache_purge().
+ * @return number of purged database records or negative value on error.
+ */
+int
+tfw_cache_purge_req(TfwHttpReq *req, int *partial)
+{
+	int n, hlen, ulen;
+	unsigned long key;
+	char host[TFW_CACHE_HOST_MAX], *uri;
+	TfwCacheIdxEnt *e;
+
+	*partial = 0;
+	if (!tfw_cfg.cache)
+		return 0;
+
+	ulen = tfw_str_len(&req->uri);
+	uri = kmalloc(ulen, GFP_ATOMIC);
+	if (!uri)
+		return -ENOMEM;
+	tfw_cache_str_copy(uri, ulen, &req->uri);
+
+	if (ulen && uri[ulen - 1] == '*') {
+		hlen = tfw_cache_req_host(req, host);
+		n = hlen < 0 ? hlen
+			     : tfw_cache_purge(host, hlen, uri, ulen - 1, 1,
+					       partial);
+		goto out;
+	}
+
+	/*
+	 * The entry key is calculated as for GET request, so the entry
+	 * is purged even if it was evicted from the index.
+	 */
+	key = tfw_cache_key_calc(req);
+	n = tfw_cache_remove(key);
+
+	spin_lock_bh(&c_idx_lock);
+	e = tfw_cache_idx_ent(key);
+	if (e) {
+		TfwCacheIdxHost *h = e->host;
+		tfw_cache_idx_del(e);
+		tfw_cache_idx_host_put(h);
+	}
+	spin_unlock_bh(&c_idx_lock);
+out:
+	kfree(uri);
+	return n;
+}
+
+/**
+ * Purge the cache entries by @spec of form "host[/uri][*]", e.g.
+ * "example.com/img/*" purges all images of example.com and just
+ * "example.com" purges all the host entries.
+ * @return number of purged database records or negative value on error.
+ */
+int
+tfw_cache_purge_spec(char *spec)
 {
-	long copied = 0;
+	int i, n, prefix, partial;
+	size_t hlen, ulen;
+	char *uri;
+
+	spec = strim(spec);
+	uri = strchrnul(spec, '/');
+	hlen = uri - spec;
+	ulen = strlen(uri);
+	if (!hlen)
+		return -EINVAL;
+
+	prefix = !ulen || uri[ulen - 1] == '*';
+	if (ulen && prefix)
+		--ulen;
+	for (i = 0; i < hlen; ++i)
+		spec[i] = tolower(spec[i]);
+
+	n = tfw_cache_purge(spec, hlen, uri, ulen, prefix, &partial);
+	if (partial)
+		TFW_WARN("Cache: the index misses some entries, purge of %.*s"
+			 " may be incomplete\n", (int)hlen, spec);
+
+	return n;
+}
 
-	BUG_ON(src->flags & (TFW_STR_COMPOUND | TFW_STR_COMPOUND2));
+/**
+ * Look up the variants table with normalized Vary @vary for @key.
+ * Must be called under rcu_read_lock_bh().
+ */
+static TfwCacheEntry *
+tfw_cache_variants_lookup(TDB *db, unsigned long key, const char *vary,
+			  unsigned int vary_len)
+{
+	TfwCacheEntry *ce = tdb_lookup(db, key);
 
-	while (copied < src->len) {
-		int room = (char *)(*trec + 1) + (*trec)->len - *p;
-		BUG_ON(room < 0);
-		if (!room) {
-			BUG_ON(tot_len < copied);
-			*trec = tdb_entry_add(db, *trec, tot_len - copied);
-			if (!*trec)
-				return -ENOMEM;
-			*p = (char *)(*trec + 1);
-			room = (*trec)->len;
-		}
-		room = min((long)room, src->len - copied);
-		memcpy(p, (char *)src->ptr + copied, room);
-		*p += room;
-		copied += room;
-	}
+	if (ce && ce->vary_len == vary_len
+	    && !memcmp(TDB_PTR(db->hdr, (unsigned long)ce->vary), vary,
+		       vary_len))
+		return ce;
 
-	return copied;
+	return NULL;
 }
 
 /**
- * Copies TfwStr (probably compound) to TdbRec.
- * @return number of copied bytes (@src overall length).
+ * Get generation @vgen of the variants table with normalized Vary @vary
+ * for primary @key. A new table replaces a response or a table for other
+ * Vary stored with the key, so the older variants become unreachable.
+ *
+ * The table is created only if it's absent: concurrent responses for the
+ * key are serialized, so they don't replace the table created by each
+ * other with a new generation. Responses w/o Vary still can replace the
+ * table, so the generation is read from the table visible after insertion.
  */
-static long
-tfw_cache_copy_str_compound(char **p, TdbVRec **trec, TfwStr *src,
-			    size_t tot_len)
+static int
+tfw_cache_variants(TDB *db, unsigned long key, const char *vary,
+		   unsigned int vary_len, unsigned int *vgen)
 {
-	int i;
-	long copied = 0;
+	size_t len = sizeof(TfwCacheEntry) - sizeof(TdbVRec) + vary_len;
+	spinlock_t *lock = &c_vary_lock[hash_min(key,
+						 TFW_CACHE_VARY_LOCK_BITS)];
+	TfwCacheEntry *ce;
+	int r = 0;
 
-	BUG_ON(!tot_len);
+	spin_lock_bh(lock);
 
-	if (!(src->flags & TFW_STR_COMPOUND))
-		return tfw_cache_copy_str(p, trec, src, tot_len);
+	rcu_read_lock_bh();
+	ce = tfw_cache_variants_lookup(db, key, vary, vary_len);
+	if (ce)
+		*vgen = ce->vgen;
+	rcu_read_unlock_bh();
+	if (ce)
+		goto out;
 
-	for (i = 0; i < src->len; ++i) {
-		long n = tfw_cache_copy_str(p, trec, (TfwStr *)src->ptr + i,
-					    tot_len - copied);
-		if (n < 0)
-			return n;
-		copied += n;
-		BUG_ON(tot_len < copied);
+	r = -ENOMEM;
+	ce = (TfwCacheEntry *)tdb_entry_alloc(db, key, &len);
+	if (!ce)
+		goto out;
+	if (len < sizeof(*ce) - sizeof(ce->trec) + vary_len) {
+		tdb_entry_free(db, (TdbRec *)ce);
+		goto out;
+	}
+	memset(&ce->hdr_num, 0, sizeof(*ce) - sizeof(ce->trec));
+	ce->date = get_seconds();
+	ce->vary_len = vary_len;
+	ce->vgen = prandom_u32();
+	ce->vary = (char *)TDB_OFF(db->hdr, ce + 1);
+	memcpy(ce + 1, vary, vary_len);
+	ce->trec.len = (char *)(ce + 1) + vary_len - ce->trec.data;
+
+	if (tdb_entry_publish(db, (TdbRec *)ce)) {
+		tdb_entry_free(db, (TdbRec *)ce);
+		goto out;
+	}
+	tfw_cache_replace(db, ce);
+
+	rcu_read_lock_bh();
+	ce = tfw_cache_variants_lookup(db, key, vary, vary_len);
+	if (ce) {
+		*vgen = ce->vgen;
+		r = 0;
+	} else {
+		r = -ENOENT;
 	}
+	rcu_read_unlock_bh();
+out:
+	spin_unlock_bh(lock);
 
-	return copied;
+	return r;
 }
 
 /**
@@ -201,6 +1361,10 @@ tfw_cache_copy_str_compound(char **p, TdbVRec **trec, TfwStr *src,
  *
  * It's nasty to copy data on CPU, but we can't use DMA for mmaped file
  * as well as for unaligned memory areas.
+ *
+ * The whole entry is written to private (not linked with the database index)
+ * record and published only when it's complete, so concurrent readers
+ * never see partially written entries.
  */
 static void
 tfw_cache_copy_resp(struct work_struct *work)
@@ -210,106 +1374,166 @@ tfw_cache_copy_resp(struct work_struct *work)
 	long n;
 	char *p;
 	TfwCWork *cw = (TfwCWork *)work;
-	TfwCacheEntry *ce = cw->cw_ce;
+	TfwHttpResp *resp = cw->cw_resp;
+	unsigned long key = cw->cw_ckey;
+	TDB *db = tfw_cache_key_db(key);
+	int hit = 0, vary_len;
+	unsigned int cond_len, vgen;
+	char cond[TFW_CACHE_COND_MAX], vary[TFW_CACHE_VARY_MAX];
+	TfwCacheEntry *ce;
 	TdbVRec *trec;
 	TfwHttpHdrTbl *htbl;
 	TfwHttpHdr *hdr;
 
-	BUG_ON(!ce->resp);
-
-	/* Write HTTP headers. */
-	htbl = ce->resp->h_tbl;
-	ce->hdr_num = htbl->size;
+	/* Store the response as a variant for the request headers. */
+	if (resp->vary.len) {
+		vary_len = tfw_cache_vary_norm(vary, &resp->vary);
+		if (vary_len <= 0
+		    || tfw_cache_variants(db, key, vary, vary_len, &vgen))
+			goto out;
+		key = tfw_cache_variant_key(key, vgen, vary, vary_len,
+					    cw->cw_creq);
+		db = tfw_cache_key_db(key);
+	}
 
-	hlens = sizeof(ce->hdr_lens[0]) * ce->hdr_num;
-	tot_len = hlens + ce->resp->msg.len;
+	htbl = resp->h_tbl;
+	hlens = sizeof(ce->hdr_lens[0]) * htbl->size;
+	cond_len = tfw_cache_cond_build(cond, resp);
+	tot_len = sizeof(*ce) - sizeof(ce->trec) + hlens + cond_len
+		  + resp->msg.len;
 
 	/*
 	 * Try to place the cached response in single memory chunk.
 	 *
 	 * Number of HTTP headers is limited by TFW_HTTP_HDR_NUM_MAX while TDB
 	 * should be able to allocate an empty page if we issued a large
-	 * request. So HTTP header lengths must fit the first allocated data
-	 * chunk, also there must be some space for headers and message bodies.
+	 * request. So HTTP header lengths and the conditional header must fit
+	 * the first allocated data chunk, also there must be some space for
+	 * headers and message bodies.
 	 */
-	trec = tdb_entry_add(db, (TdbVRec *)ce, tot_len);
-	if (!trec || trec->len <= hlens) {
+	ce = (TfwCacheEntry *)tdb_entry_alloc(db, key, &tot_len);
+	if (!ce) {
 		TFW_WARN("Cannot allocate memory to cache HTTP headers."
 			 " Probably TDB cache is exhausted.\n");
+		goto out;
+	}
+	trec = &ce->trec;
+	if (trec->len <= sizeof(*ce) - sizeof(*trec) + hlens + cond_len) {
+		TFW_WARN("Cache: too many HTTP headers to cache\n");
 		goto err;
 	}
-	p = (char *)(trec + 1) + hlens;
-	tot_len -= hlens;
+	ce->hdr_num = htbl->size;
+	ce->date = get_seconds();
+	ce->lifetime = tfw_cache_lifetime(resp);
+	ce->swr = resp->cache_ctl.swr;
+	ce->vary_len = 0;
+	p = (char *)(ce + 1);
+	ce->hdr_lens = (unsigned int *)TDB_OFF(db->hdr, p);
+	p += hlens;
+	ce->cond_len = cond_len;
+	ce->cond = (char *)TDB_OFF(db->hdr, p);
+	memcpy(p, cond, cond_len);
+	p += cond_len;
+	tot_len = resp->msg.len;
 
 	/*
 	 * Set start of headers pointer just after array of
 	 * header length.
 	 */
-	ce->hdrs = p;
+	ce->hdrs = (char *)TDB_OFF(db->hdr, p);
 	hdr = htbl->tbl;
-	for (i = 0; i < hlens / sizeof(ce->hdr_lens[0]); ++i, ++hdr) {
-		n = tfw_cache_copy_str_compound(&p, &trec, &hdr->field,
+	for (i = 0; i < ce->hdr_num; ++i, ++hdr) {
+		n = tfw_cache_copy_str_compound(db, &p, &trec, &hdr->field,
 						tot_len);
 		if (n < 0) {
 			TFW_ERR("Cache: cannot copy HTTP header\n");
 			goto err;
 		}
 		BUG_ON(n > tot_len);
+		((unsigned int *)(ce + 1))[i] = n;
 		tot_len -= n;
 	}
 
 	/* Write HTTP response body. */
-	ce->body = p;
-	n = tfw_cache_copy_str_compound(&p, &trec, &ce->resp->body, tot_len);
-	if (n < 0) {
-		TFW_ERR("Cache: cannot copy HTTP body\n");
-		goto err;
+	ce->body = (char *)TDB_OFF(db->hdr, p);
+	if (resp->body.len) {
+		n = tfw_cache_copy_str_compound(db, &p, &trec, &resp->body,
+						tot_len);
+		if (n < 0) {
+			TFW_ERR("Cache: cannot copy HTTP body\n");
+			goto err;
+		}
+		ce->body_len = n;
 	}
-	ce->body_len = n;
 
+	/* Don't send garbage at the end of the last chunk. */
+	trec->len = p - trec->data;
+
+	if (tdb_entry_publish(db, (TdbRec *)ce)) {
+		TFW_WARN("Cache: cannot add entry to the database\n");
+		goto err;
+	}
+	tfw_cache_replace(db, ce);
+	tfw_cache_idx_add(cw->cw_creq, cw->cw_ckey);
+	hit = 1;
+	goto out;
 err:
-	/* FIXME all allocated TDB blocks are leaked here. */
+	/* All the record chunks are reclaimed by TDB garbage collector. */
+	tdb_entry_free(db, (TdbRec *)ce);
+out:
+	tfw_cache_collapse_done(cw->cw_creq, hit);
+	/* Now we don't need the request and the reponse anymore. */
+	tfw_http_msg_free((TfwHttpMsg *)cw->cw_creq);
+	tfw_http_msg_free((TfwHttpMsg *)resp);
 	kmem_cache_free(c_cache, cw);
 }
 
+/**
+ * Only successful responses for GET requests which may be shared among
+ * clients are cached.
+ */
+static int
+tfw_cache_cacheable(TfwHttpResp *resp, TfwHttpReq *req)
+{
+	return req->method == TFW_HTTP_METH_GET && resp->status == 200
+	       && !((req->cache_ctl.flags | resp->cache_ctl.flags)
+		    & TFW_HTTP_CC_NO_STORE)
+	       && !(resp->cache_ctl.flags & TFW_HTTP_CC_PRIVATE)
+	       /* Repeated or split Vary isn't parsed. */
+	       && !(resp->vary.ptr && !resp->vary.len);
+}
+
 void
 tfw_cache_add(TfwHttpResp *resp, TfwHttpReq *req)
 {
 	TfwCWork *cw;
-	TfwCacheEntry *ce, cdata = {{}};
-	unsigned long key;
-	size_t len = sizeof(cdata);
 
 	if (!tfw_cfg.cache)
 		goto out;
-
-	key = tfw_cache_key_calc(req);
-
-	/* TODO copy at least first part of URI here. */
-
-	ce = (TfwCacheEntry *)tdb_entry_create(db, key, &cdata, &len);
-	BUG_ON(len != sizeof(cdata));
-	if (!ce)
-		goto out;
-
-	ce->resp = resp;
-
-	/*
-	 * We must write the entry key now because the request dies
-	 * when the function finishes.
-	 */
-	if (tfw_cache_entry_key_copy(ce, req))
+	if (!tfw_cache_cacheable(resp, req)) {
+		/* 304 is for the request validators, not for the key. */
+		if (resp->status != 304)
+			tfw_cache_collapse_pass(req);
 		goto out;
+	}
 
 	cw = kmem_cache_alloc(c_cache, GFP_ATOMIC);
 	if (!cw)
 		goto out;
 	INIT_WORK(&cw->work, tfw_cache_copy_resp);
-	cw->cw_ce = ce;
-	queue_work_on(tfw_cache_sched_work_cpu(numa_node_id()), cache_wq,
-		      (struct work_struct *)cw);
-
+	/*
+	 * The work owns the request and the response from now,
+	 * so the key can be calculated and copied to the entry later.
+	 */
+	cw->cw_resp = resp;
+	cw->cw_creq = req;
+	cw->cw_ckey = tfw_cache_key_calc(req);
+	/* Write the entry on a CPU of the node owning the key. */
+	queue_work_on(tfw_cache_sched_work_cpu(tfw_cache_key_node(cw->cw_ckey)),
+		      cache_wq, (struct work_struct *)cw);
+	return;
 out:
+	tfw_cache_collapse_done(req, 0);
 	/* Now we don't need the request and the reponse anymore. */
 	tfw_http_msg_free((TfwHttpMsg *)req);
 	tfw_http_msg_free((TfwHttpMsg *)resp);
@@ -319,47 +1543,48 @@ out:
 			 + sizeof(struct tcphdr))
 
 /**
- * Build ce->resp and ce->resp->msg that it can be sent via TCP socket.
+ * Build a response from the cache entry @ce that it can be sent via TCP
+ * socket.
  *
  * Cache entry data is set as paged fragments of skb.
  * See do_tcp_sendpages() as reference.
  *
  * We return skbs in the cache entry response w/o setting any
  * network headers - tcp_transmit_skb() will do it for us.
+ *
+ * The cache entry is shared among all CPUs, so it's read only here.
+ * The fragments hold references to the database pages, so the entry
+ * pages aren't reused by TDB while the skbs are alive even if the entry
+ * is evicted.
  */
-static int
-tfw_cache_build_resp(TfwCacheEntry *ce)
+static TfwHttpResp *
+tfw_cache_build_resp(TDB *db, TfwCacheEntry *ce)
 {
 	int f = 0;
 	TdbVRec *trec = &ce->trec;
 	char *data;
+	struct page *page;
 	struct sk_buff *skb = NULL;
+	TfwHttpResp *resp;
 
 	/*
 	 * Allocated response won't be checked by any filters and
 	 * is used for sending response data only, so don't initialize
 	 * connection and GFSM fields.
 	 */
-	ce->resp = (TfwHttpResp *)tfw_http_msg_alloc(Conn_Srv);
-	if (!ce->resp)
-		return -ENOMEM;
+	resp = (TfwHttpResp *)tfw_http_msg_alloc(Conn_Srv);
+	if (!resp)
+		return NULL;
 
 	/* Deserialize offsets to pointers. */
-	ce->key = TDB_PTR(db->hdr, (unsigned long)ce->key);
-	ce->hdr_lens = TDB_PTR(db->hdr, (unsigned long)ce->hdr_lens);
-	ce->hdrs = TDB_PTR(db->hdr, (unsigned long)ce->hdrs);
-	ce->body = TDB_PTR(db->hdr, (unsigned long)ce->body);
+	data = TDB_PTR(db->hdr, (unsigned long)ce->hdrs);
 
 	/* See tfw_cache_copy_resp(). */
-	BUG_ON((char *)(trec + 1) + trec->len <= ce->hdrs);
+	BUG_ON((char *)(trec + 1) + TDB_VREC_LEN(trec) <= data);
 
-	trec = TDB_PTR(db->hdr, TDB_DI2O(trec->chunk_next));
-	for (data = ce->hdrs;
-	     (long)trec != (long)db->hdr;
-	     trec = TDB_PTR(db->hdr, TDB_DI2O(trec->chunk_next)),
-		data = trec->data)
-	{
-		int off, size = trec->len;
+	while (1) {
+		int off, size;
+		char *end = (char *)(trec + 1) + TDB_VREC_LEN(trec);
 
 		if (!skb || f == MAX_SKB_FRAGS) {
 			/* Protocol headers are placed in linear data only. */
@@ -367,22 +1592,203 @@ tfw_cache_build_resp(TfwCacheEntry *ce)
 			if (!skb)
 				goto err_skb;
 			skb_reserve(skb, SKB_HDR_SZ);
-			ss_skb_queue_tail(&ce->resp->msg.skb_list, skb);
+			ss_skb_queue_tail(&resp->msg.skb_list, skb);
 			f = 0;
 		}
 
+		/* Large chunks span several pages, each page is a fragment. */
 		off = (unsigned long)data & ~PAGE_MASK;
-		size = (char *)(trec + 1) + trec->len - data;
+		size = min_t(long, end - data, PAGE_SIZE - off);
 
-		skb_fill_page_desc(skb, f, virt_to_page(data), off, size);
+		page = virt_to_page(data);
+		get_page(page);
+		skb_fill_page_desc(skb, f, page, off, size);
+		skb->len += size;
+		skb->data_len += size;
+		skb->truesize += size;
 
 		++f;
+
+		data += size;
+		if (data < end)
+			continue;
+		if (!trec->chunk_next)
+			break;
+		trec = TDB_PTR(db->hdr, TDB_DI2O(trec->chunk_next));
+		data = trec->data;
 	}
 
-	return 0;
+	return resp;
 err_skb:
-	tfw_http_msg_free((TfwHttpMsg *)ce->resp);
-	return -ENOMEM;
+	tfw_http_msg_free((TfwHttpMsg *)resp);
+	return NULL;
+}
+
+/**
+ * Refresh the cache entry revalidated by @req with 304 response @resp in
+ * place, w/o copying the response body again, RFC 7234 4.3.4. The entry
+ * keeps its lifetime if the response has no explicit expiration time.
+ * If @cresp isn't NULL, then it gets response built from the refreshed
+ * entry.
+ * @return 0 on success, the function frees @req and @resp in this case
+ * like tfw_cache_add(), or negative value if the entry isn't in the cache
+ * any more.
+ */
+int
+tfw_cache_refresh(TfwHttpResp *resp, TfwHttpReq *req, TfwHttpResp **cresp)
+{
+	int r = -ENOENT;
+	unsigned int lifetime;
+	unsigned long key;
+	TfwCacheEntry *ce;
+	TDB *db;
+
+	if (!tfw_cfg.cache)
+		return -ENOENT;
+
+	key = tfw_cache_key_calc(req);
+	db = tfw_cache_key_db(key);
+	lifetime = tfw_cache_lifetime(resp);
+
+	rcu_read_lock_bh();
+	ce = tfw_cache_lookup(&db, &key, req);
+	if (ce) {
+		if (lifetime != TFW_CACHE_LIFETIME_INF)
+			ACCESS_ONCE(ce->lifetime) = lifetime;
+		ACCESS_ONCE(ce->date) = get_seconds();
+		r = 0;
+		if (cresp && !(*cresp = tfw_cache_build_resp(db, ce)))
+			r = -ENOMEM;
+	}
+	rcu_read_unlock_bh();
+
+	if (r)
+		return r;
+
+	tfw_cache_collapse_done(req, 1);
+	tfw_http_msg_free((TfwHttpMsg *)req);
+	tfw_http_msg_free((TfwHttpMsg *)resp);
+
+	return 0;
+}
+
+/**
+ * Build own GET request refreshing stale cache entry @ce with @key for
+ * @req in background, so the client request is answered by the stale
+ * entry as usual. The request has the same URI and host, but no other
+ * client headers, so only entries w/o variants are refreshed in this way.
+ * The request is conditional if the entry has validators. The response
+ * for the request updates the cache only, see tfw_http_resp_process().
+ */
+static TfwHttpReq *
+tfw_cache_bg_req(TDB *db, TfwCacheEntry *ce, unsigned long key,
+		 TfwHttpReq *req)
+{
+	static const char rl[] = " HTTP/1.1\r\nConnection: keep-alive\r\n"
+				 "Host: ";
+	char *p, *cond = TDB_PTR(db->hdr, (unsigned long)ce->cond);
+	int ulen = tfw_str_len(&req->uri), hlen = tfw_str_len(&req->host);
+	size_t len;
+	struct sk_buff *skb;
+	TfwHttpReq *ireq;
+
+	if (ulen <= 0 || hlen <= 0)
+		return NULL;
+	len = 4 + ulen + sizeof(rl) - 1 + hlen + 2 + ce->cond_len + 2;
+
+	ireq = (TfwHttpReq *)tfw_http_msg_alloc(Conn_Clnt);
+	if (!ireq)
+		return NULL;
+	skb = alloc_skb(SKB_HDR_SZ + len, GFP_ATOMIC);
+	if (!skb)
+		goto err;
+	skb_reserve(skb, SKB_HDR_SZ);
+	ss_skb_queue_tail(&ireq->msg.skb_list, skb);
+
+	p = skb_put(skb, len);
+	memcpy(p, "GET ", 4);
+	p += 4;
+	p += tfw_cache_str_copy(p, ulen, &req->uri);
+	memcpy(p, rl, sizeof(rl) - 1);
+	p += sizeof(rl) - 1;
+	p += tfw_cache_str_copy(p, hlen, &req->host);
+	memcpy(p, "\r\n", 2);
+	p += 2;
+	memcpy(p, cond, ce->cond_len);
+	p += ce->cond_len;
+	memcpy(p, "\r\n", 2);
+
+	if (tfw_http_parse_req(ireq, skb->data, len) != TFW_PASS)
+		goto err;
+	ireq->msg.len = len;
+	/* The key of the client request is used even if the URI differs. */
+	ireq->cache_key = key;
+	ireq->flags |= TFW_HTTP_CACHE_BG;
+
+	return ireq;
+err:
+	tfw_http_msg_free((TfwHttpMsg *)ireq);
+	return NULL;
+}
+
+static void
+tfw_cache_fault_in_done(void *arg)
+{
+	TfwCWork *cw = arg;
+
+	queue_work_on(tfw_cache_sched_work_cpu(tfw_cache_key_node(cw->cw_key)),
+		      cache_wq, (struct work_struct *)cw);
+}
+
+/**
+ * The cache entry is in cold part of tiered storage, so continue the
+ * request processing on a work queue when the entry is read from disk.
+ * @return 0 if the request processing is deferred.
+ */
+static int
+tfw_cache_fault_in(TDB *db, TfwHttpReq *req, unsigned long key,
+		   tfw_http_req_cache_cb_t action, void *data)
+{
+	TfwCWork *cw = kmem_cache_alloc(c_cache, GFP_ATOMIC);
+
+	if (!cw)
+		return -ENOMEM;
+	INIT_WORK(&cw->work, tfw_cache_req_process_node);
+	cw->cw_req = req;
+	cw->cw_act = action;
+	cw->cw_data = data;
+	cw->cw_key = key;
+
+	if (tdb_fault_in(db, key, tfw_cache_fault_in_done, cw)) {
+		kmem_cache_free(c_cache, cw);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/**
+ * Forward own refresh request @req for entry @key from a separate work.
+ * The request has no session (@action gets NULL data), so it doesn't
+ * depend on the client connection which triggered the refresh.
+ */
+static void
+tfw_cache_bg_forward(TfwHttpReq *req, unsigned long key,
+		     void (*action)(TfwHttpReq *, TfwHttpResp *, void *))
+{
+	TfwCWork *cw = kmem_cache_alloc(c_cache, GFP_ATOMIC);
+
+	if (!cw) {
+		action(req, NULL, NULL);
+		return;
+	}
+	INIT_WORK(&cw->work, tfw_cache_req_forward);
+	cw->cw_req = req;
+	cw->cw_act = action;
+	cw->cw_data = NULL;
+	cw->cw_key = key;
+	queue_work_on(tfw_cache_sched_work_cpu(tfw_cache_key_node(key)),
+		      cache_wq, (struct work_struct *)cw);
 }
 
 static void
@@ -390,44 +1796,91 @@ __cache_req_process_node(TfwHttpReq *req, unsigned long key,
 			 void (*action)(TfwHttpReq *, TfwHttpResp *, void *),
 			 void *data)
 {
+	int r = 0;
+	unsigned long vkey = key;
 	TfwCacheEntry *ce;
+	TfwHttpReq *ireq = NULL;
 	TfwHttpResp *resp = NULL;
+	TDB *db = tfw_cache_key_db(key);
 
-	ce = tdb_lookup(db, key);
-	if (!ce)
-		goto finish_req_processing;
+	/* The entry can't be freed while we're building the response. */
+	/* Process the request when the entry is read from disk. */
+	if (!tdb_resident(db, key)
+	    && !tfw_cache_fault_in(db, req, key, action, data))
+		return;
+
+	rcu_read_lock_bh();
 
 	/* TODO process collisions. */
+	ce = tfw_cache_lookup(&db, &vkey, req);
+	/*
+	 * If the response can't be built, then it seems we have the cache
+	 * entry, but there is memory issues. Try to send send the request
+	 * to backend in hope that we have memory when we get an answer.
+	 */
+	if (ce) {
+		if (tfw_cache_entry_fresh(ce, req)) {
+			resp = tfw_cache_build_resp(db, ce);
+		}
+		else if (vkey == key && tfw_cache_entry_swr(ce, req)
+			 && (resp = tfw_cache_build_resp(db, ce)))
+		{
+			/* Only one request refreshes the entry. */
+			r = tfw_cache_collapse(NULL, key, action, data);
+			if (r)
+				ireq = tfw_cache_bg_req(db, ce, key, req);
+		}
+		else {
+			tfw_cache_revalidate(db, ce, req);
+		}
+	}
 
-	if (!ce->resp)
-		if (tfw_cache_build_resp(ce))
-			/*
-			 * It seems we have the cache entry,
-			 * but there is memory issues.
-			 * Try to send send the request to backend in hope
-			 * that we have memory when we get an answer.
-			 */
-			goto finish_req_processing;
+	rcu_read_unlock_bh();
+
+	if (ireq) {
+		/* The refresh request wakes up the requests for the entry. */
+		if (r == -ENOENT) {
+			ireq->flags |= TFW_HTTP_CACHE_COLLAPSE;
+			ireq->collapse_key = key;
+		}
+		tfw_cache_bg_forward(ireq, key, action);
+	}
+	else if (r == -ENOENT) {
+		/* Let other requests refresh the entry. */
+		tfw_cache_collapse_wake(key, 1);
+	}
 
-	/* We have already assembled response. */
-	resp = ce->resp;
+	/*
+	 * Wait for the response for the same request sent before.
+	 * Responses for conditional requests can't be shared.
+	 */
+	if (!resp && req->method == TFW_HTTP_METH_GET
+	    && !tfw_cache_req_conditional(req)
+	    && !tfw_cache_collapse(req, vkey, action, data))
+		return;
 
-finish_req_processing:
 	action(req, resp, data);
-	tfw_http_msg_free((TfwHttpMsg *)req);
 }
 
 static void
 tfw_cache_req_process_node(struct work_struct *work)
 {
 	TfwCWork *cw = (TfwCWork *)work;
-	TfwHttpReq *req = cw->cw_req;
-	tfw_http_req_cache_cb_t action = cw->cw_act;
-	void *data = cw->cw_data;
 
-	__cache_req_process_node(req, cw->cw_key, action, data);
+	/* The request and the callback expect softirq context. */
+	local_bh_disable();
+	__cache_req_process_node(cw->cw_req, cw->cw_key, cw->cw_act,
+				 cw->cw_data);
+	local_bh_enable();
+
+	kmem_cache_free(c_cache, cw);
 }
 
+/**
+ * Serve the request from the cache or forward it to backend. @action is
+ * called once for the request, probably later from other CPU, see
+ * tfw_http_req_cache_cb_t for the request ownership.
+ */
 void
 tfw_cache_req_process(TfwHttpReq *req, tfw_http_req_cache_cb_t action,
 		      void *data)
@@ -435,8 +1888,10 @@ tfw_cache_req_process(TfwHttpReq *req, tfw_http_req_cache_cb_t action,
 	int node;
 	unsigned long key;
 
-	if (!tfw_cfg.cache)
+	if (!tfw_cfg.cache) {
+		action(req, NULL, data);
 		return;
+	}
 
 	key = tfw_cache_key_calc(req);
 
@@ -453,6 +1908,7 @@ tfw_cache_req_process(TfwHttpReq *req, tfw_http_req_cache_cb_t action,
 		cw->cw_key = key;
 		queue_work_on(tfw_cache_sched_work_cpu(node), cache_wq,
 			      (struct work_struct *)cw);
+		return;
 	}
 
 process_locally:
@@ -484,6 +1940,186 @@ tfw_cache_mgr(void *arg)
 	return 0;
 }
 
+static void
+tfw_cache_nodes_close(void)
+{
+	int i;
+
+	for (i = 0; i < c_nodes_n; ++i) {
+		TfwCacheNode *cn = &c_nodes[c_node_ids[i]];
+		if (cn->db)
+			tdb_close(cn->db);
+		kfree(cn->cpu);
+		memset(cn, 0, sizeof(*cn));
+	}
+	c_nodes_n = 0;
+}
+
+/**
+ * Open a database shard for each NUMA node with CPUs.
+ * The cache size is evenly distributed among the nodes.
+ */
+static int
+tfw_cache_nodes_open(void)
+{
+	int node, cpu;
+	unsigned long size, hot_size;
+
+	for_each_node_with_cpus(node)
+		c_node_ids[c_nodes_n++] = node;
+
+	size = (unsigned long)tfw_cfg.c_size * PAGE_SIZE / c_nodes_n;
+	hot_size = (unsigned long)tfw_cfg.c_hot_size * PAGE_SIZE / c_nodes_n;
+
+	for (node = 0; node < c_nodes_n; ++node) {
+		TfwCacheNode *cn = &c_nodes[c_node_ids[node]];
+		const struct cpumask *mask = cpumask_of_node(c_node_ids[node]);
+
+		cn->cpu = kmalloc(sizeof(int) * cpumask_weight(mask),
+				  GFP_KERNEL);
+		if (!cn->cpu)
+			goto err;
+		for_each_cpu(cpu, mask)
+			cn->cpu[cn->nr_cpus++] = cpu;
+
+		cn->db = tdb_open(tfw_cfg.c_path, "cache", size, hot_size, 0,
+				  c_node_ids[node]);
+		if (!cn->db)
+			goto err;
+	}
+
+	return 0;
+err:
+	tfw_cache_nodes_close();
+	return -ENOMEM;
+}
+
+/**
+ * Resize the node databases to the current cache size. The size is evenly
+ * distributed among the nodes as on opening.
+ */
+int
+tfw_cache_resize(void)
+{
+	int node, r;
+	unsigned long size;
+
+	if (!c_nodes_n)
+		return 0;
+
+	size = (unsigned long)tfw_cfg.c_size * PAGE_SIZE / c_nodes_n;
+	for (node = 0; node < c_nodes_n; ++node) {
+		r = tdb_resize(c_nodes[c_node_ids[node]].db, size);
+		if (r) {
+			TFW_ERR("Cache: cannot resize node %d to %lu bytes\n",
+				c_node_ids[node], size);
+			return r;
+		}
+	}
+
+	return 0;
+}
+
+typedef struct {
+	char	*buf;
+	size_t	size;
+	int	pos;
+} TfwCacheDbgBuf;
+
+static void
+tfw_cache_dbg_hist(TfwCacheDbgBuf *d, const char *name, unsigned long *h)
+{
+	int i;
+
+	d->pos += snprintf(d->buf + d->pos, d->size - d->pos, "  %s:", name);
+	for (i = 0; i < TDB_STAT_HIST && d->pos < d->size; ++i)
+		if (h[i])
+			d->pos += snprintf(d->buf + d->pos, d->size - d->pos,
+					   " %d%s=%lu", i,
+					   i == TDB_STAT_HIST - 1 ? "+" : "",
+					   h[i]);
+	if (d->pos < d->size)
+		d->pos += snprintf(d->buf + d->pos, d->size - d->pos, "\n");
+}
+
+static int
+tfw_cache_dbg_tbl(TDB *db, void *arg)
+{
+	TdbInfo i;
+	TdbHtrieStat st;
+	TfwCacheDbgBuf *d = arg;
+
+	if (d->pos >= d->size)
+		return -ENOSPC;
+
+	tdb_info(db, &i);
+	d->pos += snprintf(d->buf + d->pos, d->size - d->pos,
+			   "%s (node %d) %s: size=%lu lookups=%lu hits=%lu"
+			   " inserts=%lu errors=%lu\n",
+			   i.name, i.node, i.path, i.dbsz, i.stat.lookups,
+			   i.stat.hits, i.stat.inserts, i.stat.errors);
+	if (tdb_htrie_info(db, &st) || d->pos >= d->size)
+		return 0;
+
+	d->pos += snprintf(d->buf + d->pos, d->size - d->pos,
+			   "  blocks: total=%lu free=%lu (%lu%% used) index=%lu"
+			   " data=%lu cold=%lu i_wm=%lu d_wm=%lu\n"
+			   "  index: nodes=%lu leafs=%lu records=%lu bursts=%lu"
+			   " alloc_errors=%lu\n",
+			   st.blks, st.free_blks,
+			   st.blks ? (st.blks - st.free_blks) * 100 / st.blks
+				   : 0,
+			   st.i_blks, st.d_blks, st.cold_blks, st.i_wm, st.d_wm,
+			   st.nodes, st.leafs, st.recs, st.bursts,
+			   st.alloc_errs);
+	if (d->pos >= d->size)
+		return 0;
+	tfw_cache_dbg_hist(d, "depth", st.depth);
+	if (d->pos >= d->size)
+		return 0;
+	tfw_cache_dbg_hist(d, "chain", st.chain);
+	if (d->pos >= d->size)
+		return 0;
+	tfw_cache_dbg_hist(d, "occupancy", st.occupancy);
+
+	return 0;
+}
+
+/**
+ * Dump statistics of all the database tables on read().
+ * The output is truncated by the buffer size.
+ */
+static int
+tfw_cache_debugfs_hook(bool input, char *buf, size_t size)
+{
+	TfwCacheDbgBuf d = { .buf = buf, .size = size, .pos = 0 };
+
+	if (input)
+		return 0;
+
+	tdb_for_each_tbl(tfw_cache_dbg_tbl, &d);
+
+	return min_t(int, d.pos, size);
+}
+
+/**
+ * Purge the cache entries by the written spec, see tfw_cache_purge_spec(),
+ * and show the index size and number of the entries missed in it on read().
+ */
+static int
+tfw_cache_purge_debugfs_hook(bool input, char *buf, size_t size)
+{
+	int r;
+
+	if (input) {
+		r = tfw_cache_purge_spec(buf);
+		return r < 0 ? r : 0;
+	}
+
+	return snprintf(buf, size, "index entries: %u missed: %lu\n",
+			ACCESS_ONCE(c_idx_n), ACCESS_ONCE(c_idx_lost));
+}
+
 int __init
 tfw_cache_init(void)
 {
@@ -492,9 +2128,9 @@ tfw_cache_init(void)
 	if (!tfw_cfg.cache)
 		return 0;
 
-	db = tdb_open(tfw_cfg.c_path, tfw_cfg.c_size, 0);
-	if (!db)
-		return 1;
+	r = tfw_cache_nodes_open();
+	if (r)
+		return r;
 
 	cache_mgr_thr = kthread_run(tfw_cache_mgr, NULL, "tfw_cache_mgr");
 	if (IS_ERR(cache_mgr_thr)) {
@@ -503,21 +2139,26 @@ tfw_cache_init(void)
 		goto err_thr;
 	}
 
+	r = -ENOMEM;
 	c_cache = KMEM_CACHE(tfw_cache_work_t, 0);
 	if (!c_cache)
 		goto err_cache;
 
+	/* The work queue is bound, so works run on the node CPUs. */
 	cache_wq = alloc_workqueue("tfw_cache_wq", WQ_MEM_RECLAIM, 0);
 	if (!cache_wq)
 		goto err_wq;
 
+	tfw_debugfs_bind("/cache/tdb", tfw_cache_debugfs_hook);
+	tfw_debugfs_bind("/cache/purge", tfw_cache_purge_debugfs_hook);
+
 	return 0;
 err_wq:
 	kmem_cache_destroy(c_cache);
 err_cache:
 	kthread_stop(cache_mgr_thr);
 err_thr:
-	tdb_close(db);
+	tfw_cache_nodes_close();
 	return r;
 }
 
@@ -527,8 +2168,13 @@ tfw_cache_exit(void)
 	if (!tfw_cfg.cache)
 		return;
 
+	/* Stop the pending entries timers queueing works. */
+	tfw_cache_collapse_purge();
 	destroy_workqueue(cache_wq);
+	/* Pending entries created by the flushed works. */
+	tfw_cache_collapse_purge();
+	tfw_cache_idx_purge();
 	kmem_cache_destroy(c_cache);
 	kthread_stop(cache_mgr_thr);
-	tdb_close(db);
+	tfw_cache_nodes_close();
 }
@@ -23,9 +23,17 @@
 #include "http.h"
 
 void tfw_cache_add(TfwHttpResp *resp, TfwHttpReq *req);
+int tfw_cache_refresh(TfwHttpResp *resp, TfwHttpReq *req,
+		      TfwHttpResp **cresp);
 void tfw_cache_req_process(TfwHttpReq *req, tfw_http_req_cache_cb_t action,
 			   void *data);
+void tfw_cache_abort(TfwHttpReq *req);
 
+int tfw_cache_purge(const char *host, size_t hlen, const char *uri, size_t ulen,
+		    int prefix, int *partial);
+int tfw_cache_purge_req(TfwHttpReq *req, int *partial);
+int tfw_cache_purge_spec(char *spec);
+int tfw_cache_resize(void);
 int tfw_cache_init(void);
 void tfw_cache_exit(void);
 
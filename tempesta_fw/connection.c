@@ -24,6 +24,7 @@
 #include "connection.h"
 #include "gfsm.h"
 #include "log.h"
+#include "sched.h"
 #include "session.h"
 
 #include "sync_socket.h"
@@ -48,6 +49,7 @@ tfw_connection_alloc(int type, void *handler)
 
 	TFW_CONN_TYPE(c) = type;
 	c->hndl = handler;
+	INIT_LIST_HEAD(&c->fwd_queue);
 
 	return c;
 }
@@ -57,18 +59,9 @@ tfw_connection_free(TfwConnection *c)
 {
 	TFW_DBG("Free connection: %p\n", c);
 
-	if (c->sess) {
-		/*
-		 * FIXME do we need to synchronize this?
-		 * If a connection can be processed from different CPUs, then we do.
-		 */
-		TfwConnection *peer_conn = tfw_connection_peer(c);
-		if (peer_conn) {
-			TFW_DBG("Detach from peer: %p\n", peer_conn);
-			peer_conn->sess = NULL;
-		}
+	/* Server connections aren't bound to sessions. */
+	if (c->sess)
 		tfw_session_free(c->sess);
-	}
 
 	kmem_cache_free(conn_cache, c);
 }
@@ -148,9 +141,21 @@ tfw_connection_send_cli(TfwSession *sess, TfwMsg *msg)
 	ss_send(sess->cli->sock, &msg->skb_list);
 }
 
+/**
+ * Forward @msg to a server. @sess is the client session of the message or
+ * NULL for own messages, e.g. the cache refreshing its entries. The message
+ * is queued in the server connection until tfw_connection_unqueue() takes
+ * it for the server response.
+ *
+ * The server connection is locked, so the caller mustn't hold locks which
+ * are taken under socket locks.
+ */
 int
 tfw_connection_send_srv(TfwSession *sess, TfwMsg *msg)
 {
+	int r = 0;
+	struct sock *sk;
+	TfwServer *srv;
 	TfwConnection *srv_conn;
 
 	/*
@@ -163,25 +168,52 @@ tfw_connection_send_srv(TfwSession *sess, TfwMsg *msg)
 	 * XXX Or should we do this on connection fail event instead?
 	 */
 
-	if (tfw_session_sched_msg(sess, msg)) {
-		TFW_ERR("Cannot schedule message, msg=%p clnt=%p\n",
-			msg, sess->cli);
+	srv = tfw_sched_get_srv(msg);
+	if (!srv) {
+		TFW_ERR("Cannot schedule message, msg=%p sess=%p\n",
+			msg, sess);
 		return -1;
 	}
+	if (sess)
+		sess->srv = srv;
 
-	/* Bind the server connection with the session. */
-	srv_conn = tfw_sess_conn(sess, Conn_Srv);
 	/*
-	 * Check that the server doesn't service somebody else.
-	 * FIXME when do we need to free the server session,
-	 * 	 that it can service other clients?
+	 * The server answers in the order the messages are sent, so queue
+	 * and send the message under the socket lock. The connection is
+	 * unlinked from the socket under the lock when it's closed.
 	 */
-	BUG_ON(srv_conn->sess && srv_conn->sess != sess);
-	srv_conn->sess = sess;
+	sk = srv->sock;
+	bh_lock_sock_nested(sk);
+	srv_conn = sk->sk_user_data;
+	if (srv_conn) {
+		list_add_tail(&msg->fwd_list, &srv_conn->fwd_queue);
+		ss_do_send(sk, &msg->skb_list);
+	} else {
+		TFW_ERR("Server connection is closed, msg=%p sess=%p\n",
+			msg, sess);
+		r = -1;
+	}
+	bh_unlock_sock(sk);
 
-	ss_send(sess->srv->sock, &msg->skb_list);
+	return r;
+}
 
-	return 0;
+/**
+ * Take the first message forwarded to server connection @conn.
+ * Called under the socket lock, i.e. from the socket callbacks.
+ * @return NULL if there are no messages waiting for responses.
+ */
+TfwMsg *
+tfw_connection_unqueue(TfwConnection *conn)
+{
+	TfwMsg *msg;
+
+	if (list_empty(&conn->fwd_queue))
+		return NULL;
+	msg = list_first_entry(&conn->fwd_queue, TfwMsg, fwd_list);
+	list_del_init(&msg->fwd_list);
+
+	return msg;
 }
 
 /*
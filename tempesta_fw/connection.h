@@ -42,7 +42,10 @@ enum {
 
 #define TFW_CONN_TYPE2IDX(t)	TFW_FSM_TYPE(t)
 
-/* TODO backend connection could have many sessions. */
+/*
+ * Server connections are shared by many sessions, so the forwarded
+ * messages are queued in the connection to match them with responses.
+ */
 typedef struct {
 	/*
 	 * Stack of l5-l7 protocol handlers.
@@ -54,6 +57,12 @@ typedef struct {
 	void 		*hndl;	/* TfwClient or TfwServer handler */
 	TfwSession	*sess;	/* currently handled session */
 
+	/*
+	 * Messages forwarded to the server and waiting for responses,
+	 * protected by the socket lock.
+	 */
+	struct list_head fwd_queue;
+
 	/* Original sk->sk_destruct. Destructors passed to tfw_connection_new()
 	 * must call it manually. */
 	void (*sk_destruct)(struct sock *sk);
@@ -126,6 +135,7 @@ int tfw_connection_new(struct sock *sk, int type, void *handler,
 		       void (*destructor)(struct sock *s));
 void tfw_connection_send_cli(TfwSession *sess, TfwMsg *msg);
 int tfw_connection_send_srv(TfwSession *sess, TfwMsg *msg);
+TfwMsg *tfw_connection_unqueue(TfwConnection *conn);
 
 void tfw_connection_hooks_register(TfwConnHooks *hooks, int type);
 
@@ -22,7 +22,9 @@
 #include <linux/highmem.h>
 #include <linux/skbuff.h>
 #include <linux/string.h>
+#include <net/tcp.h>
 
+#include "tempesta.h"
 #include "cache.h"
 #include "classifier.h"
 #include "gfsm.h"
@@ -54,9 +56,38 @@ tfw_http_conn_init(TfwConnection *conn)
 	return 0;
 }
 
+static void tfw_http_conn_srv_drop(TfwConnection *conn);
+
 static void
 tfw_http_conn_destruct(TfwConnection *conn)
 {
+	TfwSession *sess = conn->sess;
+	TfwHttpReq *req, *tmp;
+
+	if (TFW_CONN_TYPE(conn) & Conn_Srv) {
+		tfw_http_conn_srv_drop(conn);
+	}
+	else if (sess) {
+		spin_lock_bh(&sess->lock);
+		list_for_each_entry_safe(req, tmp, &sess->req_list,
+					 msg.pl_list)
+		{
+			list_del_init(&req->msg.pl_list);
+			/*
+			 * The cache callback frees the request processed by
+			 * the cache. Forwarded request is freed when it gets
+			 * the response, which still updates the cache.
+			 */
+			if (req->flags & (TFW_HTTP_CACHE_PEND | TFW_HTTP_SENT))
+				continue;
+			/* Nobody answers the request, release its waiters. */
+			tfw_cache_abort(req);
+			tfw_http_msg_free(req->resp);
+			tfw_http_msg_free((TfwHttpMsg *)req);
+		}
+		spin_unlock_bh(&sess->lock);
+	}
+
 	tfw_http_msg_free((TfwHttpMsg *)conn->msg);
 }
 
@@ -311,6 +342,15 @@ next_skb:
 						  hm->msg.skb_list.first, \
 						  hm->crlf)
 
+/**
+ * Add header @hdr of length @len (including trailing CRLF) to @hm.
+ */
+int
+tfw_http_msg_hdr_add(TfwHttpMsg *hm, const char *hdr, size_t len)
+{
+	return __hdr_add(hdr, len, hm->msg.skb_list.first, hm->crlf);
+}
+
 static int
 __hdr_delete(TfwStr *hdr, struct sk_buff *skb)
 {
@@ -619,23 +659,250 @@ tfw_http_adjust_resp(TfwHttpResp *resp)
 	return 0;
 }
 
+#define S_200	"HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n"
+#define S_202	"HTTP/1.1 202 Accepted\r\nContent-Length: 0\r\n\r\n"
+#define S_403	"HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\n\r\n"
+#define S_404	"HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n"
+#define S_502	"HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\n\r\n"
+
+/**
+ * Build response @status of length @len w/o body.
+ */
+static TfwHttpMsg *
+tfw_http_status_msg(const char *status, size_t len)
+{
+	struct sk_buff *skb;
+	TfwHttpMsg *resp;
+
+	resp = tfw_http_msg_alloc(Conn_Srv);
+	if (!resp)
+		return NULL;
+	skb = alloc_skb(MAX_TCP_HEADER + len, GFP_ATOMIC);
+	if (!skb) {
+		tfw_http_msg_free(resp);
+		return NULL;
+	}
+	skb_reserve(skb, MAX_TCP_HEADER);
+	memcpy(skb_put(skb, len), status, len);
+	ss_skb_queue_tail(&resp->msg.skb_list, skb);
+
+	return resp;
+}
+
+#define TFW_HTTP_STATUS_MSG(s)	tfw_http_status_msg(s, sizeof(s) - 1)
+
+/**
+ * Send response @status of length @len w/o body to the client.
+ */
+static void
+tfw_http_send_status(TfwSession *sess, const char *status, size_t len)
+{
+	TfwHttpMsg *resp = tfw_http_status_msg(status, len);
+
+	if (resp)
+		tfw_connection_send_cli(sess, (TfwMsg *)resp);
+}
+
+#define TFW_HTTP_SEND_STATUS(sess, s)					\
+	tfw_http_send_status(sess, s, sizeof(s) - 1)
+
+/**
+ * Send the responses of session @sess pipeline in the order of the client
+ * requests, so the client gets the responses in the right order. Requests
+ * processed by the cache hold their places in the pipeline, so nothing
+ * after them is sent. New requests for the server are moved to @fwd and
+ * keep their places in the pipeline until the responses come.
+ *
+ * Called under the session lock, which is taken inside socket locks, so
+ * the caller forwards @fwd by tfw_http_sess_forward() w/o the lock.
+ */
+static void
+tfw_http_sess_flush(TfwSession *sess, struct list_head *fwd)
+{
+	int head = 1;
+	TfwHttpReq *req, *tmp;
+
+	list_for_each_entry_safe(req, tmp, &sess->req_list, msg.pl_list) {
+		if (req->flags & TFW_HTTP_CACHE_PEND)
+			break;
+		if (!req->resp && !(req->flags & TFW_HTTP_SENT)) {
+			/* Responses don't make new requests for the server. */
+			BUG_ON(!fwd);
+			req->flags |= TFW_HTTP_SENT;
+			req->sess = sess;
+			tfw_session_get(sess);
+			list_add_tail(&req->msg.fwd_list, fwd);
+		}
+		/* Responses wait for the server response for the request. */
+		if (req->flags & TFW_HTTP_SENT) {
+			head = 0;
+			continue;
+		}
+		if (!head)
+			continue;
+		tfw_connection_send_cli(sess, (TfwMsg *)req->resp);
+		list_del(&req->msg.pl_list);
+		tfw_http_msg_free((TfwHttpMsg *)req);
+	}
+}
+
+/**
+ * Request @req can't get the server response, so answer it with 502 in its
+ * turn, or just free it if the client has gone or it's own cache request.
+ * The request reference to its session is released.
+ */
+static void
+tfw_http_req_fail(TfwHttpReq *req)
+{
+	TfwSession *sess = req->sess;
+
+	/* Release the requests waiting for the response. */
+	tfw_cache_abort(req);
+
+	if (sess) {
+		spin_lock_bh(&sess->lock);
+		if (sess->cli && !list_empty(&req->msg.pl_list)) {
+			req->flags &= ~TFW_HTTP_SENT;
+			req->resp = TFW_HTTP_STATUS_MSG(S_502);
+			if (req->resp) {
+				/* The flush frees the request. */
+				tfw_http_sess_flush(sess, NULL);
+				req = NULL;
+			} else {
+				list_del(&req->msg.pl_list);
+			}
+		}
+		spin_unlock_bh(&sess->lock);
+		tfw_session_put(sess);
+	}
+	tfw_http_msg_free((TfwHttpMsg *)req);
+}
+
+/**
+ * Forward requests @fwd of session @sess moved by tfw_http_sess_flush().
+ * The requests can be answered and freed as soon as they're forwarded.
+ */
+static void
+tfw_http_sess_forward(TfwSession *sess, struct list_head *fwd)
+{
+	TfwHttpReq *req, *tmp;
+
+	list_for_each_entry_safe(req, tmp, fwd, msg.fwd_list) {
+		list_del_init(&req->msg.fwd_list);
+		if (tfw_connection_send_srv(sess, (TfwMsg *)req))
+			tfw_http_req_fail(req);
+	}
+}
+
+/**
+ * Add request @req, which is either processed by the cache or already has
+ * the response, to the session pipeline.
+ */
+static void
+tfw_http_sess_add(TfwSession *sess, TfwHttpReq *req)
+{
+	LIST_HEAD(fwd);
+
+	spin_lock_bh(&sess->lock);
+	list_add_tail(&req->msg.pl_list, &sess->req_list);
+	if (!(req->flags & TFW_HTTP_CACHE_PEND))
+		tfw_http_sess_flush(sess, &fwd);
+	spin_unlock_bh(&sess->lock);
+
+	tfw_http_sess_forward(sess, &fwd);
+}
+
+/**
+ * Answer the requests forwarded through closed server connection @conn.
+ */
+static void
+tfw_http_conn_srv_drop(TfwConnection *conn)
+{
+	TfwHttpReq *req;
+
+	while ((req = (TfwHttpReq *)tfw_connection_unqueue(conn)))
+		tfw_http_req_fail(req);
+}
+
+/**
+ * The session is referenced by tfw_http_req_process() for the callback and
+ * the request holds its place in the session pipeline. The place is taken
+ * away if the connection is closed. The cache forwards its own background
+ * refresh requests w/o a session (@data is NULL), so they don't depend on
+ * the client connection which triggered the refresh.
+ */
 static void
 tfw_http_req_cache_cb(TfwHttpReq *req, TfwHttpResp *resp, void *data)
 {
 	TfwSession *sess = data;
+	LIST_HEAD(fwd);
+
+	if (!sess) {
+		/* The response for the request updates the cache only. */
+		if (tfw_http_adjust_req(req)
+		    || tfw_connection_send_srv(NULL, (TfwMsg *)req))
+			tfw_http_req_fail(req);
+		return;
+	}
+
+	spin_lock_bh(&sess->lock);
+
+	req->flags &= ~TFW_HTTP_CACHE_PEND;
+	if (unlikely(!sess->cli || list_empty(&req->msg.pl_list))) {
+		/* The client has gone, so nobody needs the response. */
+		spin_unlock_bh(&sess->lock);
+		if (!resp)
+			tfw_cache_abort(req);
+		tfw_http_msg_free((TfwHttpMsg *)resp);
+		tfw_http_msg_free((TfwHttpMsg *)req);
+		goto out;
+	}
 
 	if (resp) {
 		/*
-		 * We have prepared response, send it as is.
+		 * We have prepared response, send it as is in its turn.
 		 * TODO should we adjust it somehow?
 		 */
-		tfw_connection_send_cli(sess, (TfwMsg *)resp);
-	} else {
-		if (tfw_http_adjust_req(req))
-			return;
-		/* Send the request to appropriate server. */
-		tfw_connection_send_srv(sess, (TfwMsg *)req);
+		req->resp = (TfwHttpMsg *)resp;
 	}
+	else if (tfw_http_adjust_req(req)) {
+		tfw_cache_abort(req);
+		req->resp = TFW_HTTP_STATUS_MSG(S_502);
+		if (!req->resp) {
+			list_del_init(&req->msg.pl_list);
+			tfw_http_msg_free((TfwHttpMsg *)req);
+		}
+	}
+	tfw_http_sess_flush(sess, &fwd);
+
+	spin_unlock_bh(&sess->lock);
+
+	tfw_http_sess_forward(sess, &fwd);
+out:
+	tfw_session_put(sess);
+}
+
+/**
+ * PURGE request is processed locally: the cache entries are purged and
+ * 200 is sent if there were some entries or 404 otherwise. 202 is sent if
+ * the purge is best-effort, i.e. some entries may be left in the cache.
+ * The method is allowed by cache_purge_method sysctl only.
+ * @return the response to send.
+ */
+static TfwHttpMsg *
+tfw_http_purge(TfwHttpReq *req)
+{
+	int n, partial;
+
+	if (!tfw_cfg.c_purge)
+		return TFW_HTTP_STATUS_MSG(S_403);
+
+	n = tfw_cache_purge_req(req, &partial);
+	if (partial)
+		return TFW_HTTP_STATUS_MSG(S_202);
+	if (n > 0)
+		return TFW_HTTP_STATUS_MSG(S_200);
+	return TFW_HTTP_STATUS_MSG(S_404);
 }
 
 /**
@@ -656,8 +923,8 @@ tfw_http_req_process(TfwConnection *conn, unsigned char *data, size_t len)
 
 	/* Process pipelined requests in a loop. */
 	while (1) {
-		TfwHttpMsg *hm;
-		int msg_off = req->parser.data_off;
+		TfwHttpMsg *hm = NULL;
+		int more, msg_off = req->parser.data_off;
 
 		r = tfw_http_parse_req(req, data, len);
 
@@ -681,8 +948,11 @@ tfw_http_req_process(TfwConnection *conn, unsigned char *data, size_t len)
 				goto block;
 			return TFW_POSTPONE;
 		case TFW_PASS:
-			/* Request is fully parsed, add it to the connection. */
-			list_add_tail(&req->msg.pl_list, &sess->req_list);
+			/*
+			 * Request is fully parsed, detach it from connection.
+			 * It's added to the session pipeline when it's
+			 * processed.
+			 */
 			conn->msg = NULL;
 
 			tfw_http_establish_skb_hdrs((TfwHttpMsg *)req);
@@ -696,18 +966,40 @@ tfw_http_req_process(TfwConnection *conn, unsigned char *data, size_t len)
 
 		/* The request is fully parsed, process it. */
 
-		tfw_cache_req_process(req, tfw_http_req_cache_cb, sess);
+		/*
+		 * Pipelined requests: create new sibling message while
+		 * the request is alive, the cache may free it.
+		 */
+		more = req->parser.data_off && req->parser.data_off != len;
+		if (more) {
+			hm = tfw_http_msg_create_sibling((TfwHttpMsg *)req,
+							 Conn_Clnt);
+			if (hm)
+				tfw_http_parser_msg_inherit((TfwHttpMsg *)req,
+							    hm);
+		}
+
+		/* The request can outlive the connection. */
+		req->conn = NULL;
+		if (unlikely(req->method == TFW_HTTP_METH_PURGE)) {
+			req->resp = tfw_http_purge(req);
+			if (req->resp)
+				tfw_http_sess_add(sess, req);
+			else
+				tfw_http_msg_free((TfwHttpMsg *)req);
+		} else {
+			req->flags |= TFW_HTTP_CACHE_PEND;
+			tfw_http_sess_add(sess, req);
+			tfw_session_get(sess);
+			tfw_cache_req_process(req, tfw_http_req_cache_cb, sess);
+		}
 
-		if (!req->parser.data_off || req->parser.data_off == len)
-			/* There is no more pending data in skbs. */
+		/* There is no more pending data in skbs. */
+		if (!more)
 			break;
-
-		/* Pipelined requests: create new sibling message. */
-		hm = tfw_http_msg_create_sibling((TfwHttpMsg *)req, Conn_Clnt);
+		/* Bad... Let's wait little bit... */
 		if (!hm)
-			/* Bad... Let's wait little bit... */
 			return TFW_POSTPONE;
-		tfw_http_parser_msg_inherit((TfwHttpMsg *)req, hm);
 		req = (TfwHttpReq *)hm;
 	}
 
@@ -724,10 +1016,8 @@ tfw_http_resp_process(TfwConnection *conn, unsigned char *data, size_t len)
 {
 	int r = TFW_BLOCK;
 	TfwHttpResp *resp = (TfwHttpResp *)conn->msg;
-	TfwSession *sess = conn->sess;
 
 	BUG_ON(!resp);
-	BUG_ON(!sess);
 
 	TFW_DBG("received %lu server data bytes (%.*s) on socket (conn=%p)\n",
 		len, (int)len, data, conn);
@@ -768,29 +1058,78 @@ tfw_http_resp_process(TfwConnection *conn, unsigned char *data, size_t len)
 			  data, len);
 	if (r == TFW_PASS) {
 		TfwHttpReq *req;
+		TfwSession *sess;
 
 		if (tfw_http_adjust_resp(resp))
 			goto block;
 
 		/*
 		 * Cache adjusted and filtered responses only.
-		 * We get responses in the same order as requests,
-		 * so we can just pop the first request.
+		 * We get responses in the same order as requests are
+		 * forwarded to the server connection, so we can just take
+		 * the first forwarded request.
 		 */
-		if (unlikely(list_empty(&sess->req_list))) {
+		req = (TfwHttpReq *)tfw_connection_unqueue(conn);
+		if (unlikely(!req)) {
 			TFW_WARN("Response w/o request\n");
 			goto block;
 		}
 
-		req = list_first_entry(&sess->req_list, TfwHttpReq, msg.pl_list);
+		sess = req->sess;
+		if (sess)
+			spin_lock_bh(&sess->lock);
+		if (!sess || !sess->cli || list_empty(&req->msg.pl_list)) {
+			/*
+			 * The cache refreshes its stale entry by own request
+			 * or the client has gone, so the response updates
+			 * the cache only. Responses for client conditional
+			 * requests don't revalidate the entry.
+			 */
+			int own = req->flags & (TFW_HTTP_CACHE_BG
+						| TFW_HTTP_CACHE_REVAL);
+			if (sess) {
+				spin_unlock_bh(&sess->lock);
+				tfw_session_put(sess);
+			}
+			if (resp->status != 304 || !own
+			    || tfw_cache_refresh(resp, req, NULL))
+				tfw_cache_add(resp, req);
+			return r;
+		}
 		list_del(&req->msg.pl_list);
 
 		/*
-		 * Send the response to client before caching it.
-		 * The cache frees the response.
+		 * The cache revalidated its entry by the request and the entry
+		 * is still valid, so send the cached response to the client
+		 * which didn't ask for 304.
 		 */
-		tfw_connection_send_cli(sess, (TfwMsg *)resp);
+		if (resp->status == 304
+		    && (req->flags & TFW_HTTP_CACHE_REVAL))
+		{
+			TfwHttpResp *cresp;
+			if (!tfw_cache_refresh(resp, req, &cresp)) {
+				tfw_connection_send_cli(sess, (TfwMsg *)cresp);
+				tfw_http_sess_flush(sess, NULL);
+				spin_unlock_bh(&sess->lock);
+				tfw_session_put(sess);
+				return r;
+			}
+			/*
+			 * The entry is evicted while it was revalidated, but
+			 * the client can't handle 304 for its unconditional
+			 * request.
+			 */
+			TFW_HTTP_SEND_STATUS(sess, S_502);
+		} else {
+			/* Send the response to client before caching it. */
+			tfw_connection_send_cli(sess, (TfwMsg *)resp);
+		}
+		/* Send the responses waiting for the response. */
+		tfw_http_sess_flush(sess, NULL);
+		spin_unlock_bh(&sess->lock);
+		tfw_session_put(sess);
 
+		/* The cache frees the request and the response. */
 		tfw_cache_add(resp, req);
 	}
 	else if (r == TFW_BLOCK) {
@@ -36,6 +36,7 @@ typedef enum {
 	TFW_HTTP_METH_GET	= 0,
 	TFW_HTTP_METH_HEAD	= 1,
 	TFW_HTTP_METH_POST	= 2,
+	TFW_HTTP_METH_PURGE	= 3,
 } tfw_http_meth_t;
 
 #define TFW_HTTP_CC_NO_CACHE		0x001
@@ -47,11 +48,14 @@ typedef enum {
 #define TFW_HTTP_CC_PROXY_REV		0x040
 #define TFW_HTTP_CC_PUBLIC		0x080
 #define TFW_HTTP_CC_PRIVATE		0x100
+#define TFW_HTTP_CC_MAX_AGE		0x200
+#define TFW_HTTP_CC_S_MAXAGE		0x400
 typedef struct {
 	unsigned int	flags;
 	unsigned int	max_age;
 	unsigned int	s_maxage;
 	unsigned int	max_fresh;
+	unsigned int	swr;	/* stale-while-revalidate */
 } TfwCacheControl;
 
 /**
@@ -112,6 +116,16 @@ typedef struct {
 #define TFW_HTTP_CONN_KA		0x0002
 #define __TFW_HTTP_CONN_MASK		(TFW_HTTP_CONN_CLOSE | TFW_HTTP_CONN_KA)
 #define TFW_HTTP_CHUNKED		0x0004
+/* The request is made conditional by the cache to revalidate an entry. */
+#define TFW_HTTP_CACHE_REVAL		0x0008
+/* Own cache request refreshing an entry in background. */
+#define TFW_HTTP_CACHE_BG		0x0010
+/* Other requests for the same cache entry wait for the response. */
+#define TFW_HTTP_CACHE_COLLAPSE		0x0020
+/* The request holds its place in the pipeline while the cache processes it. */
+#define TFW_HTTP_CACHE_PEND		0x0040
+/* The request is forwarded to the server and waits for the response. */
+#define TFW_HTTP_SENT			0x0080
 
 #define TFW_HTTP_MSG_COMMON						\
 	TfwMsg		msg;						\
@@ -139,6 +153,10 @@ typedef struct {
 	unsigned char	method;
 	TfwStr		host; /* host in URI, may differ from Host header */
 	TfwStr		uri;
+	unsigned long	cache_key; /* see tfw_cache_key_calc() */
+	unsigned long	collapse_key; /* see tfw_cache_collapse() */
+	TfwHttpMsg	*resp; /* response waiting for its turn in pipeline */
+	TfwSession	*sess; /* client session of the forwarded request */
 } TfwHttpReq;
 
 typedef struct {
@@ -146,8 +164,16 @@ typedef struct {
 	unsigned short	status;
 	unsigned int	keep_alive;
 	unsigned int	expires;
+	TfwStr		etag;		/* validators for conditional */
+	TfwStr		last_modified;	/* requests, RFC 7232 */
+	TfwStr		vary;		/* empty if repeated or split */
 } TfwHttpResp;
 
+/*
+ * Cache callback for the request processed by tfw_cache_req_process().
+ * The callback owns the request: it sends the response if it's passed,
+ * otherwise forwards the request.
+ */
 typedef void (*tfw_http_req_cache_cb_t)(TfwHttpReq *, TfwHttpResp *, void *);
 
 /* Internal (parser) HTTP functions. */
@@ -157,6 +183,7 @@ int tfw_http_parse_resp(TfwHttpResp *resp, unsigned char *data, size_t len);
 
 /* External HTTP functions. */
 int tfw_http_msg_process(void *conn, unsigned char *data, size_t len);
+int tfw_http_msg_hdr_add(TfwHttpMsg *hm, const char *hdr, size_t len);
 int tfw_http_init(void);
 void tfw_http_exit(void);
 
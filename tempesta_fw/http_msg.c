@@ -40,6 +40,7 @@ tfw_http_msg_alloc(int type)
 	memset(hm->h_tbl->tbl, 0, __HHTBL_SZ(1) * sizeof(TfwHttpHdr));
 
 	INIT_LIST_HEAD(&hm->msg.pl_list);
+	INIT_LIST_HEAD(&hm->msg.fwd_list);
 
 	hm->msg.destructor = (tfw_msg_destructor_t)tfw_http_msg_free;
 
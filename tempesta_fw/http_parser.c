@@ -1120,6 +1120,11 @@ __req_parse_host(TfwHttpReq *req, unsigned char *data, size_t *lenrval)
 		if (!hlen_set) {
 			*lenrval = p - data; /* set header length */
 			hlen_set = true;
+			/* Absolute URI host has precedence, RFC 7230 5.4. */
+			if (!req->host.len) {
+				req->host.ptr = data;
+				req->host.len = *lenrval;
+			}
 		}
 		if (c == '\n') {
 			r = p - data + 1;
@@ -1172,6 +1177,12 @@ tfw_http_parse_req(TfwHttpReq *req, unsigned char *data, size_t len)
 		case TFW_CHAR4_INT('P', 'O', 'S', 'T'):
 			req->method = TFW_HTTP_METH_POST;
 			__FSM_MOVE_n(Req_MUSpace, 4);
+		case TFW_CHAR4_INT('P', 'U', 'R', 'G'):
+			/* Non-standard method to purge cache entries. */
+			if (unlikely(*(p + 4) != 'E'))
+				return TFW_BLOCK;
+			req->method = TFW_HTTP_METH_PURGE;
+			__FSM_MOVE_n(Req_MUSpace, 5);
 		}
 
 		return TFW_BLOCK; /* Unsupported method */
@@ -1548,6 +1559,7 @@ enum {
 	Resp_I_CC,
 	Resp_I_CC_MaxAgeV,
 	Resp_I_CC_SMaxAgeV,
+	Resp_I_CC_SWRV,
 	/* Expires header */
 	Resp_I_Expires,
 	Resp_I_ExpDate,
@@ -1560,6 +1572,8 @@ enum {
 	/* Keep-Alive header. */
 	Resp_I_KeepAlive,
 	Resp_I_KeepAliveTO,
+	/* ETag and Last-Modified headers. */
+	Resp_I_Value,
 
 	Resp_I_Ext,
 	Resp_I_EoT,
@@ -1611,7 +1625,7 @@ __resp_parse_cache_control(TfwHttpResp *resp, unsigned char *data, size_t *lenrv
 				__FSM_I_MOVE_str(Resp_I_EoT, "public");
 			});
 			TRY_STR_LAMBDA("private", {
-				resp->cache_ctl.flags |= TFW_HTTP_CC_PUBLIC;
+				resp->cache_ctl.flags |= TFW_HTTP_CC_PRIVATE;
 				__FSM_I_MOVE_str(Resp_I_EoT, "private");
 			});
 			TRY_STR_LAMBDA("proxy-revalidate", {
@@ -1622,6 +1636,7 @@ __resp_parse_cache_control(TfwHttpResp *resp, unsigned char *data, size_t *lenrv
 			goto cache_extension;
 		case 's':
 			TRY_STR("s-maxage=", Resp_I_CC_SMaxAgeV);
+			TRY_STR("stale-while-revalidate=", Resp_I_CC_SWRV);
 		default:
 		cache_extension:
 			__FSM_I_MOVE_n(Resp_I_Ext, 0);
@@ -1634,6 +1649,7 @@ __resp_parse_cache_control(TfwHttpResp *resp, unsigned char *data, size_t *lenrv
 		if (n < 0)
 			return n;
 		resp->cache_ctl.max_age = acc;
+		resp->cache_ctl.flags |= TFW_HTTP_CC_MAX_AGE;
 		__FSM_I_MOVE_n(Resp_I_EoT, n);
 	}
 
@@ -1643,6 +1659,17 @@ __resp_parse_cache_control(TfwHttpResp *resp, unsigned char *data, size_t *lenrv
 		if (n < 0)
 			return n;
 		resp->cache_ctl.s_maxage = acc;
+		resp->cache_ctl.flags |= TFW_HTTP_CC_S_MAXAGE;
+		__FSM_I_MOVE_n(Resp_I_EoT, n);
+	}
+
+	/* RFC 5861 extension. */
+	__FSM_STATE(Resp_I_CC_SWRV) {
+		unsigned int acc = 0;
+		int n = __parse_int(chunk, p, len, &acc);
+		if (n < 0)
+			return n;
+		resp->cache_ctl.swr = acc;
 		__FSM_I_MOVE_n(Resp_I_EoT, n);
 	}
 
@@ -1874,7 +1901,7 @@ __resp_parse_expires(TfwHttpResp *resp, unsigned char *data, size_t *lenrval)
 			return n;
 		else if (n != 2)
 			return CSTR_BADLEN;
-		resp->expires = t * 3600;
+		resp->expires += t * 3600;
 		/* Skip hour and follwing ':'. */
 		__FSM_I_MOVE_n(Resp_I_ExpMin, 3);
 	}
@@ -1886,7 +1913,7 @@ __resp_parse_expires(TfwHttpResp *resp, unsigned char *data, size_t *lenrval)
 			return n;
 		else if (n != 2)
 			return CSTR_BADLEN;
-		resp->expires = t * 60;
+		resp->expires += t * 60;
 		/* Skip minutes and follwing ':'. */
 		__FSM_I_MOVE_n(Resp_I_ExpSec, 3);
 	}
@@ -1898,7 +1925,7 @@ __resp_parse_expires(TfwHttpResp *resp, unsigned char *data, size_t *lenrval)
 			return n;
 		else if (n != 2)
 			return CSTR_BADLEN;
-		resp->expires = t;
+		resp->expires += t;
 		/* Skip seconds and follwing ' GMT'. */
 		__FSM_I_MOVE_n(Resp_I_EoL, 6);
 	}
@@ -1925,6 +1952,88 @@ done:
 	return r;
 }
 
+/**
+ * Parse opaque field-value of ETag and Last-Modified headers to @val.
+ * The values are sent back to the server in conditional requests as is,
+ * so they're just stored w/o trailing spaces. Values spanning several
+ * skbs aren't stored, so such responses just aren't revalidated.
+ */
+static int
+__resp_parse_value(TfwHttpResp *resp, unsigned char *data, size_t *lenrval,
+		   TfwStr *val)
+{
+	int r = CSTR_NEQ;
+	TfwHttpParser *parser = &resp->parser;
+	unsigned char *p = data;
+	size_t len = *lenrval;
+	unsigned char c = *p;
+	bool hlen_set = false;
+
+	__FSM_START(parser->_i_st) {
+
+	__FSM_STATE(Resp_I_Value) {
+		unsigned char *end, *lf = memchr(p, '\n', len);
+		if (!lf) {
+			/* Leave empty value, so the tail isn't stored. */
+			val->ptr = p;
+			return CSTR_POSTPONE;
+		}
+		for (end = lf; end > p && isspace(*(end - 1)); --end)
+			;
+		/*
+		 * Leave empty value for repeated headers as well, so a list
+		 * value (e.g. Vary) is never taken partially.
+		 */
+		if (!val->ptr) {
+			val->ptr = p;
+			val->len = end - p;
+		} else {
+			val->len = 0;
+		}
+		__FSM_I_MOVE_n(Resp_I_EoL, end - p);
+	}
+
+	__FSM_STATE(Resp_I_EoL) {
+		if (!hlen_set) {
+			*lenrval = p - data; /* set header length */
+			hlen_set = true;
+		}
+		if (c == '\n') {
+			r = p - data + 1;
+			goto done;
+		}
+		if (isspace(c))
+			/* Eat all spaces including '\r'. */
+			__FSM_I_MOVE(Resp_I_EoL);
+
+		return CSTR_NEQ;
+	}
+
+	} /* FSM END */
+done:
+	parser->_i_st = Resp_I_0;
+	return r;
+}
+
+static int
+__resp_parse_etag(TfwHttpResp *resp, unsigned char *data, size_t *lenrval)
+{
+	return __resp_parse_value(resp, data, lenrval, &resp->etag);
+}
+
+static int
+__resp_parse_last_modified(TfwHttpResp *resp, unsigned char *data,
+			   size_t *lenrval)
+{
+	return __resp_parse_value(resp, data, lenrval, &resp->last_modified);
+}
+
+static int
+__resp_parse_vary(TfwHttpResp *resp, unsigned char *data, size_t *lenrval)
+{
+	return __resp_parse_value(resp, data, lenrval, &resp->vary);
+}
+
 static int
 __resp_parse_keep_alive(TfwHttpResp *resp, unsigned char *data, size_t *lenrval)
 {
@@ -2027,6 +2136,10 @@ enum {
 	Resp_HdrContent_Length,
 	Resp_HdrContent_LengthV,
 	Resp_HdrE,
+	Resp_HdrEt,
+	Resp_HdrEta,
+	Resp_HdrEtag,
+	Resp_HdrEtagV,
 	Resp_HdrEx,
 	Resp_HdrExp,
 	Resp_HdrExpi,
@@ -2045,6 +2158,20 @@ enum {
 	Resp_HdrKeep_Aliv,
 	Resp_HdrKeep_Alive,
 	Resp_HdrKeep_AliveV,
+	Resp_HdrL,
+	Resp_HdrLa,
+	Resp_HdrLas,
+	Resp_HdrLast,
+	Resp_HdrLast_,
+	Resp_HdrLast_M,
+	Resp_HdrLast_Mo,
+	Resp_HdrLast_Mod,
+	Resp_HdrLast_Modi,
+	Resp_HdrLast_Modif,
+	Resp_HdrLast_Modifi,
+	Resp_HdrLast_Modifie,
+	Resp_HdrLast_Modified,
+	Resp_HdrLast_ModifiedV,
 	Resp_HdrT,
 	Resp_HdrTr,
 	Resp_HdrTra,
@@ -2063,6 +2190,11 @@ enum {
 	Resp_HdrTransfer_Encodin,
 	Resp_HdrTransfer_Encoding,
 	Resp_HdrTransfer_EncodingV,
+	Resp_HdrV,
+	Resp_HdrVa,
+	Resp_HdrVar,
+	Resp_HdrVary,
+	Resp_HdrVaryV,
 	Resp_HdrOther,
 	Resp_HdrDone,
 	/* Body */
@@ -2181,6 +2313,13 @@ tfw_http_parse_resp(TfwHttpResp *resp, unsigned char *data, size_t len)
 				parser->_i_st = Resp_HdrExpiresV;
 				__FSM_MOVE_n(RGen_LWS, 8);
 			}
+			if (likely(p + 5 <= data + len
+				   && C4_INT_LCM(p, 'e', 't', 'a', 'g')
+				   && *(p + 4) == ':'))
+			{
+				parser->_i_st = Resp_HdrEtagV;
+				__FSM_MOVE_n(RGen_LWS, 5);
+			}
 			__FSM_MOVE(Resp_HdrE);
 		case 'k':
 			if (likely(p + 9 <= data + len
@@ -2194,6 +2333,18 @@ tfw_http_parse_resp(TfwHttpResp *resp, unsigned char *data, size_t len)
 				__FSM_MOVE_n(RGen_LWS, 13);
 			}
 			__FSM_MOVE(Resp_HdrK);
+		case 'l':
+			if (likely(p + 14 <= data + len
+				   && C4_INT_LCM(p, 'l', 'a', 's', 't')
+				   && *(p + 4) == '-'
+				   && C8_INT_LCM(p + 5, 'm', 'o', 'd', 'i',
+							'f', 'i', 'e', 'd')
+				   && *(p + 13) == ':'))
+			{
+				parser->_i_st = Resp_HdrLast_ModifiedV;
+				__FSM_MOVE_n(RGen_LWS, 14);
+			}
+			__FSM_MOVE(Resp_HdrL);
 		case 't':
 			if (likely(p + 17 <= data + len
 				   && C8_INT_LCM(p, 't', 'r', 'a', 'n',
@@ -2207,6 +2358,15 @@ tfw_http_parse_resp(TfwHttpResp *resp, unsigned char *data, size_t len)
 				__FSM_MOVE_n(RGen_LWS, 18);
 			}
 			__FSM_MOVE(Resp_HdrT);
+		case 'v':
+			if (likely(p + 5 <= data + len
+				   && C4_INT_LCM(p, 'v', 'a', 'r', 'y')
+				   && *(p + 4) == ':'))
+			{
+				parser->_i_st = Resp_HdrVaryV;
+				__FSM_MOVE_n(RGen_LWS, 5);
+			}
+			__FSM_MOVE(Resp_HdrV);
 		default:
 			__FSM_MOVE(Resp_HdrOther);
 		}
@@ -2270,6 +2430,18 @@ tfw_http_parse_resp(TfwHttpResp *resp, unsigned char *data, size_t len)
 	TFW_HTTP_PARSE_HDR_VAL(Resp_HdrExpiresV, Resp_Hdr, Resp_I_Expires,
 			       resp, __resp_parse_expires);
 
+	/* 'ETag:*LWS' is read, process field-value. */
+	TFW_HTTP_PARSE_HDR_VAL(Resp_HdrEtagV, Resp_Hdr, Resp_I_Value, resp,
+			       __resp_parse_etag);
+
+	/* 'Last-Modified:*LWS' is read, process field-value. */
+	TFW_HTTP_PARSE_HDR_VAL(Resp_HdrLast_ModifiedV, Resp_Hdr, Resp_I_Value,
+			       resp, __resp_parse_last_modified);
+
+	/* 'Vary:*LWS' is read, process field-value. */
+	TFW_HTTP_PARSE_HDR_VAL(Resp_HdrVaryV, Resp_Hdr, Resp_I_Value, resp,
+			       __resp_parse_vary);
+
 	/* 'Keep-Alive:*LWS' is read, process field-value. */
 	TFW_HTTP_PARSE_HDR_VAL(Resp_HdrKeep_AliveV, Resp_Hdr, Resp_I_KeepAlive,
 			       resp, __resp_parse_keep_alive);
@@ -2365,8 +2537,26 @@ tfw_http_parse_resp(TfwHttpResp *resp, unsigned char *data, size_t len)
 	__FSM_TX_AF(Resp_HdrContent_Lengt, 'h', Resp_HdrContent_Length, hdr_a, Resp_HdrOther);
 	__FSM_TX_AF_LWS(Resp_HdrContent_Length, ':', Resp_HdrContent_LengthV, hdr_a, Resp_HdrOther);
 
+	__FSM_STATE(Resp_HdrE) {
+		if (unlikely(!IN_ALPHABET(c, hdr_a)))
+			return TFW_BLOCK;
+
+		switch (LC(c)) {
+		case 't':
+			__FSM_MOVE(Resp_HdrEt);
+		case 'x':
+			__FSM_MOVE(Resp_HdrEx);
+		default:
+			__FSM_MOVE(Resp_HdrOther);
+		}
+	}
+
+	/* ETag header processing. */
+	__FSM_TX_AF(Resp_HdrEt, 'a', Resp_HdrEta, hdr_a, Resp_HdrOther);
+	__FSM_TX_AF(Resp_HdrEta, 'g', Resp_HdrEtag, hdr_a, Resp_HdrOther);
+	__FSM_TX_AF_LWS(Resp_HdrEtag, ':', Resp_HdrEtagV, hdr_a, Resp_HdrOther);
+
 	/* Expires header processing. */
-	__FSM_TX_AF(Resp_HdrE, 'x', Resp_HdrEx, hdr_a, Resp_HdrOther);
 	__FSM_TX_AF(Resp_HdrEx, 'p', Resp_HdrExp, hdr_a, Resp_HdrOther);
 	__FSM_TX_AF(Resp_HdrExp, 'i', Resp_HdrExpi, hdr_a, Resp_HdrOther);
 	__FSM_TX_AF(Resp_HdrExpi, 'r', Resp_HdrExpir, hdr_a, Resp_HdrOther);
@@ -2386,6 +2576,21 @@ tfw_http_parse_resp(TfwHttpResp *resp, unsigned char *data, size_t len)
 	__FSM_TX_AF(Resp_HdrKeep_Aliv, 'e', Resp_HdrKeep_Alive, hdr_a, Resp_HdrOther);
 	__FSM_TX_AF_LWS(Resp_HdrKeep_Alive, ':', Resp_HdrKeep_AliveV, hdr_a, Resp_HdrOther);
 
+	/* Last-Modified header processing. */
+	__FSM_TX_AF(Resp_HdrL, 'a', Resp_HdrLa, hdr_a, Resp_HdrOther);
+	__FSM_TX_AF(Resp_HdrLa, 's', Resp_HdrLas, hdr_a, Resp_HdrOther);
+	__FSM_TX_AF(Resp_HdrLas, 't', Resp_HdrLast, hdr_a, Resp_HdrOther);
+	__FSM_TX_AF(Resp_HdrLast, '-', Resp_HdrLast_, hdr_a, Resp_HdrOther);
+	__FSM_TX_AF(Resp_HdrLast_, 'm', Resp_HdrLast_M, hdr_a, Resp_HdrOther);
+	__FSM_TX_AF(Resp_HdrLast_M, 'o', Resp_HdrLast_Mo, hdr_a, Resp_HdrOther);
+	__FSM_TX_AF(Resp_HdrLast_Mo, 'd', Resp_HdrLast_Mod, hdr_a, Resp_HdrOther);
+	__FSM_TX_AF(Resp_HdrLast_Mod, 'i', Resp_HdrLast_Modi, hdr_a, Resp_HdrOther);
+	__FSM_TX_AF(Resp_HdrLast_Modi, 'f', Resp_HdrLast_Modif, hdr_a, Resp_HdrOther);
+	__FSM_TX_AF(Resp_HdrLast_Modif, 'i', Resp_HdrLast_Modifi, hdr_a, Resp_HdrOther);
+	__FSM_TX_AF(Resp_HdrLast_Modifi, 'e', Resp_HdrLast_Modifie, hdr_a, Resp_HdrOther);
+	__FSM_TX_AF(Resp_HdrLast_Modifie, 'd', Resp_HdrLast_Modified, hdr_a, Resp_HdrOther);
+	__FSM_TX_AF_LWS(Resp_HdrLast_Modified, ':', Resp_HdrLast_ModifiedV, hdr_a, Resp_HdrOther);
+
 	/* Transfer-Encoding header processing. */
 	__FSM_TX_AF(Resp_HdrT, 'r', Resp_HdrTr, hdr_a, Resp_HdrOther);
 	__FSM_TX_AF(Resp_HdrTr, 'a', Resp_HdrTra, hdr_a, Resp_HdrOther);
@@ -2405,6 +2610,12 @@ tfw_http_parse_resp(TfwHttpResp *resp, unsigned char *data, size_t len)
 	__FSM_TX_AF(Resp_HdrTransfer_Encodin, 'g', Resp_HdrTransfer_Encoding, hdr_a, Resp_HdrOther);
 	__FSM_TX_AF_LWS(Resp_HdrTransfer_Encoding, ':', Resp_HdrTransfer_EncodingV, hdr_a, Resp_HdrOther);
 
+	/* Vary header processing. */
+	__FSM_TX_AF(Resp_HdrV, 'a', Resp_HdrVa, hdr_a, Resp_HdrOther);
+	__FSM_TX_AF(Resp_HdrVa, 'r', Resp_HdrVar, hdr_a, Resp_HdrOther);
+	__FSM_TX_AF(Resp_HdrVar, 'y', Resp_HdrVary, hdr_a, Resp_HdrOther);
+	__FSM_TX_AF_LWS(Resp_HdrVary, ':', Resp_HdrVaryV, hdr_a, Resp_HdrOther);
+
 	}
 	__FSM_FINISH(resp);
 
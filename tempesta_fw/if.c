@@ -65,6 +65,7 @@ tfw_str_tokens_count(const char *str)
 typedef struct {
 	char	listen[TFW_MAX_PROC_STR_LEN];
 	char	backends[TFW_MAX_PROC_STR_LEN];
+	char	cache_purge[TFW_MAX_PROC_STR_LEN];
 } TfwSysctlTable;
 
 TfwSysctlTable tfw_param_tbl;
@@ -157,6 +158,47 @@ sysctl_addr(ctl_table *ctl, int write, void __user *buffer, size_t *lenp,
 	return r;
 }
 
+/**
+ * Resize the cache storage online on cache_size writes.
+ * The previous size is restored if the storage can't be resized.
+ */
+static int
+sysctl_cache_size(ctl_table *ctl, int write, void __user *buffer,
+		  size_t *lenp, loff_t *ppos)
+{
+	int r;
+	unsigned int old = tfw_cfg.c_size;
+
+	r = proc_dointvec(ctl, write, buffer, lenp, ppos);
+	if (r || !write || tfw_cfg.c_size == old)
+		return r;
+
+	r = tfw_cache_resize();
+	if (r)
+		tfw_cfg.c_size = old;
+
+	return r;
+}
+
+/**
+ * Purge the cache entries on cache_purge writes,
+ * see tfw_cache_purge_spec() for the format.
+ */
+static int
+sysctl_cache_purge(ctl_table *ctl, int write, void __user *buffer,
+		   size_t *lenp, loff_t *ppos)
+{
+	int r;
+
+	r = proc_dostring(ctl, write, buffer, lenp, ppos);
+	if (r || !write)
+		return r;
+
+	r = tfw_cache_purge_spec(ctl->data);
+
+	return r < 0 ? r : 0;
+}
+
 static ctl_table tfw_ctl_main_tbl[] = {
 	{
 		.procname	= "backend",
@@ -174,11 +216,32 @@ static ctl_table tfw_ctl_main_tbl[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_dointvec,
 	},
-	{ /* TODO read-only for now, make updatable. */
+	{
 		.procname	= "cache_size",
 		.data		= &tfw_cfg.c_size,
 		.maxlen		= sizeof(int),
 		.mode		= 0644,
+		.proc_handler	= sysctl_cache_size,
+	},
+	{
+		.procname	= "cache_purge",
+		.data		= tfw_param_tbl.cache_purge,
+		.maxlen		= TFW_MAX_PROC_STR_LEN,
+		.mode		= 0644,
+		.proc_handler	= sysctl_cache_purge,
+	},
+	{
+		.procname	= "cache_purge_method",
+		.data		= &tfw_cfg.c_purge,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec,
+	},
+	{
+		.procname	= "cache_hot_size",
+		.data		= &tfw_cfg.c_hot_size,
+		.maxlen		= sizeof(int),
+		.mode		= 0444,
 		.proc_handler	= proc_dointvec,
 	},
 	{ /* TODO read-only for now, make updatable. */
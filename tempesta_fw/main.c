@@ -41,6 +41,11 @@ static unsigned int cache_size = 256 * 1024;
 module_param(cache_size, uint, 0444);
 MODULE_PARM_DESC(cache_size, "Maximum cache size in pages");
 
+static unsigned int cache_hot_size = 0;
+module_param(cache_hot_size, uint, 0444);
+MODULE_PARM_DESC(cache_hot_size, "Cache size in pages locked in memory,"
+		 " other cache pages can be swapped out (0 locks all pages)");
+
 static char *cache_path = "/opt/tempesta/cache";
 module_param(cache_path, charp, 0444);
 MODULE_PARM_DESC(cache_path, "Path to cache directory");
@@ -61,6 +66,7 @@ tfw_init(void)
 	/* Initialize tfw_cfg. */
 	init_rwsem(&tfw_cfg.mtx);
 	tfw_cfg.c_size = cache_size;
+	tfw_cfg.c_hot_size = cache_hot_size;
 	memcpy(tfw_cfg.c_path, cache_path, DEF_PROC_STR_LEN);
 
 	r = tfw_if_init();
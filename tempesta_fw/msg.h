@@ -38,6 +38,8 @@ typedef struct tfw_msg {
 	SsSkbList	skb_list;	/* list of sk_buff's belonging
 					   to the message. */
 	struct list_head pl_list;	/* Element of a pipeline list. */
+	struct list_head fwd_list;	/* Element of a server connection
+					   forwarding queue. */
 	tfw_msg_destructor_t destructor;
 } TfwMsg;
 
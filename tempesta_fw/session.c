@@ -23,25 +23,10 @@
 #include <linux/list.h>
 
 #include "log.h"
-#include "sched.h"
 #include "session.h"
 
 static struct kmem_cache *sess_cache;
 
-int
-tfw_session_sched_msg(TfwSession *s, TfwMsg *msg)
-{
-	TfwServer *srv = tfw_sched_get_srv(msg);
-	if (!srv) {
-		TFW_ERR("Can't get an appropriate server for a session");
-		return -ENOENT;
-	}
-
-	s->srv = srv;
-
-	return 0;
-}
-
 TfwSession *
 tfw_session_create(TfwClient *cli)
 {
@@ -52,6 +37,8 @@ tfw_session_create(TfwClient *cli)
 	s->cli = cli;
 	s->srv = NULL;
 	INIT_LIST_HEAD(&s->req_list);
+	spin_lock_init(&s->lock);
+	atomic_set(&s->refcnt, 1);
 
 	return s;
 }
@@ -63,13 +50,27 @@ tfw_session_free(TfwSession *s)
 
 	TFW_DBG("Free session: %p\n", s);
 
+	spin_lock_bh(&s->lock);
+
 	/* Release all pipelined HTTP requests. */
 	list_for_each_entry_safe(msg, tmp, &s->req_list, pl_list) {
 		list_del(&msg->pl_list);
 		tfw_msg_destruct(msg);
 	}
 
-	kmem_cache_free(sess_cache, s);
+	/* The client connection is closed, so don't send anything to it. */
+	s->cli = NULL;
+
+	spin_unlock_bh(&s->lock);
+
+	tfw_session_put(s);
+}
+
+void
+tfw_session_put(TfwSession *s)
+{
+	if (atomic_dec_and_test(&s->refcnt))
+		kmem_cache_free(sess_cache, s);
 }
 
 int
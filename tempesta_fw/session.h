@@ -20,27 +20,42 @@
 #ifndef __TFW_SESSION_H__
 #define __TFW_SESSION_H__
 
+#include <linux/atomic.h>
+#include <linux/spinlock.h>
+
 #include "client.h"
 #include "server.h"
 
 /**
  * Tempesta reuses server connections to handle many clients.
  * Each client or server connection has TfwConneciton descriptor for internal
- * usage. TfwSession maps a client connection with a server connection which
- * is currently dedicated to process the client. When we receive first client
- * request we allocate ThSession, choose a server connection and bind
- * the client connection with the server connection through just allocated
- * session.
+ * usage. TfwSession keeps the client connection pipeline and the server which
+ * got the last client request. When we receive first client request we
+ * allocate TfwSession and bind the client connection with it. Forwarded
+ * requests reference the session, so server connections aren't bound to it.
  */
 typedef struct {
 	TfwServer	*srv;
 	TfwClient	*cli;
 	struct list_head req_list; /* list of pipelined requests */
+	spinlock_t	lock;	/* protects @cli and @req_list */
+	atomic_t	refcnt;
 } TfwSession;
 
-int tfw_session_sched_msg(TfwSession *s, TfwMsg *msg);
 TfwSession *tfw_session_create(TfwClient *cli);
 void tfw_session_free(TfwSession *s);
+void tfw_session_put(TfwSession *s);
+
+/**
+ * The session is referenced by requests processed asynchronously, e.g. by
+ * the cache, so it's alive while the requests are processed even if the
+ * client connection is closed. @cli is NULL in this case.
+ */
+static inline void
+tfw_session_get(TfwSession *s)
+{
+	atomic_inc(&s->refcnt);
+}
 
 int tfw_session_init(void);
 void tfw_session_exit(void);
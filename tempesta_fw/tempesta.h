@@ -59,7 +59,9 @@ typedef struct {
 	/* Cache configuration. */
 	int			cache;
 	unsigned int		c_size; /* cache size in pages */
+	unsigned int		c_hot_size; /* locked cache size in pages */
 	char			c_path[TDB_PATH_LEN]; /* cache files path */
+	int			c_purge; /* allow HTTP PURGE method */
 } TfwCfg;
 
 /* Main configuration structure. */